@@ -0,0 +1,462 @@
+/* fake_ircd.c
+ *
+ * Implementation of the stand-in IRC server
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#ifdef HAVE_TLS
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+#endif /* HAVE_TLS */
+
+#include "fake_ircd.h"
+
+#define SERVER_NAME "irc.bench.test"
+
+//Subject of the certificate, and of the one that's meant to be refused
+#define TLS_GOOD_NAME "IP:127.0.0.1"
+#define TLS_BAD_NAME "DNS:other.invalid"
+
+//Bytes of traffic built up before each write
+#define SEND_BATCH (64 * 1024)
+
+uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+#ifdef HAVE_TLS
+/*
+ * Makes a self-signed certificate for one subject alternative name, good
+ * for a day, as its own CA.
+ *
+ * Returns the certificate, or NULL on error.
+ */
+X509 * make_certificate(EVP_PKEY *key, const char *alt_name) {
+    X509 *cert = X509_new();
+    if(cert == NULL) {
+	return NULL;
+    }
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), -60);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 3600);
+    X509_set_pubkey(cert, key);
+
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *) SERVER_NAME, -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+
+    const char *extensions[][2] = {
+	{ "basicConstraints", "critical,CA:TRUE" },
+	{ "subjectAltName", alt_name },
+    };
+    for(size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+	X509_EXTENSION *extension = X509V3_EXT_conf(NULL, NULL, extensions[i][0], extensions[i][1]);
+	if(extension == NULL || !X509_add_ext(cert, extension, -1)) {
+	    X509_EXTENSION_free(extension);
+	    X509_free(cert);
+	    return NULL;
+	}
+	X509_EXTENSION_free(extension);
+    }
+
+    if(!X509_sign(cert, key, EVP_sha256())) {
+	X509_free(cert);
+	return NULL;
+    }
+    return cert;
+}
+
+/*
+ * Sets up the server side of TLS and writes the certificate to ca_file
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int init_fake_tls(fake_ircd *this, const char *ca_file) {
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *cert = key == NULL ? NULL : make_certificate(key, this->tls == FAKE_TLS_BAD_CERT ? TLS_BAD_NAME : TLS_GOOD_NAME);
+    FILE *out = cert == NULL ? NULL : fopen(ca_file, "w");
+    int written = out != NULL && PEM_write_X509(out, cert);
+    if(out != NULL && fclose(out) != 0) {
+	written = 0;
+    }
+
+    this->tls_ctx = written ? SSL_CTX_new(TLS_server_method()) : NULL;
+    int ready = this->tls_ctx != NULL
+	&& SSL_CTX_use_certificate(this->tls_ctx, cert) == 1
+	&& SSL_CTX_use_PrivateKey(this->tls_ctx, key) == 1;
+
+    //kTLS only does AEAD suites, so this one is left to OpenSSL on both ends
+    if(ready && this->tls == FAKE_TLS_NO_KTLS) {
+	ready = SSL_CTX_set_max_proto_version(this->tls_ctx, TLS1_2_VERSION) == 1
+	    && SSL_CTX_set_cipher_list(this->tls_ctx, "ECDHE-ECDSA-AES128-SHA256") == 1;
+    }
+
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    if(!ready) {
+	fprintf(stderr, "fake ircd: couldn't set up TLS\n");
+	ERR_print_errors_fp(stderr);
+	return -1;
+    }
+    pthread_mutex_init(&(this->tls_lock), NULL);
+    return 0;
+}
+
+/*
+ * Runs the server side of the handshake on the accepted fd, which is made
+ * non-blocking so the sender and reader can take turns with the session
+ *
+ * Returns 0 on success, -1 on error or timeout.
+ */
+int fake_tls_accept(fake_ircd *this, int timeout_ms) {
+    fcntl(this->fd, F_SETFL, fcntl(this->fd, F_GETFL) | O_NONBLOCK);
+    this->ssl = SSL_new(this->tls_ctx);
+    if(this->ssl == NULL || SSL_set_fd(this->ssl, this->fd) != 1) {
+	return -1;
+    }
+
+    while(1) {
+	int result = SSL_accept(this->ssl);
+	if(result == 1) {
+	    return 0;
+	}
+
+	int error = SSL_get_error(this->ssl, result);
+	struct pollfd ready = { this->fd, error == SSL_ERROR_WANT_WRITE ? POLLOUT : POLLIN, 0 };
+	if((error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) || poll(&ready, 1, timeout_ms) != 1) {
+	    fprintf(stderr, "fake ircd: TLS handshake failed\n");
+	    ERR_print_errors_fp(stderr);
+	    this->tls_failed = 1;
+	    return -1;
+	}
+    }
+}
+
+/*
+ * One SSL_read or SSL_write, waiting out the session's wants outside the
+ * lock so the other thread gets its turn
+ */
+ssize_t fake_tls_io(fake_ircd *this, char *buf, size_t len, int writing) {
+    while(1) {
+	pthread_mutex_lock(&(this->tls_lock));
+	int result = writing ? SSL_write(this->ssl, buf, len) : SSL_read(this->ssl, buf, len);
+	int error = result > 0 ? SSL_ERROR_NONE : SSL_get_error(this->ssl, result);
+	pthread_mutex_unlock(&(this->tls_lock));
+
+	if(result > 0) {
+	    return result;
+	}
+	if(error == SSL_ERROR_ZERO_RETURN) {
+	    return 0;
+	}
+	if(error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+	    return -1;
+	}
+
+	//Short, since the other thread may have taken what we waited for
+	struct pollfd ready = { this->fd, error == SSL_ERROR_WANT_WRITE ? POLLOUT : POLLIN, 0 };
+	poll(&ready, 1, 10);
+	if(ready.revents & (POLLHUP | POLLERR | POLLNVAL)) {
+	    return -1;
+	}
+    }
+}
+#endif /* HAVE_TLS */
+
+/*
+ * Reads or writes the connection, through TLS if it has it
+ *
+ * Returns what read() or write() would.
+ */
+ssize_t fake_ircd_io(fake_ircd *this, char *buf, size_t len, int writing) {
+    #ifdef HAVE_TLS
+    if(this->ssl != NULL) {
+	return fake_tls_io(this, buf, len, writing);
+    }
+    #endif /* HAVE_TLS */
+    return writing ? write(this->fd, buf, len) : read(this->fd, buf, len);
+}
+
+int init_fake_ircd(fake_ircd *this, traffic_mix *mix, fake_tls_mode tls, const char *ca_file) {
+    memset(this, 0, sizeof(fake_ircd));
+    this->fd = -1;
+    this->listen_fd = -1;
+    this->mix = *mix;
+    this->tls = tls;
+    init_histogram(&(this->pong_latency));
+
+    #ifdef HAVE_TLS
+    if(tls != FAKE_TLS_OFF && init_fake_tls(this, ca_file) != 0) {
+	return -1;
+    }
+    #else
+    if(tls != FAKE_TLS_OFF) {
+	fprintf(stderr, "fake ircd: built without OpenSSL, so no TLS\n");
+	return -1;
+    }
+    #endif /* HAVE_TLS */
+
+    this->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(this->listen_fd < 0) {
+	perror("socket()");
+	return -1;
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+
+    socklen_t address_len = sizeof(address);
+    if(bind(this->listen_fd, (struct sockaddr *) &address, sizeof(address)) != 0
+	    || listen(this->listen_fd, 1) != 0
+	    || getsockname(this->listen_fd, (struct sockaddr *) &address, &address_len) != 0) {
+	perror("fake ircd");
+	close(this->listen_fd);
+	this->listen_fd = -1;
+	return -1;
+    }
+    this->port = ntohs(address.sin_port);
+    return 0;
+}
+
+/*
+ * Writes all of buf, blocking while the multiplexer catches up
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int write_all(fake_ircd *this, const char *buf, size_t len) {
+    while(len > 0) {
+	ssize_t written = fake_ircd_io(this, (char *) buf, len, 1);
+	if(written < 0) {
+	    if(errno == EINTR) {
+		continue;
+	    }
+	    return -1;
+	}
+	buf += written;
+	len -= written;
+    }
+    return 0;
+}
+
+int fake_ircd_accept(fake_ircd *this, int timeout_ms) {
+    struct pollfd ready = { this->listen_fd, POLLIN, 0 };
+    if(poll(&ready, 1, timeout_ms) != 1) {
+	fprintf(stderr, "fake ircd: the multiplexer never connected\n");
+	return -1;
+    }
+
+    this->fd = accept(this->listen_fd, NULL, NULL);
+    if(this->fd < 0) {
+	perror("accept()");
+	return -1;
+    }
+    #ifdef HAVE_TLS
+    if(this->tls != FAKE_TLS_OFF && fake_tls_accept(this, timeout_ms) != 0) {
+	return -1;
+    }
+    #endif /* HAVE_TLS */
+
+    //Registration is done once we've seen USER, which follows NICK
+    char buf[4096];
+    size_t len = 0;
+    while(memmem(buf, len, "USER ", 5) == NULL) {
+	ready.fd = this->fd;
+	//TLS may have read more than it's handed us so far
+	int pending = 0;
+	#ifdef HAVE_TLS
+	pending = this->ssl != NULL && SSL_pending(this->ssl) > 0;
+	#endif /* HAVE_TLS */
+	if(len == sizeof(buf) || (!pending && poll(&ready, 1, timeout_ms) != 1)) {
+	    fprintf(stderr, "fake ircd: the multiplexer never registered\n");
+	    return -1;
+	}
+	ssize_t received = fake_ircd_io(this, buf + len, sizeof(buf) - len, 0);
+	if(received <= 0) {
+	    return -1;
+	}
+	len += received;
+    }
+
+    const char *welcome = ":" SERVER_NAME " 001 loadgen :Welcome to the bench\r\n";
+    return write_all(this, welcome, strlen(welcome));
+}
+
+/*
+ * Appends a NAMES burst for FAKE_IRCD_CHANNEL to out
+ *
+ * Returns the bytes appended.
+ */
+size_t format_names(fake_ircd *this, char *out, size_t size, uint64_t burst) {
+    size_t len = 0;
+    for(size_t line = 0; line < this->mix.names_lines && size - len > 512; line++) {
+	len += sprintf(out + len, ":" SERVER_NAME " 353 loadgen = " FAKE_IRCD_CHANNEL " :");
+	for(int i = 0; i < 20; i++) {
+	    const char *modes[] = { "@", "+", "", "" };
+	    len += sprintf(out + len, "%s%snick%lu_%lu_%d", i == 0 ? "" : " ",
+		    modes[i % 4], (unsigned long) burst, (unsigned long) line, i);
+	}
+	len += sprintf(out + len, "\r\n");
+    }
+    len += sprintf(out + len, ":" SERVER_NAME " 366 loadgen " FAKE_IRCD_CHANNEL " :End of /NAMES list.\r\n");
+    this->lines_sent += this->mix.names_lines + 1;
+    return len;
+}
+
+/*
+ * Sender thread. Every pass works out how much of each kind of traffic is
+ * due by now, and writes it in batches of SEND_BATCH.
+ */
+void * fake_ircd_send(void *args) {
+    fake_ircd *this = (fake_ircd *) args;
+    traffic_mix *mix = &(this->mix);
+
+    size_t out_size = SEND_BATCH + 64 * 1024 + mix->names_lines * 512;
+    char *out = malloc(out_size);
+    char *filler = malloc(mix->privmsg_size + 1);
+    memset(filler, 'x', mix->privmsg_size);
+    filler[mix->privmsg_size] = '\0';
+
+    uint64_t names_sent = 0;
+    uint64_t pings_sent = 0;
+    this->send_started_ns = now_ns();
+
+    while(this->sending) {
+	uint64_t now = now_ns();
+	double elapsed = (now - this->send_started_ns) / 1e9;
+	size_t len = 0;
+
+	while(this->privmsgs_sent < (uint64_t) (mix->privmsg_rate * elapsed) && len < SEND_BATCH) {
+	    this->privmsgs_sent++;
+	    len += snprintf(out + len, out_size - len,
+		    ":user%lu!bench@load.test PRIVMSG " FAKE_IRCD_CHANNEL " :%lu %lu %s\r\n",
+		    (unsigned long) (this->privmsgs_sent % 1000), (unsigned long) this->privmsgs_sent,
+		    (unsigned long) now_ns(), filler);
+	    this->lines_sent++;
+	}
+
+	if(names_sent < (uint64_t) (mix->names_rate * elapsed)) {
+	    len += format_names(this, out + len, out_size - len, names_sent++);
+	}
+
+	if(pings_sent < (uint64_t) (mix->ping_rate * elapsed)) {
+	    len += snprintf(out + len, out_size - len, "PING :%lu\r\n", (unsigned long) now_ns());
+	    pings_sent++;
+	    this->lines_sent++;
+	}
+
+	if(len == 0) {
+	    struct timespec pause = { 0, 200 * 1000 };
+	    nanosleep(&pause, NULL);
+	    continue;
+	}
+
+	if(write_all(this, out, len) != 0) {
+	    perror("fake ircd: write()");
+	    break;
+	}
+	this->bytes_sent += len;
+    }
+
+    this->send_stopped_ns = now_ns();
+    free(filler);
+    free(out);
+    return NULL;
+}
+
+/*
+ * Reader thread. Times the PONGs that come back for our PINGs and ignores
+ * everything else.
+ */
+void * fake_ircd_read(void *args) {
+    fake_ircd *this = (fake_ircd *) args;
+    char buf[16384];
+    size_t len = 0;
+
+    while(1) {
+	ssize_t received = fake_ircd_io(this, buf + len, sizeof(buf) - len, 0);
+	if(received <= 0) {
+	    break;
+	}
+	len += received;
+
+	char *line = buf;
+	char *end;
+	while((end = memchr(line, '\n', buf + len - line)) != NULL) {
+	    if(strncmp(line, "PONG", 4) == 0) {
+		char *stamp = memchr(line, ':', end - line);
+		if(stamp != NULL) {
+		    histogram_record(&(this->pong_latency), now_ns() - strtoull(stamp + 1, NULL, 10));
+		}
+	    }
+	    line = end + 1;
+	}
+
+	len = buf + len - line;
+	memmove(buf, line, len);
+	if(len == sizeof(buf)) {
+	    len = 0;
+	}
+    }
+    return NULL;
+}
+
+int fake_ircd_start(fake_ircd *this) {
+    this->sending = 1;
+    if(pthread_create(&(this->sender), NULL, &fake_ircd_send, this) != 0) {
+	return -1;
+    }
+    if(pthread_create(&(this->reader), NULL, &fake_ircd_read, this) != 0) {
+	this->sending = 0;
+	pthread_join(this->sender, NULL);
+	return -1;
+    }
+    this->reading = 1;
+    return 0;
+}
+
+void fake_ircd_stop(fake_ircd *this) {
+    if(this->sending) {
+	this->sending = 0;
+	pthread_join(this->sender, NULL);
+    }
+}
+
+void destroy_fake_ircd(fake_ircd *this) {
+    fake_ircd_stop(this);
+    if(this->fd >= 0) {
+	//Wakes the reader
+	shutdown(this->fd, SHUT_RDWR);
+	if(this->reading) {
+	    pthread_join(this->reader, NULL);
+	}
+	close(this->fd);
+    }
+    if(this->listen_fd >= 0) {
+	close(this->listen_fd);
+    }
+
+    #ifdef HAVE_TLS
+    if(this->tls_ctx != NULL) {
+	SSL_free(this->ssl);
+	SSL_CTX_free(this->tls_ctx);
+	pthread_mutex_destroy(&(this->tls_lock));
+    }
+    #endif /* HAVE_TLS */
+}
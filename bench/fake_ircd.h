@@ -0,0 +1,124 @@
+/* fake_ircd.h
+ *
+ * Defines a stand-in for an IRC server that a multiplexer under test
+ * connects to. Once started, it welcomes the multiplexer and then floods
+ * it with a mix of traffic at fixed rates:
+ *
+ *   PRIVMSG  to #bench, stamped with a sequence number and send time
+ *   NAMES    bursts of 353 replies ended by a 366, as on a big JOIN
+ *   PING     stamped with the send time, to time the PONG coming back
+ *
+ * It can also speak TLS, with a throwaway self-signed certificate that it
+ * writes out for the multiplexer to use as its CA file.
+ */
+
+#ifndef _FAKE_IRCD_H
+#define _FAKE_IRCD_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#ifdef HAVE_TLS
+#include <openssl/ssl.h>
+#endif /* HAVE_TLS */
+
+#include "histogram.h"
+
+//Channel every line is sent to
+#define FAKE_IRCD_CHANNEL "#bench"
+
+typedef enum fake_tls_mode_enum {
+    FAKE_TLS_OFF,
+    //A certificate for 127.0.0.1, and whatever the two sides agree on
+    FAKE_TLS_ON,
+    //Only TLS 1.2 with a CBC suite, which the kernel can't take over
+    FAKE_TLS_NO_KTLS,
+    //A certificate for another name, which the multiplexer must refuse
+    FAKE_TLS_BAD_CERT
+} fake_tls_mode;
+
+typedef struct traffic_mix_struct {
+    //PRIVMSG lines per second, and bytes of filler in each
+    double privmsg_rate;
+    size_t privmsg_size;
+
+    //NAMES bursts per second, and 353 lines in each
+    double names_rate;
+    size_t names_lines;
+
+    double ping_rate;
+} traffic_mix;
+
+typedef struct fake_ircd_struct {
+    int listen_fd;
+    in_port_t port;
+    int fd;
+
+    traffic_mix mix;
+
+    fake_tls_mode tls;
+    //Set if the multiplexer connected but the handshake failed
+    int tls_failed;
+    #ifdef HAVE_TLS
+    SSL_CTX *tls_ctx;
+    SSL *ssl;
+    //The sender and reader share the session, one call at a time
+    pthread_mutex_t tls_lock;
+    #endif /* HAVE_TLS */
+
+    pthread_t sender;
+    pthread_t reader;
+    volatile int sending;
+    int reading;
+
+    //Filled in by the sender thread
+    uint64_t privmsgs_sent;
+    uint64_t lines_sent;
+    uint64_t bytes_sent;
+    uint64_t send_started_ns;
+    uint64_t send_stopped_ns;
+
+    //PING to PONG round trips, filled in by the reader thread
+    histogram pong_latency;
+} fake_ircd;
+
+/*
+ * Listens on a free port on the loopback interface. Unless tls is 
+ * FAKE_TLS_OFF, the certificate is written to ca_file.
+ *
+ * Returns 0 on success, -1 on error, e.g. TLS without OpenSSL.
+ */
+int init_fake_ircd(fake_ircd *this, traffic_mix *mix, fake_tls_mode tls, const char *ca_file);
+
+/*
+ * Waits for the multiplexer to connect, finish the TLS handshake if 
+ * there is one, and register, and welcomes it.
+ *
+ * Returns 0 on success, -1 on error or timeout.
+ */
+int fake_ircd_accept(fake_ircd *this, int timeout_ms);
+
+/*
+ * Starts sending traffic, and reading what comes back
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int fake_ircd_start(fake_ircd *this);
+
+/*
+ * Stops sending traffic. Replies are still read until destroy.
+ */
+void fake_ircd_stop(fake_ircd *this);
+
+/*
+ * Hangs up on the multiplexer and frees everything.
+ */
+void destroy_fake_ircd(fake_ircd *this);
+
+/*
+ * CLOCK_MONOTONIC in nanoseconds, the clock every stamp uses
+ */
+uint64_t now_ns(void);
+
+#endif /* _FAKE_IRCD_H */
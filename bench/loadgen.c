@@ -0,0 +1,378 @@
+/* loadgen.c
+ *
+ * End-to-end load generator. Runs a multiplexer (the bot binary) against a
+ * fake ircd on the loopback interface, attaches a swarm of bots to it, and
+ * reports throughput, delivery latency and the multiplexer's CPU time per
+ * line. Everything runs offline, on one box, so builds can be compared.
+ *
+ * Usage: loadgen [-b bot] [-c clients] [-T client threads] [-w workers]
+ *                [-r privmsgs/s] [-s privmsg bytes] [-N names bursts/s]
+ *                [-n names lines] [-P pings/s] [-d seconds]
+ *                [-t on|noktls|badcert]
+ *
+ * With -t the bot connects over TLS: on lets the two sides pick, noktls
+ * makes them fall back from kTLS to OpenSSL, and badcert checks that the
+ * bot refuses a certificate for the wrong name. The bot's account of the
+ * handshake is printed with the results.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "fake_ircd.h"
+#include "swarm.h"
+
+typedef struct loadgen_options_struct {
+    char *bot;
+    size_t clients;
+    size_t client_threads;
+    size_t workers;
+    traffic_mix mix;
+    double duration;
+    fake_tls_mode tls;
+} loadgen_options;
+
+/*
+ * CPU time a process has used so far, in nanoseconds
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int process_cpu_ns(pid_t pid, uint64_t *user_ns, uint64_t *system_ns) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    FILE *stat = fopen(path, "r");
+    if(stat == NULL) {
+	return -1;
+    }
+
+    char buf[1024];
+    size_t len = fread(buf, 1, sizeof(buf) - 1, stat);
+    fclose(stat);
+    buf[len] = '\0';
+
+    //utime and stime are the 12th and 13th fields after the command name
+    char *fields = strrchr(buf, ')');
+    unsigned long user_ticks, system_ticks;
+    if(fields == NULL || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+		&user_ticks, &system_ticks) != 2) {
+	return -1;
+    }
+
+    long ticks_per_second = sysconf(_SC_CLK_TCK);
+    *user_ns = user_ticks * (1000000000ULL / ticks_per_second);
+    *system_ns = system_ticks * (1000000000ULL / ticks_per_second);
+    return 0;
+}
+
+/*
+ * Peak resident set of a process, in KiB, or 0 if unknown
+ */
+unsigned long process_peak_rss_kb(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int) pid);
+    FILE *status = fopen(path, "r");
+    if(status == NULL) {
+	return 0;
+    }
+
+    char line[256];
+    unsigned long peak = 0;
+    while(fgets(line, sizeof(line), status) != NULL) {
+	if(sscanf(line, "VmHWM: %lu", &peak) == 1) {
+	    break;
+	}
+    }
+    fclose(status);
+    return peak;
+}
+
+/*
+ * Writes a one line config for the bot and starts it, quietly unless it's
+ * using TLS, when its errors go to bot.log
+ *
+ * Returns the bot's pid, or -1 on error.
+ */
+pid_t start_bot(loadgen_options *options, const char *directory, in_port_t port, const char *socket_path) {
+    char config_path[256];
+    snprintf(config_path, sizeof(config_path), "%s/loadgen.conf", directory);
+    FILE *config = fopen(config_path, "w");
+    if(config == NULL) {
+	perror(config_path);
+	return -1;
+    }
+    fprintf(config, "127.0.0.1 %s%u %s loadgen loadgen Load Generator\n",
+	    options->tls != FAKE_TLS_OFF ? "+" : "", (unsigned int) port, socket_path);
+    fclose(config);
+
+    char workers[32];
+    snprintf(workers, sizeof(workers), "%lu", (unsigned long) options->workers);
+    char ca_path[256], log_path[256];
+    snprintf(ca_path, sizeof(ca_path), "%s/ca.pem", directory);
+    snprintf(log_path, sizeof(log_path), "%s/bot.log", directory);
+
+    pid_t pid = fork();
+    if(pid == 0) {
+	if(freopen("/dev/null", "w", stdout) == NULL
+		|| freopen(options->tls != FAKE_TLS_OFF ? log_path : "/dev/null", "w", stderr) == NULL) {
+	    _exit(127);
+	}
+	if(options->tls != FAKE_TLS_OFF) {
+	    execl(options->bot, options->bot, "-w", workers, "-c", ca_path, config_path, (char *) NULL);
+	}
+	else {
+	    execl(options->bot, options->bot, "-w", workers, config_path, (char *) NULL);
+	}
+	_exit(127);
+    }
+    if(pid < 0) {
+	perror("fork()");
+    }
+    return pid;
+}
+
+/*
+ * Prints what the bot had to say about TLS
+ *
+ * Returns the number of lines printed.
+ */
+int print_tls_log(const char *directory) {
+    char log_path[256];
+    snprintf(log_path, sizeof(log_path), "%s/bot.log", directory);
+    FILE *log = fopen(log_path, "r");
+    if(log == NULL) {
+	return 0;
+    }
+
+    char line[512];
+    int printed = 0;
+    while(fgets(line, sizeof(line), log) != NULL) {
+	if(strstr(line, "TLS") != NULL && printed < 5) {
+	    printf("tls                %s", line);
+	    printed++;
+	}
+    }
+    fclose(log);
+    return printed;
+}
+
+void print_latency(const char *name, histogram *latency) {
+    printf("%-18s p50 %9.1f us   p99 %9.1f us   p999 %9.1f us   max %9.1f us   (%lu samples)\n", name,
+	    histogram_percentile(latency, 0.50) / 1e3, histogram_percentile(latency, 0.99) / 1e3,
+	    histogram_percentile(latency, 0.999) / 1e3, latency->max / 1e3, (unsigned long) latency->total);
+}
+
+int run_load(loadgen_options *options) {
+    char directory[] = "/tmp/loadgen.XXXXXX";
+    if(mkdtemp(directory) == NULL) {
+	perror("mkdtemp()");
+	return 1;
+    }
+    char socket_path[128];
+    snprintf(socket_path, sizeof(socket_path), "%s/mux.sock", directory);
+
+    char ca_path[256];
+    snprintf(ca_path, sizeof(ca_path), "%s/ca.pem", directory);
+
+    int status = 1;
+    swarm bots;
+    int swarm_ready = 0;
+    pid_t bot = -1;
+
+    fake_ircd ircd;
+    if(init_fake_ircd(&ircd, &(options->mix), options->tls, ca_path) != 0) {
+	goto cleanup;
+    }
+
+    bot = start_bot(options, directory, ircd.port, socket_path);
+    int accepted = bot < 0 ? -1 : fake_ircd_accept(&ircd, 5000);
+    if(options->tls == FAKE_TLS_BAD_CERT) {
+	//Give the bot a moment to say why it hung up
+	struct timespec pause = { 0, 100 * 1000 * 1000 };
+	nanosleep(&pause, NULL);
+	print_tls_log(directory);
+	if(accepted == 0 || !ircd.tls_failed) {
+	    fprintf(stderr, "loadgen: the bot %s\n", accepted == 0
+		    ? "accepted a certificate for the wrong name" : "never tried the handshake");
+	    goto cleanup;
+	}
+	printf("tls                certificate for the wrong name refused, as it should be\n");
+	status = 0;
+	goto cleanup;
+    }
+    if(accepted != 0) {
+	print_tls_log(directory);
+	goto cleanup;
+    }
+
+    swarm_ready = 1;
+    if(init_swarm(&bots, socket_path, options->clients, options->client_threads, 5000) != 0
+	    || swarm_start(&bots) != 0) {
+	fprintf(stderr, "loadgen: couldn't attach %lu clients\n", (unsigned long) options->clients);
+	goto cleanup;
+    }
+
+    //Let the multiplexer take in the clients before the flood starts
+    struct timespec settle = { 0, 200 * 1000 * 1000 };
+    nanosleep(&settle, NULL);
+
+    uint64_t user_before, system_before;
+    process_cpu_ns(bot, &user_before, &system_before);
+    if(fake_ircd_start(&ircd) != 0) {
+	goto cleanup;
+    }
+
+    struct timespec duration = { (time_t) options->duration,
+	(long) ((options->duration - (time_t) options->duration) * 1e9) };
+    nanosleep(&duration, NULL);
+    fake_ircd_stop(&ircd);
+
+    //Wait for deliveries to stop, so the backlog counts too
+    uint64_t delivered = swarm_lines(&bots);
+    for(int quiet = 0, waited = 0; quiet < 5 && waited < 100; waited++) {
+	struct timespec pause = { 0, 100 * 1000 * 1000 };
+	nanosleep(&pause, NULL);
+	uint64_t now_delivered = swarm_lines(&bots);
+	quiet = now_delivered == delivered ? quiet + 1 : 0;
+	delivered = now_delivered;
+    }
+    uint64_t drained_ns = now_ns();
+
+    uint64_t user_after, system_after;
+    process_cpu_ns(bot, &user_after, &system_after);
+    unsigned long peak_rss = process_peak_rss_kb(bot);
+
+    histogram latency;
+    init_histogram(&latency);
+    uint64_t lines, privmsgs, bytes;
+    swarm_stop(&bots, &latency, &lines, &privmsgs, &bytes);
+
+    double sent_seconds = (ircd.send_stopped_ns - ircd.send_started_ns) / 1e9;
+    double total_seconds = (drained_ns - ircd.send_started_ns) / 1e9;
+    uint64_t cpu_ns = (user_after - user_before) + (system_after - system_before);
+
+    printf("clients %lu, workers %lu, %.0f privmsgs/s of %lu bytes, %.1f names bursts/s of %lu lines, %.1f pings/s\n",
+	    (unsigned long) options->clients, (unsigned long) options->workers,
+	    options->mix.privmsg_rate, (unsigned long) options->mix.privmsg_size,
+	    options->mix.names_rate, (unsigned long) options->mix.names_lines, options->mix.ping_rate);
+    printf("sent               %lu lines (%lu privmsgs), %.1f MiB in %.2f s: %.0f lines/s\n",
+	    (unsigned long) ircd.lines_sent, (unsigned long) ircd.privmsgs_sent,
+	    ircd.bytes_sent / 1048576.0, sent_seconds, ircd.lines_sent / sent_seconds);
+    printf("delivered          %lu lines, %.1f MiB in %.2f s: %.0f lines/s, %.1f%% of privmsgs\n",
+	    (unsigned long) lines, bytes / 1048576.0, total_seconds, lines / total_seconds,
+	    ircd.privmsgs_sent == 0 ? 0.0 : 100.0 * privmsgs / ((double) ircd.privmsgs_sent * options->clients));
+    print_latency("privmsg delivery", &latency);
+    print_latency("ping to pong", &(ircd.pong_latency));
+    printf("multiplexer cpu    %.2f s user, %.2f s system: %.2f us per line in, %.3f us per line out\n",
+	    (user_after - user_before) / 1e9, (system_after - system_before) / 1e9,
+	    ircd.lines_sent == 0 ? 0.0 : cpu_ns / 1e3 / ircd.lines_sent,
+	    lines == 0 ? 0.0 : cpu_ns / 1e3 / lines);
+    printf("multiplexer rss    %lu KiB peak\n", peak_rss);
+    if(options->tls != FAKE_TLS_OFF) {
+	print_tls_log(directory);
+    }
+    status = 0;
+
+cleanup:
+    if(bot > 0) {
+	kill(bot, SIGTERM);
+	waitpid(bot, NULL, 0);
+    }
+    if(swarm_ready) {
+	destroy_swarm(&bots);
+    }
+    destroy_fake_ircd(&ircd);
+
+    unlink(socket_path);
+    unlink(ca_path);
+    char path[256];
+    snprintf(path, sizeof(path), "%s/loadgen.conf", directory);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/bot.log", directory);
+    unlink(path);
+    rmdir(directory);
+    return status;
+}
+
+int main(int argc, char **argv) {
+    loadgen_options options;
+    options.bot = "./bot";
+    options.clients = 10;
+    options.client_threads = 2;
+    options.workers = 0;
+    options.mix.privmsg_rate = 10000;
+    options.mix.privmsg_size = 64;
+    options.mix.names_rate = 1;
+    options.mix.names_lines = 100;
+    options.mix.ping_rate = 10;
+    options.duration = 5;
+    options.tls = FAKE_TLS_OFF;
+
+    int opt;
+    while((opt = getopt(argc, argv, "b:c:T:w:r:s:N:n:P:d:t:")) != -1) {
+	switch(opt) {
+	    case 'b':
+		options.bot = optarg;
+		break;
+	    case 'c':
+		options.clients = strtoul(optarg, NULL, 10);
+		break;
+	    case 'T':
+		options.client_threads = strtoul(optarg, NULL, 10);
+		break;
+	    case 'w':
+		options.workers = strtoul(optarg, NULL, 10);
+		break;
+	    case 'r':
+		options.mix.privmsg_rate = strtod(optarg, NULL);
+		break;
+	    case 's':
+		options.mix.privmsg_size = strtoul(optarg, NULL, 10);
+		break;
+	    case 'N':
+		options.mix.names_rate = strtod(optarg, NULL);
+		break;
+	    case 'n':
+		options.mix.names_lines = strtoul(optarg, NULL, 10);
+		break;
+	    case 'P':
+		options.mix.ping_rate = strtod(optarg, NULL);
+		break;
+	    case 'd':
+		options.duration = strtod(optarg, NULL);
+		break;
+	    case 't':
+		if(strcmp(optarg, "on") == 0) {
+		    options.tls = FAKE_TLS_ON;
+		    break;
+		}
+		if(strcmp(optarg, "noktls") == 0) {
+		    options.tls = FAKE_TLS_NO_KTLS;
+		    break;
+		}
+		if(strcmp(optarg, "badcert") == 0) {
+		    options.tls = FAKE_TLS_BAD_CERT;
+		    break;
+		}
+		//Fall through
+	    default:
+		fprintf(stderr, "Usage: %s [-b bot] [-c clients] [-T client threads] [-w workers]\n"
+			"\t[-r privmsgs/s] [-s privmsg bytes] [-N names bursts/s] [-n names lines]\n"
+			"\t[-P pings/s] [-d seconds] [-t on|noktls|badcert]\n", argv[0]);
+		return 1;
+	}
+    }
+
+    if(options.clients == 0 || options.client_threads == 0) {
+	fprintf(stderr, "loadgen: need at least one client and client thread\n");
+	return 1;
+    }
+
+    //A bot that dies takes its sockets with it; we'd rather see the error
+    signal(SIGPIPE, SIG_IGN);
+    return run_load(&options);
+}
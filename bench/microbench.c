@@ -0,0 +1,352 @@
+/* microbench.c
+ *
+ * Microbenchmarks for the per-line hot paths: parsing, framing a stream
+ * into lines, and the string utilities. Each benchmark reports the time
+ * and the number of allocations per line, and the results can be written
+ * out as JSON to compare builds.
+ *
+ * Allocations are counted by linking with --wrap for malloc, calloc,
+ * realloc and free, so only calls made from our own objects are counted.
+ * The sources under test are built without DEBUG, whose tracing would
+ * swamp the numbers.
+ *
+ * Usage: microbench [-t seconds per benchmark] [-s seed] [-o results.json]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "irc_message.h"
+#include "buffered_socket.h"
+#include "arena.h"
+#include "utilities.h"
+
+/* Allocation counting */
+
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t count, size_t size);
+void * __real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+static uint64_t allocations;
+
+void * __wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+}
+
+void * __wrap_calloc(size_t count, size_t size) {
+    allocations++;
+    return __real_calloc(count, size);
+}
+
+void * __wrap_realloc(void *ptr, size_t size) {
+    allocations++;
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr) {
+    __real_free(ptr);
+}
+
+/* Corpus */
+
+static const char *corpus[] = {
+    //Short PRIVMSGs, the bulk of any busy channel
+    ":alice!alice@host.example.com PRIVMSG #chan :hi\r\n",
+    ":bob!~bob@192.0.2.17 PRIVMSG #linux :anyone around?\r\n",
+    ":carol!carol@user/carol PRIVMSG finchbot :ping\r\n",
+    //Long trailing params
+    ":dave!dave@host.example.com PRIVMSG #chan :Lorem ipsum dolor sit amet, consectetur "
+	"adipiscing elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua. Ut "
+	"enim ad minim veniam, quis nostrud exercitation ullamco laboris nisi ut aliquip ex ea "
+	"commodo consequat. Duis aute irure dolor in reprehenderit in voluptate velit esse cillum "
+	"dolore eu fugiat nulla pariatur. Excepteur sint occaecat cupidatat non proident.\r\n",
+    //Numerics with the full 15 params
+    ":irc.example.net 005 finchbot AWAYLEN=200 CASEMAPPING=rfc1459 CHANLIMIT=#:120 "
+	"CHANMODES=b,k,l,imnpst CHANNELLEN=50 CHANTYPES=# ELIST=CMNTU HOSTLEN=64 KICKLEN=255 "
+	"MAXLIST=b:100 MODES=4 NETWORK=Example NICKLEN=30 :are supported by this server\r\n",
+    ":irc.example.net 353 finchbot = #chan :@op +voice alice bob carol dave eve frank "
+	"grace heidi ivan judy mallory niaj olivia peggy rupert sybil trent victor walter\r\n",
+    ":irc.example.net 352 finchbot #chan ~alice host.example.com irc.example.net alice H@ :0 Alice\r\n",
+    //Unprefixed lines
+    "PING :irc.example.net\r\n",
+    "NOTICE * :*** Looking up your hostname...\r\n",
+    "ERROR :Closing Link: finchbot (Ping timeout)\r\n",
+    //Other prefixed commands
+    ":eve!eve@host.example.com JOIN :#chan\r\n",
+    ":frank!frank@host.example.com PART #a,#b :leaving\r\n",
+    ":grace!grace@host.example.com MODE #chan +o alice\r\n",
+    ":heidi!heidi@host.example.com QUIT :Quit: bye\r\n",
+};
+
+#define CORPUS_LEN (sizeof(corpus) / sizeof(corpus[0]))
+
+typedef struct result_struct {
+    char name[64];
+    uint64_t lines;
+    double ns_per_line;
+    double allocs_per_line;
+} result;
+
+static result results[32];
+static size_t results_len;
+static double min_seconds = 0.5;
+
+uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * Runs one pass of a benchmark over and over for at least min_seconds, and
+ * records the time and allocations per line. Each pass returns the lines
+ * it processed.
+ */
+void run_benchmark(const char *name, uint64_t (*pass)(void *), void *args) {
+    //Warm up caches, pools and arenas
+    pass(args);
+
+    uint64_t lines = 0;
+    uint64_t allocations_before = allocations;
+    uint64_t started = now_ns();
+    uint64_t elapsed;
+    do {
+	lines += pass(args);
+	elapsed = now_ns() - started;
+    } while(elapsed < min_seconds * 1e9);
+
+    result *this = &(results[results_len++]);
+    snprintf(this->name, sizeof(this->name), "%s", name);
+    this->lines = lines;
+    this->ns_per_line = (double) elapsed / lines;
+    this->allocs_per_line = (double) (allocations - allocations_before) / lines;
+    printf("%-28s %12.1f ns/line %8.2f allocs/line %12lu lines\n", this->name,
+	    this->ns_per_line, this->allocs_per_line, (unsigned long) lines);
+}
+
+/* Parsing */
+
+static volatile size_t sink;
+
+/*
+ * parse_message modifies nothing, but takes a char *
+ */
+static char *corpus_copy[CORPUS_LEN];
+
+uint64_t pass_parse_message(void *args) {
+    for(size_t i = 0; i < CORPUS_LEN; i++) {
+	irc_message *msg = parse_message(corpus_copy[i]);
+	sink += msg->params_len;
+	destroy_message(msg);
+    }
+    return CORPUS_LEN;
+}
+
+uint64_t pass_parse_message_in(void *args) {
+    arena *scratch = (arena *) args;
+    for(size_t i = 0; i < CORPUS_LEN; i++) {
+	irc_message *msg = parse_message_in(scratch, corpus_copy[i]);
+	sink += msg->params_len;
+	arena_reset(scratch);
+    }
+    return CORPUS_LEN;
+}
+
+uint64_t pass_parse_message_view(void *args) {
+    for(size_t i = 0; i < CORPUS_LEN; i++) {
+	irc_message msg;
+	parse_message_view(&msg, corpus[i], strlen(corpus[i]));
+	sink += msg.command_id;
+    }
+    return CORPUS_LEN;
+}
+
+uint64_t pass_parse_message_view_params(void *args) {
+    for(size_t i = 0; i < CORPUS_LEN; i++) {
+	irc_message msg;
+	parse_message_view(&msg, corpus[i], strlen(corpus[i]));
+	sink += message_param_count(&msg);
+    }
+    return CORPUS_LEN;
+}
+
+/* Framing */
+
+typedef struct feed_args_struct {
+    buffered_socket *bufsock;
+    //The corpus repeated into one stream
+    char *stream;
+    size_t stream_len;
+    uint64_t stream_lines;
+    //Sizes to cut the stream into, cycled through
+    size_t *fragments;
+    size_t fragments_len;
+    uint64_t received;
+} feed_args;
+
+void on_feed_line(char *line, size_t len, void *args) {
+    feed_args *feed = (feed_args *) args;
+    feed->received++;
+    sink += len;
+}
+
+uint64_t pass_feed(void *args) {
+    feed_args *feed = (feed_args *) args;
+    size_t offset = 0;
+    size_t fragment = 0;
+
+    while(offset < feed->stream_len) {
+	size_t len = feed->fragments[fragment];
+	fragment = (fragment + 1) % feed->fragments_len;
+	if(len > feed->stream_len - offset) {
+	    len = feed->stream_len - offset;
+	}
+	bufsock_feed(feed->bufsock, feed->stream + offset, len);
+	offset += len;
+    }
+    return feed->stream_lines;
+}
+
+/*
+ * Benchmarks framing with the stream cut into pieces of the given sizes.
+ * Fails loudly if a line goes missing, since then the numbers are wrong.
+ */
+void run_feed(const char *name, char *stream, size_t stream_len, uint64_t stream_lines,
+	size_t *fragments, size_t fragments_len) {
+    feed_args feed = { NULL, stream, stream_len, stream_lines, fragments, fragments_len, 0 };
+    feed.bufsock = new_buffered_socket("\r\n", &on_feed_line, &feed);
+
+    run_benchmark(name, &pass_feed, &feed);
+
+    if(feed.received % stream_lines != 0) {
+	fprintf(stderr, "%s: received %lu lines, not a multiple of %lu\n", name,
+		(unsigned long) feed.received, (unsigned long) stream_lines);
+	exit(1);
+    }
+    destroy_buffered_socket(feed.bufsock);
+}
+
+/* String utilities */
+
+uint64_t pass_str_append(void *args) {
+    for(size_t i = 0; i < CORPUS_LEN; i++) {
+	//Rebuild the line from its words, as a naive parser would
+	char *line = NULL;
+	const char *word = corpus[i];
+	while(*word != '\0') {
+	    const char *space = strchr(word, ' ');
+	    size_t len = space == NULL ? strlen(word) : (size_t) (space - word + 1);
+	    free(strn_append(&line, (char *) word, len));
+	    word += len;
+	}
+	free(str_append(&line, "\r\n"));
+	sink += strlen(line);
+	free(line);
+    }
+    return CORPUS_LEN;
+}
+
+/* Results */
+
+int write_results(const char *path, unsigned int seed) {
+    FILE *out = fopen(path, "w");
+    if(out == NULL) {
+	perror(path);
+	return -1;
+    }
+
+    fprintf(out, "{\n  \"seed\": %u,\n  \"seconds_per_benchmark\": %g,\n  \"benchmarks\": [\n", seed, min_seconds);
+    for(size_t i = 0; i < results_len; i++) {
+	fprintf(out, "    {\"name\": \"%s\", \"lines\": %lu, \"ns_per_line\": %.2f, \"allocs_per_line\": %.3f}%s\n",
+		results[i].name, (unsigned long) results[i].lines, results[i].ns_per_line,
+		results[i].allocs_per_line, i + 1 < results_len ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+    fclose(out);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    char *output = NULL;
+    unsigned int seed = 1;
+
+    int opt;
+    while((opt = getopt(argc, argv, "t:s:o:")) != -1) {
+	switch(opt) {
+	    case 't':
+		min_seconds = strtod(optarg, NULL);
+		break;
+	    case 's':
+		seed = strtoul(optarg, NULL, 10);
+		break;
+	    case 'o':
+		output = optarg;
+		break;
+	    default:
+		fprintf(stderr, "Usage: %s [-t seconds per benchmark] [-s seed] [-o results.json]\n", argv[0]);
+		return 1;
+	}
+    }
+
+    for(size_t i = 0; i < CORPUS_LEN; i++) {
+	corpus_copy[i] = strdup(corpus[i]);
+    }
+
+    arena scratch;
+    init_arena(&scratch, 4096);
+
+    run_benchmark("parse_message", &pass_parse_message, NULL);
+    run_benchmark("parse_message_in", &pass_parse_message_in, &scratch);
+    run_benchmark("parse_message_view", &pass_parse_message_view, NULL);
+    run_benchmark("parse_message_view_params", &pass_parse_message_view_params, NULL);
+
+    //A stream of the corpus, repeated
+    size_t stream_len = 0;
+    uint64_t stream_lines = 0;
+    char *stream = malloc(256 * 1024);
+    while(stream_len < 128 * 1024) {
+	for(size_t i = 0; i < CORPUS_LEN; i++) {
+	    size_t len = strlen(corpus[i]);
+	    memcpy(stream + stream_len, corpus[i], len);
+	    stream_len += len;
+	    stream_lines++;
+	}
+    }
+
+    size_t whole[] = { stream_len };
+    size_t bytes[] = { 1 };
+    size_t small[] = { 7, 13, 29 };
+    size_t packets[] = { 1448 };
+    size_t reads[] = { 16384 };
+    size_t scattered[4096];
+    srand(seed);
+    for(size_t i = 0; i < sizeof(scattered) / sizeof(scattered[0]); i++) {
+	scattered[i] = 1 + rand() % 4096;
+    }
+
+    run_feed("bufsock_feed/whole", stream, stream_len, stream_lines, whole, 1);
+    run_feed("bufsock_feed/1", stream, stream_len, stream_lines, bytes, 1);
+    run_feed("bufsock_feed/7-29", stream, stream_len, stream_lines, small, 3);
+    run_feed("bufsock_feed/1448", stream, stream_len, stream_lines, packets, 1);
+    run_feed("bufsock_feed/16384", stream, stream_len, stream_lines, reads, 1);
+    run_feed("bufsock_feed/random", stream, stream_len, stream_lines, scattered, sizeof(scattered) / sizeof(scattered[0]));
+
+    run_benchmark("strn_append", &pass_str_append, NULL);
+
+    destroy_arena(&scratch);
+    free(stream);
+    for(size_t i = 0; i < CORPUS_LEN; i++) {
+	free(corpus_copy[i]);
+    }
+
+    if(output != NULL && write_results(output, seed) != 0) {
+	return 1;
+    }
+    return 0;
+}
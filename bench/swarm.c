@@ -0,0 +1,204 @@
+/* swarm.c
+ *
+ * Implementation of the swarm of synthetic bots
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#include "swarm.h"
+#include "fake_ircd.h"
+
+/*
+ * Connects to the multiplexer's socket, waiting for it to show up
+ *
+ * Returns the fd, or -1 on error or timeout.
+ */
+int connect_bot(const char *socket_path, int timeout_ms) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+
+    uint64_t deadline = now_ns() + (uint64_t) timeout_ms * 1000000;
+    while(1) {
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0) {
+	    perror("socket()");
+	    return -1;
+	}
+	if(connect(fd, (struct sockaddr *) &address, sizeof(address)) == 0) {
+	    //We're not resuming, so live lines needn't wait for us to say so
+	    const char *live = "MUX LIVE\r\n";
+	    if(write(fd, live, strlen(live)) < 0) {
+		perror("write()");
+	    }
+	    fcntl(fd, F_SETFL, O_NONBLOCK);
+	    return fd;
+	}
+	close(fd);
+
+	if(now_ns() > deadline) {
+	    perror(socket_path);
+	    return -1;
+	}
+	struct timespec pause = { 0, 10 * 1000 * 1000 };
+	nanosleep(&pause, NULL);
+    }
+}
+
+int init_swarm(swarm *this, const char *socket_path, size_t clients_len, size_t threads_len, int timeout_ms) {
+    memset(this, 0, sizeof(swarm));
+    if(threads_len > clients_len) {
+	threads_len = clients_len;
+    }
+
+    this->clients = calloc(clients_len, sizeof(swarm_client));
+    this->threads = calloc(threads_len, sizeof(swarm_thread));
+    if(this->clients == NULL || this->threads == NULL) {
+	return -1;
+    }
+
+    for(size_t i = 0; i < threads_len; i++) {
+	swarm_thread *thread = &(this->threads[i]);
+	thread->swarm = this;
+	init_histogram(&(thread->latency));
+	thread->epoll_fd = epoll_create1(0);
+	if(thread->epoll_fd < 0) {
+	    perror("epoll_create1()");
+	    return -1;
+	}
+	this->threads_len++;
+    }
+
+    for(size_t i = 0; i < clients_len; i++) {
+	swarm_client *client = &(this->clients[i]);
+	client->fd = connect_bot(socket_path, timeout_ms);
+	client->buf = malloc(SWARM_READ_SIZE);
+	this->clients_len++;
+	if(client->fd < 0 || client->buf == NULL) {
+	    return -1;
+	}
+
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = client;
+	if(epoll_ctl(this->threads[i % threads_len].epoll_fd, EPOLL_CTL_ADD, client->fd, &event) != 0) {
+	    perror("epoll_ctl()");
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Counts the complete lines in a bot's buffer, timing the stamped PRIVMSGs
+ * among them, and keeps whatever partial line is left over
+ */
+void swarm_consume(swarm_thread *this, swarm_client *client) {
+    static const char marker[] = " PRIVMSG " FAKE_IRCD_CHANNEL " :";
+    uint64_t now = now_ns();
+    char *line = client->buf;
+    char *end;
+
+    while((end = memchr(line, '\n', client->buf + client->len - line)) != NULL) {
+	__atomic_fetch_add(&(this->lines), 1, __ATOMIC_RELAXED);
+
+	char *stamp = memmem(line, end - line, marker, sizeof(marker) - 1);
+	if(stamp != NULL) {
+	    char *sent;
+	    strtoull(stamp + sizeof(marker) - 1, &sent, 10);
+	    uint64_t sent_ns = strtoull(sent, NULL, 10);
+	    if(sent_ns > 0 && sent_ns <= now) {
+		histogram_record(&(this->latency), now - sent_ns);
+	    }
+	    __atomic_fetch_add(&(this->privmsgs), 1, __ATOMIC_RELAXED);
+	}
+	line = end + 1;
+    }
+
+    client->len = client->buf + client->len - line;
+    memmove(client->buf, line, client->len);
+    if(client->len == SWARM_READ_SIZE) {
+	client->len = 0;
+    }
+}
+
+void * swarm_run(void *args) {
+    swarm_thread *this = (swarm_thread *) args;
+    struct epoll_event events[64];
+
+    while(this->swarm->running) {
+	int ready = epoll_wait(this->epoll_fd, events, 64, 100);
+	for(int i = 0; i < ready; i++) {
+	    swarm_client *client = (swarm_client *) events[i].data.ptr;
+
+	    //Level triggered, so one read per wakeup keeps the bots fair
+	    ssize_t received = read(client->fd, client->buf + client->len, SWARM_READ_SIZE - client->len);
+	    if(received > 0) {
+		__atomic_fetch_add(&(this->bytes), received, __ATOMIC_RELAXED);
+		client->len += received;
+		swarm_consume(this, client);
+	    }
+	    else if(received == 0 || (errno != EAGAIN && errno != EINTR)) {
+		epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+	    }
+	}
+    }
+    return NULL;
+}
+
+int swarm_start(swarm *this) {
+    this->running = 1;
+    for(size_t i = 0; i < this->threads_len; i++) {
+	if(pthread_create(&(this->threads[i].thread), NULL, &swarm_run, &(this->threads[i])) != 0) {
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+uint64_t swarm_lines(swarm *this) {
+    uint64_t lines = 0;
+    for(size_t i = 0; i < this->threads_len; i++) {
+	lines += __atomic_load_n(&(this->threads[i].lines), __ATOMIC_RELAXED);
+    }
+    return lines;
+}
+
+void swarm_stop(swarm *this, histogram *latency, uint64_t *lines, uint64_t *privmsgs, uint64_t *bytes) {
+    if(this->running) {
+	this->running = 0;
+	for(size_t i = 0; i < this->threads_len; i++) {
+	    pthread_join(this->threads[i].thread, NULL);
+	}
+    }
+
+    *lines = *privmsgs = *bytes = 0;
+    for(size_t i = 0; i < this->threads_len; i++) {
+	histogram_merge(latency, &(this->threads[i].latency));
+	*lines += this->threads[i].lines;
+	*privmsgs += this->threads[i].privmsgs;
+	*bytes += this->threads[i].bytes;
+    }
+}
+
+void destroy_swarm(swarm *this) {
+    for(size_t i = 0; i < this->clients_len; i++) {
+	close(this->clients[i].fd);
+	free(this->clients[i].buf);
+    }
+    for(size_t i = 0; i < this->threads_len; i++) {
+	close(this->threads[i].epoll_fd);
+    }
+    free(this->clients);
+    free(this->threads);
+}
@@ -0,0 +1,81 @@
+/* swarm.h
+ *
+ * Defines a swarm of synthetic bots attached to a multiplexer's unix
+ * socket. The bots are spread over a few threads, each reading its share
+ * with epoll, and time every PRIVMSG the fake ircd stamped from the moment
+ * it was sent to the moment it arrived.
+ */
+
+#ifndef _SWARM_H
+#define _SWARM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "histogram.h"
+
+//Bytes of a partial line a bot can hold between reads
+#define SWARM_READ_SIZE (64 * 1024)
+
+typedef struct swarm_client_struct {
+    int fd;
+    char *buf;
+    size_t len;
+} swarm_client;
+
+typedef struct swarm_thread_struct {
+    struct swarm_struct *swarm;
+    pthread_t thread;
+    int epoll_fd;
+
+    //Delivery latency of stamped PRIVMSGs
+    histogram latency;
+
+    //Updated as lines arrive, and may be read from other threads
+    uint64_t lines;
+    uint64_t privmsgs;
+    uint64_t bytes;
+} swarm_thread;
+
+typedef struct swarm_struct {
+    swarm_client *clients;
+    size_t clients_len;
+
+    swarm_thread *threads;
+    size_t threads_len;
+
+    volatile int running;
+} swarm;
+
+/*
+ * Connects clients_len bots to the socket, retrying until it appears or
+ * the timeout runs out.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int init_swarm(swarm *this, const char *socket_path, size_t clients_len, size_t threads_len, int timeout_ms);
+
+/*
+ * Starts the threads reading
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int swarm_start(swarm *this);
+
+/*
+ * Lines received by every bot so far
+ */
+uint64_t swarm_lines(swarm *this);
+
+/*
+ * Stops the threads and adds up what they saw
+ */
+void swarm_stop(swarm *this, histogram *latency, uint64_t *lines, uint64_t *privmsgs, uint64_t *bytes);
+
+/*
+ * Disconnects every bot and frees the swarm
+ */
+void destroy_swarm(swarm *this);
+
+#endif /* _SWARM_H */
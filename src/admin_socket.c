@@ -0,0 +1,483 @@
+/* admin_socket.c
+ *
+ * Implements the admin socket and metrics scrapes
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "admin_socket.h"
+#include "fanout_worker.h"
+
+/* Internal function declarations */
+void on_admin_listen_event(int fd, uint32_t events, void *args);
+void on_admin_read(char *line, size_t len, void *args);
+void on_admin_drain(buffered_socket *bufsock, void *args);
+void on_admin_close(buffered_socket *bufsock, void *args);
+void remove_admin_connection(admin_connection *admin);
+void start_scrape(admin_connection *admin);
+void on_scrape_collect(void *args);
+void on_scrape_reported(void *args);
+void free_scrape(scrape *this);
+
+int attach_admin_socket(irc_multiplexer *this) {
+    init_event_handler(&(this->admin_handler), this->admin_socket, &on_admin_listen_event, this);
+    return event_loop_add(this->loop, &(this->admin_handler), EPOLLIN);
+}
+
+void close_admin_socket(irc_multiplexer *this) {
+    while(this->admins != NULL) {
+	remove_admin_connection(this->admins);
+    }
+
+    if(this->admin_socket >= 0) {
+	event_loop_remove(this->loop, &(this->admin_handler));
+	close(this->admin_socket);
+	this->admin_socket = -1;
+	unlink(this->admin_socket_path);
+    }
+
+    //The workers are gone, so nobody is going to report back on these
+    while(this->scrapes != NULL) {
+	scrape *current = this->scrapes;
+	this->scrapes = current->next;
+	free_scrape(current);
+    }
+}
+
+/*
+ * Accepts every pending connection on the admin socket
+ */
+void on_admin_listen_event(int fd, uint32_t events, void *args) {
+    irc_multiplexer *this = (irc_multiplexer *) args;
+
+    while(1) {
+	int admin_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if(admin_fd < 0) {
+	    if(errno == EINTR) {
+		continue;
+	    }
+	    if(errno != EAGAIN && errno != EWOULDBLOCK) {
+		perror("accept4()");
+	    }
+	    return;
+	}
+
+	admin_connection *admin = malloc(sizeof(admin_connection));
+	if(admin == NULL) {
+	    close(admin_fd);
+	    continue;
+	}
+	admin->owner = this;
+	admin->requested = 0;
+	admin->http = 0;
+	admin->scrape = NULL;
+
+	//A bare LF ends the request line, so CR LF works too
+	admin->bufsock = new_buffered_socket("\n", &on_admin_read, admin);
+	if(admin->bufsock == NULL) {
+	    close(admin_fd);
+	    free(admin);
+	    continue;
+	}
+	admin->bufsock->fd = admin_fd;
+	admin->bufsock->close_callback = &on_admin_close;
+	admin->bufsock->drain_callback = &on_admin_drain;
+	if(bufsock_attach(admin->bufsock, this->loop) != 0) {
+	    destroy_buffered_socket(admin->bufsock);
+	    free(admin);
+	    continue;
+	}
+
+	admin->next = this->admins;
+	this->admins = admin;
+    }
+}
+
+/*
+ * The first line is the request. Anything after it, like HTTP headers, is
+ * ignored.
+ */
+void on_admin_read(char *line, size_t len, void *args) {
+    admin_connection *admin = (admin_connection *) args;
+
+    if(admin->requested) {
+	return;
+    }
+    admin->requested = 1;
+    admin->http = len >= 4 && memcmp(line, "GET ", 4) == 0;
+    start_scrape(admin);
+}
+
+/*
+ * The answer is out, so we're done writing. The peer closes its end once
+ * it has read everything, which is when we let go of the connection;
+ * closing first could reset it before the answer is read.
+ */
+void on_admin_drain(buffered_socket *bufsock, void *args) {
+    admin_connection *admin = (admin_connection *) args;
+
+    if(admin->requested && admin->scrape == NULL) {
+	shutdown(bufsock->fd, SHUT_WR);
+    }
+}
+
+void on_admin_close(buffered_socket *bufsock, void *args) {
+    remove_admin_connection((admin_connection *) args);
+}
+
+void remove_admin_connection(admin_connection *admin) {
+    irc_multiplexer *owner = admin->owner;
+
+    for(admin_connection **current = &(owner->admins);
+	    *current != NULL;
+	    current = &((*current)->next) ) {
+
+	if(*current == admin) {
+	    *current = admin->next;
+	    break;
+	}
+    }
+
+    //Let a scrape in progress finish, but with nobody to tell
+    if(admin->scrape != NULL) {
+	admin->scrape->admin = NULL;
+    }
+    destroy_buffered_socket(admin->bufsock);
+    free(admin);
+}
+
+/*
+ * Asks every thread with clients for its numbers. Our own are collected
+ * right away, the workers' come back through our mailbox.
+ */
+void start_scrape(admin_connection *admin) {
+    irc_multiplexer *owner = admin->owner;
+
+    scrape *this = malloc(sizeof(scrape));
+    if(this == NULL) {
+	return;
+    }
+    this->owner = owner;
+    this->admin = admin;
+    this->lists_len = owner->workers_len + 1;
+    this->pending = this->lists_len;
+    this->lists = calloc(this->lists_len, sizeof(list_metrics));
+    if(this->lists == NULL) {
+	free(this);
+	return;
+    }
+
+    this->next = owner->scrapes;
+    owner->scrapes = this;
+    admin->scrape = this;
+
+    for(size_t i = 0; i < this->lists_len; i++) {
+	list_metrics *metrics = &(this->lists[i]);
+	metrics->scrape = this;
+	if(i == 0) {
+	    metrics->list = &(owner->clients);
+	    metrics->loop = owner->loop;
+	}
+	else {
+	    metrics->list = &(owner->workers[i - 1].clients);
+	    metrics->loop = &(owner->workers[i - 1].loop);
+	}
+    }
+
+    for(size_t i = 1; i < this->lists_len; i++) {
+	if(mailbox_post(&(owner->workers[i - 1].mailbox), &on_scrape_collect, NULL, &(this->lists[i])) != 0) {
+	    //Report the worker as having no clients rather than never finishing
+	    on_scrape_reported(this);
+	}
+    }
+
+    //May finish the scrape, so it goes last
+    on_scrape_collect(&(this->lists[0]));
+}
+
+/*
+ * Copies one thread's numbers into the scrape. Runs on the thread that
+ * owns the client list.
+ */
+void on_scrape_collect(void *args) {
+    list_metrics *this = (list_metrics *) args;
+    client_list *list = this->list;
+
+    this->clients = calloc(list->len == 0 ? 1 : list->len, sizeof(client_metrics));
+    for(size_t i = 0; i < list->len && this->clients != NULL; i++) {
+	client_socket *client = list->items[i];
+	buffered_socket *bufsock = client->bufsock;
+	client_metrics *metrics = &(this->clients[this->clients_len++]);
+	metrics->sender = client->sender;
+	metrics->lines_in = bufsock->stats.lines_in;
+	metrics->bytes_in = bufsock->stats.bytes_in;
+	metrics->lines_out = bufsock->stats.lines_out;
+	metrics->bytes_out = bufsock->stats.bytes_out;
+	metrics->oversized = bufsock->stats.oversized;
+	metrics->parse_errors = client->parse_errors;
+	metrics->dropped = client->dropped;
+	metrics->queued_bytes = bufsock->write_queued_bytes;
+	metrics->queued_lines = bufsock->write_queued_count;
+    }
+
+    this->backlog = list->backlog_stats;
+    this->fanout_time = list->fanout_time;
+    this->iterations = this->loop->iterations;
+    if(this->loop->latency != NULL) {
+	this->loop_latency = *(this->loop->latency);
+    }
+
+    irc_multiplexer *owner = this->scrape->owner;
+    if(list == &(owner->clients)) {
+	on_scrape_reported(this->scrape);
+    }
+    else {
+	mailbox_post(&(owner->mailbox), &on_scrape_reported, NULL, this->scrape);
+    }
+}
+
+/*
+ * A thread reported back. Once they all have, answer the request.
+ */
+void on_scrape_reported(void *args) {
+    scrape *this = (scrape *) args;
+    irc_multiplexer *owner = this->owner;
+
+    if(--this->pending > 0) {
+	return;
+    }
+
+    for(scrape **current = &(owner->scrapes);
+	    *current != NULL;
+	    current = &((*current)->next) ) {
+
+	if(*current == this) {
+	    *current = this->next;
+	    break;
+	}
+    }
+
+    admin_connection *admin = this->admin;
+    if(admin != NULL) {
+	admin->scrape = NULL;
+
+	metrics_text text;
+	init_metrics_text(&text);
+	format_metrics(this, &text);
+
+	if(admin->http) {
+	    bufsock_printf(admin->bufsock, "HTTP/1.0 200 OK\r\n"
+		    "Content-Type: text/plain; version=0.0.4\r\n"
+		    "Content-Length: %lu\r\n"
+		    "Connection: close\r\n\r\n", (unsigned long) text.len);
+	}
+	if(bufsock_write(admin->bufsock, text.data, text.len) != 0 || text.len == 0) {
+	    shutdown(admin->bufsock->fd, SHUT_WR);
+	}
+	destroy_metrics_text(&text);
+    }
+    free_scrape(this);
+}
+
+void free_scrape(scrape *this) {
+    for(size_t i = 0; i < this->lists_len; i++) {
+	free(this->lists[i].clients);
+    }
+    free(this->lists);
+    free(this);
+}
+
+/*
+ * Per client metric families, read out of client_metrics by offset
+ */
+typedef struct client_family_struct {
+    const char *name;
+    const char *type;
+    const char *help;
+    size_t offset;
+} client_family;
+
+static const client_family client_families[] = {
+    { "client_received_lines_total", "counter", "Lines read from the client.",
+	offsetof(client_metrics, lines_in) },
+    { "client_received_bytes_total", "counter", "Bytes read from the client.",
+	offsetof(client_metrics, bytes_in) },
+    { "client_sent_lines_total", "counter", "Queued writes sent to the client, one per line except for history chunks.",
+	offsetof(client_metrics, lines_out) },
+    { "client_sent_bytes_total", "counter", "Bytes sent to the client.",
+	offsetof(client_metrics, bytes_out) },
+    { "client_oversized_lines_total", "counter", "Lines from the client discarded for being too long.",
+	offsetof(client_metrics, oversized) },
+    { "client_parse_errors_total", "counter", "Lines from the client that could not be parsed.",
+	offsetof(client_metrics, parse_errors) },
+    { "client_dropped_lines_total", "counter", "Lines for the client discarded by the backlog policy.",
+	offsetof(client_metrics, dropped) },
+    { "client_queued_bytes", "gauge", "Bytes waiting to be written to the client.",
+	offsetof(client_metrics, queued_bytes) },
+    { "client_queued_lines", "gauge", "Lines waiting to be written to the client.",
+	offsetof(client_metrics, queued_lines) },
+};
+
+static const char *policy_names[BACKLOG_POLICY_COUNT] = {
+    [BACKLOG_DISCONNECT] = "disconnect",
+    [BACKLOG_DROP_OLDEST] = "drop_oldest",
+    [BACKLOG_DROP_NON_PRIVMSG] = "drop_non_privmsg",
+    [BACKLOG_SUMMARIZE] = "summarize",
+};
+
+/*
+ * Starts a family and adds its only sample
+ */
+void format_single(metrics_text *text, const char *name, const char *type, const char *help,
+	const char *labels, unsigned long value) {
+    metrics_family(text, name, type, help);
+    metrics_sample(text, name, labels, value);
+}
+
+void format_metrics(scrape *this, metrics_text *text) {
+    irc_multiplexer *owner = this->owner;
+    buffered_socket *remote = owner->remote;
+
+    //Every sample is labelled with the socket clients connect to
+    metrics_text mux_labels;
+    init_metrics_text(&mux_labels);
+    metrics_printf(&mux_labels, "mux=\"");
+    if(owner->listen_socket_path != NULL) {
+	metrics_escape(&mux_labels, owner->listen_socket_path, strlen(owner->listen_socket_path));
+    }
+    metrics_printf(&mux_labels, "\"");
+    const char *labels = mux_labels.data;
+
+    //Connections before this one count too
+    bufsock_stats *earlier = &(owner->remote_stats);
+
+    format_single(text, "remote_received_lines_total", "counter", "Lines read from the IRC server.",
+	    labels, earlier->lines_in + remote->stats.lines_in);
+    format_single(text, "remote_received_bytes_total", "counter", "Bytes read from the IRC server.",
+	    labels, earlier->bytes_in + remote->stats.bytes_in);
+    format_single(text, "remote_sent_lines_total", "counter", "Lines sent to the IRC server.",
+	    labels, earlier->lines_out + remote->stats.lines_out);
+    format_single(text, "remote_sent_bytes_total", "counter", "Bytes sent to the IRC server.",
+	    labels, earlier->bytes_out + remote->stats.bytes_out);
+    format_single(text, "remote_oversized_lines_total", "counter", "Lines from the IRC server discarded for being too long.",
+	    labels, earlier->oversized + remote->stats.oversized);
+    format_single(text, "remote_parse_errors_total", "counter", "Lines from the IRC server that could not be parsed.",
+	    labels, owner->parse_errors);
+    format_single(text, "remote_queued_bytes", "gauge", "Bytes waiting to be written to the IRC server.",
+	    labels, remote->write_queued_bytes);
+    format_single(text, "remote_queued_lines", "gauge", "Lines waiting to be written to the IRC server.",
+	    labels, remote->write_queued_count);
+    format_single(text, "remote_connected", "gauge", "Whether we are connected to the IRC server.",
+	    labels, owner->connected);
+    format_single(text, "remote_connects_total", "counter", "Connections made to the IRC server.",
+	    labels, owner->connects);
+    format_single(text, "remote_registered", "gauge", "Whether the IRC server has accepted our registration.",
+	    labels, owner->registered);
+    format_single(text, "remote_last_seq", "gauge", "Sequence number of the last line from the IRC server.",
+	    labels, owner->seq);
+
+    metrics_family(text, "remote_commands_total", "counter", "Lines read from the IRC server, by command.");
+    for(int id = 0; id < CMD_COUNT; id++) {
+	if(owner->command_counts[id] == 0) {
+	    continue;
+	}
+	char command[16];
+	if(command_is_numeric(id)) {
+	    snprintf(command, sizeof(command), "%03d", id);
+	}
+	else {
+	    const char *name = command_name(id);
+	    snprintf(command, sizeof(command), "%s", name == NULL ? "UNKNOWN" : name);
+	}
+	metrics_printf(text, METRICS_PREFIX "remote_commands_total{%s,command=\"%s\"} %lu\n",
+		labels, command, owner->command_counts[id]);
+    }
+
+    //Lines held back by the flood limits, ours and every client's
+    outbound_scheduler *outbound = &(owner->outbound);
+    unsigned long outbound_queued = outbound->urgent.len + outbound->priority.len;
+    for(outbound_queue *queue = outbound->active_head; queue != NULL; queue = queue->next_active) {
+	outbound_queued += queue->len;
+    }
+    format_single(text, "outbound_queued_lines", "gauge", "Lines waiting for the flood limits to allow them out.",
+	    labels, outbound_queued);
+    format_single(text, "outbound_sent_lines_total", "counter", "Lines released by the flood limits.",
+	    labels, outbound->stats.sent);
+    format_single(text, "outbound_stalls_total", "counter", "Times client lines had to wait for the flood limits.",
+	    labels, outbound->stats.stalls);
+    format_single(text, "outbound_dropped_lines_total", "counter", "Client lines refused because too many were queued.",
+	    labels, outbound->stats.dropped);
+
+    if(owner->log != NULL) {
+	format_single(text, "log_dropped_lines_total", "counter", "Lines from the IRC server that could not be written to the message log.",
+		labels, __atomic_load_n(&(owner->log->dropped), __ATOMIC_RELAXED));
+    }
+
+    //The rest is per thread: ours is "main", then the workers in order
+    char **thread_labels = calloc(this->lists_len, sizeof(char *));
+    for(size_t i = 0; i < this->lists_len; i++) {
+	size_t size = mux_labels.len + 32;
+	thread_labels[i] = malloc(size);
+	if(i == 0) {
+	    snprintf(thread_labels[i], size, "%s,thread=\"main\"", labels);
+	}
+	else {
+	    snprintf(thread_labels[i], size, "%s,thread=\"worker%lu\"", labels, (unsigned long) (i - 1));
+	}
+    }
+
+    metrics_family(text, "loop_iterations_total", "counter", "Event loop wakeups.");
+    for(size_t i = 0; i < this->lists_len; i++) {
+	metrics_sample(text, "loop_iterations_total", thread_labels[i], this->lists[i].iterations);
+    }
+    metrics_family(text, "loop_latency_seconds", "histogram", "Time spent handling each event loop wakeup.");
+    for(size_t i = 0; i < this->lists_len; i++) {
+	metrics_histogram(text, "loop_latency_seconds", thread_labels[i], &(this->lists[i].loop_latency));
+    }
+    metrics_family(text, "fanout_seconds", "histogram", "Time spent queueing each line for its clients.");
+    for(size_t i = 0; i < this->lists_len; i++) {
+	metrics_histogram(text, "fanout_seconds", thread_labels[i], &(this->lists[i].fanout_time));
+    }
+
+    metrics_family(text, "clients", "gauge", "Connected clients.");
+    for(size_t i = 0; i < this->lists_len; i++) {
+	metrics_sample(text, "clients", thread_labels[i], this->lists[i].clients_len);
+    }
+    metrics_family(text, "backlog_interventions_total", "counter", "Times a backlog policy stepped in for a client that fell behind.");
+    for(size_t i = 0; i < this->lists_len; i++) {
+	for(int policy = 0; policy < BACKLOG_POLICY_COUNT; policy++) {
+	    metrics_printf(text, METRICS_PREFIX "backlog_interventions_total{%s,policy=\"%s\"} %lu\n",
+		    thread_labels[i], policy_names[policy], this->lists[i].backlog.fired[policy]);
+	}
+    }
+    metrics_family(text, "backlog_dropped_lines_total", "counter", "Lines discarded by backlog policies.");
+    for(size_t i = 0; i < this->lists_len; i++) {
+	metrics_sample(text, "backlog_dropped_lines_total", thread_labels[i], this->lists[i].backlog.dropped_messages);
+    }
+
+    for(size_t f = 0; f < sizeof(client_families) / sizeof(client_family); f++) {
+	const client_family *family = &(client_families[f]);
+	metrics_family(text, family->name, family->type, family->help);
+
+	for(size_t i = 0; i < this->lists_len; i++) {
+	    for(size_t c = 0; c < this->lists[i].clients_len; c++) {
+		client_metrics *client = &(this->lists[i].clients[c]);
+		unsigned long value = *(unsigned long *) ((char *) client + family->offset);
+		metrics_printf(text, METRICS_PREFIX "%s{%s,client=\"%lu\"} %lu\n",
+			family->name, thread_labels[i], client->sender, value);
+	    }
+	}
+    }
+
+    for(size_t i = 0; i < this->lists_len; i++) {
+	free(thread_labels[i]);
+    }
+    free(thread_labels);
+    destroy_metrics_text(&mux_labels);
+}
@@ -0,0 +1,93 @@
+/* admin_socket.h
+ *
+ * Defines the admin socket, which serves a multiplexer's metrics in the
+ * Prometheus text format without going near the client socket. A scrape
+ * asks every thread serving clients for its numbers by way of its mailbox,
+ * so counters are only ever read by the thread that writes them, and
+ * answers once the last thread has reported back.
+ */
+
+#ifndef _ADMIN_SOCKET_H
+#define _ADMIN_SOCKET_H
+
+#include "irc_multiplexer.h"
+#include "metrics.h"
+
+/*
+ * One client's numbers at the time of a scrape
+ */
+typedef struct client_metrics_struct {
+    unsigned long sender;
+    unsigned long lines_in;
+    unsigned long bytes_in;
+    unsigned long lines_out;
+    unsigned long bytes_out;
+    unsigned long oversized;
+    unsigned long parse_errors;
+    unsigned long dropped;
+    unsigned long queued_bytes;
+    unsigned long queued_lines;
+} client_metrics;
+
+/*
+ * One thread's clients and loop at the time of a scrape
+ */
+typedef struct list_metrics_struct {
+    //Where to collect from, on the thread that owns them
+    client_list *list;
+    event_loop *loop;
+    struct scrape_struct *scrape;
+
+    client_metrics *clients;
+    size_t clients_len;
+    backlog_stats backlog;
+    histogram fanout_time;
+    unsigned long iterations;
+    histogram loop_latency;
+} list_metrics;
+
+typedef struct scrape_struct {
+    irc_multiplexer *owner;
+    //Connection to answer, NULL if it hung up while we were collecting
+    struct admin_connection_struct *admin;
+
+    //The multiplexer's own clients first, then each worker's
+    list_metrics *lists;
+    size_t lists_len;
+    //Threads yet to report back
+    size_t pending;
+
+    struct scrape_struct *next;
+} scrape;
+
+typedef struct admin_connection_struct {
+    buffered_socket *bufsock;
+    irc_multiplexer *owner;
+
+    //Set once the request line came in, and whether it was HTTP
+    int requested;
+    int http;
+    scrape *scrape;
+
+    struct admin_connection_struct *next;
+} admin_connection;
+
+/*
+ * Registers the admin listen socket with the multiplexer's loop.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int attach_admin_socket(irc_multiplexer *this);
+
+/*
+ * Hangs up on admin connections, stops listening and frees scrapes still
+ * waiting on workers. The workers must have been stopped already.
+ */
+void close_admin_socket(irc_multiplexer *this);
+
+/*
+ * Formats a finished scrape
+ */
+void format_metrics(scrape *this, metrics_text *text);
+
+#endif /* _ADMIN_SOCKET_H */
@@ -0,0 +1,98 @@
+/* arena.c
+ *
+ * Implementation of the bump allocator
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+//Enough for any type on the platforms we run on
+#define ARENA_ALIGN 16
+
+void init_arena(arena *this, size_t chunk_size) {
+    this->head = NULL;
+    this->current = NULL;
+    this->used = 0;
+    this->chunk_size = chunk_size;
+}
+
+void destroy_arena(arena *this) {
+    arena_chunk *next;
+    for(arena_chunk *current = this->head; current != NULL; current = next) {
+	next = current->next;
+	free(current);
+    }
+    init_arena(this, this->chunk_size);
+}
+
+/*
+ * Links a new chunk in after the current one, so that chunks already
+ * waiting for reuse further along stay where they are
+ */
+arena_chunk * arena_grow(arena *this, size_t size) {
+    arena_chunk *chunk = malloc(sizeof(arena_chunk) + size);
+    if(chunk == NULL) {
+	return NULL;
+    }
+    chunk->size = size;
+
+    if(this->current == NULL) {
+	chunk->next = this->head;
+	this->head = chunk;
+    }
+    else {
+	chunk->next = this->current->next;
+	this->current->next = chunk;
+    }
+    return chunk;
+}
+
+void * arena_alloc(arena *this, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+    if(this->current != NULL && this->current->size - this->used >= size) {
+	void *ptr = this->current->data + this->used;
+	this->used += size;
+	return ptr;
+    }
+
+    //Move on to the next chunk kept from an earlier cycle, or make one
+    arena_chunk *next = this->current == NULL ? this->head : this->current->next;
+    if(next == NULL || next->size < size) {
+	next = arena_grow(this, size > this->chunk_size ? size : this->chunk_size);
+	if(next == NULL) {
+	    return NULL;
+	}
+    }
+
+    this->current = next;
+    this->used = size;
+    return next->data;
+}
+
+char * arena_strndup(arena *this, const char *str, size_t len) {
+    char *copy = arena_alloc(this, len + 1);
+    if(copy != NULL) {
+	memcpy(copy, str, len);
+	copy[len] = '\0';
+    }
+    return copy;
+}
+
+void arena_reset(arena *this) {
+    arena_chunk **current = &(this->head);
+    while(*current != NULL) {
+	arena_chunk *chunk = *current;
+	if(chunk->size > this->chunk_size) {
+	    *current = chunk->next;
+	    free(chunk);
+	}
+	else {
+	    current = &(chunk->next);
+	}
+    }
+    this->current = NULL;
+    this->used = 0;
+}
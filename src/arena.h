@@ -0,0 +1,60 @@
+/* arena.h
+ *
+ * Defines a bump allocator for short-lived data, e.g. whatever a line's
+ * handlers need while it's being processed. Allocations are never freed
+ * one at a time; the whole arena is reset at once instead, which keeps
+ * its chunks around for reuse.
+ */
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+typedef struct arena_chunk_struct {
+    struct arena_chunk_struct *next;
+    size_t size;
+    char data[];
+} arena_chunk;
+
+typedef struct arena_struct {
+    //Chunks in the order they're filled; allocation happens in current
+    arena_chunk *head;
+    arena_chunk *current;
+    size_t used;
+
+    size_t chunk_size;
+} arena;
+
+/*
+ * Sets up an empty arena. Nothing is allocated until the first
+ * arena_alloc.
+ */
+void init_arena(arena *this, size_t chunk_size);
+
+/*
+ * Frees every chunk
+ */
+void destroy_arena(arena *this);
+
+/*
+ * Returns size bytes aligned for any type, or NULL on error. Requests
+ * bigger than the chunk size get a chunk of their own.
+ */
+void * arena_alloc(arena *this, size_t size);
+
+/*
+ * Copies len bytes of str into the arena, NUL terminated.
+ *
+ * Returns the copy, or NULL on error.
+ */
+char * arena_strndup(arena *this, const char *str, size_t len);
+
+/*
+ * Releases everything allocated so far. Chunks of the usual size are kept
+ * for reuse and oversized ones are freed, so the arena settles at the size
+ * its busiest reset cycle needed.
+ */
+void arena_reset(arena *this);
+
+#endif /* _ARENA_H */
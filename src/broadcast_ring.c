@@ -0,0 +1,132 @@
+/* broadcast_ring.c
+ *
+ * Implementation of the broadcast ring
+ *
+ * The producer fills a slot and then publishes it with a release store of
+ * head; consumers acquire head before reading slots. Consumers release 
+ * their cursor once they are done with a slot, and the producer acquires 
+ * the cursors before reusing (and unreferencing) a slot.
+ *
+ * A producer that finds the ring full sets waiting and then looks at the
+ * cursors again, while a consumer moves its cursor and then looks at 
+ * waiting. There's a full fence between the store and the load on both 
+ * sides, so at least one of the two sees the other's store, and a wakeup 
+ * is never lost.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "broadcast_ring.h"
+
+int init_broadcast_ring(broadcast_ring *this, size_t size, size_t consumers_len) {
+    size_t rounded = 1;
+    while(rounded < size) {
+	rounded <<= 1;
+    }
+
+    this->head = 0;
+    this->min_tail = 0;
+    this->full_waits = 0;
+    this->waiting = 0;
+    this->size = rounded;
+    this->mask = rounded - 1;
+    this->cursors_len = consumers_len;
+
+    this->entries = calloc(rounded, sizeof(ring_entry));
+    if(this->entries == NULL) {
+	return -1;
+    }
+
+    if(posix_memalign((void **) &(this->cursors), RING_CACHE_LINE, 
+		consumers_len * sizeof(ring_cursor)) != 0) {
+	free(this->entries);
+	return -1;
+    }
+    memset(this->cursors, 0, consumers_len * sizeof(ring_cursor));
+    return 0;
+}
+
+void destroy_broadcast_ring(broadcast_ring *this) {
+    for(size_t i = 0; i < this->size; i++) {
+	if(this->entries[i].line != NULL) {
+	    shared_buffer_unref(this->entries[i].line);
+	}
+    }
+    free(this->entries);
+    free(this->cursors);
+}
+
+/*
+ * Recomputes the position of the slowest consumer
+ */
+uint64_t ring_min_tail(broadcast_ring *this) {
+    uint64_t min = this->head;
+    for(size_t i = 0; i < this->cursors_len; i++) {
+	uint64_t position = __atomic_load_n(&(this->cursors[i].position), __ATOMIC_ACQUIRE);
+	if(position < min) {
+	    min = position;
+	}
+    }
+    return min;
+}
+
+int ring_is_full(broadcast_ring *this) {
+    if(this->head - this->min_tail >= this->size) {
+	this->min_tail = ring_min_tail(this);
+    }
+    return this->head - this->min_tail >= this->size;
+}
+
+int ring_publish(broadcast_ring *this, shared_buffer *line) {
+    //Only rescans the cursors when the cached minimum says we're full
+    if(ring_is_full(this)) {
+	return -1;
+    }
+
+    //Every consumer is past this slot, so the old line can go
+    ring_entry *entry = &(this->entries[this->head & this->mask]);
+    if(entry->line != NULL) {
+	shared_buffer_unref(entry->line);
+    }
+    entry->line = shared_buffer_ref(line);
+
+    __atomic_store_n(&(this->head), this->head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int ring_wait_for_space(broadcast_ring *this) {
+    this->full_waits++;
+    __atomic_store_n(&(this->waiting), 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    this->min_tail = ring_min_tail(this);
+
+    //A consumer got there first, and may or may not have seen us waiting
+    if(this->head - this->min_tail < this->size) {
+	__atomic_store_n(&(this->waiting), 0, __ATOMIC_RELAXED);
+	return 0;
+    }
+    return 1;
+}
+
+ring_entry * ring_peek(broadcast_ring *this, size_t consumer) {
+    uint64_t position = this->cursors[consumer].position;
+    if(position == __atomic_load_n(&(this->head), __ATOMIC_ACQUIRE)) {
+	return NULL;
+    }
+    return &(this->entries[position & this->mask]);
+}
+
+void ring_consume(broadcast_ring *this, size_t consumer) {
+    uint64_t position = this->cursors[consumer].position;
+    __atomic_store_n(&(this->cursors[consumer].position), position + 1, __ATOMIC_RELEASE);
+}
+
+int ring_take_waiting(broadcast_ring *this) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&(this->waiting), __ATOMIC_RELAXED) == 0) {
+	return 0;
+    }
+    //Several consumers may move on at once, but only one of them says so
+    return __atomic_exchange_n(&(this->waiting), 0, __ATOMIC_ACQ_REL);
+}
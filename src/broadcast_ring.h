@@ -0,0 +1,111 @@
+/* broadcast_ring.h
+ *
+ * Defines a lock-free, single producer, multiple consumer ring in which 
+ * every consumer sees every entry. The producer (the thread reading the 
+ * remote) publishes lines, and each fan-out worker walks the ring at its 
+ * own pace with a private cursor. Nothing is locked, and nobody waits: 
+ * when the slowest consumer is a full ring behind, the producer stops 
+ * producing and asks to be told once a consumer has moved on.
+ */
+
+#ifndef _BROADCAST_RING_H
+#define _BROADCAST_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "shared_buffer.h"
+
+#define RING_CACHE_LINE 64
+
+typedef struct ring_entry_struct {
+    //The ring holds a reference until the slot is reused
+    shared_buffer *line;
+} ring_entry;
+
+/*
+ * A consumer's position, kept on its own cache line so consumers never
+ * share one with each other or with the producer.
+ */
+typedef struct ring_cursor_struct {
+    uint64_t position;
+    char padding[RING_CACHE_LINE - sizeof(uint64_t)];
+} __attribute__ ((aligned (RING_CACHE_LINE))) ring_cursor;
+
+typedef struct broadcast_ring_struct {
+    //Next position the producer will write
+    uint64_t head __attribute__ ((aligned (RING_CACHE_LINE)));
+
+    //Producer's cached copy of the slowest consumer position
+    uint64_t min_tail;
+    //Times the producer found the ring full and had to wait for space
+    unsigned long full_waits;
+
+    //Set by the producer while it waits for space, cleared by the consumer that tells it
+    int waiting __attribute__ ((aligned (RING_CACHE_LINE)));
+
+    ring_entry *entries;
+    size_t size;
+    size_t mask;
+
+    ring_cursor *cursors;
+    size_t cursors_len;
+} broadcast_ring;
+
+/*
+ * Creates a ring of size entries (rounded up to a power of two) read by 
+ * consumers_len consumers.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int init_broadcast_ring(broadcast_ring *this, size_t size, size_t consumers_len);
+
+/*
+ * Drops the references still held by the ring and frees it.
+ */
+void destroy_broadcast_ring(broadcast_ring *this);
+
+/*
+ * Returns 1 if publishing now would have to wait for a consumer, 0 
+ * otherwise. Producer only.
+ */
+int ring_is_full(broadcast_ring *this);
+
+/*
+ * Publishes a line, taking a reference to it. Producer only.
+ *
+ * Returns 0 on success, or -1 if the ring is full, in which case the line
+ * isn't taken.
+ */
+int ring_publish(broadcast_ring *this, shared_buffer *line);
+
+/*
+ * Asks to be told when a consumer moves on, after the producer found the 
+ * ring full. Producer only.
+ *
+ * Returns 1 if the ring is still full, in which case a consumer will see
+ * ring_take_waiting return 1 once it's consumed something, or 0 if space
+ * has turned up since and nobody will say so.
+ */
+int ring_wait_for_space(broadcast_ring *this);
+
+/*
+ * Returns the entry at the consumer's cursor without consuming it, or NULL
+ * if the consumer has caught up with the producer. The line stays valid 
+ * until ring_consume is called.
+ */
+ring_entry * ring_peek(broadcast_ring *this, size_t consumer);
+
+/*
+ * Moves the consumer past the entry returned by ring_peek.
+ */
+void ring_consume(broadcast_ring *this, size_t consumer);
+
+/*
+ * Returns 1 if the producer was waiting for space, in which case it's up
+ * to this consumer to tell it there is some now, or 0 otherwise. Call after
+ * ring_consume.
+ */
+int ring_take_waiting(broadcast_ring *this);
+
+#endif /* _BROADCAST_RING_H */
@@ -6,161 +6,596 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
-#include "utilities.h"
+#include "scan.h"
 #include "buffered_socket.h"
 
-buffered_socket * new_buffered_socket(char *delimiter, void (*read_callback)(char *, void *), void *read_callback_args) {
+int manage_read_buffer(buffered_socket *this);
 
-    buffered_socket *this = malloc(sizeof(buffered_socket));
+buffered_socket * new_buffered_socket(char *delimiter, void (*read_callback)(char *, size_t, void *), void *read_callback_args) {
+    return new_pooled_buffered_socket(NULL, NULL, delimiter, read_callback, read_callback_args);
+}
+
+buffered_socket * new_pooled_buffered_socket(pool *sockets, pool *segments, char *delimiter, void (*read_callback)(char *, size_t, void *), void *read_callback_args) {
+
+    buffered_socket *this = sockets == NULL ? malloc(sizeof(buffered_socket)) : pool_alloc(sockets);
+    if(this == NULL) {
+	return NULL;
+    }
+    this->pool = sockets;
+    this->segment_pool = segments;
 
     this->fd = -1;
+    this->loop = NULL;
 
     this->delimiter = delimiter;
+    this->delimiter_len = strlen(delimiter);
 
     this->read_buffer = NULL;
-    this->write_buffer = NULL;
+    this->read_size = 0;
+    this->read_start = 0;
+    this->read_end = 0;
+    this->read_scan = 0;
+
+    this->write_head = NULL;
+    this->write_tail = NULL;
+    this->write_queued_bytes = 0;
+    this->write_queued_count = 0;
+
+    this->tls = NULL;
+
+    memset(&(this->stats), 0, sizeof(bufsock_stats));
 
     this->read_callback = read_callback;
     this->read_callback_args = read_callback_args;
+    this->close_callback = NULL;
+    this->drain_callback = NULL;
+
+    this->paused = 0;
+    this->resumed = 0;
+    this->dispatching = 0;
+    this->destroyed = 0;
     return this;
 }
 
-int manage_read_buffer(buffered_socket *this, char *buf) {
+write_segment * alloc_segment(buffered_socket *this) {
+    if(this->segment_pool == NULL) {
+	return malloc(sizeof(write_segment));
+    }
+    return pool_alloc(this->segment_pool);
+}
 
-    // Check to see if message contains delimiter
-    char *delimiter_ptr = strstr(buf, this->delimiter);
+/*
+ * Drops a segment's reference to its buffer and frees the segment
+ */
+void free_segment(buffered_socket *this, write_segment *segment) {
+    shared_buffer_unref(segment->buffer);
+    if(this->segment_pool == NULL) {
+	free(segment);
+    }
+    else {
+	pool_free(this->segment_pool, segment);
+    }
+}
 
-    /* We have no idea what recv is going to pass us, but we operate on 
-     * the delimiter given to us. We store our input into a buffer until we
-     * hit that delimiter and then we ship the buffer off.
-     */
-    if(delimiter_ptr != NULL) {
-	// Current message contains the delimiter
+void free_write_queue(buffered_socket *this) {
+    write_segment *current = this->write_head;
+    while(current != NULL) {
+	write_segment *next = current->next;
+	free_segment(this, current);
+	current = next;
+    }
+    this->write_head = NULL;
+    this->write_tail = NULL;
+    this->write_queued_bytes = 0;
+    this->write_queued_count = 0;
+}
 
-	size_t delimiter_offset = delimiter_ptr - buf;
-	size_t substr_len = delimiter_offset + strlen(this->delimiter) - 1;
+/*
+ * Frees the socket and everything it owns
+ */
+void free_buffered_socket(buffered_socket *this) {
+    free_write_queue(this);
+    free(this->read_buffer);
+    if(this->pool == NULL) {
+	free(this);
+    }
+    else {
+	pool_free(this->pool, this);
+    }
+}
+
+/*
+ * Frees a socket whose destruction was deferred until its callbacks returned
+ */
+void release_buffered_socket(buffered_socket *this) {
+    if(this->dispatching == 0 && this->destroyed) {
+	free_buffered_socket(this);
+    }
+}
+
+/*
+ * Event loop callback for a buffered socket. Drains the socket, flushes
+ * queued output and tells the owner if the connection went away.
+ */
+void bufsock_on_event(int fd, uint32_t events, void *args) {
+    buffered_socket *this = (buffered_socket *) args;
+
+    this->dispatching++;
 
-	if(this->read_buffer == NULL) {
-	    // No previous buffer, initialize one
-	    this->read_buffer = malloc(substr_len + 1);
-	    memset(this->read_buffer, 0, substr_len + 1);
-	    strncpy(this->read_buffer, buf, substr_len);
+    int closed = 0;
+    if(this->paused) {
+	//A hangup will still be there once we read again
+    }
+    else if((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) || this->resumed) {
+	/* Lines left behind while we were paused go first. TLS may have 
+	 * data of its own buffered that epoll can't know about, so the 
+	 * socket is read even if it didn't say it was readable.
+	 */
+	this->resumed = 0;
+	manage_read_buffer(this);
+	if(read_buffered_socket(this) < 0) {
+	    closed = 1;
 	}
+    }
 
-	//Append up to the delimiter if it isn't the first character
-	if(substr_len + 1 > 0) {
-	    char *old = strn_append(&(this->read_buffer), buf, substr_len + 1);
-	    free(old);
+    //Deferred flush, or the kernel has room for us again
+    if(!closed && !this->destroyed && this->write_head != NULL
+	    && (events == EVENT_LOOP_DEFERRED || (events & EPOLLOUT))) {
+	int flushed = write_buffered_socket(this);
+	if(flushed < 0) {
+	    closed = 1;
+	}
+	else if(flushed == 1 && this->drain_callback != NULL) {
+	    (*(this->drain_callback))(this, this->read_callback_args);
 	}
+    }
 
-	//Fire off the callback!
-	(*(this->read_callback))(this->read_buffer, this->read_callback_args);
+    if(closed && !this->destroyed && this->close_callback != NULL) {
+	(*(this->close_callback))(this, this->read_callback_args);
+    }
 
-	free(this->read_buffer);
+    this->dispatching--;
+    release_buffered_socket(this);
+}
 
-	//If anything remains after the delimiter, add it to a new buffer
-	size_t excess = strlen(delimiter_ptr + strlen(this->delimiter));
-	char *excess_str = delimiter_ptr + strlen(this->delimiter);
-	if(excess > 0) {
+int bufsock_attach(buffered_socket *this, event_loop *loop) {
+    this->loop = loop;
+    init_event_handler(&(this->handler), this->fd, &bufsock_on_event, this);
 
-	    //Check to see if there's another delimiter in our excess string
-	    delimiter_ptr = strstr(excess_str, this->delimiter);
-	    if(delimiter_ptr != NULL) {
-		fprintf(stderr, "HOLY FUCKING SHIT, RECURSION!\n");
-		manage_read_buffer(this, excess_str);
-	    }
-	    else {
-		this->read_buffer = malloc(excess + 1);
-		memset(this->read_buffer, 0, excess + 1);
-		strcpy(this->read_buffer, excess_str);
-	    }
+    /* EPOLLOUT stays registered; being edge-triggered it only fires after
+     * the kernel had pushed back on a write, so it costs nothing otherwise.
+     */
+    if(event_loop_add(loop, &(this->handler), EPOLLIN | EPOLLOUT | EPOLLRDHUP) != 0) {
+	this->loop = NULL;
+	return -1;
+    }
 
+    //Output queued before we were attached
+    if(this->write_head != NULL) {
+	event_loop_defer(loop, &(this->handler));
+    }
+    return 0;
+}
+
+void bufsock_pause(buffered_socket *this) {
+    if(this->paused) {
+	return;
+    }
+    this->paused = 1;
+
+    //EPOLLHUP and EPOLLERR are reported regardless, and ignored until we resume
+    if(this->loop != NULL) {
+	event_loop_modify(this->loop, &(this->handler), EPOLLOUT);
+    }
+}
+
+void bufsock_resume(buffered_socket *this) {
+    if(!this->paused) {
+	return;
+    }
+    this->paused = 0;
+
+    if(this->loop != NULL) {
+	this->resumed = 1;
+	event_loop_modify(this->loop, &(this->handler), EPOLLIN | EPOLLOUT | EPOLLRDHUP);
+	event_loop_defer(this->loop, &(this->handler));
+    }
+}
+
+void bufsock_detach(buffered_socket *this) {
+    if(this->loop != NULL) {
+	event_loop_remove(this->loop, &(this->handler));
+	this->loop = NULL;
+    }
+}
+
+void destroy_buffered_socket(buffered_socket *this) {
+    if(this->destroyed) {
+	return;
+    }
+
+    bufsock_detach(this);
+    if(this->tls != NULL) {
+	destroy_tls_session(this->tls);
+	this->tls = NULL;
+    }
+    if(this->fd >= 0) {
+	close(this->fd);
+	this->fd = -1;
+    }
+
+    //We're somewhere up the stack from bufsock_on_event, let it free us
+    if(this->dispatching > 0) {
+	this->destroyed = 1;
+	return;
+    }
+    free_buffered_socket(this);
+}
+
+/*
+ * Finds the first delimiter in buf, using the vector scanners for the
+ * delimiters we actually use.
+ */
+char * find_delimiter(buffered_socket *this, char *buf, size_t len) {
+    if(this->delimiter_len == 2 && this->delimiter[0] == '\r' && this->delimiter[1] == '\n') {
+	return (char *) scan_crlf(buf, len);
+    }
+    else if(this->delimiter_len == 1) {
+	return (char *) scan_byte(buf, len, this->delimiter[0]);
+    }
+    return memmem(buf, len, this->delimiter, this->delimiter_len);
+}
+
+/*
+ * Hands every complete line in the receive buffer to read_callback. Lines
+ * are passed in place: the byte following the delimiter is swapped for a
+ * NUL for the duration of the callback and then restored. Only bytes that
+ * arrived since the last call are searched for the delimiter.
+ *
+ * Returns 1 if at least one line was dispatched, 0 otherwise.
+ */
+int manage_read_buffer(buffered_socket *this) {
+    int flushed = 0;
+
+    this->dispatching++;
+    while(!this->destroyed && !this->paused && this->read_scan < this->read_end) {
+	char *scan = this->read_buffer + this->read_scan;
+	char *delimiter_ptr = find_delimiter(this, scan, this->read_end - this->read_scan);
+
+	if(delimiter_ptr == NULL) {
+	    //The delimiter may straddle this read and the next one
+	    size_t keep = this->delimiter_len - 1;
+	    if(this->read_end - this->read_start > keep) {
+		this->read_scan = this->read_end - keep;
+	    }
+	    break;
 	}
-	else {
-	    this->read_buffer = NULL;
-	}
-	return 1;
+
+	char *line = this->read_buffer + this->read_start;
+	size_t line_len = (delimiter_ptr - line) + this->delimiter_len;
+
+	this->read_start += line_len;
+	this->read_scan = this->read_start;
+
+	//There is always a spare byte after read_end for the terminator
+	char saved = line[line_len];
+	line[line_len] = '\0';
+	this->stats.lines_in++;
+	(*(this->read_callback))(line, line_len, this->read_callback_args);
+	line[line_len] = saved;
+
+	flushed = 1;
     }
-    else {
-	//We're still aggregating information into the read_buffer
-	char *old = str_append(&(this->read_buffer), buf);
-	free(old);
-	return 0;
+    this->dispatching--;
+
+    //Everything was consumed, rewind to the start of the buffer
+    if(this->read_start == this->read_end) {
+	this->read_start = 0;
+	this->read_end = 0;
+	this->read_scan = 0;
     }
+
+    return flushed;
 }
 
 /*
- * Handles incoming message fragments received from the server socket.
- * Buffers input until a newline is reached, then acts as necessary.
+ * Makes sure at least one byte can be appended to the receive buffer while
+ * keeping a spare byte for in-place NUL termination. Consumed bytes are
+ * compacted away first, and the buffer only grows if that isn't enough.
+ *
+ * Returns 0 on success, -1 if the buffer can't grow any further.
  */
-int read_buffered_socket(buffered_socket *this) {
+int reserve_read_buffer(buffered_socket *this) {
+    if(this->read_end + 1 < this->read_size) {
+	return 0;
+    }
+
+    //Slide the unconsumed tail down to the front
+    if(this->read_start > 0) {
+	size_t pending = this->read_end - this->read_start;
+	memmove(this->read_buffer, this->read_buffer + this->read_start, pending);
+	this->read_scan -= this->read_start;
+	this->read_end = pending;
+	this->read_start = 0;
 
-    //Create a buffer that is the max size of a socket read
-    int rcvbuf = 8;
-    unsigned int rcvbuf_len = sizeof(rcvbuf);
+	if(this->read_end + 1 < this->read_size) {
+	    return 0;
+	}
+    }
 
-    /*
-    getsockopt(this->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &rcvbuf_len);
-    */
-    int error = setsockopt(this->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, rcvbuf_len);
-    if(error != 0) {
-	perror("setsockopt()");
+    size_t new_size = this->read_size == 0 ? BUFSOCK_READ_SIZE : this->read_size * 2;
+    if(new_size > BUFSOCK_MAX_READ_SIZE) {
 	return -1;
     }
 
-    char buf[rcvbuf + 1];
-    memset(buf, 0, rcvbuf + 1);
+    char *new_buffer = realloc(this->read_buffer, new_size);
+    if(new_buffer == NULL) {
+	return -1;
+    }
+    this->read_buffer = new_buffer;
+    this->read_size = new_size;
+    return 0;
+}
 
-    //Receive data and ensure data truncation didn't occur
-    ssize_t received = recv(this->fd, buf, rcvbuf, 0);
-    if(received > rcvbuf) {
-	fprintf(stderr, "Error: data truncated during recv().\n");
+/*
+ * A peer sent an absurdly long line, drop what we have of it.
+ */
+void discard_read_buffer(buffered_socket *this) {
+    fprintf(stderr, "Error: fd %d sent more than %d bytes without a delimiter, discarding.\n", 
+	    this->fd, BUFSOCK_MAX_READ_SIZE);
+    this->stats.oversized++;
+    this->read_start = 0;
+    this->read_end = 0;
+    this->read_scan = 0;
+}
+
+int bufsock_feed(buffered_socket *this, const char *data, size_t len) {
+    int flushed = 0;
+
+    this->dispatching++;
+    while(len > 0 && !this->destroyed) {
+	if(reserve_read_buffer(this) != 0) {
+	    discard_read_buffer(this);
+	    reserve_read_buffer(this);
+	}
+
+	size_t space = this->read_size - this->read_end - 1;
+	size_t chunk = len < space ? len : space;
+	memcpy(this->read_buffer + this->read_end, data, chunk);
+	this->read_end += chunk;
+	this->stats.bytes_in += chunk;
+	data += chunk;
+	len -= chunk;
+
+	if(manage_read_buffer(this) == 1) {
+	    flushed = 1;
+	}
     }
+    this->dispatching--;
 
-    return manage_read_buffer(this, buf);
+    if(this->destroyed) {
+	release_buffered_socket(this);
+	return -1;
+    }
+    return flushed;
 }
 
 /*
- * Writes the current write buffer to a socket
- *
- * TODO
- *  - Make this non-blocking
- *  - Either truncate message to fit buffer or return error
+ * Handles incoming message fragments received from the socket. Reads 
+ * straight into the receive buffer as much as the kernel will give us and
+ * dispatches complete lines. Keeps reading until EAGAIN, since the event 
+ * loop is edge-triggered and will not tell us about data we left behind.
  */
-int write_buffered_socket(buffered_socket *this) {
+int read_buffered_socket(buffered_socket *this) {
 
-    char *msg = this->write_buffer;
-    unsigned int payload_len = strlen(msg);
+    int flushed = 0;
+    while(!this->destroyed && !this->paused) {
+	if(reserve_read_buffer(this) != 0) {
+	    discard_read_buffer(this);
+	    if(reserve_read_buffer(this) != 0) {
+		return -1;
+	    }
+	}
 
-    #ifdef DEBUG
-    fprintf(stderr, "Attempting to send msg \"%s\" with payload_len %u\n", msg, payload_len);
-    #endif /* DEBUG */
-    ssize_t sent_data = send(this->fd, msg, payload_len, 0);
-    msg += sent_data;
-    payload_len -= sent_data;
+	size_t space = this->read_size - this->read_end - 1;
+	char *into = this->read_buffer + this->read_end;
+	ssize_t received = this->tls != NULL
+	    ? tls_recv(this->tls, into, space)
+	    : recv(this->fd, into, space, MSG_DONTWAIT);
+	if(received == 0) {
+	    //Orderly shutdown by the peer
+	    return -1;
+	}
+	else if(received < 0) {
+	    if(errno == EAGAIN || errno == EWOULDBLOCK) {
+		break;
+	    }
+	    else if(errno == EINTR) {
+		continue;
+	    }
+	    perror("recv()");
+	    return -1;
+	}
 
-    #ifdef DEBUG
-    fprintf(stderr, "Sent %lu bytes, remaining msg is now \"%s\", payload_len now %u\n", (unsigned long)sent_data, msg, payload_len);
-    #endif /* DEBUG */
+	this->read_end += received;
+	this->stats.bytes_in += received;
+	if(manage_read_buffer(this) == 1) {
+	    flushed = 1;
+	}
+    }
+
+    return flushed;
+}
 
-    if(payload_len == 0) {
-	this->write_buffer = NULL;
-	return 1;
+int bufsock_write(buffered_socket *this, const char *data, size_t len) {
+    if(this->destroyed) {
+	return -1;
     }
-    else {
-	this->write_buffer = msg;
+    if(len == 0) {
 	return 0;
     }
+
+    shared_buffer *buffer = new_shared_buffer(data, len);
+    if(buffer == NULL) {
+	return -1;
+    }
+
+    int error = bufsock_write_shared(this, buffer);
+    shared_buffer_unref(buffer);
+    return error;
 }
 
-int bufsock_is_connected(buffered_socket *this) {
-    int error = send(this->fd, "", 0, MSG_NOSIGNAL);
-    if(error == -1) {
+int bufsock_write_shared(buffered_socket *this, shared_buffer *buffer) {
+    return bufsock_write_shared_from(this, buffer, 0);
+}
+
+int bufsock_write_shared_from(buffered_socket *this, shared_buffer *buffer, size_t start) {
+    if(this->destroyed) {
+	return -1;
+    }
+    if(buffer->len <= start) {
 	return 0;
     }
+
+    write_segment *segment = alloc_segment(this);
+    if(segment == NULL) {
+	return -1;
+    }
+    segment->next = NULL;
+    segment->buffer = shared_buffer_ref(buffer);
+    segment->start = start;
+    segment->offset = start;
+
+    if(this->write_tail == NULL) {
+	this->write_head = segment;
+    }
     else {
-	return 1;
-    }   
+	this->write_tail->next = segment;
+    }
+    this->write_tail = segment;
+    this->write_queued_bytes += buffer->len - start;
+    this->write_queued_count++;
+
+    if(this->loop != NULL) {
+	event_loop_defer(this->loop, &(this->handler));
+    }
+    return 0;
+}
+
+size_t bufsock_drop_queued(buffered_socket *this, size_t keep_first, unsigned int keep_tags, size_t max_bytes, size_t max_count) {
+    size_t dropped = 0;
+    size_t seen = 0;
+    write_segment *previous = NULL;
+    write_segment **current = &(this->write_head);
+
+    while(*current != NULL
+	    && (this->write_queued_bytes > max_bytes || this->write_queued_count > max_count)) {
+
+	write_segment *segment = *current;
+	if(seen++ < keep_first || segment->offset > segment->start || (segment->buffer->tags & keep_tags) != 0) {
+	    previous = segment;
+	    current = &(segment->next);
+	    continue;
+	}
+
+	*current = segment->next;
+	if(this->write_tail == segment) {
+	    this->write_tail = previous;
+	}
+	this->write_queued_bytes -= segment->buffer->len - segment->start;
+	this->write_queued_count--;
+	free_segment(this, segment);
+	dropped++;
+    }
+    return dropped;
+}
+
+int bufsock_printf(buffered_socket *this, const char *format, ...) {
+    char buf[BUFSOCK_MAX_LINE + 1];
+
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+
+    if(len < 0) {
+	return -1;
+    }
+    else if(len > BUFSOCK_MAX_LINE) {
+	len = BUFSOCK_MAX_LINE;
+	memcpy(buf + len - this->delimiter_len, this->delimiter, this->delimiter_len);
+    }
+    return bufsock_write(this, buf, len);
+}
+
+/*
+ * Writes the outbound queue to the socket, gathering up to BUFSOCK_MAX_IOV
+ * segments per syscall. Stops as soon as the kernel pushes back; the rest 
+ * goes out when EPOLLOUT fires.
+ */
+int write_buffered_socket(buffered_socket *this) {
+
+    while(this->write_head != NULL) {
+	struct iovec iov[BUFSOCK_MAX_IOV];
+	int iovcnt = 0;
+
+	for(write_segment *current = this->write_head;
+		current != NULL && iovcnt < BUFSOCK_MAX_IOV;
+		current = current->next ) {
+
+	    iov[iovcnt].iov_base = current->buffer->data + current->offset;
+	    iov[iovcnt].iov_len = current->buffer->len - current->offset;
+	    iovcnt++;
+	}
+
+	//sendmsg() rather than writev() so a dead peer can't SIGPIPE us
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	ssize_t sent_data = this->tls != NULL
+	    ? tls_sendmsg(this->tls, &msg)
+	    : sendmsg(this->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if(sent_data < 0) {
+	    if(errno == EAGAIN || errno == EWOULDBLOCK) {
+		return 0;
+	    }
+	    else if(errno == EINTR) {
+		continue;
+	    }
+	    perror("sendmsg()");
+	    return -1;
+	}
+
+	//Retire everything the kernel took
+	this->write_queued_bytes -= sent_data;
+	this->stats.bytes_out += sent_data;
+	while(sent_data > 0) {
+	    write_segment *current = this->write_head;
+	    size_t remaining = current->buffer->len - current->offset;
+
+	    if((size_t) sent_data < remaining) {
+		current->offset += sent_data;
+		break;
+	    }
+
+	    sent_data -= remaining;
+	    this->write_head = current->next;
+	    this->write_queued_count--;
+	    this->stats.lines_out++;
+	    free_segment(this, current);
+	}
+	if(this->write_head == NULL) {
+	    this->write_tail = NULL;
+	}
+    }
+
+    return 1;
 }
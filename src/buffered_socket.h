@@ -6,42 +6,224 @@
 #ifndef BUFFERED_SOCKET_H
 #define BUFFERED_SOCKET_H
 
+#include <stddef.h>
+
+#include "event_loop.h"
+#include "shared_buffer.h"
+#include "pool.h"
+#include "tls_session.h"
+
+//Initial size of the receive buffer, grown on demand
+#define BUFSOCK_READ_SIZE 16384
+
+//A line longer than this without a delimiter is discarded
+#define BUFSOCK_MAX_READ_SIZE (1024 * 1024)
+
+//Most segments handed to the kernel in a single writev
+#define BUFSOCK_MAX_IOV 64
+
+//Longest line bufsock_printf will format
+#define BUFSOCK_MAX_LINE 512
+
+/*
+ * Traffic through a socket since it was created
+ */
+typedef struct bufsock_stats_struct {
+    unsigned long lines_in;
+    unsigned long bytes_in;
+    //Queued writes retired, which is one line each for line protocols
+    unsigned long lines_out;
+    unsigned long bytes_out;
+    //Lines thrown away for having no delimiter within BUFSOCK_MAX_READ_SIZE
+    unsigned long oversized;
+} bufsock_stats;
+
+/*
+ * An entry in a socket's write queue. The data itself lives in a shared
+ * buffer that may be queued on many sockets at once.
+ */
+typedef struct write_segment_struct {
+    struct write_segment_struct *next;
+    shared_buffer *buffer;
+    //Where in the buffer this socket's copy starts
+    size_t start;
+    //Bytes of the buffer already accepted by the kernel, or skipped
+    size_t offset;
+} write_segment;
+
 typedef struct buffered_socket_struct {
     int fd;
 
+    //Registration with the event loop driving this socket
+    event_loop *loop;
+    event_handler handler;
+
     char *delimiter;
+    size_t delimiter_len;
 
+    /* Receive buffer. Bytes in [read_start, read_end) have been received
+     * but not yet handed to read_callback, and read_scan is where the
+     * search for the next delimiter resumes so old bytes are never rescanned.
+     */
     char *read_buffer;
-    char *write_buffer;
+    size_t read_size;
+    size_t read_start;
+    size_t read_end;
+    size_t read_scan;
+
+    /* Outbound queue. Writes are appended here and flushed with a single
+     * writev at the end of the loop iteration, or when the fd becomes
+     * writable again after the kernel pushed back.
+     */
+    write_segment *write_head;
+    write_segment *write_tail;
+    size_t write_queued_bytes;
+    size_t write_queued_count;
 
-    void (*read_callback)(char *, void *);
+    /* Called with each complete line, delimiter included. The line points
+     * into read_buffer and is only valid for the duration of the call; it is
+     * NUL terminated for convenience.
+     */
+    void (*read_callback)(char *, size_t, void *);
     void *read_callback_args;
+
+    //Where the socket and its write segments came from, NULL for malloc
+    pool *pool;
+    pool *segment_pool;
+
+    /* Set if the connection is TLS, in which case reads and writes go
+     * through it; it's destroyed along with the socket
+     */
+    tls_session *tls;
+
+    bufsock_stats stats;
+
+    //Set while the owner doesn't want any more lines, see bufsock_pause
+    int paused;
+    //Set from bufsock_resume until we've caught up on what was left unread
+    int resumed;
+
+    //Set while callbacks run so destroy_buffered_socket can defer the free
+    int dispatching;
+    int destroyed;
+
+    //Fired once when the peer hangs up or the socket errors out
+    void (*close_callback)(struct buffered_socket_struct *, void *);
+
+    //Fired whenever the outbound queue has been written out completely
+    void (*drain_callback)(struct buffered_socket_struct *, void *);
 } buffered_socket;
 
-buffered_socket * new_buffered_socket(char *delimiter, void (*read_callback)(char *, void *), void *read_callback_args);
+buffered_socket * new_buffered_socket(char *delimiter, void (*read_callback)(char *, size_t, void *), void *read_callback_args);
+
+/*
+ * Like new_buffered_socket, but takes the socket from one pool and its 
+ * write segments from another. Either may be NULL to use malloc. The pools
+ * must belong to the thread that will drive the socket, and outlive it.
+ */
+buffered_socket * new_pooled_buffered_socket(pool *sockets, pool *segments, char *delimiter, void (*read_callback)(char *, size_t, void *), void *read_callback_args);
+
+/*
+ * Registers the socket with an event loop. Incoming data is read and 
+ * dispatched to read_callback as it arrives, and close_callback (if set) 
+ * is fired when the connection goes away: the peer hanging up shows up as
+ * EPOLLRDHUP and recv() returning 0, and a dead peer as a failed write 
+ * (EPIPE, ECONNRESET). Nothing needs to poll for it.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int bufsock_attach(buffered_socket *this, event_loop *loop);
+
+/*
+ * Removes the socket from its event loop. Does not close the fd.
+ */
+void bufsock_detach(buffered_socket *this);
+
+/*
+ * Detaches, closes the fd and frees the socket and its buffers. May be
+ * called from inside one of the socket's own callbacks.
+ */
+void destroy_buffered_socket(buffered_socket *this);
+
+/*
+ * Stops handing lines to read_callback, and stops reading the socket, so
+ * the peer is held back by TCP flow control. Lines already received stay
+ * in the buffer. May be called from read_callback, in which case it's the
+ * last line dispatched.
+ */
+void bufsock_pause(buffered_socket *this);
+
+/*
+ * Undoes bufsock_pause. Lines left in the buffer are dispatched later 
+ * from the loop, not from within this call.
+ */
+void bufsock_resume(buffered_socket *this);
 
 /*
- * Reads from a buffered socket, and triggers the callback if the line 
- * terminator was reached.
+ * Reads everything currently available on a buffered socket, and triggers 
+ * the callback for every line terminator reached.
  *
  * Returns 0 if read was successful, 1 if read was successful and 
- * buffer was flushed, and -1 on error.
+ * buffer was flushed, and -1 on error or when the peer closed the socket.
  */
 int read_buffered_socket(buffered_socket *this);
 
 /*
- * Writes from buffer into a buffered socket
+ * Appends data to the receive buffer as if it had been read from the 
+ * socket, firing read_callback for every completed line.
  *
- * Returns 0 if write was successful, 1 if write was successful and 
- * buffer was completely flushed, and -1 on error.
+ * Returns 0 if no line was completed, 1 if at least one was, and -1 on error.
  */
-int write_buffered_socket(buffered_socket *this);
+int bufsock_feed(buffered_socket *this, const char *data, size_t len);
+
+/*
+ * Copies data onto the end of the socket's outbound queue and schedules a
+ * flush. Never blocks; lines queued during the same loop iteration are
+ * sent together.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int bufsock_write(buffered_socket *this, const char *data, size_t len);
+
+/*
+ * Queues a reference to a shared buffer rather than a copy of it; the 
+ * reference is dropped once the buffer has been written out. The caller 
+ * keeps its own reference.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int bufsock_write_shared(buffered_socket *this, shared_buffer *buffer);
+
+/*
+ * Like bufsock_write_shared, but only queues the buffer from start on, 
+ * e.g. to leave out its header.
+ */
+int bufsock_write_shared_from(buffered_socket *this, shared_buffer *buffer, size_t start);
+
+/*
+ * Drops queued segments, oldest first, until no more than max_bytes and 
+ * max_count remain. The first keep_first segments are left alone, and so 
+ * are segments whose buffer has any of keep_tags set and a segment the 
+ * kernel has already taken part of.
+ *
+ * Returns the number of segments dropped.
+ */
+size_t bufsock_drop_queued(buffered_socket *this, size_t keep_first, unsigned int keep_tags, size_t max_bytes, size_t max_count);
+
+/*
+ * Formats a line of at most BUFSOCK_MAX_LINE bytes and queues it with 
+ * bufsock_write. A line that doesn't fit is truncated, but still ends with
+ * the socket's delimiter.
+ */
+int bufsock_printf(buffered_socket *this, const char *format, ...)
+    __attribute__ ((format (printf, 2, 3)));
 
 /*
- * Checks to see if a buffered socket is still connected
+ * Flushes as much of the outbound queue as the kernel will take right now
  *
- * Returns 1 on connected, 0 on disconnected
+ * Returns 0 if write was successful, 1 if write was successful and 
+ * buffer was completely flushed, and -1 on error.
  */
-int bufsock_is_connected(buffered_socket *this);
+int write_buffered_socket(buffered_socket *this);
 
 #endif /* BUFFERED_SOCKET_H */
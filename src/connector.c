@@ -0,0 +1,354 @@
+/* connector.c
+ *
+ * Implements the non-blocking, address racing connector
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "connector.h"
+
+/*
+ * A name being resolved. The resolver thread and the connector each hold
+ * a reference, and the connector lets go of its own if it gives up first,
+ * so neither has to wait for the other.
+ */
+typedef struct resolve_job_struct {
+    pthread_mutex_t lock;
+    int refs;
+
+    //Who to answer, NULL once the connector gave up
+    connector *connector;
+    mailbox *mailbox;
+
+    char *host;
+    char port[8];
+
+    int error;
+    struct addrinfo *result;
+} resolve_job;
+
+void on_resolved(void *args);
+void on_attempt_event(int fd, uint32_t events, void *args);
+void on_attempt_delay(void *args);
+void on_connect_deadline(void *args);
+void start_attempt(connector *this);
+
+void release_job(resolve_job *job) {
+    pthread_mutex_lock(&(job->lock));
+    int refs = --job->refs;
+    pthread_mutex_unlock(&(job->lock));
+
+    if(refs == 0) {
+	if(job->result != NULL) {
+	    freeaddrinfo(job->result);
+	}
+	pthread_mutex_destroy(&(job->lock));
+	free(job->host);
+	free(job);
+    }
+}
+
+/*
+ * The answer was never delivered, e.g. the mailbox went away first
+ */
+void drop_job(void *args) {
+    release_job((resolve_job *) args);
+}
+
+/*
+ * Resolver thread: getaddrinfo can block for as long as DNS takes, so it
+ * gets a thread to do it on
+ */
+void * resolve_thread(void *args) {
+    resolve_job *job = (resolve_job *) args;
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    job->error = getaddrinfo(job->host, job->port, &hints, &(job->result));
+
+    //Our reference goes with the answer, if anyone's still waiting for it
+    pthread_mutex_lock(&(job->lock));
+    int posted = job->connector != NULL && mailbox_post(job->mailbox, &on_resolved, &drop_job, job) == 0;
+    pthread_mutex_unlock(&(job->lock));
+
+    if(!posted) {
+	release_job(job);
+    }
+    return NULL;
+}
+
+void init_connector(connector *this, event_loop *loop, mailbox *mailbox) {
+    memset(this, 0, sizeof(connector));
+    this->loop = loop;
+    this->mailbox = mailbox;
+    init_timer(&(this->delay), &on_attempt_delay, this);
+    init_timer(&(this->deadline), &on_connect_deadline, this);
+}
+
+int connector_busy(connector *this) {
+    return this->job != NULL || this->order != NULL;
+}
+
+int connector_start(connector *this, const char *host, in_port_t port, connector_callback callback, void *args) {
+    connector_cancel(this);
+
+    resolve_job *job = calloc(1, sizeof(resolve_job));
+    if(job == NULL) {
+	return -1;
+    }
+    pthread_mutex_init(&(job->lock), NULL);
+    job->refs = 2;
+    job->connector = this;
+    job->mailbox = this->mailbox;
+    job->host = strdup(host);
+    snprintf(job->port, sizeof(job->port), "%u", (unsigned int) port);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int error = job->host == NULL ? ENOMEM : pthread_create(&thread, &attr, &resolve_thread, job);
+    pthread_attr_destroy(&attr);
+
+    if(error != 0) {
+	fprintf(stderr, "Error resolving %s: %s\n", host, strerror(error));
+	job->refs = 1;
+	release_job(job);
+	return -1;
+    }
+
+    this->host = host;
+    this->port = port;
+    this->callback = callback;
+    this->args = args;
+    this->job = job;
+    this->last_error = 0;
+    event_loop_add_timer(this->loop, &(this->deadline), CONNECTOR_TIMEOUT);
+    return 0;
+}
+
+/*
+ * Closes an attempt that's still in flight
+ */
+void abandon_attempt(connector *this, connect_attempt *attempt) {
+    if(attempt->handler.fd < 0) {
+	return;
+    }
+    event_loop_remove(this->loop, &(attempt->handler));
+    close(attempt->handler.fd);
+    attempt->handler.fd = -1;
+    this->pending--;
+}
+
+void connector_cancel(connector *this) {
+    if(this->job != NULL) {
+	pthread_mutex_lock(&(this->job->lock));
+	this->job->connector = NULL;
+	pthread_mutex_unlock(&(this->job->lock));
+	release_job(this->job);
+	this->job = NULL;
+    }
+
+    for(size_t i = 0; i < this->order_len; i++) {
+	abandon_attempt(this, &(this->attempts[i]));
+    }
+    free(this->attempts);
+    free(this->order);
+    if(this->addresses != NULL) {
+	freeaddrinfo(this->addresses);
+    }
+    this->attempts = NULL;
+    this->order = NULL;
+    this->addresses = NULL;
+    this->order_len = 0;
+    this->next = 0;
+
+    event_loop_cancel_timer(this->loop, &(this->delay));
+    event_loop_cancel_timer(this->loop, &(this->deadline));
+}
+
+/*
+ * Hands the caller the winning fd, or -1, and tidies up the rest
+ */
+void connector_finish(connector *this, int fd) {
+    connector_callback callback = this->callback;
+    void *args = this->args;
+
+    connector_cancel(this);
+    (*callback)(fd, args);
+}
+
+/*
+ * Gives up once every address has been tried and none is still pending
+ */
+void connector_check_failed(connector *this) {
+    if(this->pending == 0 && this->next == this->order_len) {
+	fprintf(stderr, "Error: could not connect to %s:%u: %s\n", this->host, (unsigned int) this->port,
+		strerror(this->last_error != 0 ? this->last_error : EHOSTUNREACH));
+	connector_finish(this, -1);
+    }
+}
+
+/*
+ * Loop thread: the name resolved. Sort the addresses so the families take
+ * turns, starting with whichever the resolver ranked first.
+ */
+void on_resolved(void *args) {
+    resolve_job *job = (resolve_job *) args;
+    connector *this = job->connector;
+
+    if(this == NULL) {
+	release_job(job);
+	return;
+    }
+
+    //Both our references are done with
+    this->job = NULL;
+    int error = job->error;
+    this->addresses = job->result;
+    job->result = NULL;
+    release_job(job);
+    release_job(job);
+
+    if(error != 0) {
+	fprintf(stderr, "Error resolving %s: %s\n", this->host, gai_strerror(error));
+	connector_finish(this, -1);
+	return;
+    }
+
+    size_t len = 0;
+    for(struct addrinfo *current = this->addresses; current != NULL; current = current->ai_next) {
+	len++;
+    }
+    this->order = calloc(len, sizeof(struct addrinfo *));
+    this->attempts = calloc(len, sizeof(connect_attempt));
+    if(this->order == NULL || this->attempts == NULL) {
+	connector_finish(this, -1);
+	return;
+    }
+
+    int first_family = this->addresses->ai_family;
+    struct addrinfo *same = this->addresses;
+    struct addrinfo *other = this->addresses;
+    for(size_t i = 0; i < len; i++) {
+	//Take the next of the family whose turn it is, or of the other one if that ran out
+	int want_first = (i % 2) == 0;
+	while(same != NULL && same->ai_family != first_family) same = same->ai_next;
+	while(other != NULL && other->ai_family == first_family) other = other->ai_next;
+
+	struct addrinfo **pick = (want_first && same != NULL) || other == NULL ? &same : &other;
+	this->order[i] = *pick;
+	*pick = (*pick)->ai_next;
+
+	init_event_handler(&(this->attempts[i].handler), -1, &on_attempt_event, &(this->attempts[i]));
+	this->attempts[i].connector = this;
+    }
+    this->order_len = len;
+    this->next = 0;
+
+    start_attempt(this);
+}
+
+/*
+ * Starts connecting to the next address, skipping those that fail on the
+ * spot (e.g. IPv6 with no route), and arms the delay for the one after
+ */
+void start_attempt(connector *this) {
+    while(this->next < this->order_len) {
+	connect_attempt *attempt = &(this->attempts[this->next]);
+	struct addrinfo *address = this->order[this->next];
+	this->next++;
+
+	int fd = socket(address->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	if(fd < 0) {
+	    this->last_error = errno;
+	    continue;
+	}
+
+	if(connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+	    connector_finish(this, fd);
+	    return;
+	}
+	if(errno != EINPROGRESS) {
+	    this->last_error = errno;
+	    close(fd);
+	    continue;
+	}
+
+	init_event_handler(&(attempt->handler), fd, &on_attempt_event, attempt);
+	if(event_loop_add(this->loop, &(attempt->handler), EPOLLOUT) != 0) {
+	    this->last_error = errno;
+	    close(fd);
+	    attempt->handler.fd = -1;
+	    continue;
+	}
+	this->pending++;
+
+	if(this->next < this->order_len) {
+	    event_loop_add_timer(this->loop, &(this->delay), CONNECTOR_ATTEMPT_DELAY);
+	}
+	return;
+    }
+
+    connector_check_failed(this);
+}
+
+/*
+ * An attempt finished connecting, one way or the other
+ */
+void on_attempt_event(int fd, uint32_t events, void *args) {
+    connect_attempt *attempt = (connect_attempt *) args;
+    connector *this = attempt->connector;
+
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) != 0) {
+	error = errno;
+    }
+
+    if(error == 0) {
+	//The fd is the caller's now, so it mustn't be closed with the losers
+	event_loop_remove(this->loop, &(attempt->handler));
+	attempt->handler.fd = -1;
+	this->pending--;
+	connector_finish(this, fd);
+	return;
+    }
+    if(error == EINPROGRESS) {
+	return;
+    }
+
+    this->last_error = error;
+    abandon_attempt(this, attempt);
+
+    //No point waiting out the delay for the next one
+    event_loop_cancel_timer(this->loop, &(this->delay));
+    start_attempt(this);
+}
+
+/*
+ * Timer: the last attempt is taking a while, race the next one against it
+ */
+void on_attempt_delay(void *args) {
+    start_attempt((connector *) args);
+}
+
+/*
+ * Timer: nothing connected in time
+ */
+void on_connect_deadline(void *args) {
+    connector *this = (connector *) args;
+
+    fprintf(stderr, "Error: timed out connecting to %s:%u\n", this->host, (unsigned int) this->port);
+    connector_finish(this, -1);
+}
@@ -0,0 +1,87 @@
+/* connector.h
+ *
+ * Defines a connector, which opens a TCP connection to a host without
+ * blocking its event loop. The name is resolved on a thread of its own,
+ * and every address it resolves to is raced Happy Eyeballs style (RFC
+ * 8305): IPv6 and IPv4 addresses take turns, another attempt is started
+ * whenever the last has been pending CONNECTOR_ATTEMPT_DELAY ms or has
+ * failed, and the first to connect wins.
+ */
+
+#ifndef _CONNECTOR_H
+#define _CONNECTOR_H
+
+#include <netdb.h>
+#include <netinet/in.h>
+
+#include "event_loop.h"
+#include "mailbox.h"
+
+//How long an attempt gets before the next address is tried alongside it
+#define CONNECTOR_ATTEMPT_DELAY 250
+
+//How long resolving and connecting may take altogether
+#define CONNECTOR_TIMEOUT (30 * 1000)
+
+/*
+ * Called with the connected, non-blocking fd, which it then owns, or with
+ * -1 if no address could be reached
+ */
+typedef void (*connector_callback)(int fd, void *args);
+
+typedef struct connect_attempt_struct {
+    //fd is -1 unless the attempt is pending
+    event_handler handler;
+    struct connector_struct *connector;
+} connect_attempt;
+
+typedef struct connector_struct {
+    event_loop *loop;
+    //Where the resolver thread posts its answer, on the loop's thread
+    mailbox *mailbox;
+
+    const char *host;
+    in_port_t port;
+    connector_callback callback;
+    void *args;
+
+    //Set while the name is being resolved
+    struct resolve_job_struct *job;
+
+    //Addresses in the order they're tried, and the next one to try
+    struct addrinfo *addresses;
+    struct addrinfo **order;
+    size_t order_len;
+    size_t next;
+
+    //One per address; pending counts those in flight
+    connect_attempt *attempts;
+    size_t pending;
+    int last_error;
+
+    //Starts the next attempt, and gives up on the lot
+    timer delay;
+    timer deadline;
+} connector;
+
+void init_connector(connector *this, event_loop *loop, mailbox *mailbox);
+
+/*
+ * Starts resolving host and connecting to it. The callback is always
+ * called later from the loop, never from in here.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int connector_start(connector *this, const char *host, in_port_t port, connector_callback callback, void *args);
+
+/*
+ * Abandons a connect in progress, if there is one, without calling back
+ */
+void connector_cancel(connector *this);
+
+/*
+ * Whether a connect is in progress
+ */
+int connector_busy(connector *this);
+
+#endif /* _CONNECTOR_H */
@@ -0,0 +1,218 @@
+/* event_loop.c
+ *
+ * Implements an edge-triggered epoll event loop
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "event_loop.h"
+
+int init_event_loop(event_loop *this) {
+    this->running = 0;
+    this->dispatch_index = 0;
+    this->dispatch_count = 0;
+    this->deferred = NULL;
+    this->iterations = 0;
+    this->latency = NULL;
+    init_timer_wheel(&(this->timers), event_loop_now_ms());
+
+    this->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(this->epoll_fd < 0) {
+	perror("epoll_create1()");
+	return -1;
+    }
+    return 0;
+}
+
+void destroy_event_loop(event_loop *this) {
+    if(this->epoll_fd >= 0) {
+	close(this->epoll_fd);
+	this->epoll_fd = -1;
+    }
+}
+
+void init_event_handler(event_handler *this, int fd, event_callback callback, void *args) {
+    this->fd = fd;
+    this->callback = callback;
+    this->args = args;
+    this->deferred = 0;
+    this->next_deferred = NULL;
+}
+
+int event_loop_add(event_loop *this, event_handler *handler, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events | EPOLLET;
+    ev.data.ptr = handler;
+
+    if(epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, handler->fd, &ev) != 0) {
+	perror("epoll_ctl(EPOLL_CTL_ADD)");
+	return -1;
+    }
+    return 0;
+}
+
+int event_loop_modify(event_loop *this, event_handler *handler, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events | EPOLLET;
+    ev.data.ptr = handler;
+
+    if(epoll_ctl(this->epoll_fd, EPOLL_CTL_MOD, handler->fd, &ev) != 0) {
+	perror("epoll_ctl(EPOLL_CTL_MOD)");
+	return -1;
+    }
+    return 0;
+}
+
+int event_loop_remove(event_loop *this, event_handler *handler) {
+
+    /* The handler may be freed as soon as we return, so make sure nothing
+     * left over from the current epoll_wait() batch still points at it.
+     */
+    for(int i = this->dispatch_index; i < this->dispatch_count; i++) {
+	if(this->events[i].data.ptr == handler) {
+	    this->events[i].data.ptr = NULL;
+	}
+    }
+
+    if(handler->deferred) {
+	for(event_handler **current = &(this->deferred);
+		*current != NULL;
+		current = &((*current)->next_deferred) ) {
+
+	    if(*current == handler) {
+		*current = handler->next_deferred;
+		break;
+	    }
+	}
+	handler->deferred = 0;
+	handler->next_deferred = NULL;
+    }
+
+    //Closed fds are dropped from the epoll set by the kernel already
+    if(handler->fd < 0) {
+	return 0;
+    }
+
+    if(epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, handler->fd, NULL) != 0) {
+	if(errno != EBADF && errno != ENOENT) {
+	    perror("epoll_ctl(EPOLL_CTL_DEL)");
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+void event_loop_defer(event_loop *this, event_handler *handler) {
+    if(handler->deferred) {
+	return;
+    }
+    handler->deferred = 1;
+    handler->next_deferred = this->deferred;
+    this->deferred = handler;
+}
+
+/*
+ * Runs deferred handlers until none are left. Handlers may defer themselves
+ * or others again while we're at it.
+ */
+void run_deferred(event_loop *this) {
+    while(this->deferred != NULL) {
+	event_handler *handler = this->deferred;
+	this->deferred = handler->next_deferred;
+	handler->deferred = 0;
+	handler->next_deferred = NULL;
+
+	(*(handler->callback))(handler->fd, EVENT_LOOP_DEFERRED, handler->args);
+    }
+}
+
+uint64_t event_loop_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+uint64_t event_loop_now_ms(void) {
+    return event_loop_now_ns() / 1000000;
+}
+
+void event_loop_add_timer(event_loop *this, timer *t, uint64_t delay_ms) {
+    timer_arm(&(this->timers), t, event_loop_now_ms() + delay_ms);
+}
+
+void event_loop_cancel_timer(event_loop *this, timer *t) {
+    timer_cancel(&(this->timers), t);
+}
+
+int event_loop_run_once(event_loop *this, int timeout_ms) {
+
+    //Work deferred outside of the loop (e.g. during setup) goes out first
+    run_deferred(this);
+
+    //Sleep no longer than the next timer allows
+    uint64_t next_timer = timer_wheel_next(&(this->timers));
+    if(next_timer != UINT64_MAX) {
+	uint64_t now = event_loop_now_ms();
+	uint64_t wait = next_timer > now ? next_timer - now : 0;
+	if(timeout_ms < 0 || wait < (uint64_t) timeout_ms) {
+	    timeout_ms = wait > INT32_MAX ? INT32_MAX : (int) wait;
+	}
+    }
+
+    int ready = epoll_wait(this->epoll_fd, this->events, EVENT_LOOP_MAX_EVENTS, timeout_ms);
+    if(ready < 0) {
+	if(errno == EINTR) {
+	    return 0;
+	}
+	perror("epoll_wait()");
+	return -1;
+    }
+    this->iterations++;
+    uint64_t woke_at = this->latency == NULL ? 0 : event_loop_now_ns();
+
+    //Service every ready fd, not just the first one
+    int dispatched = 0;
+    this->dispatch_count = ready;
+    for(this->dispatch_index = 0; this->dispatch_index < this->dispatch_count; ) {
+	struct epoll_event *ev = &(this->events[this->dispatch_index++]);
+	event_handler *handler = ev->data.ptr;
+
+	//Handler was removed by an earlier callback in this batch
+	if(handler == NULL) {
+	    continue;
+	}
+
+	(*(handler->callback))(handler->fd, ev->events, handler->args);
+	dispatched++;
+    }
+    this->dispatch_index = 0;
+    this->dispatch_count = 0;
+
+    timer_wheel_advance(&(this->timers), event_loop_now_ms());
+    run_deferred(this);
+
+    //The histogram may have come or gone during the iteration
+    if(this->latency != NULL && woke_at != 0) {
+	histogram_record(this->latency, event_loop_now_ns() - woke_at);
+    }
+    return dispatched;
+}
+
+void event_loop_run(event_loop *this) {
+    this->running = 1;
+    while(this->running) {
+	if(event_loop_run_once(this, -1) < 0) {
+	    break;
+	}
+    }
+}
+
+void event_loop_stop(event_loop *this) {
+    this->running = 0;
+}
@@ -0,0 +1,135 @@
+/* event_loop.h
+ *
+ * Defines an edge-triggered epoll event loop. Anything that owns a file
+ * descriptor (buffered sockets, the listen socket) embeds an event_handler
+ * and registers it exactly once; the loop then hands every ready fd back to
+ * its handler on each wakeup.
+ */
+
+#ifndef _EVENT_LOOP_H
+#define _EVENT_LOOP_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#include "histogram.h"
+#include "timer_wheel.h"
+
+/* Number of epoll events drained per epoll_wait() call */
+#define EVENT_LOOP_MAX_EVENTS 256
+
+typedef void (*event_callback)(int fd, uint32_t events, void *args);
+
+/*
+ * A handler's callback is invoked with the ready epoll events, or with
+ * events set to EVENT_LOOP_DEFERRED when it runs because of event_loop_defer.
+ */
+#define EVENT_LOOP_DEFERRED 0
+
+typedef struct event_handler_struct {
+    int fd;
+
+    event_callback callback;
+    void *args;
+
+    //Membership in the loop's deferred list
+    int deferred;
+    struct event_handler_struct *next_deferred;
+} event_handler;
+
+typedef struct event_loop_struct {
+    int epoll_fd;
+    int running;
+
+    //Events from the last epoll_wait() that have not been dispatched yet
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    int dispatch_index;
+    int dispatch_count;
+
+    //Handlers to run once the current batch of events has been dispatched
+    event_handler *deferred;
+
+    //epoll_wait() sleeps until the first of these is due, at the latest
+    timer_wheel timers;
+
+    //Wakeups so far
+    unsigned long iterations;
+    /* If set, how long each wakeup took to service, from epoll_wait()
+     * returning to the last deferred handler being done
+     */
+    histogram *latency;
+} event_loop;
+
+/*
+ * Creates the epoll instance backing the loop.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int init_event_loop(event_loop *this);
+
+/*
+ * Closes the epoll instance. Registered handlers are not touched.
+ */
+void destroy_event_loop(event_loop *this);
+
+void init_event_handler(event_handler *this, int fd, event_callback callback, void *args);
+
+/*
+ * Registers a handler for the given epoll events. EPOLLET is always added,
+ * so handlers must drain their fd until EAGAIN.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int event_loop_add(event_loop *this, event_handler *handler, uint32_t events);
+
+int event_loop_modify(event_loop *this, event_handler *handler, uint32_t events);
+
+/*
+ * Unregisters a handler. Safe to call from inside a callback, including on
+ * handlers other than the one currently being dispatched; any event still
+ * pending for the handler in the current batch is dropped, and so is a
+ * pending deferred call.
+ */
+int event_loop_remove(event_loop *this, event_handler *handler);
+
+/*
+ * Schedules a handler to be called with EVENT_LOOP_DEFERRED at the end of
+ * the current loop iteration, after every ready fd has been serviced. Work
+ * generated by many events in one iteration (e.g. lines queued for output)
+ * can then be handled in one go. Deferring an already deferred handler is
+ * a no-op.
+ */
+void event_loop_defer(event_loop *this, event_handler *handler);
+
+/*
+ * Arms a timer to fire delay_ms from now, on the loop's thread, after the
+ * ready handlers have been dispatched. Re-arming moves the timer.
+ */
+void event_loop_add_timer(event_loop *this, timer *t, uint64_t delay_ms);
+
+void event_loop_cancel_timer(event_loop *this, timer *t);
+
+/*
+ * Waits up to timeout_ms for activity (-1 blocks forever), or until the
+ * next timer is due if that's sooner, and dispatches every ready handler
+ * and due timer.
+ *
+ * Returns the number of handlers dispatched, or -1 on error.
+ */
+int event_loop_run_once(event_loop *this, int timeout_ms);
+
+/*
+ * Runs the loop until event_loop_stop is called.
+ */
+void event_loop_run(event_loop *this);
+
+void event_loop_stop(event_loop *this);
+
+/*
+ * Reads the monotonic clock, in nanoseconds and in the milliseconds timers
+ * are kept in
+ */
+uint64_t event_loop_now_ns(void);
+uint64_t event_loop_now_ms(void);
+
+#endif /* _EVENT_LOOP_H */
@@ -0,0 +1,175 @@
+/* fanout_worker.c
+ *
+ * Implements fan-out worker threads
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "fanout_worker.h"
+
+typedef struct adopt_args_struct {
+    fanout_worker *worker;
+    int fd;
+    shared_buffer *snapshot;
+    unsigned long seq;
+} adopt_args;
+
+/*
+ * Drains the ring into our clients' queues. The queues are flushed at the
+ * end of the loop iteration, so a burst goes out in as few writes as 
+ * possible.
+ */
+void fanout_worker_on_ring(int fd, uint32_t events, void *args) {
+    fanout_worker *this = (fanout_worker *) args;
+    broadcast_ring *ring = &(this->owner->ring);
+
+    uint64_t count;
+    if(read(fd, &count, sizeof(count)) < 0) {
+	//Spurious wakeup, the ring is checked regardless
+    }
+
+    ring_entry *entry;
+    size_t consumed = 0;
+    while((entry = ring_peek(ring, this->index)) != NULL) {
+	fanout_line(&(this->clients), entry->line, NULL);
+	ring_consume(ring, this->index);
+	consumed++;
+    }
+
+    //The remote thread stopped reading when the ring filled up, and is waiting to hear there's room
+    if(consumed > 0 && ring_take_waiting(ring)) {
+	mailbox_post(&(this->owner->mailbox), &on_ring_space, NULL, this->owner);
+    }
+}
+
+/*
+ * Hands back what a client that was never adopted held, e.g. at shutdown
+ */
+void drop_adopt(void *args) {
+    adopt_args *adopt = (adopt_args *) args;
+
+    close(adopt->fd);
+    if(adopt->snapshot != NULL) {
+	shared_buffer_unref(adopt->snapshot);
+    }
+    free(adopt);
+}
+
+/*
+ * Mailbox work: take ownership of a client accepted by the remote thread
+ */
+void fanout_worker_on_adopt(void *args) {
+    adopt_args *adopt = (adopt_args *) args;
+    fanout_worker *this = adopt->worker;
+
+    client_socket *client = add_client_socket(this->owner, &(this->clients), adopt->fd);
+    if(client == NULL) {
+	close(adopt->fd);
+    }
+    else if(adopt->snapshot != NULL) {
+	client_send_state(client, adopt->snapshot, adopt->seq);
+    }
+
+    if(adopt->snapshot != NULL) {
+	shared_buffer_unref(adopt->snapshot);
+    }
+    free(adopt);
+}
+
+/*
+ * Mailbox work: hang up on everyone and leave the loop
+ */
+void fanout_worker_on_stop(void *args) {
+    fanout_worker *this = (fanout_worker *) args;
+
+    while(this->clients.len > 0) {
+	remove_client_socket(this->clients.items[this->clients.len - 1]);
+    }
+    destroy_client_list(&(this->clients));
+    this->running = 0;
+}
+
+void * run_fanout_worker(void *args) {
+    fanout_worker *this = (fanout_worker *) args;
+
+    while(this->running) {
+	if(event_loop_run_once(&(this->loop), -1) < 0) {
+	    break;
+	}
+    }
+    return NULL;
+}
+
+int start_fanout_worker(fanout_worker *this, irc_multiplexer *owner, size_t index) {
+    this->owner = owner;
+    this->index = index;
+    this->running = 1;
+
+    if(init_event_loop(&(this->loop)) != 0) {
+	return -1;
+    }
+    init_histogram(&(this->loop_latency));
+    this->loop.latency = &(this->loop_latency);
+    if(init_mailbox(&(this->mailbox), &(this->loop)) != 0) {
+	return -1;
+    }
+
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(fd < 0) {
+	perror("eventfd()");
+	return -1;
+    }
+    init_event_handler(&(this->ring_handler), fd, &fanout_worker_on_ring, this);
+    if(event_loop_add(&(this->loop), &(this->ring_handler), EPOLLIN) != 0) {
+	return -1;
+    }
+
+    init_client_list(&(this->clients), &(this->loop));
+    this->clients.mailbox = &(this->mailbox);
+
+    int error = pthread_create(&(this->thread), NULL, &run_fanout_worker, this);
+    if(error != 0) {
+	fprintf(stderr, "Error: could not start fan-out worker: %s\n", strerror(error));
+	return -1;
+    }
+    return 0;
+}
+
+void fanout_worker_notify(fanout_worker *this) {
+    uint64_t one = 1;
+    if(write(this->ring_handler.fd, &one, sizeof(one)) < 0) {
+	perror("write(eventfd)");
+    }
+}
+
+void fanout_worker_adopt(fanout_worker *this, int fd, shared_buffer *snapshot, unsigned long seq) {
+    adopt_args *adopt = malloc(sizeof(adopt_args));
+    if(adopt == NULL) {
+	//The snapshot is still the caller's, as nothing took a reference
+	close(fd);
+	return;
+    }
+    adopt->worker = this;
+    adopt->fd = fd;
+    adopt->snapshot = snapshot == NULL ? NULL : shared_buffer_ref(snapshot);
+    adopt->seq = seq;
+
+    if(mailbox_post(&(this->mailbox), &fanout_worker_on_adopt, &drop_adopt, adopt) != 0) {
+	drop_adopt(adopt);
+    }
+}
+
+void stop_fanout_worker(fanout_worker *this) {
+    mailbox_post(&(this->mailbox), &fanout_worker_on_stop, NULL, this);
+    pthread_join(this->thread, NULL);
+
+    event_loop_remove(&(this->loop), &(this->ring_handler));
+    close(this->ring_handler.fd);
+    destroy_mailbox(&(this->mailbox));
+    destroy_event_loop(&(this->loop));
+}
@@ -0,0 +1,60 @@
+/* fanout_worker.h
+ *
+ * Defines a fan-out worker: a thread that owns a share of a multiplexer's
+ * clients and writes every line the remote thread publishes to the 
+ * broadcast ring out to them. Clients are created, served and destroyed on
+ * the worker's thread only.
+ */
+
+#ifndef _FANOUT_WORKER_H
+#define _FANOUT_WORKER_H
+
+#include <pthread.h>
+
+#include "event_loop.h"
+#include "mailbox.h"
+#include "irc_multiplexer.h"
+
+typedef struct fanout_worker_struct {
+    pthread_t thread;
+    irc_multiplexer *owner;
+
+    //Our consumer slot in the owner's ring
+    size_t index;
+
+    event_loop loop;
+    histogram loop_latency;
+    mailbox mailbox;
+    //eventfd poked by the remote thread when the ring has new lines
+    event_handler ring_handler;
+
+    client_list clients;
+    int running;
+} fanout_worker;
+
+/*
+ * Sets up the worker's loop and starts its thread.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int start_fanout_worker(fanout_worker *this, irc_multiplexer *owner, size_t index);
+
+/*
+ * Tells the worker there are new lines in the ring. Safe from any thread.
+ */
+void fanout_worker_notify(fanout_worker *this);
+
+/*
+ * Passes an accepted client fd to the worker, which then owns it, along
+ * with the state snapshot to greet it with, taken when line seq was the 
+ * latest, or NULL. Safe from any thread.
+ */
+void fanout_worker_adopt(fanout_worker *this, int fd, shared_buffer *snapshot, unsigned long seq);
+
+/*
+ * Has the worker disconnect its clients and exit, then waits for it and
+ * frees what it used.
+ */
+void stop_fanout_worker(fanout_worker *this);
+
+#endif /* _FANOUT_WORKER_H */
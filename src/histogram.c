@@ -0,0 +1,87 @@
+/* histogram.c
+ *
+ * Implementation of the log-linear histogram
+ */
+
+#include <string.h>
+
+#include "histogram.h"
+
+void init_histogram(histogram *this) {
+    memset(this, 0, sizeof(histogram));
+}
+
+/*
+ * Values below HISTOGRAM_SUB_BUCKETS get a bucket each; above that, the
+ * top HISTOGRAM_SUB_BITS bits after the leading one pick the bucket.
+ */
+unsigned int bucket_of(uint64_t value) {
+    if(value < HISTOGRAM_SUB_BUCKETS) {
+	return (unsigned int) value;
+    }
+    unsigned int magnitude = 63 - __builtin_clzll(value);
+    unsigned int sub = (value >> (magnitude - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return (magnitude - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+/*
+ * Highest value that lands in a bucket
+ */
+uint64_t bucket_top(unsigned int bucket) {
+    if(bucket < HISTOGRAM_SUB_BUCKETS) {
+	return bucket;
+    }
+    unsigned int magnitude = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+    uint64_t sub = bucket % HISTOGRAM_SUB_BUCKETS;
+    uint64_t base = (1ULL << magnitude) | (sub << (magnitude - HISTOGRAM_SUB_BITS));
+    return base + (1ULL << (magnitude - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+void histogram_record(histogram *this, uint64_t value) {
+    this->counts[bucket_of(value)]++;
+    this->total++;
+    this->sum += value;
+    if(value > this->max) {
+	this->max = value;
+    }
+}
+
+void histogram_merge(histogram *this, const histogram *other) {
+    for(unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+	this->counts[i] += other->counts[i];
+    }
+    this->total += other->total;
+    this->sum += other->sum;
+    if(other->max > this->max) {
+	this->max = other->max;
+    }
+}
+
+uint64_t histogram_percentile(const histogram *this, double fraction) {
+    if(this->total == 0) {
+	return 0;
+    }
+
+    uint64_t rank = (uint64_t) (fraction * this->total);
+    if(rank >= this->total) {
+	rank = this->total - 1;
+    }
+
+    uint64_t seen = 0;
+    for(unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+	seen += this->counts[i];
+	if(seen > rank) {
+	    uint64_t top = bucket_top(i);
+	    return top < this->max ? top : this->max;
+	}
+    }
+    return this->max;
+}
+
+uint64_t histogram_count_below(const histogram *this, uint64_t limit) {
+    uint64_t below = 0;
+    for(unsigned int i = 0; i < HISTOGRAM_BUCKETS && bucket_top(i) < limit; i++) {
+	below += this->counts[i];
+    }
+    return below;
+}
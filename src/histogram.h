@@ -0,0 +1,47 @@
+/* histogram.h
+ *
+ * Defines a log-linear histogram of nanosecond latencies, good to about
+ * 6% at any magnitude. Each power of two is split into
+ * HISTOGRAM_SUB_BUCKETS linear buckets. Recording is a few instructions
+ * and never allocates, so histograms can stay on in the data path; a
+ * histogram belongs to one thread.
+ */
+
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+
+#include <stdint.h>
+
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (64 * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct histogram_struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} histogram;
+
+void init_histogram(histogram *this);
+
+void histogram_record(histogram *this, uint64_t value);
+
+/*
+ * Adds another histogram's samples to this one
+ */
+void histogram_merge(histogram *this, const histogram *other);
+
+/*
+ * Returns the value below which a fraction (0 to 1) of samples fall, or 0
+ * for an empty histogram.
+ */
+uint64_t histogram_percentile(const histogram *this, double fraction);
+
+/*
+ * Returns how many samples were below limit, which must be a power of two
+ * for the count to be exact.
+ */
+uint64_t histogram_count_below(const histogram *this, uint64_t limit);
+
+#endif /* _HISTOGRAM_H */
@@ -0,0 +1,245 @@
+/* history.c
+ *
+ * Implementation of the line history
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "history.h"
+
+int init_history_ring(history_ring *this, size_t size) {
+    size_t rounded = 1;
+    while(rounded < size) {
+	rounded <<= 1;
+    }
+
+    this->lines = calloc(rounded, sizeof(shared_buffer *));
+    if(this->lines == NULL) {
+	return -1;
+    }
+    this->size = rounded;
+    this->mask = rounded - 1;
+    this->pushed = 0;
+    return 0;
+}
+
+void destroy_history_ring(history_ring *this) {
+    for(size_t i = 0; i < this->size; i++) {
+	if(this->lines[i] != NULL) {
+	    shared_buffer_unref(this->lines[i]);
+	}
+    }
+    free(this->lines);
+    this->lines = NULL;
+}
+
+void history_ring_push(history_ring *this, shared_buffer *line) {
+    shared_buffer **slot = &(this->lines[this->pushed & this->mask]);
+    if(*slot != NULL) {
+	shared_buffer_unref(*slot);
+    }
+    *slot = shared_buffer_ref(line);
+    this->pushed++;
+}
+
+/*
+ * Index (in pushed order) of the oldest line still held
+ */
+unsigned long history_ring_first(history_ring *this) {
+    return this->pushed > this->size ? this->pushed - this->size : 0;
+}
+
+/*
+ * Index (in pushed order) of the first line held with a sequence number 
+ * above after. Lines are in sequence order, so this is a binary search.
+ */
+unsigned long history_ring_find(history_ring *this, unsigned long after) {
+    unsigned long low = history_ring_first(this);
+    unsigned long high = this->pushed;
+
+    while(low < high) {
+	unsigned long middle = low + (high - low) / 2;
+	if(this->lines[middle & this->mask]->seq <= after) {
+	    low = middle + 1;
+	}
+	else {
+	    high = middle;
+	}
+    }
+    return low;
+}
+
+/*
+ * Newest sequence number this ring lost from the range (after, upto]
+ */
+unsigned long history_ring_missing(history_ring *this, unsigned long after, unsigned long upto) {
+    //Nothing was dropped from an empty range, e.g. a resume from past the newest line
+    if(this->pushed <= this->size || after >= upto) {
+	return 0;
+    }
+
+    unsigned long oldest = this->lines[history_ring_first(this) & this->mask]->seq;
+    if(oldest <= after + 1) {
+	return 0;
+    }
+    return oldest - 1 < upto ? oldest - 1 : upto;
+}
+
+int init_history(history *this, size_t global_size, size_t channel_size) {
+    init_string_map(&(this->channels), 1);
+    this->channel_size = channel_size;
+    return init_history_ring(&(this->global), global_size);
+}
+
+void destroy_history(history *this) {
+    size_t cursor = 0;
+    string_map_entry *entry;
+    while((entry = string_map_next(&(this->channels), &cursor)) != NULL) {
+	destroy_history_ring((history_ring *) entry->value);
+	free(entry->value);
+    }
+    destroy_string_map(&(this->channels));
+    destroy_history_ring(&(this->global));
+}
+
+void history_record(history *this, shared_buffer *line, irc_message *msg, string_map *joined) {
+    history_ring_push(&(this->global), line);
+
+    irc_slice channels[IRC_MAX_PARAMS];
+    size_t channels_len = message_channels(msg, channels, IRC_MAX_PARAMS);
+
+    for(size_t i = 0; i < channels_len; i++) {
+	history_ring *ring = string_map_get(&(this->channels), channels[i].ptr, channels[i].len);
+	if(ring == NULL) {
+	    //Anything can name a channel, but only ours are worth a ring
+	    if(string_map_get(joined, channels[i].ptr, channels[i].len) == NULL) {
+		continue;
+	    }
+
+	    ring = malloc(sizeof(history_ring));
+	    if(ring == NULL || init_history_ring(ring, this->channel_size) != 0) {
+		free(ring);
+		continue;
+	    }
+	    if(string_map_put(&(this->channels), channels[i].ptr, channels[i].len, ring) != 0) {
+		destroy_history_ring(ring);
+		free(ring);
+		continue;
+	    }
+	}
+
+	//"PART #a,#A" names the same channel twice
+	if(ring->pushed > 0 && ring->lines[(ring->pushed - 1) & ring->mask] == line) {
+	    continue;
+	}
+	history_ring_push(ring, line);
+    }
+}
+
+void history_forget(history *this, const char *channel, size_t len) {
+    history_ring *ring = string_map_remove(&(this->channels), channel, len);
+    if(ring != NULL) {
+	destroy_history_ring(ring);
+	free(ring);
+    }
+}
+
+int compare_seq(const void *a, const void *b) {
+    unsigned long left = (*(shared_buffer * const *) a)->seq;
+    unsigned long right = (*(shared_buffer * const *) b)->seq;
+    return left < right ? -1 : left > right;
+}
+
+/*
+ * Appends the lines of one ring in (after, upto] that match the filters
+ */
+int collect_ring(history_ring *ring, subscription_filter *filters, unsigned long after, unsigned long upto,
+	shared_buffer ***lines, size_t *len, size_t *size) {
+    subscriber sub;
+    sub.filters = filters;
+
+    for(unsigned long i = history_ring_find(ring, after); i < ring->pushed; i++) {
+	shared_buffer *line = ring->lines[i & ring->mask];
+	if(line->seq > upto) {
+	    break;
+	}
+
+	if(filters != NULL) {
+	    irc_message msg;
+	    if(parse_message_view(&msg, line->data + line->header_len, line->len - line->header_len) != 0
+		    || !subscription_matches(&sub, &msg)) {
+		continue;
+	    }
+	}
+
+	if(*len == *size) {
+	    size_t new_size = *size == 0 ? 64 : *size * 2;
+	    shared_buffer **grown = realloc(*lines, new_size * sizeof(shared_buffer *));
+	    if(grown == NULL) {
+		return -1;
+	    }
+	    *lines = grown;
+	    *size = new_size;
+	}
+	(*lines)[(*len)++] = shared_buffer_ref(line);
+    }
+    return 0;
+}
+
+size_t history_collect(history *this, subscription_filter *filters, unsigned long after, unsigned long upto,
+	shared_buffer ***lines, unsigned long *missing_upto) {
+    size_t len = 0, size = 0;
+    *lines = NULL;
+    *missing_upto = 0;
+
+    //Channels we aren't in have no ring, and are looked for in the global one
+    int channels_only = filters != NULL;
+    for(subscription_filter *filter = filters; filter != NULL; filter = filter->next) {
+	if(filter->type != FILTER_CHANNEL
+		|| string_map_get(&(this->channels), filter->value, filter->value_len) == NULL) {
+	    channels_only = 0;
+	}
+    }
+
+    int error = 0;
+    if(!channels_only) {
+	error = collect_ring(&(this->global), filters, after, upto, lines, &len, &size);
+	*missing_upto = history_ring_missing(&(this->global), after, upto);
+    }
+    else {
+	for(subscription_filter *filter = filters; filter != NULL && !error; filter = filter->next) {
+	    history_ring *ring = string_map_get(&(this->channels), filter->value, filter->value_len);
+
+	    //Lines about several of our channels are in each of their rings
+	    error = collect_ring(ring, NULL, after, upto, lines, &len, &size);
+	    unsigned long missing = history_ring_missing(ring, after, upto);
+	    if(missing > *missing_upto) {
+		*missing_upto = missing;
+	    }
+	}
+
+	if(len > 1) {
+	    qsort(*lines, len, sizeof(shared_buffer *), &compare_seq);
+	}
+	size_t kept = 0;
+	for(size_t i = 0; i < len; i++) {
+	    if(kept > 0 && (*lines)[kept - 1] == (*lines)[i]) {
+		shared_buffer_unref((*lines)[i]);
+		continue;
+	    }
+	    (*lines)[kept++] = (*lines)[i];
+	}
+	len = kept;
+    }
+
+    if(error) {
+	for(size_t i = 0; i < len; i++) {
+	    shared_buffer_unref((*lines)[i]);
+	}
+	free(*lines);
+	*lines = NULL;
+	return (size_t) -1;
+    }
+    return len;
+}
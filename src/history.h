@@ -0,0 +1,78 @@
+/* history.h
+ *
+ * Defines the in-memory history of lines from the remote. Every line gets
+ * a sequence number and is kept in a global ring, and also in a smaller 
+ * ring for each of our channels it's about, so a quiet channel's history
+ * isn't pushed out by a busy one. A client that reconnects can then be 
+ * sent what it missed instead of asking the server again.
+ */
+
+#ifndef _HISTORY_H
+#define _HISTORY_H
+
+#include <stddef.h>
+
+#include "shared_buffer.h"
+#include "string_map.h"
+#include "subscription.h"
+
+/*
+ * A bounded ring of lines in sequence order. The oldest line is dropped to
+ * make room for a new one.
+ */
+typedef struct history_ring_struct {
+    shared_buffer **lines;
+    size_t size;
+    size_t mask;
+    //Lines ever pushed; the newest is at (pushed - 1) & mask
+    unsigned long pushed;
+} history_ring;
+
+typedef struct history_struct {
+    history_ring global;
+
+    //Channel name (case-mapped) to history_ring
+    string_map channels;
+    size_t channel_size;
+} history;
+
+/*
+ * Sets up a history keeping global_size lines overall and channel_size per
+ * channel, both rounded up to a power of two.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int init_history(history *this, size_t global_size, size_t channel_size);
+
+void destroy_history(history *this);
+
+/*
+ * Keeps a reference to a line, which must have its seq set. msg is the 
+ * line parsed with parse_message_view, used to find its channels. Only 
+ * channels in joined (case-mapped names, e.g. irc_state's channels) get a
+ * ring; lines about any other channel, like a LIST reply or an INVITE, are
+ * only kept in the global one.
+ */
+void history_record(history *this, shared_buffer *line, irc_message *msg, string_map *joined);
+
+/*
+ * Frees a channel's ring, once we've left the channel.
+ */
+void history_forget(history *this, const char *channel, size_t len);
+
+/*
+ * Collects the lines with a sequence number in (after, upto] that match a
+ * set of filters (NULL for all), oldest first, taking a reference to each.
+ * When every filter is one of our channels only those channels' rings are
+ * searched, so they reach further back.
+ *
+ * *missing_upto is set to the newest sequence number in the range that
+ * was pushed out of memory and can't be replayed, or 0 if nothing was.
+ *
+ * Returns the number of lines stored in *lines, which the caller frees, or
+ * (size_t) -1 on error.
+ */
+size_t history_collect(history *this, subscription_filter *filters, unsigned long after, unsigned long upto,
+	shared_buffer ***lines, unsigned long *missing_upto);
+
+#endif /* _HISTORY_H */
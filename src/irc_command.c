@@ -0,0 +1,281 @@
+/* irc_command.c
+ *
+ * Resolves command names to ids. Rather than hashing, lookup switches on
+ * the length and then the first byte, which leaves at most a couple of
+ * candidates to compare against.
+ */
+
+#include <string.h>
+
+#include "irc_command.h"
+
+static const char *command_names[CMD_COUNT - CMD_UNKNOWN - 1] = {
+    "ACCOUNT",
+    "ADMIN",
+    "AUTHENTICATE",
+    "AWAY",
+    "BATCH",
+    "CAP",
+    "CHGHOST",
+    "CNOTICE",
+    "CONNECT",
+    "CPRIVMSG",
+    "DIE",
+    "ERROR",
+    "HELP",
+    "INFO",
+    "INVITE",
+    "ISON",
+    "JOIN",
+    "KICK",
+    "KILL",
+    "KNOCK",
+    "LINKS",
+    "LIST",
+    "LUSERS",
+    "MODE",
+    "MOTD",
+    "MUX",
+    "NAMES",
+    "NICK",
+    "NOTICE",
+    "OPER",
+    "PART",
+    "PASS",
+    "PING",
+    "PONG",
+    "PRIVMSG",
+    "QUIT",
+    "REHASH",
+    "RESTART",
+    "SERVICE",
+    "SERVLIST",
+    "SETNAME",
+    "SQUERY",
+    "SQUIT",
+    "STATS",
+    "SUMMON",
+    "TAGMSG",
+    "TIME",
+    "TOPIC",
+    "TRACE",
+    "USER",
+    "USERHOST",
+    "USERS",
+    "VERSION",
+    "WALLOPS",
+    "WHO",
+    "WHOIS",
+    "WHOWAS",
+};
+
+static inline char upper(char c) {
+    return c >= 'a' && c <= 'z' ? c - 32 : c;
+}
+
+/*
+ * Compares a command against an uppercase name of the same length
+ */
+static int verb_equals(const char *command, const char *name, size_t len) {
+    for(size_t i = 1; i < len; i++) {
+	if(upper(command[i]) != name[i]) {
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+int lookup_command(const char *command, size_t len) {
+
+    if(len == 3 && command[0] >= '0' && command[0] <= '9'
+	    && command[1] >= '0' && command[1] <= '9'
+	    && command[2] >= '0' && command[2] <= '9') {
+	return (command[0] - '0') * 100 + (command[1] - '0') * 10 + (command[2] - '0');
+    }
+
+    switch(len) {
+	case 3:
+	    switch(upper(command[0])) {
+		case 'C':
+		    if(verb_equals(command, "CAP", 3)) return CMD_CAP;
+		    break;
+		case 'D':
+		    if(verb_equals(command, "DIE", 3)) return CMD_DIE;
+		    break;
+		case 'M':
+		    if(verb_equals(command, "MUX", 3)) return CMD_MUX;
+		    break;
+		case 'W':
+		    if(verb_equals(command, "WHO", 3)) return CMD_WHO;
+		    break;
+	    }
+	    break;
+	case 4:
+	    switch(upper(command[0])) {
+		case 'A':
+		    if(verb_equals(command, "AWAY", 4)) return CMD_AWAY;
+		    break;
+		case 'H':
+		    if(verb_equals(command, "HELP", 4)) return CMD_HELP;
+		    break;
+		case 'I':
+		    if(verb_equals(command, "INFO", 4)) return CMD_INFO;
+		    if(verb_equals(command, "ISON", 4)) return CMD_ISON;
+		    break;
+		case 'J':
+		    if(verb_equals(command, "JOIN", 4)) return CMD_JOIN;
+		    break;
+		case 'K':
+		    if(verb_equals(command, "KICK", 4)) return CMD_KICK;
+		    if(verb_equals(command, "KILL", 4)) return CMD_KILL;
+		    break;
+		case 'L':
+		    if(verb_equals(command, "LIST", 4)) return CMD_LIST;
+		    break;
+		case 'M':
+		    if(verb_equals(command, "MODE", 4)) return CMD_MODE;
+		    if(verb_equals(command, "MOTD", 4)) return CMD_MOTD;
+		    break;
+		case 'N':
+		    if(verb_equals(command, "NICK", 4)) return CMD_NICK;
+		    break;
+		case 'O':
+		    if(verb_equals(command, "OPER", 4)) return CMD_OPER;
+		    break;
+		case 'P':
+		    if(verb_equals(command, "PART", 4)) return CMD_PART;
+		    if(verb_equals(command, "PASS", 4)) return CMD_PASS;
+		    if(verb_equals(command, "PING", 4)) return CMD_PING;
+		    if(verb_equals(command, "PONG", 4)) return CMD_PONG;
+		    break;
+		case 'Q':
+		    if(verb_equals(command, "QUIT", 4)) return CMD_QUIT;
+		    break;
+		case 'T':
+		    if(verb_equals(command, "TIME", 4)) return CMD_TIME;
+		    break;
+		case 'U':
+		    if(verb_equals(command, "USER", 4)) return CMD_USER;
+		    break;
+	    }
+	    break;
+	case 5:
+	    switch(upper(command[0])) {
+		case 'A':
+		    if(verb_equals(command, "ADMIN", 5)) return CMD_ADMIN;
+		    break;
+		case 'B':
+		    if(verb_equals(command, "BATCH", 5)) return CMD_BATCH;
+		    break;
+		case 'E':
+		    if(verb_equals(command, "ERROR", 5)) return CMD_ERROR;
+		    break;
+		case 'K':
+		    if(verb_equals(command, "KNOCK", 5)) return CMD_KNOCK;
+		    break;
+		case 'L':
+		    if(verb_equals(command, "LINKS", 5)) return CMD_LINKS;
+		    break;
+		case 'N':
+		    if(verb_equals(command, "NAMES", 5)) return CMD_NAMES;
+		    break;
+		case 'S':
+		    if(verb_equals(command, "SQUIT", 5)) return CMD_SQUIT;
+		    if(verb_equals(command, "STATS", 5)) return CMD_STATS;
+		    break;
+		case 'T':
+		    if(verb_equals(command, "TOPIC", 5)) return CMD_TOPIC;
+		    if(verb_equals(command, "TRACE", 5)) return CMD_TRACE;
+		    break;
+		case 'U':
+		    if(verb_equals(command, "USERS", 5)) return CMD_USERS;
+		    break;
+		case 'W':
+		    if(verb_equals(command, "WHOIS", 5)) return CMD_WHOIS;
+		    break;
+	    }
+	    break;
+	case 6:
+	    switch(upper(command[0])) {
+		case 'I':
+		    if(verb_equals(command, "INVITE", 6)) return CMD_INVITE;
+		    break;
+		case 'L':
+		    if(verb_equals(command, "LUSERS", 6)) return CMD_LUSERS;
+		    break;
+		case 'N':
+		    if(verb_equals(command, "NOTICE", 6)) return CMD_NOTICE;
+		    break;
+		case 'R':
+		    if(verb_equals(command, "REHASH", 6)) return CMD_REHASH;
+		    break;
+		case 'S':
+		    if(verb_equals(command, "SQUERY", 6)) return CMD_SQUERY;
+		    if(verb_equals(command, "SUMMON", 6)) return CMD_SUMMON;
+		    break;
+		case 'T':
+		    if(verb_equals(command, "TAGMSG", 6)) return CMD_TAGMSG;
+		    break;
+		case 'W':
+		    if(verb_equals(command, "WHOWAS", 6)) return CMD_WHOWAS;
+		    break;
+	    }
+	    break;
+	case 7:
+	    switch(upper(command[0])) {
+		case 'A':
+		    if(verb_equals(command, "ACCOUNT", 7)) return CMD_ACCOUNT;
+		    break;
+		case 'C':
+		    if(verb_equals(command, "CHGHOST", 7)) return CMD_CHGHOST;
+		    if(verb_equals(command, "CNOTICE", 7)) return CMD_CNOTICE;
+		    if(verb_equals(command, "CONNECT", 7)) return CMD_CONNECT;
+		    break;
+		case 'P':
+		    if(verb_equals(command, "PRIVMSG", 7)) return CMD_PRIVMSG;
+		    break;
+		case 'R':
+		    if(verb_equals(command, "RESTART", 7)) return CMD_RESTART;
+		    break;
+		case 'S':
+		    if(verb_equals(command, "SERVICE", 7)) return CMD_SERVICE;
+		    if(verb_equals(command, "SETNAME", 7)) return CMD_SETNAME;
+		    break;
+		case 'V':
+		    if(verb_equals(command, "VERSION", 7)) return CMD_VERSION;
+		    break;
+		case 'W':
+		    if(verb_equals(command, "WALLOPS", 7)) return CMD_WALLOPS;
+		    break;
+	    }
+	    break;
+	case 8:
+	    switch(upper(command[0])) {
+		case 'C':
+		    if(verb_equals(command, "CPRIVMSG", 8)) return CMD_CPRIVMSG;
+		    break;
+		case 'S':
+		    if(verb_equals(command, "SERVLIST", 8)) return CMD_SERVLIST;
+		    break;
+		case 'U':
+		    if(verb_equals(command, "USERHOST", 8)) return CMD_USERHOST;
+		    break;
+	    }
+	    break;
+	case 12:
+	    switch(upper(command[0])) {
+		case 'A':
+		    if(verb_equals(command, "AUTHENTICATE", 12)) return CMD_AUTHENTICATE;
+		    break;
+	    }
+	    break;
+    }
+    return CMD_UNKNOWN;
+}
+
+const char * command_name(int id) {
+    if(id <= CMD_UNKNOWN || id >= CMD_COUNT) {
+	return NULL;
+    }
+    return command_names[id - CMD_UNKNOWN - 1];
+}
@@ -0,0 +1,99 @@
+/* irc_command.h
+ *
+ * Maps IRC commands to small integer ids, so that handlers, filters and
+ * counters can be looked up by array index rather than by string. Numeric
+ * replies are their own id, 0-999; the named commands come after them.
+ */
+
+#ifndef _IRC_COMMAND_H
+#define _IRC_COMMAND_H
+
+#include <stddef.h>
+
+#define IRC_NUMERIC_COUNT 1000
+
+typedef enum irc_command_enum {
+    //Anything that isn't a numeric or one of the commands below
+    CMD_UNKNOWN = IRC_NUMERIC_COUNT,
+    CMD_ACCOUNT,
+    CMD_ADMIN,
+    CMD_AUTHENTICATE,
+    CMD_AWAY,
+    CMD_BATCH,
+    CMD_CAP,
+    CMD_CHGHOST,
+    CMD_CNOTICE,
+    CMD_CONNECT,
+    CMD_CPRIVMSG,
+    CMD_DIE,
+    CMD_ERROR,
+    CMD_HELP,
+    CMD_INFO,
+    CMD_INVITE,
+    CMD_ISON,
+    CMD_JOIN,
+    CMD_KICK,
+    CMD_KILL,
+    CMD_KNOCK,
+    CMD_LINKS,
+    CMD_LIST,
+    CMD_LUSERS,
+    CMD_MODE,
+    CMD_MOTD,
+    CMD_MUX,
+    CMD_NAMES,
+    CMD_NICK,
+    CMD_NOTICE,
+    CMD_OPER,
+    CMD_PART,
+    CMD_PASS,
+    CMD_PING,
+    CMD_PONG,
+    CMD_PRIVMSG,
+    CMD_QUIT,
+    CMD_REHASH,
+    CMD_RESTART,
+    CMD_SERVICE,
+    CMD_SERVLIST,
+    CMD_SETNAME,
+    CMD_SQUERY,
+    CMD_SQUIT,
+    CMD_STATS,
+    CMD_SUMMON,
+    CMD_TAGMSG,
+    CMD_TIME,
+    CMD_TOPIC,
+    CMD_TRACE,
+    CMD_USER,
+    CMD_USERHOST,
+    CMD_USERS,
+    CMD_VERSION,
+    CMD_WALLOPS,
+    CMD_WHO,
+    CMD_WHOIS,
+    CMD_WHOWAS,
+    CMD_COUNT
+} irc_command;
+
+/*
+ * Resolves a command, case insensitively. Three digits resolve to the
+ * numeric they spell.
+ *
+ * Returns the command's id, or CMD_UNKNOWN.
+ */
+int lookup_command(const char *command, size_t len);
+
+/*
+ * Returns 1 if id is a numeric reply, 0 otherwise.
+ */
+static inline int command_is_numeric(int id) {
+    return id >= 0 && id < IRC_NUMERIC_COUNT;
+}
+
+/*
+ * Returns the name of a named command, or NULL for numerics and
+ * CMD_UNKNOWN.
+ */
+const char * command_name(int id);
+
+#endif /* _IRC_COMMAND_H */
@@ -0,0 +1,120 @@
+/* irc_host.c
+ *
+ * Implements sharded hosting of multiplexers
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include "irc_host.h"
+
+int init_host(irc_host *this, size_t shards_len, int pin_threads) {
+    if(shards_len == 0) {
+	shards_len = 1;
+    }
+
+    this->shards = calloc(shards_len, sizeof(irc_shard));
+    this->shards_len = shards_len;
+    this->next_shard = 0;
+    if(this->shards == NULL) {
+	return -1;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cpus < 1) {
+	cpus = 1;
+    }
+
+    for(size_t i = 0; i < shards_len; i++) {
+	irc_shard *shard = &(this->shards[i]);
+	shard->index = i;
+	shard->cpu = pin_threads ? (int)(i % cpus) : -1;
+	shard->instances = NULL;
+	shard->instances_len = 0;
+	shard->instances_size = 0;
+
+	if(init_event_loop(&(shard->loop)) != 0) {
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+void host_add_multiplexer(irc_host *this, irc_multiplexer *mux) {
+    irc_shard *shard = &(this->shards[this->next_shard]);
+    this->next_shard = (this->next_shard + 1) % this->shards_len;
+
+    if(shard->instances_len == shard->instances_size) {
+	shard->instances_size = shard->instances_size == 0 ? 4 : shard->instances_size * 2;
+	shard->instances = realloc(shard->instances, shard->instances_size * sizeof(irc_multiplexer *));
+    }
+    shard->instances[shard->instances_len++] = mux;
+}
+
+/*
+ * Body of a shard thread. Everything a multiplexer owns is created and 
+ * used from here on, so it never leaves this thread.
+ */
+void * run_shard(void *args) {
+    irc_shard *this = (irc_shard *) args;
+
+    if(this->cpu >= 0) {
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(this->cpu, &cpus);
+	int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	if(error != 0) {
+	    fprintf(stderr, "Warning: could not pin shard %lu to cpu %d: %s\n", 
+		    (unsigned long) this->index, this->cpu, strerror(error));
+	}
+    }
+
+    for(size_t i = 0; i < this->instances_len; i++) {
+	if(attach_multiplexer(this->instances[i], &(this->loop)) != 0) {
+	    fprintf(stderr, "Error: could not start multiplexer for %s on shard %lu\n",
+		    this->instances[i]->server, (unsigned long) this->index);
+	}
+    }
+
+    //Keep going as long as one of our multiplexers is alive
+    while(1) {
+	int running = 0;
+	for(size_t i = 0; i < this->instances_len; i++) {
+	    running |= this->instances[i]->running;
+	}
+	if(!running) {
+	    break;
+	}
+
+	if(event_loop_run_once(&(this->loop), -1) < 0) {
+	    break;
+	}
+    }
+
+    destroy_event_loop(&(this->loop));
+    return NULL;
+}
+
+void start_host(irc_host *this) {
+    for(size_t i = 0; i < this->shards_len; i++) {
+	irc_shard *shard = &(this->shards[i]);
+	if(shard->instances_len == 0) {
+	    continue;
+	}
+
+	int error = pthread_create(&(shard->thread), NULL, &run_shard, shard);
+	if(error != 0) {
+	    fprintf(stderr, "Error: could not start shard %lu: %s\n", (unsigned long) i, strerror(error));
+	    exit(1);
+	}
+    }
+
+    for(size_t i = 0; i < this->shards_len; i++) {
+	if(this->shards[i].instances_len > 0) {
+	    pthread_join(this->shards[i].thread, NULL);
+	}
+    }
+}
@@ -0,0 +1,59 @@
+/* irc_host.h
+ *
+ * Hosts many multiplexers (one per network and identity) in a single 
+ * process. Multiplexers are spread over a fixed number of shards, each 
+ * being one thread running its own event loop, optionally pinned to a core.
+ * A multiplexer lives on exactly one shard for its whole life, so shards 
+ * share nothing and never contend.
+ */
+
+#ifndef _IRC_HOST_H
+#define _IRC_HOST_H
+
+#include <pthread.h>
+
+#include "event_loop.h"
+#include "irc_multiplexer.h"
+
+typedef struct irc_shard_struct {
+    pthread_t thread;
+    size_t index;
+    //Core the thread is pinned to, or -1 to let the scheduler decide
+    int cpu;
+
+    event_loop loop;
+
+    irc_multiplexer **instances;
+    size_t instances_len;
+    size_t instances_size;
+} irc_shard;
+
+typedef struct irc_host_struct {
+    irc_shard *shards;
+    size_t shards_len;
+
+    //Round robin cursor for placing new multiplexers
+    size_t next_shard;
+} irc_host;
+
+/*
+ * Sets up shards_len shards. When pin_threads is set, shard i is pinned to
+ * core i modulo the number of online cores.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int init_host(irc_host *this, size_t shards_len, int pin_threads);
+
+/*
+ * Assigns a configured (but not yet attached) multiplexer to a shard. Must
+ * be called before start_host.
+ */
+void host_add_multiplexer(irc_host *this, irc_multiplexer *mux);
+
+/*
+ * Starts a thread per shard and waits until every multiplexer has shut
+ * down.
+ */
+void start_host(irc_host *this);
+
+#endif /* _IRC_HOST_H */
@@ -1,4 +1,4 @@
-/* irc_message.h
+/* irc_message.c
  *
  * Implementation for functions that operate on irc messages
  */
@@ -9,8 +9,25 @@
 #include <stdio.h>
 
 #include "irc_message.h"
+#include "scan.h"
 #include "utilities.h"
 
+/*
+ * Allocates a copy of len bytes of str for one of a message's fields,
+ * from the message's arena if it has one
+ */
+char * message_strndup(irc_message *this, const char *str, size_t len) {
+    if(this->arena != NULL) {
+	return arena_strndup(this->arena, str, len);
+    }
+    char *copy = malloc(len + 1);
+    if(copy != NULL) {
+	memcpy(copy, str, len);
+	copy[len] = '\0';
+    }
+    return copy;
+}
+
 /* parse_prefix
  *
  * Attempts to parse the prefix from an irc message, and store it in 
@@ -20,27 +37,31 @@ char * parse_prefix(irc_message *this, char *msg) {
     
     //return as-is if no leading colon
     if(*msg != ':') {
-	#ifdef DEBUG
-	fprintf(stderr, "No prefix.\n");
-	#endif /* DEBUG */
 	return msg;
     }
 
-    char *tail = msg;
-
-    while(*tail != ' ') {
-	tail++;
+    char *tail = (char *) scan_byte(msg, strlen(msg), ' ');
+    if(tail == NULL) {
+	tail = msg + strlen(msg);
     }
 
     size_t len = tail - msg;
 
-    this->prefix = malloc(len + 1);
-    strncpy(this->prefix, msg, len);
-    *(this->prefix + len) = '\0';
+    this->prefix = message_strndup(this, msg, len);
 
     return tail;
 }
 
+/* find_line_end
+ *
+ * Locates the CR LF ending msg, or the terminating NUL if there is none
+ */
+char * find_line_end(char *msg) {
+    size_t len = strlen(msg);
+    char *end = (char *) scan_crlf(msg, len);
+    return end == NULL ? msg + len : end;
+}
+
 /* parse_command
  *
  * Extracts the command from an IRC message, and stores it in 
@@ -48,50 +69,46 @@ char * parse_prefix(irc_message *this, char *msg) {
  */
 char * parse_command(irc_message *this, char *msg) {
 
-    char *tail = msg;
-
-    //Check to see if we're receiving a server reply
-    if(isdigit(msg[0]) && isdigit(msg[1]) && isdigit(msg[2])) {
-	#ifdef DEBUG
-	fprintf(stderr, "Received server reply.\n");
-	#endif /* DEBUG */
-    }
-
-    while(*tail != ' ') {
-	tail++;
+    //A command with no params ends at the CR LF
+    char *line_end = find_line_end(msg);
+    char *tail = (char *) scan_byte(msg, line_end - msg, ' ');
+    if(tail == NULL) {
+	tail = line_end;
     }
 
     size_t len = tail - msg;
 
-    this->command = malloc(len + 1);
-    strncpy(this->command, msg, len);
-    *(this->command + len) = '\0';
+    this->command = message_strndup(this, msg, len);
+    //Server replies come out as their number, e.g. 353
+    this->command_id = lookup_command(this->command, len);
 
     return tail;
 }
 
 void add_param(irc_message *this, char *param) {
 
-    //Create new array of char *'s, and then add our new param to it
-    if(this->params_array == NULL) {
-	this->params_array = malloc(sizeof(char *));
-	(this->params_array)[0] = param;
-	this->params_len++;
-    }
-    //Expand array and add new param
-    else {
-	char ** new_params = malloc(sizeof(char *) * (this->params_len + 1));
-	char ** old_params = this->params_array;
-
-	memset(new_params, 0, this->params_len + 1);
-	memcpy(new_params, old_params, (sizeof(char *) *this->params_len));
-
-	new_params[this->params_len] = param;
-	this->params_len++;
+    //Grow the array by doubling; an arena's old array is just left behind
+    if(this->params_len == this->params_size) {
+	size_t size = this->params_size == 0 ? 4 : this->params_size * 2;
+	char **new_params;
 
+	if(this->arena != NULL) {
+	    new_params = arena_alloc(this->arena, size * sizeof(char *));
+	    if(new_params != NULL && this->params_len > 0) {
+		memcpy(new_params, this->params_array, this->params_len * sizeof(char *));
+	    }
+	}
+	else {
+	    new_params = realloc(this->params_array, size * sizeof(char *));
+	}
+	if(new_params == NULL) {
+	    return;
+	}
 	this->params_array = new_params;
-	free(old_params);
+	this->params_size = size;
     }
+
+    this->params_array[this->params_len++] = param;
 }
 
 /* parse_params
@@ -100,6 +117,11 @@ void add_param(irc_message *this, char *param) {
  */
 char * parse_params(irc_message *this, char *msg) {
 
+    //Nothing left but the line terminator, if that
+    if(*msg == '\0' || strncmp(msg, "\r\n", 2) == 0) {
+	return NULL;
+    }
+
     //Verify that the first character is a space, per the spec.
     if(*msg != ' ') {
 	fprintf(stderr, "ERROR: malformed params field\n");
@@ -112,24 +134,20 @@ char * parse_params(irc_message *this, char *msg) {
     }
 
     //Check to see if we are at the end of the line
-    if(strncmp(msg, "\r\n", 2) == 0 || strncmp(lookahead, "\r\n", 2) == 0) {
+    if(*lookahead == '\0' || strncmp(lookahead, "\r\n", 2) == 0) {
 	return NULL;
     }
 
+    //Runs of spaces separate params just like one does
+    msg = lookahead - 1;
+
     //Check to see if we're about to read trailing
     if(strncmp(msg, " :", 2) == 0) {
 	
 	msg += 2;
-	char *tail = msg;
-
-	while(strncmp(tail, "\r\n", 2) != 0) {
-	    tail++;
-	}
+	char *tail = find_line_end(msg);
 	
-	size_t len = tail - msg;
-	char *substr = malloc(len + 1);
-	strncpy(substr, msg, len);
-	*(substr + len) = '\0';
+	char *substr = message_strndup(this, msg, tail - msg);
 
 	add_param(this, substr);
 	return NULL;
@@ -137,16 +155,13 @@ char * parse_params(irc_message *this, char *msg) {
     //We're still reading space delimited params
     else {
 	msg++;
-	char *tail = msg;
-
-	while(*tail != ' ' && strncmp(tail, "\r\n", 2) != 0) {
-	    tail++;
+	char *line_end = find_line_end(msg);
+	char *tail = (char *) scan_byte(msg, line_end - msg, ' ');
+	if(tail == NULL) {
+	    tail = line_end;
 	}
 
-	size_t len = tail - msg;
-	char *substr = malloc(len + 1);
-	strncpy(substr, msg, len);
-	*(substr + len) = '\0';
+	char *substr = message_strndup(this, msg, tail - msg);
 
 	add_param(this, substr);
 	return parse_params(this, tail);
@@ -184,46 +199,169 @@ char * parse_params(irc_message *this, char *msg) {
  * <crlf>     ::= CR LF
  */
 irc_message * parse_message(char *msg) {
+    return parse_message_in(NULL, msg);
+}
+
+irc_message * parse_message_in(arena *arena, char *msg) {
 
     //Prepare struct
-    irc_message *this = malloc(sizeof(irc_message)); 
+    irc_message *this = arena == NULL ? malloc(sizeof(irc_message)) : arena_alloc(arena, sizeof(irc_message));
+    if(this == NULL) {
+	return NULL;
+    }
+    this->arena = arena;
+    this->is_view = 0;
     this->prefix = NULL;
     this->command = NULL;
     this->params_array = NULL;
     this->params_len = 0;
+    this->params_size = 0;
+    this->command_id = CMD_UNKNOWN;
 
     //Keep raw msg available for fun and profit.
-    this->msg = malloc(strlen(msg) + 1);
-    strcpy(this->msg, msg);
-
-    #ifdef DEBUG
-    fprintf(stderr, "this->msg: \"%s\"\n", this->msg);
-    #endif /* DEBUG */
+    this->msg = message_strndup(this, msg, strlen(msg));
 
     msg = parse_prefix(this, msg);
-    #ifdef DEBUG
-    fprintf(stderr, "this->prefix: \"%s\"\n", this->prefix);
-    #endif /* DEBUG */
-
     while(*msg == ' ') msg++;
     msg = parse_command(this, msg);
-    #ifdef DEBUG
-    fprintf(stderr, "this->command: \"%s\"\n", this->command);
-    #endif /* DEBUG */
-
     parse_params(this, msg);
 
-    #ifdef DEBUG
-    for(int i = 0; i < this->params_len; i++) {
-	printf("(this->params_array)[%d]: \"%s\"\n", i, (this->params_array)[i]);
+    return this;
+}
+
+/*
+ * Same grammar as above, but nothing is copied: every field is a slice of
+ * line. Only the prefix and command are located here, params wait until
+ * split_params is called so routing on the command alone stays cheap.
+ */
+int parse_message_view(irc_message *this, const char *line, size_t len) {
+    this->is_view = 1;
+    this->msg = NULL;
+    this->prefix = NULL;
+    this->command = NULL;
+    this->params_array = NULL;
+    this->params_len = 0;
+    this->params_size = 0;
+    this->arena = NULL;
+    this->command_id = CMD_UNKNOWN;
+
+    this->line.ptr = line;
+    this->line.len = len;
+    this->prefix_view.ptr = NULL;
+    this->prefix_view.len = 0;
+    this->params_parsed = 0;
+    this->params_trailing = 0;
+    this->param_views_len = 0;
+
+    //Drop the line terminator, tolerating a bare LF
+    if(len > 0 && line[len - 1] == '\n') len--;
+    if(len > 0 && line[len - 1] == '\r') len--;
+
+    const char *head = line;
+    const char *end = line + len;
+
+    if(head < end && *head == ':') {
+	head++;
+	const char *space = scan_byte(head, end - head, ' ');
+	if(space == NULL) {
+	    return -1;
+	}
+	this->prefix_view.ptr = head;
+	this->prefix_view.len = space - head;
+	head = space;
     }
-    fprintf(stderr, "----------------------------------------\n");
-    #endif /* DEBUG */
 
-    return this;
+    while(head < end && *head == ' ') head++;
+    if(head == end) {
+	return -1;
+    }
+
+    const char *space = scan_byte(head, end - head, ' ');
+    const char *tail = space == NULL ? end : space;
+    this->command_view.ptr = head;
+    this->command_view.len = tail - head;
+    this->command_id = lookup_command(head, tail - head);
+
+    this->params_tail.ptr = tail;
+    this->params_tail.len = end - tail;
+    return 0;
+}
+
+/*
+ * Splits params_tail into param_views, one param per pass.
+ */
+void split_params(irc_message *this) {
+    const char *head = this->params_tail.ptr;
+    const char *end = head + this->params_tail.len;
+
+    this->params_parsed = 1;
+    while(head < end) {
+	while(head < end && *head == ' ') head++;
+	if(head == end) {
+	    break;
+	}
+
+	irc_slice *param = &(this->param_views[this->param_views_len++]);
+
+	//Trailing param, or the last one we have room for, runs to the end
+	if(*head == ':' || this->param_views_len == IRC_MAX_PARAMS) {
+	    if(*head == ':') {
+		this->params_trailing = 1;
+		head++;
+	    }
+	    param->ptr = head;
+	    param->len = end - head;
+	    break;
+	}
+
+	const char *space = scan_byte(head, end - head, ' ');
+	const char *tail = space == NULL ? end : space;
+	param->ptr = head;
+	param->len = tail - head;
+	head = tail;
+    }
+}
+
+size_t message_param_count(irc_message *this) {
+    if(!this->is_view) {
+	return this->params_len;
+    }
+    if(!this->params_parsed) {
+	split_params(this);
+    }
+    return this->param_views_len;
+}
+
+irc_slice message_param(irc_message *this, size_t index) {
+    irc_slice none = { NULL, 0 };
+
+    if(!this->is_view) {
+	return none;
+    }
+    if(!this->params_parsed) {
+	split_params(this);
+    }
+    if(index >= this->param_views_len) {
+	return none;
+    }
+    return this->param_views[index];
+}
+
+int slice_equals(irc_slice slice, const char *str) {
+    size_t len = strlen(str);
+    return slice.len == len && memcmp(slice.ptr, str, len) == 0;
+}
+
+int message_command_is(irc_message *this, const char *command) {
+    return slice_equals(this->command_view, command);
 }
 
 void destroy_message(irc_message *this) {
+
+    //Views don't own anything, and an arena frees everything at once
+    if(this->is_view || this->arena != NULL) {
+	return;
+    }
     
     free(this->msg);
     free(this->prefix);
@@ -232,5 +370,7 @@ void destroy_message(irc_message *this) {
     for(int i = 0; i < this->params_len; i++) {
 	free((this->params_array)[i]);
     }
+    free(this->params_array);
+    free(this);
 }
 
@@ -6,16 +6,97 @@
 #ifndef _IRC_MESSAGE_H
 #define _IRC_MESSAGE_H
 
+#include <stddef.h>
+
+#include "irc_command.h"
+#include "arena.h"
+
+//RFC1459 allows at most 14 middle params plus one trailing
+#define IRC_MAX_PARAMS 15
+
+/*
+ * A (pointer, length) view into somebody else's buffer. Not NUL terminated.
+ */
+typedef struct irc_slice_struct {
+    const char *ptr;
+    size_t len;
+} irc_slice;
+
 typedef struct irc_message_struct {
     char *msg;
     char *prefix;
     char *command;
     char **params_array;
     size_t params_len;
+    size_t params_size;
+
+    //Where parse_message_in put everything, NULL if it was malloc'd
+    arena *arena;
+
+    //The command resolved by lookup_command, set by both parsers
+    int command_id;
+
+    /* View mode, filled in by parse_message_view. Every slice points into
+     * the line that was parsed, which must outlive the message. Params are
+     * only split out the first time somebody asks for one.
+     */
+    int is_view;
+    irc_slice line;
+    irc_slice prefix_view;
+    irc_slice command_view;
+    irc_slice params_tail;
+    int params_parsed;
+    //Set if the last param was a trailing one, i.e. started with ':'
+    int params_trailing;
+    size_t param_views_len;
+    irc_slice param_views[IRC_MAX_PARAMS];
 } irc_message;
 
 irc_message * parse_message(char *str);
 
+/*
+ * Like parse_message, but the message and all its fields are allocated in
+ * an arena, and go away when the arena is reset. destroy_message is then a
+ * no-op.
+ *
+ * Returns the message, or NULL on error.
+ */
+irc_message * parse_message_in(arena *arena, char *str);
+
+/*
+ * Parses a line into views without copying or allocating anything. The
+ * trailing CR LF is optional. The prefix view excludes the leading ':',
+ * and so does the view of a trailing param.
+ *
+ * Returns 0 on success, -1 if the line holds no command (e.g. it's empty).
+ */
+int parse_message_view(irc_message *this, const char *line, size_t len);
+
+/*
+ * Number of params, splitting them out of a view message if needed
+ */
+size_t message_param_count(irc_message *this);
+
+/*
+ * Returns the param at index, or an empty slice with a NULL ptr if there 
+ * isn't one. Only valid for view messages.
+ */
+irc_slice message_param(irc_message *this, size_t index);
+
+/*
+ * Returns 1 if a view message's command is exactly command, 0 otherwise.
+ */
+int message_command_is(irc_message *this, const char *command);
+
+/*
+ * Returns 1 if the slice holds exactly str, 0 otherwise.
+ */
+int slice_equals(irc_slice slice, const char *str);
+
+/*
+ * Frees everything parse_message allocated, the message included. A no-op
+ * for view messages and messages parsed into an arena.
+ */
 void destroy_message(irc_message *this);
 
 #endif /* _IRC_MESSAGE_H */
@@ -9,7 +9,6 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/un.h>
 #include <netinet/in.h>
@@ -17,130 +16,1447 @@
 #include <netdb.h>
 #include <errno.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdarg.h>
 
 #include "irc_multiplexer.h"
+#include "fanout_worker.h"
+#include "admin_socket.h"
 #include "utilities.h"
 
 /* Internal function declarations */
-void on_remote_read(char * msg_str, void *args);
-void on_client_read(char * msg_str, void *args);
+void on_remote_read(char * msg_str, size_t msg_len, void *args);
+void on_client_read(char * msg_str, size_t msg_len, void *args);
+void on_remote_close(buffered_socket *bufsock, void *args);
+void on_client_close(buffered_socket *bufsock, void *args);
+void on_listen_event(int fd, uint32_t events, void *args);
+int open_unix_listener(char *socket_path);
 void accept_client_socket(irc_multiplexer *this);
+void on_ring_notify(int fd, uint32_t events, void *args);
+void ring_overflow_push(irc_multiplexer *this, shared_buffer *line);
+void ring_stall(irc_multiplexer *this);
+int deliver_to_client(client_socket *client, shared_buffer *line);
+void write_to_client(client_socket *client, shared_buffer *line);
+void client_control(client_socket *client, irc_message *msg);
+void forward_client_line(client_socket *client, irc_message *msg, char *msg_str, size_t msg_len);
+void on_forward(void *args);
+void drop_forward(void *args);
+void client_resume(client_socket *client, unsigned long after);
+void client_state(client_socket *client);
+void deliver_live(client_socket *client, shared_buffer *line);
+int snapshot_covers(client_socket *client, shared_buffer *line);
+void client_history(client_socket *client, irc_slice kind, irc_slice from, irc_slice to);
+void pump_history(client_socket *client);
+void emit_history_line(log_record_header *header, const char *line, void *args);
+void on_history_read(void *args);
+void drop_history(void *args);
+void close_history(client_socket *client);
+void on_client_drain(buffered_socket *bufsock, void *args);
 void connection_manager(irc_multiplexer *this, irc_message *msg);
+void on_remote_ping(irc_multiplexer *this, irc_message *msg);
+void on_remote_welcome(irc_multiplexer *this, irc_message *msg);
+void on_keepalive(void *args);
+void on_client_idle(void *args);
+void on_client_attach(void *args);
+int client_go_live(client_socket *client);
+int is_keepalive_pong(irc_message *msg);
 void set_nick(irc_multiplexer *this);
 void register_user(irc_multiplexer *this);
-int prep_select(irc_multiplexer *this, fd_set *readfds);
-void check_select(irc_multiplexer *this, fd_set *readfds);
+void publish_line(irc_multiplexer *this, char *msg_str, size_t msg_len, irc_message *msg);
+void announce(irc_multiplexer *this, const char *format, ...)
+    __attribute__ ((format (printf, 2, 3)));
+void connect_remote(irc_multiplexer *this);
+void on_remote_connected(int fd, void *args);
+void on_remote_secured(tls_session *session, int ok, void *args);
+void register_remote(irc_multiplexer *this);
+void on_reconnect(void *args);
+void lose_remote(irc_multiplexer *this);
+void rejoin_channels(irc_multiplexer *this);
+void remember_channels(irc_multiplexer *this);
+void forget_channels(irc_multiplexer *this);
+uint64_t wall_clock_us(void);
+int client_printf(client_socket *client, const char *format, ...)
+    __attribute__ ((format (printf, 2, 3)));
+int client_write_lines(client_socket *client, const char *data, size_t len);
+void client_framing(client_socket *client, irc_slice framing);
 
 /* 
  * Callback method for the buffered socket that wraps the remote connection
  */
-void on_remote_read(char * msg_str, void *args) {
+void on_remote_read(char * msg_str, size_t msg_len, void *args) {
     //Unpack args
     irc_multiplexer *this = (irc_multiplexer *) args;
-    irc_message *irc_msg = parse_message(msg_str);
+
+    //Empty lines are silently ignored, per RFC1459
+    irc_message message;
+    irc_message *irc_msg = &message;
+    if(parse_message_view(irc_msg, msg_str, msg_len) != 0) {
+	if(msg_len > 2) {
+	    this->parse_errors++;
+	}
+	return;
+    }
 
     //Run internal checks on the message to see if we need to react
     connection_manager(this, irc_msg);
 
-    //Forward message to all clients
-    for(client_socket *current = this->clients;
-	    current != NULL;
-	    current = current->next ) {
-
-	fprintf(stdout, "Sending message to client fd %d\n", current->bufsock->fd);
-	current->bufsock->write_buffer = msg_str;
-	write_buffered_socket(current->bufsock);
+    //Answers to our keepalive PINGs are nobody else's business
+    if(is_keepalive_pong(irc_msg)) {
+	destroy_message(irc_msg);
+	return;
     }
 
+    publish_line(this, msg_str, msg_len, irc_msg);
     destroy_message(irc_msg);
 }
 
-void on_client_read(char * msg_str, void *args) {
+/*
+ * Hands a line to the clients as if the remote had sent it, e.g. to tell
+ * them the connection was lost
+ */
+void announce(irc_multiplexer *this, const char *format, ...) {
+    char line[BUFSOCK_MAX_LINE + 1];
+    int len = snprintf(line, sizeof(line), ":%s NOTICE * :", MULTIPLEXER_PREFIX);
+
+    va_list args;
+    va_start(args, format);
+    int text_len = vsnprintf(line + len, sizeof(line) - len - 2, format, args);
+    va_end(args);
+
+    if(text_len < 0) {
+	return;
+    }
+    len += (size_t) text_len < sizeof(line) - len - 2 ? (size_t) text_len : sizeof(line) - len - 3;
+    memcpy(line + len, "\r\n", 3);
+    len += 2;
+
+    irc_message message;
+    if(parse_message_view(&message, line, len) == 0) {
+	publish_line(this, line, len, &message);
+	destroy_message(&message);
+    }
+}
+
+/*
+ * Numbers a line, keeps it for clients that resume and hands it to every
+ * client that wants it. msg is the line parsed as a view.
+ */
+void publish_line(irc_multiplexer *this, char *msg_str, size_t msg_len, irc_message *irc_msg) {
+    /* Number the line and keep it for clients that resume. The sequence 
+     * number goes in a tag at the front, which only clients that asked
+     * for it are sent.
+     */
+    char header[32];
+    int header_len = snprintf(header, sizeof(header), "@mux/seq=%lu ", this->seq + 1);
+
+    shared_buffer *line = new_shared_buffer_with_header(header, header_len, msg_str, msg_len);
+    if(line != NULL) {
+	line->seq = ++this->seq;
+	line->time_us = wall_clock_us();
+	if(irc_msg->command_id == CMD_PRIVMSG) {
+	    line->tags |= LINE_PRIVMSG;
+	}
+
+	//Framed now, from the parse we already have, if anyone wants it that way
+	if(__atomic_load_n(&(this->binary_clients), __ATOMIC_RELAXED) > 0) {
+	    shared_buffer *framed = new_empty_shared_buffer(mux_frame_len(irc_msg));
+	    if(framed != NULL) {
+		framed->tags = line->tags;
+		framed->seq = line->seq;
+		framed->time_us = line->time_us;
+		framed->len = mux_frame_encode(framed->data, irc_msg, line->seq, line->time_us);
+		line->framed = framed;
+	    }
+	}
+	history_record(&(this->history), line, irc_msg, &(this->state.channels));
+
+	if(this->log != NULL) {
+	    message_log_append(this->log, line, line->time_us);
+	}
+
+	if(this->workers_len > 0) {
+	    //Lines that had to wait go first, so nothing overtakes them
+	    if(this->ring_overflow_len > 0 || ring_publish(&(this->ring), line) != 0) {
+		ring_overflow_push(this, line);
+	    }
+
+	    //Workers are woken once, after everything read this iteration
+	    event_loop_defer(this->loop, &(this->ring_notify));
+
+	    //Rather than wait for the workers, stop reading until they catch up
+	    if(this->ring_overflow_len > 0 || ring_is_full(&(this->ring))) {
+		ring_stall(this);
+	    }
+	}
+	else {
+	    fanout_line(&(this->clients), line, irc_msg);
+	}
+
+	shared_buffer_unref(line);
+    }
+}
+
+/*
+ * Keeps a line that found the ring full until there's room for it
+ */
+void ring_overflow_push(irc_multiplexer *this, shared_buffer *line) {
+    if(this->ring_overflow_len == this->ring_overflow_size) {
+	size_t size = this->ring_overflow_size == 0 ? 16 : this->ring_overflow_size * 2;
+	shared_buffer **overflow = realloc(this->ring_overflow, size * sizeof(shared_buffer *));
+	if(overflow == NULL) {
+	    fprintf(stderr, "Error: no room for line %lu while the ring is full, dropping.\n", line->seq);
+	    return;
+	}
+	this->ring_overflow = overflow;
+	this->ring_overflow_size = size;
+    }
+    this->ring_overflow[this->ring_overflow_len++] = shared_buffer_ref(line);
+}
+
+/*
+ * The ring is full: wake the workers now, stop reading the remote, and 
+ * ask the workers to post on_ring_space once one of them has moved on.
+ * The line that filled the ring was seen by connection_manager first, so
+ * a PING in it is answered regardless.
+ */
+void ring_stall(irc_multiplexer *this) {
+    on_ring_notify(-1, EVENT_LOOP_DEFERRED, this);
+    if(this->remote != NULL) {
+	bufsock_pause(this->remote);
+    }
+
+    //Room turned up in the meantime and nobody will say so, so we tell ourselves
+    if(ring_wait_for_space(&(this->ring)) == 0) {
+	mailbox_post(&(this->mailbox), &on_ring_space, NULL, this);
+    }
+}
+
+void on_ring_space(void *args) {
+    irc_multiplexer *this = (irc_multiplexer *) args;
+
+    size_t published = 0;
+    while(published < this->ring_overflow_len
+	    && ring_publish(&(this->ring), this->ring_overflow[published]) == 0) {
+	shared_buffer_unref(this->ring_overflow[published]);
+	published++;
+    }
+    if(published > 0) {
+	this->ring_overflow_len -= published;
+	memmove(this->ring_overflow, this->ring_overflow + published, 
+		this->ring_overflow_len * sizeof(shared_buffer *));
+	event_loop_defer(this->loop, &(this->ring_notify));
+    }
+
+    if(this->ring_overflow_len > 0 || ring_is_full(&(this->ring))) {
+	ring_stall(this);
+    }
+    else if(this->remote != NULL) {
+	bufsock_resume(this->remote);
+    }
+}
+
+/*
+ * Wakes the fan-out workers after lines were published to the ring
+ */
+void on_ring_notify(int fd, uint32_t events, void *args) {
+    irc_multiplexer *this = (irc_multiplexer *) args;
+
+    for(size_t i = 0; i < this->workers_len; i++) {
+	fanout_worker_notify(&(this->workers[i]));
+    }
+}
+
+void fanout_line(client_list *list, shared_buffer *line, irc_message *msg) {
+    uint64_t started = event_loop_now_ns();
+
+    //Only clients with filters care what's in the line
+    irc_message message;
+    if(msg == NULL && list->subscriptions.unfiltered.len < list->len
+	    && parse_message_view(&message, line->data + line->header_len, line->len - line->header_len) == 0) {
+	msg = &message;
+    }
+
+    /* The matches are a copy, so delivery is free to hang up on a client
+     * without upsetting the walk.
+     */
+    subscriber_set *matches = subscription_route(&(list->subscriptions), msg);
+    for(size_t i = 0; i < matches->len; i++) {
+	client_socket *current = (client_socket *) matches->items[i]->owner;
+	deliver_live(current, line);
+    }
+    histogram_record(&(list->fanout_time), event_loop_now_ns() - started);
+}
+
+/*
+ * Queues a line from the remote for a client, unless the client is still
+ * being sent what it missed or its state, in which case the line waits 
+ * its turn.
+ */
+void deliver_live(client_socket *client, shared_buffer *line) {
+    if(snapshot_covers(client, line)) {
+	return;
+    }
+
+    if(client->resuming || client->awaiting_state || client->attaching) {
+	if(client->held_len == client->held_size) {
+	    size_t size = client->held_size == 0 ? 64 : client->held_size * 2;
+	    shared_buffer **held = realloc(client->held, size * sizeof(shared_buffer *));
+	    if(held == NULL) {
+		return;
+	    }
+	    client->held = held;
+	    client->held_size = size;
+	}
+	client->held[client->held_len++] = shared_buffer_ref(line);
+	return;
+    }
+
+    if(client->first_live_seq == 0) {
+	client->first_live_seq = line->seq;
+    }
+    deliver_to_client(client, line);
+}
+
+/*
+ * Returns 1 if the state snapshot a client was sent already reflects a 
+ * line, 0 otherwise. The snapshot is taken on the multiplexer's thread, 
+ * which may be ahead of a fan-out worker, so lines up to state_seq can 
+ * still turn up afterwards; only those that change the state are in it.
+ */
+int snapshot_covers(client_socket *client, shared_buffer *line) {
+    if(line->seq > client->state_seq) {
+	return 0;
+    }
+
+    irc_message msg;
+    return parse_message_view(&msg, line->data + line->header_len, line->len - line->header_len) == 0
+	&& irc_state_command(msg.command_id);
+}
+
+/*
+ * Queues a line for a client, enforcing the client backlog limits.
+ *
+ * Returns 0 if the line was queued, 1 if it was dropped, and -1 if the 
+ * client was disconnected.
+ */
+int deliver_to_client(client_socket *client, shared_buffer *line) {
+    backlog_limits *limits = &(client->owner->client_backlog);
+    backlog_stats *stats = &(client->list->backlog_stats);
+    buffered_socket *bufsock = client->bufsock;
+
+    //Room we need to leave for this line, and the summary if one is owed
+    size_t need_bytes = line->len;
+    size_t need_count = client->dropped_pending > 0 ? 2 : 1;
+    if(client->dropped_pending > 0) {
+	need_bytes += BUFSOCK_MAX_LINE;
+    }
+
+    //What's left of a replay at the front of the queue is neither counted nor dropped
+    size_t replay_count = client->replay_lines_end > bufsock->stats.lines_out
+	? client->replay_lines_end - bufsock->stats.lines_out : 0;
+    size_t replay_bytes = client->replay_bytes_end > bufsock->stats.bytes_out
+	? client->replay_bytes_end - bufsock->stats.bytes_out : 0;
+
+    int over = bufsock->write_queued_bytes + need_bytes > limits->max_bytes + replay_bytes
+	|| bufsock->write_queued_count + need_count > limits->max_messages + replay_count;
+
+    if(over) {
+	size_t max_bytes = (limits->max_bytes > need_bytes ? limits->max_bytes - need_bytes : 0) + replay_bytes;
+	size_t max_count = (limits->max_messages > need_count ? limits->max_messages - need_count : 0) + replay_count;
+	size_t dropped;
+
+	switch(limits->policy) {
+	    case BACKLOG_DISCONNECT:
+		stats->fired[BACKLOG_DISCONNECT]++;
+		fprintf(stderr, "NOTICE: Client with fd %d fell too far behind, disconnecting.\n", bufsock->fd);
+		remove_client_socket(client);
+		return -1;
+
+	    case BACKLOG_DROP_NON_PRIVMSG:
+		dropped = bufsock_drop_queued(bufsock, replay_count, LINE_PRIVMSG, max_bytes, max_count);
+		if(dropped > 0) {
+		    stats->fired[BACKLOG_DROP_NON_PRIVMSG]++;
+		    stats->dropped_messages += dropped;
+		    client->dropped += dropped;
+		}
+		//Nothing but PRIVMSGs left, fall back to the oldest of those
+		if(bufsock->write_queued_bytes > max_bytes || bufsock->write_queued_count > max_count) {
+		    dropped = bufsock_drop_queued(bufsock, replay_count, 0, max_bytes, max_count);
+		    if(dropped > 0) {
+			stats->fired[BACKLOG_DROP_OLDEST]++;
+			stats->dropped_messages += dropped;
+			client->dropped += dropped;
+		    }
+		}
+		break;
+
+	    case BACKLOG_DROP_OLDEST:
+		dropped = bufsock_drop_queued(bufsock, replay_count, 0, max_bytes, max_count);
+		stats->fired[BACKLOG_DROP_OLDEST]++;
+		stats->dropped_messages += dropped;
+		client->dropped += dropped;
+		break;
+
+	    case BACKLOG_SUMMARIZE:
+	    default:
+		if(client->dropped_pending == 0) {
+		    stats->fired[BACKLOG_SUMMARIZE]++;
+		}
+		client->dropped_pending++;
+		client->dropped++;
+		stats->dropped_messages++;
+		return 1;
+	}
+    }
+
+    //The client caught up, tell it what it missed before carrying on
+    if(client->dropped_pending > 0) {
+	client_printf(client, ":%s NOTICE * :%lu messages dropped\r\n",
+		MULTIPLEXER_PREFIX, client->dropped_pending);
+	client->dropped_pending = 0;
+    }
 
-    fprintf(stdout, "Received message \"%s\" from client\n", msg_str);
+    write_to_client(client, line);
+    return 0;
+}
+
+/*
+ * Queues a line from the remote for a client in the client's framing, 
+ * with no regard for the backlog limits
+ */
+void write_to_client(client_socket *client, shared_buffer *line) {
+    buffered_socket *bufsock = client->bufsock;
+
+    if(!client->binary) {
+	bufsock_write_shared_from(bufsock, line, client->want_seq ? 0 : line->header_len);
+    }
+    else if(line->framed != NULL) {
+	bufsock_write_shared(bufsock, line->framed);
+    }
+    else {
+	//Came in before anyone wanted frames
+	shared_buffer *framed = mux_frame_line(line);
+	if(framed != NULL) {
+	    bufsock_write_shared(bufsock, framed);
+	    shared_buffer_unref(framed);
+	}
+    }
+}
+
+/*
+ * Formats a line of at most BUFSOCK_MAX_LINE bytes of our own for a client,
+ * like bufsock_printf, and sends it in the client's framing
+ */
+int client_printf(client_socket *client, const char *format, ...) {
+    char buf[BUFSOCK_MAX_LINE + 1];
+
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+
+    if(len < 0) {
+	return -1;
+    }
+    else if(len > BUFSOCK_MAX_LINE) {
+	len = BUFSOCK_MAX_LINE;
+	memcpy(buf + len - 2, "\r\n", 2);
+    }
+    return client_write_lines(client, buf, len);
+}
+
+/*
+ * Sends a client CR LF terminated lines that aren't from the remote, in
+ * the client's framing
+ */
+int client_write_lines(client_socket *client, const char *data, size_t len) {
+    if(!client->binary) {
+	return bufsock_write(client->bufsock, data, len);
+    }
+
+    shared_buffer *frames = mux_frame_lines(data, len, 0, wall_clock_us());
+    if(frames == NULL) {
+	return -1;
+    }
+    int error = bufsock_write_shared(client->bufsock, frames);
+    shared_buffer_unref(frames);
+    return error;
+}
+
+/*
+ * Switches a client between text lines and binary frames. The NOTICE 
+ * saying so is the last thing sent the old way.
+ */
+void client_framing(client_socket *client, irc_slice framing) {
+    int binary = slice_equals(framing, "BINARY");
+    if(!binary && !slice_equals(framing, "TEXT")) {
+	client_printf(client, ":%s NOTICE * :Usage: MUX FRAMING <TEXT|BINARY>\r\n", MULTIPLEXER_PREFIX);
+	return;
+    }
+
+    client_printf(client, ":%s NOTICE * :Framing %s\r\n", MULTIPLEXER_PREFIX, binary ? "BINARY" : "TEXT");
+    if(binary != client->binary) {
+	__atomic_add_fetch(&(client->owner->binary_clients), binary ? 1 : -1, __ATOMIC_RELAXED);
+	client->binary = binary;
+    }
+}
+
+/*
+ * The time of day, in us since the epoch
+ */
+uint64_t wall_clock_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void on_client_read(char * msg_str, size_t msg_len, void *args) {
+    client_socket *client = (client_socket *) args;
+
+    irc_message message;
+    if(parse_message_view(&message, msg_str, msg_len) != 0) {
+	if(msg_len > 2) {
+	    client->parse_errors++;
+	}
+	return;
+    }
+
+    //Anything but a MUX RESUME means the client isn't after a replay
+    if(client->attaching && (message.command_id != CMD_MUX
+		|| !slice_equals(message_param(&message, 0), "RESUME"))
+	    && client_go_live(client) != 0) {
+	return;
+    }
+
+    //Lines for the multiplexer itself
+    if(message.command_id == CMD_MUX) {
+	client_control(client, &message);
+	return;
+    }
+    if(is_keepalive_pong(&message)) {
+	return;
+    }
+
+    #ifdef DEBUG
+    fprintf(stdout, "Received message \"%s\" from client fd %d\n", msg_str, client->bufsock->fd);
+    #endif /* DEBUG */
+    forward_client_line(client, &message, msg_str, msg_len);
+}
+
+typedef struct forward_args_struct {
+    irc_multiplexer *owner;
+    unsigned long sender;
+    shared_buffer *line;
+} forward_args;
+
+/*
+ * Passes a client's line on to the outbound scheduler, by way of the 
+ * multiplexer's mailbox when the client lives on a fan-out worker.
+ */
+void forward_client_line(client_socket *client, irc_message *msg, char *msg_str, size_t msg_len) {
+    irc_multiplexer *owner = client->owner;
+
+    //The connection and its registration are shared, so they're ours alone
+    if(msg->command_id == CMD_QUIT || msg->command_id == CMD_USER || msg->command_id == CMD_PASS) {
+	client_printf(client, ":%s NOTICE * :%.*s is not forwarded\r\n",
+		MULTIPLEXER_PREFIX, (int) msg->command_view.len, msg->command_view.ptr);
+	return;
+    }
+    if(msg_len > BUFSOCK_MAX_LINE) {
+	client_printf(client, ":%s NOTICE * :Line too long, not forwarded\r\n", MULTIPLEXER_PREFIX);
+	return;
+    }
+
+    shared_buffer *line = new_shared_buffer(msg_str, msg_len);
+    if(line == NULL) {
+	return;
+    }
+
+    if(client->list != &(owner->clients)) {
+	forward_args *forward = malloc(sizeof(forward_args));
+	if(forward == NULL) {
+	    shared_buffer_unref(line);
+	    return;
+	}
+	forward->owner = owner;
+	forward->sender = client->sender;
+	forward->line = line;
+	if(mailbox_post(&(owner->mailbox), &on_forward, &drop_forward, forward) != 0) {
+	    drop_forward(forward);
+	}
+	return;
+    }
+
+    if(outbound_send(&(owner->outbound), client->sender, line) != 0) {
+	client_printf(client, ":%s NOTICE * :Too many lines queued, not forwarded\r\n", MULTIPLEXER_PREFIX);
+    }
+    shared_buffer_unref(line);
+}
+
+void drop_forward(void *args) {
+    forward_args *forward = (forward_args *) args;
+    shared_buffer_unref(forward->line);
+    free(forward);
+}
+
+/*
+ * Mailbox work: queue a line forwarded by a fan-out worker's client
+ */
+void on_forward(void *args) {
+    forward_args *forward = (forward_args *) args;
+
+    if(forward->owner->running
+	    && outbound_send(&(forward->owner->outbound), forward->sender, forward->line) != 0) {
+	fprintf(stderr, "NOTICE: Too many lines queued by client %lu, dropping.\n", forward->sender);
+    }
+    shared_buffer_unref(forward->line);
+    free(forward);
+}
+
+/*
+ * Starts streaming a range of the message log to a client. Log lines are
+ * tagged with their sequence number and receive time, and are mixed in 
+ * with live traffic; a NOTICE follows the last one.
+ */
+void client_history(client_socket *client, irc_slice kind, irc_slice from, irc_slice to) {
+    message_log *log = client->owner->log;
+    int by_time = slice_equals(kind, "TIME");
+
+    if(log == NULL) {
+	client_printf(client, ":%s NOTICE * :There is no message log\r\n", MULTIPLEXER_PREFIX);
+	return;
+    }
+    if((!by_time && !slice_equals(kind, "SEQ")) || from.len == 0) {
+	client_printf(client, ":%s NOTICE * :Usage: MUX HISTORY <SEQ|TIME> <from> [<to>]\r\n",
+		MULTIPLEXER_PREFIX);
+	return;
+    }
+    if(client->history != NULL) {
+	client_printf(client, ":%s NOTICE * :Already sending history\r\n", MULTIPLEXER_PREFIX);
+	return;
+    }
+
+    //The index keeps times in microseconds
+    uint64_t scale = by_time ? 1000 : 1;
+    uint64_t first = strtoull(from.ptr, NULL, 10) * scale;
+    uint64_t last = to.len > 0 ? strtoull(to.ptr, NULL, 10) * scale + (scale - 1) : UINT64_MAX;
+
+    history_stream *stream = calloc(1, sizeof(history_stream));
+    client->history = stream;
+    if(stream == NULL || log_reader_open(&(stream->job.reader), log, by_time, first, last) != 0) {
+	close_history(client);
+	client_printf(client, ":%s NOTICE * :Could not read the message log\r\n", MULTIPLEXER_PREFIX);
+	return;
+    }
+    stream->list = client->list;
+    stream->fd = client->bufsock->fd;
+    stream->job.emit = &emit_history_line;
+    stream->job.mailbox = client->list->mailbox != NULL ? client->list->mailbox : &(client->owner->mailbox);
+    stream->job.done = &on_history_read;
+    stream->job.drop = &drop_history;
+    stream->job.args = stream;
+
+    client->bufsock->drain_callback = &on_client_drain;
+    pump_history(client);
+}
+
+/*
+ * Formats a record from the log into the client's history output
+ */
+void emit_history_line(log_record_header *header, const char *line, void *args) {
+    history_stream *stream = (history_stream *) args;
+
+    //Room for the tags or the frame header as well as the line
+    size_t need = stream->out_len + header->len + MUX_FRAME_MAX_HEADER_LEN;
+    if(need > stream->out_size) {
+	size_t size = stream->out_size == 0 ? LOG_READ_CHUNK * 2 : stream->out_size;
+	while(size < need) {
+	    size *= 2;
+	}
+	char *out = realloc(stream->out, size);
+	if(out == NULL) {
+	    return;
+	}
+	stream->out = out;
+	stream->out_size = size;
+    }
+
+    if(stream->binary) {
+	irc_message msg;
+	if(parse_message_view(&msg, line, header->len) == 0) {
+	    stream->out_len += mux_frame_encode(stream->out + stream->out_len, &msg, header->seq, header->timestamp_us);
+	}
+	return;
+    }
+
+    time_t seconds = header->timestamp_us / 1000000;
+    struct tm when;
+    gmtime_r(&seconds, &when);
+
+    char *cursor = stream->out + stream->out_len;
+    cursor += sprintf(cursor, "@mux/seq=%llu;time=", (unsigned long long) header->seq);
+    cursor += strftime(cursor, 32, "%Y-%m-%dT%H:%M:%S", &when);
+    cursor += sprintf(cursor, ".%03uZ ", (unsigned int) (header->timestamp_us / 1000 % 1000));
+    memcpy(cursor, line, header->len);
+    stream->out_len = cursor + header->len - stream->out;
+}
+
+/*
+ * Asks the log's reader thread for another chunk, unless one is already
+ * on its way or the client's queue is comfortably full; the rest follows
+ * as the client drains it.
+ */
+void pump_history(client_socket *client) {
+    history_stream *stream = client->history;
+
+    if(stream == NULL || stream->reading || client->bufsock->write_queued_bytes >= MULTIPLEXER_HISTORY_LOW_WATER) {
+	return;
+    }
+    //Frames are made up as the lines are read, see emit_history_line
+    stream->binary = client->binary;
+    stream->reading = 1;
+    message_log_read(client->owner->log, &(stream->job));
+}
+
+/*
+ * Client thread: a chunk of the log has been read
+ */
+void on_history_read(void *args) {
+    history_stream *stream = (history_stream *) args;
+    stream->reading = 0;
+
+    //The client may have stopped the stream, or gone, in the meantime
+    client_socket *client = find_client_socket(stream->list, stream->fd);
+    if(client == NULL || client->history != stream) {
+	drop_history(stream);
+	return;
+    }
+
+    if(stream->out_len > 0) {
+	bufsock_write(client->bufsock, stream->out, stream->out_len);
+	stream->out_len = 0;
+    }
+
+    if(stream->job.result < 0 || stream->job.reader.done) {
+	client_printf(client, ":%s NOTICE * :%s\r\n", MULTIPLEXER_PREFIX,
+		stream->job.result < 0 ? "Error reading the message log" : "End of history");
+	close_history(client);
+	return;
+    }
+    pump_history(client);
+}
+
+void drop_history(void *args) {
+    history_stream *stream = (history_stream *) args;
+
+    if(stream->job.reader.chunk != NULL) {
+	log_reader_close(&(stream->job.reader));
+    }
+    free(stream->out);
+    free(stream);
+}
+
+void close_history(client_socket *client) {
+    if(client->history == NULL) {
+	return;
+    }
+    //A chunk being read is freed when it comes back, see on_history_read
+    if(!client->history->reading) {
+	drop_history(client->history);
+    }
+    client->history = NULL;
+    client->bufsock->drain_callback = NULL;
+}
+
+void on_client_drain(buffered_socket *bufsock, void *args) {
+    pump_history((client_socket *) args);
+}
+
+typedef struct resume_args_struct {
+    irc_multiplexer *owner;
+    client_list *list;
+    //The client asking, as long as the fd still belongs to the same sender
+    int fd;
+    unsigned long sender;
+    subscription_filter *filters;
+
+    //Replay lines in (after, upto]
+    unsigned long after;
+    unsigned long upto;
+
+    //Filled in from the history
+    shared_buffer **lines;
+    size_t lines_len;
+    unsigned long missing_upto;
+} resume_args;
+
+void on_resume_collect(void *args);
+void on_resume_finish(void *args);
+
+/*
+ * Frees a resume that never got to the client, e.g. at shutdown
+ */
+void drop_resume(void *args) {
+    resume_args *resume = (resume_args *) args;
+
+    for(size_t i = 0; i < resume->lines_len; i++) {
+	shared_buffer_unref(resume->lines[i]);
+    }
+    free(resume->lines);
+    free_filters(resume->filters);
+    free(resume);
+}
+
+/*
+ * Starts replaying the lines after a sequence number to a client. The 
+ * history lives on the multiplexer's thread, so a client on a fan-out 
+ * worker asks for it through the mailboxes and holds back live lines until
+ * the answer comes; either way the client gets every line once and in 
+ * order, as long as it resumes before it's sent any live ones.
+ */
+void client_resume(client_socket *client, unsigned long after) {
+    if(client->resuming || client->awaiting_state) {
+	client_printf(client, ":%s NOTICE * :Already %s\r\n", MULTIPLEXER_PREFIX,
+		client->resuming ? "resuming" : "sending state");
+	return;
+    }
+
+    //The lines held since attaching are now held for the replay
+    client->attaching = 0;
+    event_loop_cancel_timer(client->list->loop, &(client->attach));
+
+    resume_args *resume = calloc(1, sizeof(resume_args));
+    if(resume == NULL) {
+	client_go_live(client);
+	return;
+    }
+    resume->owner = client->owner;
+    resume->list = client->list;
+    resume->fd = client->bufsock->fd;
+    resume->sender = client->sender;
+    resume->filters = copy_filters(client->subscriber.filters);
+    resume->after = after;
+    //Whatever was already sent live isn't sent again
+    resume->upto = client->first_live_seq > 0 ? client->first_live_seq - 1 : (unsigned long) -1;
+    client->resuming = 1;
+
+    if(client->list->mailbox == NULL) {
+	on_resume_collect(resume);
+    }
+    else if(mailbox_post(&(client->owner->mailbox), &on_resume_collect, &drop_resume, resume) != 0) {
+	client->resuming = 0;
+	drop_resume(resume);
+	client_go_live(client);
+    }
+}
+
+/*
+ * Multiplexer thread: look the missed lines up in the history
+ */
+void on_resume_collect(void *args) {
+    resume_args *resume = (resume_args *) args;
+    irc_multiplexer *owner = resume->owner;
+
+    if(resume->upto > owner->seq) {
+	resume->upto = owner->seq;
+    }
+
+    size_t len = 0;
+    if(resume->after < resume->upto) {
+	len = history_collect(&(owner->history), resume->filters, resume->after, resume->upto,
+		&(resume->lines), &(resume->missing_upto));
+	if(len == (size_t) -1) {
+	    len = 0;
+	    resume->missing_upto = resume->upto;
+	}
+    }
+    resume->lines_len = len;
+
+    if(resume->list->mailbox == NULL || mailbox_post(resume->list->mailbox, &on_resume_finish, &drop_resume, resume) != 0) {
+	on_resume_finish(resume);
+    }
+}
+
+/*
+ * Client thread: send the missed lines, then the live ones held back
+ */
+void on_resume_finish(void *args) {
+    resume_args *resume = (resume_args *) args;
+
+    //The fd may have gone to someone else by now
+    client_socket *client = find_client_socket(resume->list, resume->fd);
+    if(client != NULL && client->sender != resume->sender) {
+	client = NULL;
+    }
+
+    size_t sent = 0;
+    if(client != NULL) {
+	if(resume->missing_upto > 0) {
+	    client_printf(client, ":%s NOTICE * :Lines %lu to %lu are no longer available\r\n",
+		    MULTIPLEXER_PREFIX, resume->after + 1, resume->missing_upto);
+	}
+
+	/* The replay goes out whole, or it'd have holes in it that nobody's
+	 * told about. It's no bigger than the history, and the backlog 
+	 * limits only start counting after it.
+	 */
+	for(; sent < resume->lines_len; sent++) {
+	    write_to_client(client, resume->lines[sent]);
+	    shared_buffer_unref(resume->lines[sent]);
+	}
+	client_printf(client, ":%s NOTICE * :Resumed from %lu to %lu\r\n",
+		MULTIPLEXER_PREFIX, resume->after, resume->upto);
+
+	buffered_socket *bufsock = client->bufsock;
+	client->replay_lines_end = bufsock->stats.lines_out + bufsock->write_queued_count;
+	client->replay_bytes_end = bufsock->stats.bytes_out + bufsock->write_queued_bytes;
+
+	client->resuming = 0;
+	if(client->first_live_seq == 0) {
+	    client->first_live_seq = resume->upto + 1;
+	}
+
+	//Lines that came in while we waited, less those just replayed
+	size_t held_len = client->held_len;
+	shared_buffer **held = client->held;
+	client->held = NULL;
+	client->held_len = client->held_size = 0;
+
+	int connected = 1;
+	for(size_t i = 0; i < held_len; i++) {
+	    if(connected && held[i]->seq > resume->upto) {
+		connected = deliver_to_client(client, held[i]) >= 0;
+	    }
+	    shared_buffer_unref(held[i]);
+	}
+	free(held);
+    }
+
+    for(; sent < resume->lines_len; sent++) {
+	shared_buffer_unref(resume->lines[sent]);
+    }
+    free(resume->lines);
+    free_filters(resume->filters);
+    free(resume);
+}
+
+typedef struct state_args_struct {
+    irc_multiplexer *owner;
+    client_list *list;
+    //The client asking, as long as the fd still belongs to the same sender
+    int fd;
+    unsigned long sender;
+
+    //Filled in on the multiplexer's thread
+    shared_buffer *snapshot;
+    unsigned long seq;
+} state_args;
+
+void on_state_collect(void *args);
+void on_state_finish(void *args);
+
+void drop_state(void *args) {
+    state_args *state = (state_args *) args;
+
+    if(state->snapshot != NULL) {
+	shared_buffer_unref(state->snapshot);
+    }
+    free(state);
+}
+
+/*
+ * Returns a reference to a snapshot of our state, formatting one only if
+ * a line came in since the last, or NULL if we haven't registered yet
+ */
+shared_buffer * state_snapshot(irc_multiplexer *this) {
+    if(this->snapshot == NULL || this->snapshot_seq != this->seq) {
+	if(this->snapshot != NULL) {
+	    shared_buffer_unref(this->snapshot);
+	}
+	this->snapshot = irc_state_snapshot(&(this->state), MULTIPLEXER_PREFIX);
+	this->snapshot_seq = this->seq;
+    }
+    return this->snapshot == NULL ? NULL : shared_buffer_ref(this->snapshot);
+}
+
+void client_send_state(client_socket *client, shared_buffer *snapshot, unsigned long seq) {
+    if(client->binary) {
+	client_write_lines(client, snapshot->data, snapshot->len);
+    }
+    else {
+	bufsock_write_shared(client->bufsock, snapshot);
+    }
+    if(seq > client->state_seq) {
+	client->state_seq = seq;
+    }
+}
+
+/*
+ * Sends a client our nick and channels. The state lives on the 
+ * multiplexer's thread, so a client on a fan-out worker asks for it 
+ * through the mailboxes and holds back live lines until the answer comes,
+ * the same as for MUX RESUME.
+ */
+void client_state(client_socket *client) {
+    irc_multiplexer *owner = client->owner;
+
+    if(client->resuming || client->awaiting_state) {
+	client_printf(client, ":%s NOTICE * :Already %s\r\n", MULTIPLEXER_PREFIX,
+		client->resuming ? "resuming" : "sending state");
+	return;
+    }
+
+    if(client->list->mailbox == NULL) {
+	shared_buffer *snapshot = state_snapshot(owner);
+	if(snapshot == NULL) {
+	    client_printf(client, ":%s NOTICE * :Not registered yet\r\n", MULTIPLEXER_PREFIX);
+	    return;
+	}
+	client_send_state(client, snapshot, owner->seq);
+	shared_buffer_unref(snapshot);
+	return;
+    }
+
+    state_args *state = calloc(1, sizeof(state_args));
+    if(state == NULL) {
+	return;
+    }
+    state->owner = owner;
+    state->list = client->list;
+    state->fd = client->bufsock->fd;
+    state->sender = client->sender;
+    client->awaiting_state = 1;
+
+    if(mailbox_post(&(owner->mailbox), &on_state_collect, &drop_state, state) != 0) {
+	client->awaiting_state = 0;
+	drop_state(state);
+    }
+}
+
+/*
+ * Multiplexer thread: take the snapshot
+ */
+void on_state_collect(void *args) {
+    state_args *state = (state_args *) args;
+
+    state->snapshot = state_snapshot(state->owner);
+    state->seq = state->owner->seq;
+
+    if(mailbox_post(state->list->mailbox, &on_state_finish, &drop_state, state) != 0) {
+	on_state_finish(state);
+    }
+}
+
+/*
+ * Client thread: send the lines held back that the snapshot reflects, the
+ * snapshot, then the rest
+ */
+void on_state_finish(void *args) {
+    state_args *state = (state_args *) args;
+
+    //The fd may have gone to someone else by now
+    client_socket *client = find_client_socket(state->list, state->fd);
+    if(client != NULL && client->sender != state->sender) {
+	client = NULL;
+    }
+
+    if(client != NULL) {
+	client->awaiting_state = 0;
+
+	size_t held_len = client->held_len;
+	shared_buffer **held = client->held;
+	client->held = NULL;
+	client->held_len = client->held_size = 0;
+
+	int connected = 1;
+	size_t i = 0;
+	for(; i < held_len && held[i]->seq <= state->seq; i++) {
+	    if(connected) {
+		connected = deliver_to_client(client, held[i]) >= 0;
+	    }
+	    shared_buffer_unref(held[i]);
+	}
+
+	if(connected && state->snapshot != NULL) {
+	    client_send_state(client, state->snapshot, state->seq);
+	}
+	else if(connected) {
+	    client_printf(client, ":%s NOTICE * :Not registered yet\r\n", MULTIPLEXER_PREFIX);
+	}
+
+	for(; i < held_len; i++) {
+	    if(connected) {
+		connected = deliver_to_client(client, held[i]) >= 0;
+	    }
+	    shared_buffer_unref(held[i]);
+	}
+	free(held);
+    }
+    drop_state(state);
+}
+
+/*
+ * Handles a control line from a client:
+ *
+ *   MUX SUBSCRIBE <COMMAND|NUMERIC|CHANNEL|PREFIX> <value>
+ *   MUX UNSUBSCRIBE <COMMAND|NUMERIC|CHANNEL|PREFIX> <value>
+ *   MUX UNSUBSCRIBE ALL
+ *   MUX SEQ <ON|OFF>
+ *   MUX RESUME <seq>
+ *   MUX HISTORY SEQ <from> [<to>]
+ *   MUX HISTORY TIME <from> [<to>]      (milliseconds since the epoch)
+ *   MUX STATE
+ *   MUX FRAMING <TEXT|BINARY>
+ *
+ * Mistakes are reported back to the client in a NOTICE.
+ */
+void client_control(client_socket *client, irc_message *msg) {
+    subscription_index *index = &(client->list->subscriptions);
+    irc_slice verb = message_param(msg, 0);
+    irc_slice kind = message_param(msg, 1);
+    irc_slice value = message_param(msg, 2);
+
+    if(slice_equals(verb, "SEQ")) {
+	client->want_seq = slice_equals(kind, "ON");
+	return;
+    }
+    if(slice_equals(verb, "RESUME") && kind.len > 0) {
+	client_resume(client, strtoul(kind.ptr, NULL, 10));
+	return;
+    }
+    if(slice_equals(verb, "HISTORY")) {
+	client_history(client, kind, value, message_param(msg, 3));
+	return;
+    }
+    if(slice_equals(verb, "STATE")) {
+	client_state(client);
+	return;
+    }
+    if(slice_equals(verb, "FRAMING")) {
+	client_framing(client, kind);
+	return;
+    }
+    if(slice_equals(verb, "LIVE")) {
+	//Only there to end the attach hold, which on_client_read already did
+	return;
+    }
+
+    int subscribing = slice_equals(verb, "SUBSCRIBE");
+    if(!subscribing && !slice_equals(verb, "UNSUBSCRIBE")) {
+	client_printf(client, ":%s NOTICE * :Unknown command %.*s\r\n",
+		MULTIPLEXER_PREFIX, (int) verb.len, verb.ptr);
+	return;
+    }
+
+    if(!subscribing && slice_equals(kind, "ALL")) {
+	unsubscribe_all(index, &(client->subscriber));
+	return;
+    }
+
+    filter_type type = parse_filter_type(kind, value);
+    if(type == FILTER_TYPE_COUNT) {
+	client_printf(client, ":%s NOTICE * :Bad filter %.*s %.*s\r\n",
+		MULTIPLEXER_PREFIX, (int) kind.len, kind.ptr, (int) value.len, value.ptr);
+	return;
+    }
+
+    if(subscribing) {
+	if(subscribe(index, &(client->subscriber), type, value.ptr, value.len) < 0) {
+	    client_printf(client, ":%s NOTICE * :Could not subscribe\r\n", MULTIPLEXER_PREFIX);
+	}
+    }
+    else {
+	unsubscribe(index, &(client->subscriber), type, value.ptr, value.len);
+    }
+}
+
+/*
+ * The remote hung up on us, or the connection broke
+ */
+void on_remote_close(buffered_socket *bufsock, void *args) {
+    irc_multiplexer *this = (irc_multiplexer *) args;
+
+    fprintf(stderr, "Error: lost connection to %s:%d\n", this->server, this->port);
+    lose_remote(this);
+}
+
+void on_client_close(buffered_socket *bufsock, void *args) {
+    client_socket *client = (client_socket *) args;
+
+    fprintf(stderr, "NOTICE: Client with fd %d disconnected.\n", bufsock->fd);
+    remove_client_socket(client);
+}
+
+/*
+ * The listen socket became readable, so one or more clients are waiting
+ */
+void on_listen_event(int fd, uint32_t events, void *args) {
+    irc_multiplexer *this = (irc_multiplexer *) args;
+    accept_client_socket(this);
+}
+
+
+/*
+ * Constructor for an irc_multiplexer
+ * Null out values that should be null, so we don't get madness and anarchy
+ * when uninitialized strings are used.
+ */
+void init_multiplexer(irc_multiplexer *this) {
+    this->next_sender = 0;
+    this->binary_clients = 0;
+    this->seq = 0;
+    this->log_directory = NULL;
+    this->log = NULL;
+    set_history_size(this, MULTIPLEXER_HISTORY_SIZE, MULTIPLEXER_CHANNEL_HISTORY_SIZE);
+    init_client_list(&(this->clients), NULL);
+    this->workers = NULL;
+    this->workers_len = 0;
+    this->next_worker = 0;
+    this->ring_overflow = NULL;
+    this->ring_overflow_len = 0;
+    this->ring_overflow_size = 0;
+    this->registered = 0;
+    this->tls = 0;
+    this->tls_ca_file = NULL;
+    this->tls_context.ctx = NULL;
+    memset(&(this->remote_stats), 0, sizeof(bufsock_stats));
+    this->reconnect_delay_ms = MULTIPLEXER_RECONNECT_MIN;
+    this->reconnect_seed = (unsigned int) event_loop_now_ns() ^ (unsigned int) (uintptr_t) this;
+    init_timer(&(this->reconnect), &on_reconnect, this);
+    this->connects = 0;
+    this->connected = 0;
+    this->rejoin = NULL;
+    this->rejoin_len = 0;
+    init_irc_state(&(this->state));
+    this->snapshot = NULL;
+    this->snapshot_seq = 0;
+    init_timer(&(this->keepalive), &on_keepalive, this);
+    set_keepalive(this, MULTIPLEXER_PING_INTERVAL, MULTIPLEXER_PING_TIMEOUT);
+    this->keepalive_lines = 0;
+    this->keepalive_pinged = 0;
+    this->client_idle_ms = 0;
+    memset(this->command_counts, 0, sizeof(this->command_counts));
+    this->parse_errors = 0;
+    init_histogram(&(this->loop_latency));
+    this->admin_socket_path = NULL;
+    this->admin_socket = -1;
+    this->admins = NULL;
+    this->scrapes = NULL;
+    this->loop = NULL;
+    this->running = 0;
+    this->listen_socket = -1;
+    this->listen_socket_path = NULL;
+
+    set_client_backlog(this, 4 * 1024 * 1024, 16384, BACKLOG_SUMMARIZE);
+    this->remote = new_buffered_socket("\r\n", &on_remote_read, this);
+    this->remote->close_callback = &on_remote_close;
+    init_outbound_scheduler(&(this->outbound), NULL);
+}
+
+void set_client_backlog(irc_multiplexer *this, size_t max_bytes, size_t max_messages, backlog_policy policy) {
+    this->client_backlog.max_bytes = max_bytes;
+    this->client_backlog.max_messages = max_messages;
+    this->client_backlog.policy = policy;
+}
+
+void set_keepalive(irc_multiplexer *this, uint64_t interval_ms, uint64_t timeout_ms) {
+    this->ping_interval_ms = interval_ms;
+    this->ping_timeout_ms = timeout_ms;
+}
+
+void set_client_idle_timeout(irc_multiplexer *this, uint64_t idle_ms) {
+    this->client_idle_ms = idle_ms;
+}
+
+void set_fanout_workers(irc_multiplexer *this, size_t workers_len) {
+    this->workers_len = workers_len;
+}
+
+void set_message_log(irc_multiplexer *this, char *directory) {
+    this->log_directory = directory;
+}
+
+void set_history_size(irc_multiplexer *this, size_t history_size, size_t channel_history_size) {
+    this->history_size = history_size;
+    this->channel_history_size = channel_history_size;
+}
+
+void set_irc_server(irc_multiplexer *this, char *server_name, in_port_t server_port) {
+    this->server = server_name;
+    this->port = server_port;
+}
+
+void set_irc_tls(irc_multiplexer *this, char *ca_file) {
+    this->tls = 1;
+    this->tls_ca_file = ca_file;
+}
+
+/*
+ * Starts connecting to the remote, or schedules another go if that can't
+ * even be started
+ */
+void connect_remote(irc_multiplexer *this) {
+    #ifdef DEBUG
+    fprintf(stderr, "Connecting to %s:%d...\n", this->server, this->port);
+    #endif /* DEBUG */
+
+    if(connector_start(&(this->connector), this->server, this->port, &on_remote_connected, this) != 0) {
+	lose_remote(this);
+    }
+}
+
+/*
+ * The connector got through to the remote, or gave up
+ */
+void on_remote_connected(int fd, void *args) {
+    irc_multiplexer *this = (irc_multiplexer *) args;
+
+    if(fd < 0) {
+	lose_remote(this);
+	return;
+    }
+
+    this->remote->fd = fd;
+    if(!this->tls) {
+	register_remote(this);
+	return;
+    }
+
+    //Nothing goes out until the handshake is done
+    this->remote->tls = new_tls_session(&(this->tls_context), fd, this->server);
+    if(this->remote->tls == NULL
+	    || tls_handshake(this->remote->tls, this->loop, &on_remote_secured, this) != 0) {
+	lose_remote(this);
+    }
 }
 
-
 /*
- * Constructor for an irc_multiplexer
- * Null out values that should be null, so we don't get madness and anarchy
- * when uninitialized strings are used.
+ * The TLS handshake with the remote is over, one way or the other
  */
-void init_multiplexer(irc_multiplexer *this) {
-    this->line_buffer = NULL;
-    this->clients = NULL;
-    this->on_connect = 0;
-    this->remote = new_buffered_socket("\r\n", &on_remote_read, this);
+void on_remote_secured(tls_session *session, int ok, void *args) {
+    irc_multiplexer *this = (irc_multiplexer *) args;
 
+    if(!ok) {
+	lose_remote(this);
+	return;
+    }
+    register_remote(this);
 }
 
 /*
- * Generates an AF_INET socket to the remote and stores it
+ * Starts reading from a connection to the remote that's ready for IRC,
+ * and registers with the server
  */
-void set_irc_server(irc_multiplexer *this, char *server_name, in_port_t server_port) {
-
-    this->server = server_name;
-    this->port = server_port;
-
-    //Info for resolving DNS address
-    struct addrinfo *query_result;
+void register_remote(irc_multiplexer *this) {
+    if(bufsock_attach(this->remote, this->loop) != 0) {
+	lose_remote(this);
+	return;
+    }
+    this->connected = 1;
+    this->connects++;
 
     #ifdef DEBUG
-    fprintf(stderr, "Resolving %s... ", server_name);
+    fprintf(stderr, "Connected to %s:%d\n", this->server, this->port);
     #endif /* DEBUG */
 
-    //Query DNS for hostname
-    int error = getaddrinfo(server_name, NULL, NULL, &query_result);
-    if(error != 0) {
-	fprintf(stderr, "Error resolving %s: %s\n", server_name, gai_strerror(error));
-	exit(1);
-    }
+    this->keepalive_lines = this->remote->stats.lines_in;
+    this->keepalive_pinged = 0;
+    event_loop_add_timer(this->loop, &(this->keepalive), this->ping_interval_ms);
 
-    #ifdef DEBUG
-    fprintf(stderr, "%s\n", inet_ntoa(((struct sockaddr_in *)query_result->ai_addr)->sin_addr));
-    #endif /* DEBUG */
+    //Client lines wait until we're registered
+    outbound_set_remote(&(this->outbound), this->remote);
+    outbound_hold_clients(&(this->outbound), 1);
 
-    //Prep socket info
-    struct sockaddr_in *sockdata = (struct sockaddr_in *)query_result->ai_addr;
-    sockdata->sin_port = htons(server_port);
+    register_user(this);
+    set_nick(this);
 
-    //Generate socket
-    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if(sock < 0) {
-	perror("socket()");
-	exit(1);
+    //TODO put mode changes in a function
+    outbound_printf(&(this->outbound), "MODE %s B\r\n", this->identity.nick);
+}
+
+/*
+ * Drops the connection to the remote, if there is one, and tries again
+ * after the reconnect delay, which doubles every time until we manage to
+ * register. Clients stay attached throughout; their lines queue up until
+ * we're back.
+ */
+void lose_remote(irc_multiplexer *this) {
+    if(!this->running) {
+	return;
     }
 
-    //Establish connection to IRC server
-    if(connect(sock, (struct sockaddr *)sockdata, sizeof(*sockdata)) != 0 ) {
-	perror("connect()");
-	exit(1);
+    if(this->connected) {
+	this->connected = 0;
+	this->registered = 0;
+	event_loop_cancel_timer(this->loop, &(this->keepalive));
+	outbound_set_remote(&(this->outbound), NULL);
+	outbound_hold_clients(&(this->outbound), 1);
+
+	//Keep the traffic totals going, and start the next connection on a fresh socket
+	bufsock_stats *stats = &(this->remote->stats);
+	this->remote_stats.lines_in += stats->lines_in;
+	this->remote_stats.bytes_in += stats->bytes_in;
+	this->remote_stats.lines_out += stats->lines_out;
+	this->remote_stats.bytes_out += stats->bytes_out;
+	this->remote_stats.oversized += stats->oversized;
+	destroy_buffered_socket(this->remote);
+	this->remote = new_buffered_socket("\r\n", &on_remote_read, this);
+	this->remote->close_callback = &on_remote_close;
+
+	remember_channels(this);
+	announce(this, "Lost connection to %s:%d, reconnecting", this->server, this->port);
+    }
+    else if(this->remote->fd >= 0) {
+	//Connected, but couldn't be secured or attached
+	if(this->remote->tls != NULL) {
+	    destroy_tls_session(this->remote->tls);
+	    this->remote->tls = NULL;
+	}
+	close(this->remote->fd);
+	this->remote->fd = -1;
     }
 
-    freeaddrinfo(query_result);
+    //Anywhere between half the delay and all of it, so a crowd that lost the server together doesn't come back together
+    uint64_t delay = this->reconnect_delay_ms;
+    delay -= (uint64_t) rand_r(&(this->reconnect_seed)) % (delay / 2 + 1);
+    event_loop_add_timer(this->loop, &(this->reconnect), delay);
 
-    /* We need to retrieve the size of the socket buffer so that we can 
-     * allocate enough space for our local buffer. Retrieving less than the
-     * entire buffer will truncate the message, and that is baaaad.
-     */
-    this->remote->fd = sock;
-    this->rcvbuf_len = sizeof(this->rcvbuf);
-    getsockopt(this->remote->fd, SOL_SOCKET, SO_RCVBUF, 
-	    &(this->rcvbuf), &(this->rcvbuf_len));
+    fprintf(stderr, "NOTICE: Reconnecting to %s:%d in %lu ms.\n", this->server, this->port, (unsigned long) delay);
 
-    #ifdef DEBUG
-    fprintf(stderr, "Connected to %s:%d\n", this->server, this->port);
-    fprintf(stderr, "rcvbuf_len: %d\n", this->rcvbuf_len);
-    fprintf(stderr, "rcvbuf: %u\n", this->rcvbuf_len);
-    #endif /* DEBUG */
+    this->reconnect_delay_ms *= 2;
+    if(this->reconnect_delay_ms > MULTIPLEXER_RECONNECT_MAX) {
+	this->reconnect_delay_ms = MULTIPLEXER_RECONNECT_MAX;
+    }
+}
 
+/*
+ * Timer: time for another go at the remote
+ */
+void on_reconnect(void *args) {
+    connect_remote((irc_multiplexer *) args);
 }
 
 /* 
  * Generates and listens for clients on the listen socket
  */
 void set_local_socket(irc_multiplexer *this, char *socket_path) {
+    this->listen_socket = open_unix_listener(socket_path);
+    this->listen_socket_path = socket_path;
+}
 
+void set_admin_socket(irc_multiplexer *this, char *socket_path) {
+    this->admin_socket = open_unix_listener(socket_path);
+    this->admin_socket_path = socket_path;
+}
+
+/*
+ * Binds a non-blocking unix socket to a path, replacing a stale socket
+ * left there, and listens on it. Exits if that can't be done.
+ *
+ * Returns the listening fd.
+ */
+int open_unix_listener(char *socket_path) {
     //Remove existing socket if it exists
     struct stat socket_stat;
     int error = stat(socket_path, &socket_stat);
@@ -171,200 +1487,658 @@ void set_local_socket(irc_multiplexer *this, char *socket_path) {
 	exit(1);
     }
 
-    this->listen_socket = sock;
+    //Accepts are drained in a loop, so the listen socket must not block
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
     //Listen for lots and lots of connections, and accept them ALL.
     listen(sock, 100000);
+    return sock;
 }
 
 /* 
- * Accepts a connection on the local listen socket
+ * Accepts every pending connection on the local listen socket
  */
 void accept_client_socket(irc_multiplexer *this) {
-    if(this->clients == NULL) {
-	this->clients = malloc(sizeof(client_socket));
-	this->clients->next = NULL;
+    while(1) {
+	int fd = accept4(this->listen_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if(fd < 0) {
+	    if(errno == EINTR) {
+		continue;
+	    }
+	    if(errno != EAGAIN && errno != EWOULDBLOCK) {
+		perror("accept4()");
+	    }
+	    return;
+	}
+
+	fprintf(stdout, "Received client connection on local socket, fd %d\n", fd);
+
+	//New clients start out knowing our nick and channels
+	shared_buffer *snapshot = state_snapshot(this);
+
+	if(this->workers_len > 0) {
+	    //Round robin the new client onto a worker, which sets it up
+	    fanout_worker *worker = &(this->workers[this->next_worker]);
+	    this->next_worker = (this->next_worker + 1) % this->workers_len;
+	    fanout_worker_adopt(worker, fd, snapshot, this->seq);
+	}
+	else {
+	    client_socket *client = add_client_socket(this, &(this->clients), fd);
+	    if(client == NULL) {
+		close(fd);
+	    }
+	    else if(snapshot != NULL) {
+		client_send_state(client, snapshot, this->seq);
+	    }
+	}
+
+	if(snapshot != NULL) {
+	    shared_buffer_unref(snapshot);
+	}
     }
-    else {
-	client_socket *new_socket = malloc(sizeof(client_socket));
-	new_socket->next = this->clients;
-	this->clients = new_socket;
+}
+
+void init_client_list(client_list *list, event_loop *loop) {
+    memset(list, 0, sizeof(client_list));
+    list->loop = loop;
+    init_subscription_index(&(list->subscriptions));
+    init_pool(&(list->client_pool), sizeof(client_socket));
+    init_pool(&(list->socket_pool), sizeof(buffered_socket));
+    init_pool(&(list->segment_pool), sizeof(write_segment));
+}
+
+void destroy_client_list(client_list *list) {
+    free(list->items);
+    free(list->by_fd);
+    destroy_subscription_index(&(list->subscriptions));
+    destroy_pool(&(list->client_pool));
+    destroy_pool(&(list->socket_pool));
+    destroy_pool(&(list->segment_pool));
+}
+
+/*
+ * Puts a client in the last slot of the table and in the fd index, 
+ * growing either as needed.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int client_list_insert(client_list *list, client_socket *client) {
+    int fd = client->bufsock->fd;
+
+    if(list->len == list->size) {
+	size_t size = list->size == 0 ? 64 : list->size * 2;
+	client_socket **items = realloc(list->items, size * sizeof(client_socket *));
+	if(items == NULL) {
+	    return -1;
+	}
+	list->items = items;
+	list->size = size;
+    }
+
+    if((size_t) fd >= list->by_fd_size) {
+	size_t size = list->by_fd_size == 0 ? 64 : list->by_fd_size;
+	while(size <= (size_t) fd) {
+	    size *= 2;
+	}
+	client_socket **by_fd = realloc(list->by_fd, size * sizeof(client_socket *));
+	if(by_fd == NULL) {
+	    return -1;
+	}
+	memset(by_fd + list->by_fd_size, 0, (size - list->by_fd_size) * sizeof(client_socket *));
+	list->by_fd = by_fd;
+	list->by_fd_size = size;
+    }
+
+    client->slot = list->len;
+    list->items[list->len++] = client;
+    list->by_fd[fd] = client;
+    return 0;
+}
+
+/*
+ * Takes a client out of the table by moving the last one into its slot,
+ * and out of the fd index. Must be called while the client still has its fd.
+ */
+void client_list_erase(client_list *list, client_socket *client) {
+    client_socket *last = list->items[--list->len];
+    list->items[client->slot] = last;
+    last->slot = client->slot;
+
+    int fd = client->bufsock->fd;
+    if(fd >= 0 && (size_t) fd < list->by_fd_size && list->by_fd[fd] == client) {
+	list->by_fd[fd] = NULL;
+    }
+}
+
+client_socket * find_client_socket(client_list *list, int fd) {
+    if(fd < 0 || (size_t) fd >= list->by_fd_size) {
+	return NULL;
+    }
+    return list->by_fd[fd];
+}
+
+client_socket * add_client_socket(irc_multiplexer *this, client_list *list, int fd) {
+    client_socket *new_socket = pool_alloc(&(list->client_pool));
+    if(new_socket == NULL) {
+	return NULL;
+    }
+    new_socket->owner = this;
+    new_socket->list = list;
+    new_socket->dropped_pending = 0;
+    new_socket->dropped = 0;
+    new_socket->parse_errors = 0;
+    new_socket->sender = __atomic_fetch_add(&(this->next_sender), 1, __ATOMIC_RELAXED);
+    new_socket->want_seq = 0;
+    new_socket->binary = 0;
+    new_socket->resuming = 0;
+    new_socket->first_live_seq = 0;
+    new_socket->held = NULL;
+    new_socket->held_len = new_socket->held_size = 0;
+    new_socket->replay_lines_end = new_socket->replay_bytes_end = 0;
+    new_socket->awaiting_state = 0;
+    new_socket->state_seq = 0;
+    new_socket->attaching = 1;
+    init_timer(&(new_socket->attach), &on_client_attach, new_socket);
+    new_socket->history = NULL;
+    init_timer(&(new_socket->idle), &on_client_idle, new_socket);
+    new_socket->idle_lines = 0;
+    new_socket->idle_pinged = 0;
+    new_socket->bufsock = new_pooled_buffered_socket(&(list->socket_pool), &(list->segment_pool),
+	    "\r\n", &on_client_read, new_socket);
+    if(new_socket->bufsock == NULL) {
+	pool_free(&(list->client_pool), new_socket);
+	return NULL;
+    }
+    new_socket->bufsock->close_callback = &on_client_close;
+    new_socket->bufsock->fd = fd;
+
+    if(bufsock_attach(new_socket->bufsock, list->loop) != 0) {
+	new_socket->bufsock->fd = -1;
+	destroy_buffered_socket(new_socket->bufsock);
+	pool_free(&(list->client_pool), new_socket);
+	return NULL;
+    }
+
+    if(subscription_add(&(list->subscriptions), &(new_socket->subscriber), new_socket) != 0) {
+	destroy_buffered_socket(new_socket->bufsock);
+	pool_free(&(list->client_pool), new_socket);
+	return NULL;
+    }
+
+    if(client_list_insert(list, new_socket) != 0) {
+	subscription_remove(&(list->subscriptions), &(new_socket->subscriber));
+	destroy_buffered_socket(new_socket->bufsock);
+	pool_free(&(list->client_pool), new_socket);
+	return NULL;
     }
-    this->clients->bufsock = new_buffered_socket("\r\n", on_client_read, NULL);
-    this->clients->bufsock->fd = accept(this->listen_socket, NULL, NULL);
+
+    if(this->client_idle_ms > 0) {
+	event_loop_add_timer(list->loop, &(new_socket->idle), this->client_idle_ms);
+    }
+    event_loop_add_timer(list->loop, &(new_socket->attach), MULTIPLEXER_ATTACH_HOLD);
+    return new_socket;
+}
+
+void remove_client_socket(client_socket *client) {
+    client_list *list = client->list;
+
+    client_list_erase(list, client);
+    event_loop_cancel_timer(list->loop, &(client->idle));
+    event_loop_cancel_timer(list->loop, &(client->attach));
+    if(client->binary) {
+	__atomic_sub_fetch(&(client->owner->binary_clients), 1, __ATOMIC_RELAXED);
+    }
+    subscription_remove(&(list->subscriptions), &(client->subscriber));
+
+    for(size_t i = 0; i < client->held_len; i++) {
+	shared_buffer_unref(client->held[i]);
+    }
+    free(client->held);
+    close_history(client);
+
+    destroy_buffered_socket(client->bufsock);
+    pool_free(&(list->client_pool), client);
 }
 
+/*
+ * Lines from the remote that the multiplexer reacts to itself, indexed by
+ * command id. Anything not listed is just passed on to the clients.
+ */
+typedef void (*remote_handler)(irc_multiplexer *this, irc_message *msg);
+
+static const remote_handler remote_handlers[CMD_COUNT] = {
+    [CMD_PING] = &on_remote_ping,
+    [RPL_WELCOME] = &on_remote_welcome,
+};
+
 void connection_manager(irc_multiplexer *this, irc_message *msg) {
-    if(strcmp(msg->command, "NOTICE") == 0) {
-	#ifdef DEBUG
-	//fprintf(stderr, "Ignoring notice.\n");
-	#endif /* DEBUG */
+    this->command_counts[msg->command_id]++;
+
+    //Handlers see the state as it was before the line
+    remote_handler handler = remote_handlers[msg->command_id];
+    if(handler != NULL) {
+	handler(this, msg);
     }
-    else if(strcmp(msg->command, "PING") == 0) {
-	char buf[256];
-	snprintf(buf, 256, "PONG :%s\r\n", (msg->params_array)[0]);
-	this->remote->write_buffer = buf;
-	write_buffered_socket(this->remote);
+    irc_state_update(&(this->state), msg);
+
+    //Our own PART or KICK took the channel out of the state, and its history goes with it
+    if(msg->command_id == CMD_PART || msg->command_id == CMD_KICK) {
+	irc_slice channel = message_param(msg, 0);
+	if(channel.len > 0 && string_map_get(&(this->state.channels), channel.ptr, channel.len) == NULL) {
+	    history_forget(&(this->history), channel.ptr, channel.len);
+	}
     }
 }
 
-void set_nick(irc_multiplexer *this) {
+void on_remote_ping(irc_multiplexer *this, irc_message *msg) {
+    irc_slice server = message_param(msg, 0);
+    outbound_printf_urgent(&(this->outbound), "PONG :%.*s\r\n", (int) server.len, server.ptr);
+}
+
+/*
+ * The server accepted our registration
+ */
+void on_remote_welcome(irc_multiplexer *this, irc_message *msg) {
+    irc_reply reply;
+    if(decode_reply(msg, &reply) != 0) {
+	return;
+    }
+    this->registered = 1;
+    this->reconnect_delay_ms = MULTIPLEXER_RECONNECT_MIN;
+
+    #ifdef DEBUG
+    fprintf(stderr, "Registered as %.*s: %.*s\n", (int) reply.target.len, reply.target.ptr,
+	    (int) reply.text.text.len, reply.text.text.ptr);
+    #endif /* DEBUG */
 
-    char buf[256];
-    memset(buf, 0, 256);
-    snprintf(buf, 256, "NICK %s\r\n", this->identity.nick);
-    this->remote->write_buffer = buf;
-    write_buffered_socket(this->remote);
+    //Back where we were before the connection was lost, then let the clients at it
+    rejoin_channels(this);
+    outbound_hold_clients(&(this->outbound), 0);
+    if(this->connects > 1) {
+	announce(this, "Reconnected to %s:%d", this->server, this->port);
+    }
 }
 
-void register_user(irc_multiplexer *this) {
-    char buf[256];
+/*
+ * Joins the channels we were in on the last connection again
+ */
+void rejoin_channels(irc_multiplexer *this) {
+    for(size_t i = 0; i < this->rejoin_len; i++) {
+	outbound_printf(&(this->outbound), "%s\r\n", this->rejoin[i]);
+    }
+}
 
-    //Parameters: <username> <hostname> <servername> <realname>
-    snprintf(buf, 256, "USER %s %s %s %s\r\n", 
-	    this->identity.username, this->identity.hostname,
-	    this->identity.servername, this->identity.realname);
+/*
+ * Length of JOIN <channels> [<keys>]
+ */
+size_t join_line_len(size_t channels_len, size_t keys_len) {
+    return strlen("JOIN ") + channels_len + (keys_len > 0 ? 1 + keys_len : 0);
+}
 
-    this->remote->write_buffer = buf;
-    write_buffered_socket(this->remote);
-}
-
-int prep_select(irc_multiplexer *this, fd_set *readfds) {
-    FD_ZERO(readfds);
-    FD_SET(this->remote->fd, readfds);
-    FD_SET(this->listen_socket, readfds);
-
-    //Find the highest file descriptor for select
-    int nfds = 0;
-    if( nfds < this->remote->fd) nfds = this->remote->fd;
-    if( nfds < this->listen_socket) nfds = this->listen_socket;
-
-    //Load all the client sockets
-    for(client_socket *current = this->clients;
-	    current != NULL;
-	    current = current->next ) {
-
-	//check to see if socket is still connected
-	if(bufsock_is_connected(current->bufsock) == 0) {
-	    fprintf(stderr, "NOTICE: Client with fd %d disconnected.\n", current->bufsock->fd);
-
-	    for(client_socket *previous = this->clients; previous != NULL; previous = previous->next ) {
-		//Remove dead client socket
-		
-		if(previous == current) {
-		    //Node to delete is the head
-		    if(current->next == NULL) {
-			//We're deleting the last client socket
-			this->clients = NULL;
-		    }
-		    else {
-			this->clients = current->next;
-		    }
-		    free(current);
-		    break;
-		}
-		else if( previous->next == current) {
-		    //Node to delete is in the body
-		    fprintf(stderr, "Ehm, idunno\n");
-		    previous->next = current->next;
-		    free(current);
-		    break;
-		}
+/*
+ * Adds JOIN <channels> [<keys>] to the lines we rejoin with
+ */
+void add_rejoin_line(irc_multiplexer *this, const char *channels, const char *keys) {
+    char *line = malloc(join_line_len(strlen(channels), strlen(keys)) + 1);
+    if(line == NULL) {
+	return;
+    }
+    sprintf(line, "JOIN %s%s%s", channels, keys[0] == '\0' ? "" : " ", keys);
+    this->rejoin[this->rejoin_len++] = line;
+}
+
+/*
+ * Notes the JOINs that get us back into the channels we're in. They're 
+ * packed as many to a line as fit, as JOIN #a,#b,#c key,key, so a 
+ * reconnect costs a few lines of flood credit rather than one a channel.
+ * Keys go to the channels in order, so channels with a key come first.
+ *
+ * If we're in none, because the server never confirmed the JOINs we sent
+ * last time, the ones we already have are kept for the next try.
+ */
+void remember_channels(irc_multiplexer *this) {
+    size_t len = this->state.channels.len;
+    if(len == 0) {
+	return;
+    }
+    forget_channels(this);
+
+    //Never more lines than channels
+    this->rejoin = calloc(len, sizeof(char *));
+    channel_state **ordered = malloc(len * sizeof(channel_state *));
+    if(this->rejoin == NULL || ordered == NULL) {
+	free(ordered);
+	forget_channels(this);
+	return;
+    }
+
+    size_t ordered_len = 0;
+    for(int keyed = 1; keyed >= 0; keyed--) {
+	size_t cursor = 0;
+	string_map_entry *entry;
+	while((entry = string_map_next(&(this->state.channels), &cursor)) != NULL) {
+	    channel_state *channel = (channel_state *) entry->value;
+	    if((channel_key(channel) != NULL) == keyed) {
+		ordered[ordered_len++] = channel;
 	    }
 	}
-	else {
-	    //Locate highest fd for select()
-	    if(nfds < current->bufsock->fd) nfds = current->bufsock->fd;
-	    //Add client fd to listen sockets
-	    FD_SET(current->bufsock->fd, readfds);
+    }
+
+    char channels[MULTIPLEXER_JOIN_LINE + 1];
+    char keys[MULTIPLEXER_JOIN_LINE + 1];
+    size_t channels_len = 0;
+    size_t keys_len = 0;
+    for(size_t i = 0; i < ordered_len; i++) {
+	const char *name = ordered[i]->name;
+	const char *key = channel_key(ordered[i]);
+	size_t name_len = strlen(name);
+	size_t key_len = key == NULL ? 0 : strlen(key);
+
+	//Comma separated after the first
+	size_t more_channels = (channels_len > 0) + name_len;
+	size_t more_keys = key == NULL ? 0 : (keys_len > 0) + key_len;
+	if(channels_len > 0 && join_line_len(channels_len + more_channels, keys_len + more_keys) > MULTIPLEXER_JOIN_LINE) {
+	    channels[channels_len] = '\0';
+	    keys[keys_len] = '\0';
+	    add_rejoin_line(this, channels, keys);
+	    channels_len = keys_len = 0;
+	    more_channels = name_len;
+	    more_keys = key_len;
+	}
+	if(join_line_len(more_channels, more_keys) > MULTIPLEXER_JOIN_LINE) {
+	    continue;
 	}
 
-	if(this->clients == NULL) {
-	    //Cleanup in case we just deleted a dead socket and have no more clients
-	    break;
+	if(channels_len > 0) {
+	    channels[channels_len++] = ',';
+	}
+	memcpy(channels + channels_len, name, name_len);
+	channels_len += name_len;
+	if(key != NULL) {
+	    if(keys_len > 0) {
+		keys[keys_len++] = ',';
+	    }
+	    memcpy(keys + keys_len, key, key_len);
+	    keys_len += key_len;
 	}
     }
+    if(channels_len > 0) {
+	channels[channels_len] = '\0';
+	keys[keys_len] = '\0';
+	add_rejoin_line(this, channels, keys);
+    }
+    free(ordered);
+}
 
-    return nfds;
+void forget_channels(irc_multiplexer *this) {
+    for(size_t i = 0; i < this->rejoin_len; i++) {
+	free(this->rejoin[i]);
+    }
+    free(this->rejoin);
+    this->rejoin = NULL;
+    this->rejoin_len = 0;
 }
 
-/* 
- * Kicks off a while loop to handle all input from all sockets in every
- * direction, evar.
+/*
+ * Whether a line is a PONG for one of the PINGs we send to check on the
+ * remote and on idle clients
  */
-void start_server(irc_multiplexer *this) {
-    char buf[this->rcvbuf];
-    while(1) {
-	//Prep recv buffer
-	memset(buf, 0, this->rcvbuf);
+int is_keepalive_pong(irc_message *msg) {
+    if(msg->command_id != CMD_PONG) {
+	return 0;
+    }
+    size_t count = message_param_count(msg);
+    return count > 0 && slice_equals(message_param(msg, count - 1), MULTIPLEXER_PREFIX);
+}
 
-	//Initialize read fd_set
-	fd_set readfds;
-	int nfds = prep_select(this, &readfds);
+/*
+ * Timer: the remote has had an interval to send us something. If it did,
+ * check again an interval from now; if not, PING it, and if it's still 
+ * quiet after that, it's gone.
+ */
+void on_keepalive(void *args) {
+    irc_multiplexer *this = (irc_multiplexer *) args;
+    unsigned long lines = this->remote->stats.lines_in;
 
-	//Initialize timeout
-	this->timeout.tv_sec = 1;
-	this->timeout.tv_usec = 0;
+    if(lines != this->keepalive_lines) {
+	this->keepalive_lines = lines;
+	this->keepalive_pinged = 0;
+	event_loop_add_timer(this->loop, &(this->keepalive), this->ping_interval_ms);
+    }
+    else if(!this->keepalive_pinged) {
+	outbound_printf_urgent(&(this->outbound), "PING :%s\r\n", MULTIPLEXER_PREFIX);
+	this->keepalive_pinged = 1;
+	event_loop_add_timer(this->loop, &(this->keepalive), this->ping_timeout_ms);
+    }
+    else {
+	fprintf(stderr, "Error: %s:%d stopped answering PINGs\n", this->server, this->port);
+	lose_remote(this);
+    }
+}
 
-	/* On connect setup and such
-	 * TODO rethink and generalize this.
-	 */
-	if(this->on_connect == 0) {
-	    register_user(this);
-	    set_nick(this);
+/*
+ * Timer: same idea as on_keepalive, for a client
+ */
+void on_client_idle(void *args) {
+    client_socket *client = (client_socket *) args;
+    unsigned long lines = client->bufsock->stats.lines_in;
 
-	    //TODO put mode changes in a function
-	    char buf[256];
-	    snprintf(buf, 256, "MODE %s B\r\n", this->identity.nick);
-	    this->remote->write_buffer = buf;
-	    write_buffered_socket(this->remote);
-	    this->on_connect = 1;
-	}
+    if(lines != client->idle_lines) {
+	client->idle_lines = lines;
+	client->idle_pinged = 0;
+    }
+    else if(!client->idle_pinged) {
+	client_printf(client, "PING :%s\r\n", MULTIPLEXER_PREFIX);
+	client->idle_pinged = 1;
+    }
+    else {
+	fprintf(stderr, "NOTICE: Client with fd %d went idle, disconnecting.\n", client->bufsock->fd);
+	remove_client_socket(client);
+	return;
+    }
+    event_loop_add_timer(client->list->loop, &(client->idle), client->owner->client_idle_ms);
+}
+
+/*
+ * Timer: a client that's said nothing since attaching gets what was held
+ */
+void on_client_attach(void *args) {
+    client_go_live((client_socket *) args);
+}
+
+/*
+ * Ends the attach hold, sending the lines held back unless a resume or a
+ * state request is still holding them.
+ *
+ * Returns 0, or -1 if the client was disconnected.
+ */
+int client_go_live(client_socket *client) {
+    if(client->attaching) {
+	client->attaching = 0;
+	event_loop_cancel_timer(client->list->loop, &(client->attach));
+    }
+    if(client->resuming || client->awaiting_state) {
+	return 0;
+    }
 
-	//Begin main execution
-	int ready_fds = select(nfds + 1, &readfds, NULL, NULL, &(this->timeout));
+    size_t held_len = client->held_len;
+    shared_buffer **held = client->held;
+    client->held = NULL;
+    client->held_len = client->held_size = 0;
 
-	//If no input, print a dot to indicate inactivity.
-	if(ready_fds == 0) {
-	    fputc('.', stdout);
-	    fflush(stdout);
+    int connected = 1;
+    for(size_t i = 0; i < held_len; i++) {
+	if(connected) {
+	    if(client->first_live_seq == 0) {
+		client->first_live_seq = held[i]->seq;
+	    }
+	    connected = deliver_to_client(client, held[i]) >= 0;
 	}
-	//If remote->fd is set, then handle that input
-	else if(FD_ISSET(this->remote->fd, &readfds)) {
-	    read_buffered_socket(this->remote);
-	    //recv(this->remote->fd, buf, this->rcvbuf_len - 1, 0);
-	    //read_server_socket(this->remote, buf);
+	shared_buffer_unref(held[i]);
+    }
+    free(held);
+    return connected ? 0 : -1;
+}
+
+void set_nick(irc_multiplexer *this) {
+    outbound_printf(&(this->outbound), "NICK %s\r\n", this->identity.nick);
+}
+
+void register_user(irc_multiplexer *this) {
+    //Parameters: <username> <hostname> <servername> <realname>
+    outbound_printf(&(this->outbound), "USER %s %s %s %s\r\n", 
+	    this->identity.username, this->identity.hostname,
+	    this->identity.servername, this->identity.realname);
+}
+
+int attach_multiplexer(irc_multiplexer *this, event_loop *loop) {
+    this->loop = loop;
+    this->clients.loop = loop;
+
+    if(init_history(&(this->history), this->history_size, this->channel_history_size) != 0) {
+	return -1;
+    }
+
+    if(this->log_directory != NULL && this->log == NULL) {
+	this->log = malloc(sizeof(message_log));
+	if(open_message_log(this->log, this->log_directory) != 0) {
+	    free(this->log);
+	    this->log = NULL;
+	    return -1;
 	}
-	//We received a new connection from a client locally
-	else if(FD_ISSET(this->listen_socket, &readfds)) {
-	    fputs("Received client connection on local socket", stdout);
-	    accept_client_socket(this);
+	this->seq = this->log->last_seq;
+    }
+
+    if(init_mailbox(&(this->mailbox), loop) != 0) {
+	return -1;
+    }
+    init_connector(&(this->connector), loop, &(this->mailbox));
+    if(this->tls && init_tls_context(&(this->tls_context), this->tls_ca_file) != 0) {
+	return -1;
+    }
+
+    if(this->workers_len > 0) {
+	if(init_broadcast_ring(&(this->ring), MULTIPLEXER_RING_SIZE, this->workers_len) != 0) {
+	    return -1;
 	}
-	else {
-	    //TODO forward message from client to server
-	    for(client_socket *current = this->clients; current != NULL; current = current->next ) {
-		//Locate the client socket that has written us a message
-
-		if(FD_ISSET(current->bufsock->fd, &readfds)) {
-		    //Current client fd is readable
-		    
-		    fprintf(stderr, "----------------------------------------\n");
-		    fprintf(stderr, "received message from client fd: %d\n", current->bufsock->fd);
-		    
-
-		    //Get client socket info
-		    int client_rcvbuf;
-		    unsigned int client_rcvbuf_len = sizeof(client_rcvbuf);
-		    getsockopt(current->bufsock->fd, SOL_SOCKET, SO_RCVBUF, &client_rcvbuf, &client_rcvbuf_len);
-
-		    //Receive message, print it, and discard. 
-		    //TODO actually act on client message
-		    char clientbuf[client_rcvbuf + 1];
-		    memset(clientbuf, 0, client_rcvbuf + 1);
-		    size_t received = recv(current->bufsock->fd, clientbuf, client_rcvbuf, 0);
-		    fprintf(stderr, "message was \"%s\" of size %lu\n", clientbuf, received);
-		}
+	init_event_handler(&(this->ring_notify), -1, &on_ring_notify, this);
+
+	this->workers = calloc(this->workers_len, sizeof(fanout_worker));
+	for(size_t i = 0; i < this->workers_len; i++) {
+	    if(start_fanout_worker(&(this->workers[i]), this, i) != 0) {
+		return -1;
 	    }
-	} 
+	}
+    }
+
+    if(outbound_attach(&(this->outbound), loop) != 0) {
+	return -1;
+    }
+
+    init_event_handler(&(this->listen_handler), this->listen_socket, &on_listen_event, this);
+    if(event_loop_add(loop, &(this->listen_handler), EPOLLIN) != 0) {
+	return -1;
+    }
+    if(this->admin_socket >= 0 && attach_admin_socket(this) != 0) {
+	event_loop_remove(loop, &(this->listen_handler));
+	return -1;
+    }
+
+    //Time the loop's wakeups, unless it's shared and already timed
+    if(loop->latency == NULL) {
+	loop->latency = &(this->loop_latency);
+    }
+    this->running = 1;
+
+    //Registration follows once we're connected
+    connect_remote(this);
+    return 0;
+}
+
+void shutdown_multiplexer(irc_multiplexer *this) {
+    if(!this->running) {
+	return;
+    }
+    this->running = 0;
+    event_loop_cancel_timer(this->loop, &(this->keepalive));
+    event_loop_cancel_timer(this->loop, &(this->reconnect));
+    connector_cancel(&(this->connector));
+
+    //Reads in flight are handed back to the mailboxes, which must still be there
+    if(this->log != NULL) {
+	message_log_stop_reads(this->log);
+    }
+
+    while(this->clients.len > 0) {
+	remove_client_socket(this->clients.items[this->clients.len - 1]);
+    }
+    destroy_client_list(&(this->clients));
+
+    //Workers hang up on their own clients before they exit
+    if(this->workers_len > 0) {
+	for(size_t i = 0; i < this->workers_len; i++) {
+	    stop_fanout_worker(&(this->workers[i]));
+	}
+	free(this->workers);
+	this->workers = NULL;
+	event_loop_remove(this->loop, &(this->ring_notify));
+	destroy_broadcast_ring(&(this->ring));
+	for(size_t i = 0; i < this->ring_overflow_len; i++) {
+	    shared_buffer_unref(this->ring_overflow[i]);
+	}
+	free(this->ring_overflow);
+	this->ring_overflow = NULL;
+	this->ring_overflow_len = this->ring_overflow_size = 0;
+    }
+    destroy_mailbox(&(this->mailbox));
+    close_admin_socket(this);
+
+    if(this->loop->latency == &(this->loop_latency)) {
+	this->loop->latency = NULL;
+    }
+
+    event_loop_remove(this->loop, &(this->listen_handler));
+    close(this->listen_socket);
+    this->listen_socket = -1;
+    if(this->listen_socket_path != NULL) {
+	unlink(this->listen_socket_path);
+    }
+
+    destroy_outbound_scheduler(&(this->outbound));
+    destroy_history(&(this->history));
+    destroy_irc_state(&(this->state));
+    forget_channels(this);
+    if(this->snapshot != NULL) {
+	shared_buffer_unref(this->snapshot);
+	this->snapshot = NULL;
+    }
+    if(this->log != NULL) {
+	close_message_log(this->log);
+	free(this->log);
+	this->log = NULL;
     }
+    destroy_buffered_socket(this->remote);
+    this->remote = NULL;
+    destroy_tls_context(&(this->tls_context));
 }
 
+/* 
+ * Kicks off the event loop to handle all input from all sockets in every
+ * direction, evar.
+ */
+void start_server(irc_multiplexer *this) {
+    event_loop loop;
+
+    if(init_event_loop(&loop) != 0 || attach_multiplexer(this, &loop) != 0) {
+	exit(1);
+    }
+
+    //Timers wake the loop when there's something to do, nothing else needs to
+    while(this->running) {
+	if(event_loop_run_once(&loop, -1) < 0) {
+	    exit(1);
+	}
+    }
+
+    destroy_event_loop(&loop);
+}
@@ -12,14 +12,207 @@
 #include <arpa/inet.h>
 #include <sys/time.h>
 
+#include "event_loop.h"
 #include "buffered_socket.h"
+#include "broadcast_ring.h"
 #include "irc_message.h"
+#include "irc_reply.h"
+#include "subscription.h"
+#include "outbound_scheduler.h"
+#include "mailbox.h"
+#include "history.h"
+#include "message_log.h"
+#include "histogram.h"
+#include "irc_state.h"
+#include "connector.h"
+#include "tls_session.h"
+#include "mux_frame.h"
+
+//Prefix used on lines the multiplexer makes up itself
+#define MULTIPLEXER_PREFIX "irc_multiplexer"
+
+//Tags on shared buffers queued to clients
+#define LINE_PRIVMSG 0x1
+
+//Lines the remote can get ahead of the slowest fan-out worker
+#define MULTIPLEXER_RING_SIZE 65536
+
+//Lines kept in memory for clients that resume, overall and per channel
+#define MULTIPLEXER_HISTORY_SIZE 16384
+#define MULTIPLEXER_CHANNEL_HISTORY_SIZE 1024
+
+//More of the log is read for a client once its queue drops below this
+#define MULTIPLEXER_HISTORY_LOW_WATER (256 * 1024)
+
+//A quiet remote is sent a PING after this many ms, and dropped if it stays quiet as long again
+#define MULTIPLEXER_PING_INTERVAL (90 * 1000)
+#define MULTIPLEXER_PING_TIMEOUT (60 * 1000)
+
+//Longest JOIN we rejoin with, less its CR LF
+#define MULTIPLEXER_JOIN_LINE 510
+
+//Live lines are held back from a new client this long, or until it sends its first line
+#define MULTIPLEXER_ATTACH_HOLD 500
+
+//The delay before reconnecting doubles from the first to the last, less up to half at random
+#define MULTIPLEXER_RECONNECT_MIN 100
+#define MULTIPLEXER_RECONNECT_MAX (60 * 1000)
+
+/*
+ * A range of the message log being streamed to a client
+ */
+typedef struct history_stream_struct {
+    //Chunks are read on the log's reader thread and come back by mailbox
+    log_read_job job;
+    //Set while a chunk is out being read, when only its return may free us
+    int reading;
+
+    //The client it's for, as long as it still points back at us
+    struct client_list_struct *list;
+    int fd;
+
+    //Lines formatted from the current chunk, as frames if binary is set
+    int binary;
+    char *out;
+    size_t out_len;
+    size_t out_size;
+} history_stream;
+
+/*
+ * What to do with a client whose outbound backlog hits its limits
+ */
+typedef enum backlog_policy_enum {
+    //Hang up on the client
+    BACKLOG_DISCONNECT,
+    //Discard the oldest queued lines to make room
+    BACKLOG_DROP_OLDEST,
+    //Discard queued lines other than PRIVMSGs first, then the oldest
+    BACKLOG_DROP_NON_PRIVMSG,
+    //Discard new lines, then tell the client how many it missed
+    BACKLOG_SUMMARIZE,
+    BACKLOG_POLICY_COUNT
+} backlog_policy;
+
+typedef struct backlog_limits_struct {
+    size_t max_bytes;
+    size_t max_messages;
+    backlog_policy policy;
+} backlog_limits;
+
+typedef struct backlog_stats_struct {
+    //How often each policy had to step in
+    unsigned long fired[BACKLOG_POLICY_COUNT];
+    unsigned long dropped_messages;
+} backlog_stats;
 
 typedef struct client_socket_struct {
     buffered_socket *bufsock;
-    struct client_socket_struct *next;
+    struct irc_multiplexer_struct *owner;
+    struct client_list_struct *list;
+    //Where the client sits in its list's table
+    size_t slot;
+
+    //Lines discarded under BACKLOG_SUMMARIZE and not yet reported
+    unsigned long dropped_pending;
+
+    //Lines discarded by any backlog policy, and lines that didn't parse
+    unsigned long dropped;
+    unsigned long parse_errors;
+
+    //Identifies the client's lines to the outbound scheduler
+    unsigned long sender;
+
+    //Set with MUX SEQ ON to get lines tagged with their sequence number
+    int want_seq;
+
+    //Set with MUX FRAMING BINARY to get everything in the framing of mux_frame.h
+    int binary;
+
+    /* Set by MUX RESUME until the missed lines have been replayed, with
+     * live lines held back in the meantime. first_live_seq is the first 
+     * line sent live, which a replay must stop short of.
+     */
+    int resuming;
+    unsigned long first_live_seq;
+    shared_buffer **held;
+    size_t held_len;
+    size_t held_size;
+
+    /* A replay is queued whole, whatever the backlog limits, and the limits
+     * only apply to what's queued after it. These are the socket's 
+     * lines_out and bytes_out once the replay, and anything queued before
+     * it, is written out.
+     */
+    unsigned long replay_lines_end;
+    unsigned long replay_bytes_end;
+
+    /* Set by MUX STATE on a fan-out worker until the snapshot arrives,
+     * with live lines held back in the meantime. state_seq is the last
+     * line the snapshot it was sent reflects; lines up to there that 
+     * change the state aren't sent live.
+     */
+    int awaiting_state;
+    unsigned long state_seq;
+
+    /* Set from when a client attaches until its first line, so it can 
+     * MUX RESUME before it's sent anything live. Any other line, like 
+     * MUX LIVE, lets the held lines go, as does the attach timer firing 
+     * for a client that only listens.
+     */
+    int attaching;
+    timer attach;
+
+    //Set while MUX HISTORY is streaming the log to the client
+    history_stream *history;
+
+    /* Fires when the client has been quiet for the idle timeout, to PING
+     * it and then to drop it. idle_lines is how many lines it had sent
+     * when the timer was armed.
+     */
+    timer idle;
+    unsigned long idle_lines;
+    int idle_pinged;
+
+    //Filters set with MUX SUBSCRIBE
+    subscriber subscriber;
 } client_socket;
 
+/*
+ * A set of clients served by one thread. The multiplexer has one, and so
+ * does each of its fan-out workers.
+ */
+typedef struct client_list_struct {
+    /* Clients packed into a table with no gaps, so walking them touches
+     * as little memory as possible. Removing one moves the last into its
+     * slot.
+     */
+    client_socket **items;
+    size_t len;
+    size_t size;
+
+    //The same clients indexed by fd
+    client_socket **by_fd;
+    size_t by_fd_size;
+
+    //Loop the clients' sockets are attached to
+    event_loop *loop;
+    //Runs work on that loop's thread, NULL for the multiplexer's own list
+    mailbox *mailbox;
+
+    backlog_stats backlog_stats;
+
+    //Time taken to queue each line for every client it's routed to
+    histogram fanout_time;
+
+    //Routes lines to the clients whose filters they match
+    subscription_index subscriptions;
+
+    //Clients, their sockets and their sockets' write queues come from here
+    pool client_pool;
+    pool socket_pool;
+    pool segment_pool;
+} client_list;
+
 typedef struct irc_identity_struct {
     //Identity info
     char *nick;
@@ -34,30 +227,255 @@ typedef struct irc_multiplexer_struct {
     //Describe the server we're talking to
     char *server;
     in_port_t port;
+    //Whether we speak TLS to it, and the CAs its certificate is checked against, NULL for the system's
+    int tls;
+    char *tls_ca_file;
+    tls_context tls_context;
 
-    //IRC socket
+    /* IRC socket, a new one for every connection, and the traffic on
+     * the connections before it
+     */
     buffered_socket *remote;
-    signed int rcvbuf;
-    unsigned int rcvbuf_len;
-    char *line_buffer;
+    bufsock_stats remote_stats;
+
+    /* Connects to the remote in the background, and again after a 
+     * jittered, growing delay whenever the connection is lost, while the
+     * clients stay attached
+     */
+    connector connector;
+    timer reconnect;
+    uint64_t reconnect_delay_ms;
+    unsigned int reconnect_seed;
+    //Connections made so far, and whether we have one now
+    unsigned long connects;
+    int connected;
+    //JOINs for the channels we were in when the connection was last lost, several to a line
+    char **rejoin;
+    size_t rejoin_len;
+
+    //Paces everything we send to the remote
+    outbound_scheduler outbound;
+    //Handed out to clients, from whichever thread serves them
+    unsigned long next_sender;
+    /* Clients that asked for binary framing, on any thread. While there
+     * are some, lines are framed once as they come in rather than for each.
+     */
+    int binary_clients;
+
+    //Sequence number of the last line from the remote, and recent lines
+    unsigned long seq;
+    history history;
+    size_t history_size;
+    size_t channel_history_size;
+
+    //Everything from the remote, on disk, if set_message_log was called
+    char *log_directory;
+    message_log *log;
 
     //Address for clients to connect to
     char *listen_socket_path;
     int listen_socket;
+    event_handler listen_handler;
+
+    //Clients served from the multiplexer's own thread
+    client_list clients;
+    backlog_limits client_backlog;
+
+    /* Fan-out workers. When there are any, lines from the remote are
+     * published to the ring and each worker writes them to its own share
+     * of the clients.
+     */
+    struct fanout_worker_struct *workers;
+    size_t workers_len;
+    size_t next_worker;
+    broadcast_ring ring;
+    event_handler ring_notify;
+    /* Lines that found the ring full, published as soon as a worker makes
+     * room for them. The remote isn't read in the meantime.
+     */
+    shared_buffer **ring_overflow;
+    size_t ring_overflow_len;
+    size_t ring_overflow_size;
+    //Brings client lines from the workers, and resolved names, back to this thread
+    mailbox mailbox;
 
-    client_socket *clients;
+    /* Drives the remote, listen and client sockets. Several multiplexers
+     * may share a loop, but a multiplexer is only ever touched by the 
+     * thread running its loop.
+     */
+    event_loop *loop;
+    int running;
 
-    //select() timeout
-    struct timeval timeout;
+    /* Checks the remote is still there: if no line came in over an 
+     * interval, it's sent a PING, and if nothing comes back we reconnect.
+     */
+    timer keepalive;
+    uint64_t ping_interval_ms;
+    uint64_t ping_timeout_ms;
+    unsigned long keepalive_lines;
+    int keepalive_pinged;
+
+    //Clients quiet for this long are PINGed, then dropped; 0 never drops them
+    uint64_t client_idle_ms;
 
     irc_identity identity;
-    int on_connect;
+    /* Our nick and channels, as the remote last told us, and the last
+     * snapshot of them handed to a client, taken when line snapshot_seq 
+     * was the latest
+     */
+    irc_state state;
+    shared_buffer *snapshot;
+    unsigned long snapshot_seq;
+    //Set once the remote has welcomed us
+    int registered;
+
+    //Lines received from the remote, by command id, and lines that didn't parse
+    unsigned long command_counts[CMD_COUNT];
+    unsigned long parse_errors;
+
+    //Wakeups of our loop, unless another multiplexer on it got there first
+    histogram loop_latency;
+
+    /* Serves metrics to whoever connects, if set_admin_socket was called.
+     * Scrapes waiting on the fan-out workers are kept so shutdown can 
+     * free them.
+     */
+    char *admin_socket_path;
+    int admin_socket;
+    event_handler admin_handler;
+    struct admin_connection_struct *admins;
+    struct scrape_struct *scrapes;
 
 } irc_multiplexer;
 
 void init_multiplexer(irc_multiplexer *this);
+
+/*
+ * Sets the server to connect to. Nothing is resolved or connected until
+ * the multiplexer is attached to a loop.
+ */
 void set_irc_server(irc_multiplexer *this, char *server_name, in_port_t server_port);
+
+/*
+ * Has the connection to the server use TLS, checking the server's
+ * certificate against the CAs in ca_file, or the system's if it's NULL
+ */
+void set_irc_tls(irc_multiplexer *this, char *ca_file);
 void set_local_socket(irc_multiplexer *this, char *socket_path);
+
+/*
+ * Listens for metrics scrapes on a second unix socket. Each connection is
+ * answered with the Prometheus text format once it sends a line, over HTTP
+ * if that line is a GET, and is then closed.
+ */
+void set_admin_socket(irc_multiplexer *this, char *socket_path);
+
+/*
+ * Hooks the multiplexer's sockets into a loop and starts connecting to
+ * the remote, registering once connected. The loop must be run by the 
+ * caller.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int attach_multiplexer(irc_multiplexer *this, event_loop *loop);
+
+/*
+ * Disconnects the remote and every client and stops listening. Losing the
+ * remote doesn't call for this, we reconnect instead.
+ */
+void shutdown_multiplexer(irc_multiplexer *this);
+
+/*
+ * Runs the multiplexer on an event loop of its own until it shuts down.
+ */
 void start_server(irc_multiplexer *this);
+
+/*
+ * Bounds how much output may be queued for a single client, and picks what
+ * happens when a client falls that far behind.
+ */
+void set_client_backlog(irc_multiplexer *this, size_t max_bytes, size_t max_messages, backlog_policy policy);
+
+/*
+ * Sets how long the remote may stay quiet before it's sent a PING, and 
+ * then how long it has to answer before we give up on the connection and
+ * make a new one.
+ */
+void set_keepalive(irc_multiplexer *this, uint64_t interval_ms, uint64_t timeout_ms);
+
+/*
+ * Has clients that send nothing for idle_ms sent a PING, and dropped if
+ * they're quiet for idle_ms more. 0, the default, turns this off, since
+ * plenty of bots only ever listen. Must be called before the multiplexer 
+ * is attached.
+ */
+void set_client_idle_timeout(irc_multiplexer *this, uint64_t idle_ms);
+
+/*
+ * Hands client fan-out to workers_len threads of its own, leaving the 
+ * multiplexer's thread to read the remote and answer PINGs. Must be called 
+ * before the multiplexer is attached.
+ */
+void set_fanout_workers(irc_multiplexer *this, size_t workers_len);
+
+/*
+ * Sets how many lines are kept in memory for clients that resume, overall
+ * and per channel. Must be called before the multiplexer is attached.
+ */
+void set_history_size(irc_multiplexer *this, size_t history_size, size_t channel_history_size);
+
+/*
+ * Logs every line from the remote to a directory, and continues numbering
+ * lines where the log left off. Must be called before the multiplexer is
+ * attached.
+ */
+void set_message_log(irc_multiplexer *this, char *directory);
+
+/* Client management, shared with the fan-out workers */
+
+void init_client_list(client_list *list, event_loop *loop);
+
+/*
+ * Frees a client list. Its clients must have been removed already.
+ */
+void destroy_client_list(client_list *list);
+
+/*
+ * Wraps an accepted fd in a client and attaches it to the list's loop.
+ *
+ * Returns the new client, or NULL on error.
+ */
+client_socket * add_client_socket(irc_multiplexer *this, client_list *list, int fd);
+
+/*
+ * Unlinks a client from its list and releases everything it owns
+ */
+void remove_client_socket(client_socket *client);
+
+/*
+ * Returns the client in a list using fd, or NULL if there's none
+ */
+client_socket * find_client_socket(client_list *list, int fd);
+
+/*
+ * Sends a client a snapshot made by irc_state_snapshot when line seq was
+ * the last from the remote. Lines up to seq that reach the client later
+ * aren't sent, as the snapshot already covers them.
+ */
+void client_send_state(client_socket *client, shared_buffer *snapshot, unsigned long seq);
+
+/*
+ * Queues a line for every client in a list whose filters it matches. msg 
+ * is the line parsed with parse_message_view, or NULL to have it parsed
+ * here if any client's filters need it.
+ */
+void fanout_line(client_list *list, shared_buffer *line, irc_message *msg);
+
+/*
+ * Mailbox work: a fan-out worker made room in the ring after the remote
+ * thread found it full. Publishes the lines that had to wait, and reads 
+ * the remote again once they're all out.
+ */
+void on_ring_space(void *args);
 #endif /* _IRC_MULTIPLEXER_H */
 
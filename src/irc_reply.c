@@ -0,0 +1,207 @@
+/* irc_reply.c
+ *
+ * Decoders for common numeric replies
+ */
+
+#include <string.h>
+
+#include "irc_reply.h"
+
+/*
+ * Parses the digits at the start of a slice, advancing past them
+ */
+unsigned long slice_to_ulong(irc_slice *slice) {
+    unsigned long value = 0;
+    while(slice->len > 0 && *slice->ptr >= '0' && *slice->ptr <= '9') {
+	value = value * 10 + (*slice->ptr - '0');
+	slice->ptr++;
+	slice->len--;
+    }
+    return value;
+}
+
+int reply_is_decoded(int command_id) {
+    switch(command_id) {
+	case RPL_WELCOME:
+	case RPL_YOURHOST:
+	case RPL_CREATED:
+	case RPL_MYINFO:
+	case RPL_ISUPPORT:
+	case RPL_CHANNELMODEIS:
+	case RPL_TOPIC:
+	case RPL_TOPICWHOTIME:
+	case RPL_WHOREPLY:
+	case RPL_NAMREPLY:
+	case RPL_ENDOFNAMES:
+	case RPL_MOTD:
+	    return 1;
+	default:
+	    return 0;
+    }
+}
+
+int decode_reply(irc_message *msg, irc_reply *reply) {
+    if(!reply_is_decoded(msg->command_id)) {
+	return -1;
+    }
+
+    size_t count = message_param_count(msg);
+    if(count < 2) {
+	return -1;
+    }
+
+    reply->numeric = msg->command_id;
+    reply->target = message_param(msg, 0);
+
+    switch(msg->command_id) {
+	case RPL_WELCOME:
+	case RPL_YOURHOST:
+	case RPL_CREATED:
+	    reply->text.text = message_param(msg, count - 1);
+	    return 0;
+
+	case RPL_MOTD:
+	    reply->text.text = message_param(msg, count - 1);
+	    if(reply->text.text.len >= 2 && memcmp(reply->text.text.ptr, "- ", 2) == 0) {
+		reply->text.text.ptr += 2;
+		reply->text.text.len -= 2;
+	    }
+	    return 0;
+
+	case RPL_MYINFO:
+	    if(count < 5) {
+		return -1;
+	    }
+	    reply->myinfo.server = message_param(msg, 1);
+	    reply->myinfo.version = message_param(msg, 2);
+	    reply->myinfo.user_modes = message_param(msg, 3);
+	    reply->myinfo.channel_modes = message_param(msg, 4);
+	    return 0;
+
+	case RPL_ISUPPORT:
+	    //Skip our nick, and the "are supported by this server" at the end
+	    reply->isupport.tokens = msg->param_views + 1;
+	    reply->isupport.tokens_len = count - 1 - (msg->params_trailing ? 1 : 0);
+	    return 0;
+
+	case RPL_CHANNELMODEIS:
+	    if(count < 3) {
+		return -1;
+	    }
+	    reply->channel_modes.channel = message_param(msg, 1);
+	    reply->channel_modes.modes = message_param(msg, 2);
+	    reply->channel_modes.args = msg->param_views + 3;
+	    reply->channel_modes.args_len = count - 3;
+	    return 0;
+
+	case RPL_TOPIC:
+	    if(count < 3) {
+		return -1;
+	    }
+	    reply->topic.channel = message_param(msg, 1);
+	    reply->topic.topic = message_param(msg, 2);
+	    return 0;
+
+	case RPL_TOPICWHOTIME: {
+	    if(count < 4) {
+		return -1;
+	    }
+	    reply->topic_who_time.channel = message_param(msg, 1);
+	    reply->topic_who_time.setter = message_param(msg, 2);
+	    irc_slice set_at = message_param(msg, 3);
+	    reply->topic_who_time.set_at = slice_to_ulong(&set_at);
+	    return 0;
+	}
+
+	case RPL_WHOREPLY: {
+	    //<channel> <user> <host> <server> <nick> <flags> :<hops> <realname>
+	    if(count < 8) {
+		return -1;
+	    }
+	    reply->who.channel = message_param(msg, 1);
+	    reply->who.user = message_param(msg, 2);
+	    reply->who.host = message_param(msg, 3);
+	    reply->who.server = message_param(msg, 4);
+	    reply->who.nick = message_param(msg, 5);
+	    reply->who.flags = message_param(msg, 6);
+
+	    irc_slice trailing = message_param(msg, 7);
+	    reply->who.hops = (unsigned int) slice_to_ulong(&trailing);
+	    if(trailing.len > 0 && *trailing.ptr == ' ') {
+		trailing.ptr++;
+		trailing.len--;
+	    }
+	    reply->who.realname = trailing;
+	    return 0;
+	}
+
+	case RPL_NAMREPLY:
+	    //<visibility> <channel> :<names>, though old servers leave out visibility
+	    if(count >= 4) {
+		irc_slice visibility = message_param(msg, 1);
+		reply->names.visibility = visibility.len > 0 ? visibility.ptr[0] : '=';
+		reply->names.channel = message_param(msg, 2);
+	    }
+	    else if(count == 3) {
+		reply->names.visibility = '=';
+		reply->names.channel = message_param(msg, 1);
+	    }
+	    else {
+		return -1;
+	    }
+	    reply->names.names = message_param(msg, count - 1);
+	    return 0;
+
+	case RPL_ENDOFNAMES:
+	    reply->end_of_names.channel = message_param(msg, 1);
+	    return 0;
+    }
+    return -1;
+}
+
+/*
+ * Mode prefixes a server may put in front of a nick in RPL_NAMREPLY
+ */
+int is_name_prefix(char c) {
+    return c == '~' || c == '&' || c == '@' || c == '%' || c == '+';
+}
+
+int names_next(irc_reply *reply, size_t *cursor, irc_name *name) {
+    const char *names = reply->names.names.ptr;
+    size_t len = reply->names.names.len;
+    size_t i = *cursor;
+
+    while(i < len && names[i] == ' ') i++;
+    if(i == len) {
+	*cursor = i;
+	return 0;
+    }
+
+    size_t start = i;
+    while(i < len && is_name_prefix(names[i])) i++;
+    name->prefixes.ptr = names + start;
+    name->prefixes.len = i - start;
+
+    start = i;
+    while(i < len && names[i] != ' ') i++;
+    name->nick.ptr = names + start;
+    name->nick.len = i - start;
+
+    *cursor = i;
+    return 1;
+}
+
+int isupport_next(irc_reply *reply, size_t *cursor, irc_slice *key, irc_slice *value) {
+    if(*cursor >= reply->isupport.tokens_len) {
+	return 0;
+    }
+
+    irc_slice token = reply->isupport.tokens[(*cursor)++];
+    const char *equals = memchr(token.ptr, '=', token.len);
+
+    key->ptr = token.ptr;
+    key->len = equals == NULL ? token.len : (size_t) (equals - token.ptr);
+    value->ptr = equals == NULL ? token.ptr + token.len : equals + 1;
+    value->len = token.len - (value->ptr - token.ptr);
+    return 1;
+}
@@ -0,0 +1,140 @@
+/* irc_reply.h
+ *
+ * Decodes the numeric replies a server floods us with on connect and on
+ * JOIN into typed fields, so nothing has to tokenize them a second time.
+ * Every field is a slice of the line the message was parsed from.
+ */
+
+#ifndef _IRC_REPLY_H
+#define _IRC_REPLY_H
+
+#include <stddef.h>
+
+#include "irc_message.h"
+
+#define RPL_WELCOME 1
+#define RPL_YOURHOST 2
+#define RPL_CREATED 3
+#define RPL_MYINFO 4
+#define RPL_ISUPPORT 5
+#define RPL_CHANNELMODEIS 324
+#define RPL_TOPIC 332
+#define RPL_TOPICWHOTIME 333
+#define RPL_WHOREPLY 352
+#define RPL_NAMREPLY 353
+#define RPL_ENDOFNAMES 366
+#define RPL_MOTD 372
+
+typedef struct irc_reply_struct {
+    int numeric;
+    //Who the reply is addressed to, i.e. our nick
+    irc_slice target;
+
+    union {
+	//001-003 and 372; the MOTD's leading "- " is dropped
+	struct {
+	    irc_slice text;
+	} text;
+
+	//004
+	struct {
+	    irc_slice server;
+	    irc_slice version;
+	    irc_slice user_modes;
+	    irc_slice channel_modes;
+	} myinfo;
+
+	//005; walk tokens with isupport_next
+	struct {
+	    const irc_slice *tokens;
+	    size_t tokens_len;
+	} isupport;
+
+	//324; args are the params of modes that take one, in order
+	struct {
+	    irc_slice channel;
+	    irc_slice modes;
+	    const irc_slice *args;
+	    size_t args_len;
+	} channel_modes;
+
+	//332
+	struct {
+	    irc_slice channel;
+	    irc_slice topic;
+	} topic;
+
+	//333
+	struct {
+	    irc_slice channel;
+	    irc_slice setter;
+	    unsigned long set_at;
+	} topic_who_time;
+
+	//352
+	struct {
+	    irc_slice channel;
+	    irc_slice user;
+	    irc_slice host;
+	    irc_slice server;
+	    irc_slice nick;
+	    irc_slice flags;
+	    unsigned int hops;
+	    irc_slice realname;
+	} who;
+
+	//353; walk names with names_next
+	struct {
+	    //'=' public, '*' private, '@' secret
+	    char visibility;
+	    irc_slice channel;
+	    irc_slice names;
+	} names;
+
+	//366
+	struct {
+	    irc_slice channel;
+	} end_of_names;
+    };
+} irc_reply;
+
+/*
+ * A member of a channel, as listed by RPL_NAMREPLY
+ */
+typedef struct irc_name_struct {
+    //Mode prefixes such as "@" or "@+", possibly empty
+    irc_slice prefixes;
+    irc_slice nick;
+} irc_name;
+
+/*
+ * Returns 1 if there's a decoder for a command id, 0 otherwise.
+ */
+int reply_is_decoded(int command_id);
+
+/*
+ * Fills in reply from a parsed view message.
+ *
+ * Returns 0 on success, -1 if msg isn't a decoded numeric or is missing
+ * params.
+ */
+int decode_reply(irc_message *msg, irc_reply *reply);
+
+/*
+ * Takes the next nick from a RPL_NAMREPLY's names, advancing cursor, which
+ * starts at 0.
+ *
+ * Returns 1 if a name was found, 0 at the end of the list.
+ */
+int names_next(irc_reply *reply, size_t *cursor, irc_name *name);
+
+/*
+ * Takes the next KEY[=VALUE] token of a RPL_ISUPPORT, advancing cursor,
+ * which starts at 0. value is empty if the token has none. A key starting
+ * with '-' means the server has withdrawn it.
+ *
+ * Returns 1 if a token was found, 0 after the last one.
+ */
+int isupport_next(irc_reply *reply, size_t *cursor, irc_slice *key, irc_slice *value);
+
+#endif /* _IRC_REPLY_H */
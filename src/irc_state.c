@@ -0,0 +1,648 @@
+/* irc_state.c
+ *
+ * Implements the channel and nick state cache
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include "irc_state.h"
+#include "irc_reply.h"
+
+/*
+ * A snapshot being formatted
+ */
+typedef struct state_text_struct {
+    char *data;
+    size_t len;
+    size_t size;
+    int failed;
+} state_text;
+
+void free_channel(channel_state *channel);
+
+void init_irc_state(irc_state *this) {
+    memset(this, 0, sizeof(irc_state));
+    init_string_map(&(this->channels), 1);
+    irc_state_clear(this);
+}
+
+void destroy_irc_state(irc_state *this) {
+    irc_state_clear(this);
+    destroy_string_map(&(this->channels));
+    free(this->server);
+    this->server = NULL;
+}
+
+void irc_state_clear(irc_state *this) {
+    size_t cursor = 0;
+    string_map_entry *entry;
+    while((entry = string_map_next(&(this->channels), &cursor)) != NULL) {
+	free_channel((channel_state *) entry->value);
+    }
+    destroy_string_map(&(this->channels));
+    init_string_map(&(this->channels), 1);
+
+    free(this->nick);
+    free(this->mask);
+    this->nick = NULL;
+    this->mask = NULL;
+
+    //What RFC1459 servers have, until ISUPPORT says otherwise
+    strcpy(this->prefix_modes, "ov");
+    strcpy(this->prefix_chars, "@+");
+    strcpy(this->list_modes, "b");
+    strcpy(this->param_modes, "k");
+    strcpy(this->set_param_modes, "l");
+}
+
+/*
+ * Replaces a string field with a copy of a slice, or with NULL if the
+ * slice is empty
+ */
+void set_field(char **field, irc_slice value) {
+    free(*field);
+    *field = value.len > 0 ? strndup(value.ptr, value.len) : NULL;
+}
+
+/*
+ * Compares a slice with a string the way RFC1459 compares nicks
+ */
+int casemap_equals(irc_slice slice, const char *str) {
+    if(str == NULL || strlen(str) != slice.len) {
+	return 0;
+    }
+    for(size_t i = 0; i < slice.len; i++) {
+	if(irc_tolower(slice.ptr[i]) != irc_tolower(str[i])) {
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+/*
+ * The nick in a line's nick!user@host prefix
+ */
+irc_slice source_nick(irc_message *msg) {
+    irc_slice nick = msg->prefix_view;
+    for(size_t i = 0; i < nick.len; i++) {
+	if(nick.ptr[i] == '!' || nick.ptr[i] == '@') {
+	    nick.len = i;
+	    break;
+	}
+    }
+    return nick;
+}
+
+int is_me(irc_state *this, irc_slice nick) {
+    return casemap_equals(nick, this->nick);
+}
+
+channel_state * find_channel(irc_state *this, irc_slice name) {
+    if(name.len == 0) {
+	return NULL;
+    }
+    return (channel_state *) string_map_get(&(this->channels), name.ptr, name.len);
+}
+
+channel_state * new_channel(irc_state *this, irc_slice name) {
+    channel_state *channel = calloc(1, sizeof(channel_state));
+    if(channel == NULL) {
+	return NULL;
+    }
+    channel->name = strndup(name.ptr, name.len);
+    channel->visibility = '=';
+    init_string_map(&(channel->members), 1);
+
+    if(channel->name == NULL || string_map_put(&(this->channels), name.ptr, name.len, channel) != 0) {
+	free_channel(channel);
+	return NULL;
+    }
+    return channel;
+}
+
+void clear_members(channel_state *channel) {
+    size_t cursor = 0;
+    string_map_entry *entry;
+    while((entry = string_map_next(&(channel->members), &cursor)) != NULL) {
+	free(entry->value);
+    }
+    destroy_string_map(&(channel->members));
+    init_string_map(&(channel->members), 1);
+}
+
+void clear_modes(channel_state *channel) {
+    for(size_t i = 0; i < channel->modes_len; i++) {
+	free(channel->modes[i].arg);
+    }
+    channel->modes_len = 0;
+}
+
+void free_channel(channel_state *channel) {
+    clear_members(channel);
+    destroy_string_map(&(channel->members));
+    clear_modes(channel);
+    free(channel->name);
+    free(channel->topic);
+    free(channel->topic_setter);
+    free(channel);
+}
+
+void remove_channel(irc_state *this, irc_slice name) {
+    channel_state *channel = string_map_remove(&(this->channels), name.ptr, name.len);
+    if(channel != NULL) {
+	free_channel(channel);
+    }
+}
+
+/*
+ * Keeps the prefixes we know of, highest first, adding or dropping one
+ */
+void order_prefixes(irc_state *this, char *out, irc_slice prefixes, char change, int adding) {
+    size_t len = 0;
+    for(const char *c = this->prefix_chars; *c != '\0'; c++) {
+	int has = memchr(prefixes.ptr, *c, prefixes.len) != NULL;
+	if(*c == change) {
+	    has = adding;
+	}
+	if(has) {
+	    out[len++] = *c;
+	}
+    }
+    out[len] = '\0';
+}
+
+/*
+ * Adds a member to a channel, or updates its prefixes if it's there
+ */
+void add_member(irc_state *this, channel_state *channel, irc_slice nick, irc_slice prefixes) {
+    if(nick.len == 0) {
+	return;
+    }
+
+    channel_member *member = string_map_get(&(channel->members), nick.ptr, nick.len);
+    if(member == NULL) {
+	member = malloc(sizeof(channel_member));
+	if(member == NULL) {
+	    return;
+	}
+	if(string_map_put(&(channel->members), nick.ptr, nick.len, member) != 0) {
+	    free(member);
+	    return;
+	}
+    }
+    order_prefixes(this, member->prefixes, prefixes, '\0', 0);
+}
+
+void remove_member(channel_state *channel, irc_slice nick) {
+    free(string_map_remove(&(channel->members), nick.ptr, nick.len));
+}
+
+/*
+ * Sets or unsets a channel mode that's kept, as opposed to a list or
+ * member mode
+ */
+void set_channel_mode(channel_state *channel, char mode, int adding, const irc_slice *arg) {
+    size_t i = 0;
+    while(i < channel->modes_len && channel->modes[i].mode != mode) {
+	i++;
+    }
+
+    if(!adding) {
+	if(i < channel->modes_len) {
+	    free(channel->modes[i].arg);
+	    channel->modes_len--;
+	    memmove(channel->modes + i, channel->modes + i + 1, (channel->modes_len - i) * sizeof(channel_mode));
+	}
+	return;
+    }
+
+    if(i == channel->modes_len) {
+	if(channel->modes_len == STATE_MAX_MODES) {
+	    return;
+	}
+	channel->modes[channel->modes_len++].arg = NULL;
+    }
+    channel->modes[i].mode = mode;
+    if(arg != NULL) {
+	set_field(&(channel->modes[i].arg), *arg);
+    }
+}
+
+/*
+ * Applies a mode string such as "+o-v nick nick" to a channel
+ */
+void apply_modes(irc_state *this, channel_state *channel, irc_slice modes, const irc_slice *args, size_t args_len) {
+    int adding = 1;
+    size_t next_arg = 0;
+
+    for(size_t i = 0; i < modes.len; i++) {
+	char mode = modes.ptr[i];
+	if(mode == '+' || mode == '-') {
+	    adding = mode == '+';
+	    continue;
+	}
+
+	const char *prefix = strchr(this->prefix_modes, mode);
+	int takes_arg = prefix != NULL || strchr(this->list_modes, mode) != NULL
+	    || strchr(this->param_modes, mode) != NULL
+	    || (adding && strchr(this->set_param_modes, mode) != NULL);
+
+	const irc_slice *arg = NULL;
+	if(takes_arg) {
+	    if(next_arg == args_len) {
+		return;
+	    }
+	    arg = &(args[next_arg++]);
+	}
+
+	if(prefix != NULL) {
+	    channel_member *member = string_map_get(&(channel->members), arg->ptr, arg->len);
+	    if(member != NULL) {
+		irc_slice old = { member->prefixes, strlen(member->prefixes) };
+		char prefixes[STATE_MAX_PREFIXES + 1];
+		order_prefixes(this, prefixes, old, this->prefix_chars[prefix - this->prefix_modes], adding);
+		strcpy(member->prefixes, prefixes);
+	    }
+	}
+	else if(strchr(this->list_modes, mode) == NULL) {
+	    set_channel_mode(channel, mode, adding, arg);
+	}
+    }
+}
+
+/*
+ * Picks PREFIX and CHANMODES out of a RPL_ISUPPORT
+ */
+void update_isupport(irc_state *this, irc_reply *reply) {
+    size_t cursor = 0;
+    irc_slice key, value;
+
+    while(isupport_next(reply, &cursor, &key, &value)) {
+	if(slice_equals(key, "PREFIX")) {
+	    //(ov)@+
+	    const char *close = memchr(value.ptr, ')', value.len);
+	    if(value.len == 0 || value.ptr[0] != '(' || close == NULL) {
+		continue;
+	    }
+	    size_t modes_len = close - value.ptr - 1;
+	    size_t chars_len = value.len - modes_len - 2;
+	    if(modes_len != chars_len || modes_len > STATE_MAX_PREFIXES) {
+		continue;
+	    }
+	    memcpy(this->prefix_modes, value.ptr + 1, modes_len);
+	    this->prefix_modes[modes_len] = '\0';
+	    memcpy(this->prefix_chars, close + 1, chars_len);
+	    this->prefix_chars[chars_len] = '\0';
+	}
+	else if(slice_equals(key, "CHANMODES")) {
+	    //A,B,C,D: lists, always a param, a param when set, never a param
+	    char *kinds[3] = { this->list_modes, this->param_modes, this->set_param_modes };
+	    size_t start = 0;
+	    for(size_t kind = 0; kind < 3; kind++) {
+		size_t end = start;
+		while(end < value.len && value.ptr[end] != ',') {
+		    end++;
+		}
+		size_t len = end - start < sizeof(this->list_modes) ? end - start : sizeof(this->list_modes) - 1;
+		memcpy(kinds[kind], value.ptr + start, len);
+		kinds[kind][len] = '\0';
+		start = end < value.len ? end + 1 : end;
+	    }
+	}
+    }
+}
+
+void update_nick(irc_state *this, irc_message *msg) {
+    irc_slice old = source_nick(msg);
+    irc_slice nick = message_param(msg, 0);
+    if(old.len == 0 || nick.len == 0) {
+	return;
+    }
+
+    if(is_me(this, old)) {
+	set_field(&(this->nick), nick);
+
+	//Keep the user@host we had
+	if(this->mask != NULL) {
+	    char *rest = this->mask + strcspn(this->mask, "!@");
+	    char *mask = malloc(nick.len + strlen(rest) + 1);
+	    if(mask != NULL) {
+		memcpy(mask, nick.ptr, nick.len);
+		strcpy(mask + nick.len, rest);
+	    }
+	    free(this->mask);
+	    this->mask = mask;
+	}
+    }
+
+    size_t cursor = 0;
+    string_map_entry *entry;
+    while((entry = string_map_next(&(this->channels), &cursor)) != NULL) {
+	channel_state *channel = (channel_state *) entry->value;
+	channel_member *member = string_map_remove(&(channel->members), old.ptr, old.len);
+	if(member != NULL && string_map_put(&(channel->members), nick.ptr, nick.len, member) != 0) {
+	    free(member);
+	}
+    }
+}
+
+void update_join(irc_state *this, irc_message *msg) {
+    irc_slice nick = source_nick(msg);
+    irc_slice name = message_param(msg, 0);
+    irc_slice none = { "", 0 };
+    channel_state *channel = find_channel(this, name);
+
+    if(is_me(this, nick)) {
+	if(channel == NULL && (channel = new_channel(this, name)) == NULL) {
+	    return;
+	}
+	if(nick.len < msg->prefix_view.len) {
+	    set_field(&(this->mask), msg->prefix_view);
+	}
+    }
+    if(channel != NULL) {
+	add_member(this, channel, nick, none);
+    }
+}
+
+/*
+ * PART and KICK: someone left a channel, maybe us
+ */
+void update_leave(irc_state *this, irc_slice name, irc_slice nick) {
+    if(is_me(this, nick)) {
+	remove_channel(this, name);
+	return;
+    }
+    channel_state *channel = find_channel(this, name);
+    if(channel != NULL) {
+	remove_member(channel, nick);
+    }
+}
+
+void update_quit(irc_state *this, irc_message *msg) {
+    irc_slice nick = source_nick(msg);
+
+    size_t cursor = 0;
+    string_map_entry *entry;
+    while((entry = string_map_next(&(this->channels), &cursor)) != NULL) {
+	remove_member((channel_state *) entry->value, nick);
+    }
+}
+
+void update_topic(channel_state *channel, irc_slice topic, irc_slice setter, unsigned long set_at) {
+    set_field(&(channel->topic), topic);
+    set_field(&(channel->topic_setter), setter);
+    channel->topic_set_at = set_at;
+}
+
+void update_names(irc_state *this, irc_reply *reply) {
+    channel_state *channel = find_channel(this, reply->names.channel);
+    if(channel == NULL) {
+	return;
+    }
+
+    //A fresh listing replaces whatever we had
+    if(!channel->names_pending) {
+	clear_members(channel);
+	channel->names_pending = 1;
+    }
+    channel->visibility = reply->names.visibility;
+
+    size_t cursor = 0;
+    irc_name name;
+    while(names_next(reply, &cursor, &name)) {
+	add_member(this, channel, name.nick, name.prefixes);
+    }
+}
+
+int irc_state_command(int command_id) {
+    //The lines irc_state_update looks at
+    switch(command_id) {
+	case RPL_WELCOME:
+	case RPL_ISUPPORT:
+	case CMD_NICK:
+	case CMD_JOIN:
+	case CMD_PART:
+	case CMD_KICK:
+	case CMD_QUIT:
+	case CMD_TOPIC:
+	case CMD_MODE:
+	case RPL_CHANNELMODEIS:
+	case RPL_TOPIC:
+	case RPL_TOPICWHOTIME:
+	case RPL_NAMREPLY:
+	case RPL_ENDOFNAMES:
+	    return 1;
+	default:
+	    return 0;
+    }
+}
+
+void irc_state_update(irc_state *this, irc_message *msg) {
+    irc_reply reply;
+    channel_state *channel;
+    size_t count;
+
+    switch(msg->command_id) {
+	case RPL_WELCOME:
+	    if(decode_reply(msg, &reply) == 0) {
+		//A new connection, so nothing we knew holds any more
+		irc_state_clear(this);
+		set_field(&(this->nick), reply.target);
+		set_field(&(this->server), msg->prefix_view);
+	    }
+	    break;
+
+	case RPL_ISUPPORT:
+	    if(decode_reply(msg, &reply) == 0) {
+		update_isupport(this, &reply);
+	    }
+	    break;
+
+	case CMD_NICK:
+	    update_nick(this, msg);
+	    break;
+
+	case CMD_JOIN:
+	    update_join(this, msg);
+	    break;
+
+	case CMD_PART:
+	    update_leave(this, message_param(msg, 0), source_nick(msg));
+	    break;
+
+	case CMD_KICK:
+	    update_leave(this, message_param(msg, 0), message_param(msg, 1));
+	    break;
+
+	case CMD_QUIT:
+	    update_quit(this, msg);
+	    break;
+
+	case CMD_TOPIC:
+	    channel = find_channel(this, message_param(msg, 0));
+	    if(channel != NULL) {
+		update_topic(channel, message_param(msg, 1), msg->prefix_view, (unsigned long) time(NULL));
+	    }
+	    break;
+
+	case CMD_MODE:
+	    //User modes and channels we aren't in have no channel
+	    channel = find_channel(this, message_param(msg, 0));
+	    count = message_param_count(msg);
+	    if(channel != NULL && count >= 2) {
+		apply_modes(this, channel, message_param(msg, 1), msg->param_views + 2, count - 2);
+	    }
+	    break;
+
+	case RPL_CHANNELMODEIS:
+	    if(decode_reply(msg, &reply) == 0 && (channel = find_channel(this, reply.channel_modes.channel)) != NULL) {
+		clear_modes(channel);
+		apply_modes(this, channel, reply.channel_modes.modes, reply.channel_modes.args, reply.channel_modes.args_len);
+	    }
+	    break;
+
+	case RPL_TOPIC:
+	    if(decode_reply(msg, &reply) == 0 && (channel = find_channel(this, reply.topic.channel)) != NULL) {
+		set_field(&(channel->topic), reply.topic.topic);
+	    }
+	    break;
+
+	case RPL_TOPICWHOTIME:
+	    if(decode_reply(msg, &reply) == 0 && (channel = find_channel(this, reply.topic_who_time.channel)) != NULL) {
+		set_field(&(channel->topic_setter), reply.topic_who_time.setter);
+		channel->topic_set_at = reply.topic_who_time.set_at;
+	    }
+	    break;
+
+	case RPL_NAMREPLY:
+	    if(decode_reply(msg, &reply) == 0) {
+		update_names(this, &reply);
+	    }
+	    break;
+
+	case RPL_ENDOFNAMES:
+	    if(decode_reply(msg, &reply) == 0 && (channel = find_channel(this, reply.end_of_names.channel)) != NULL) {
+		channel->names_pending = 0;
+	    }
+	    break;
+    }
+}
+
+const char * channel_key(channel_state *channel) {
+    for(size_t i = 0; i < channel->modes_len; i++) {
+	if(channel->modes[i].mode == 'k') {
+	    return channel->modes[i].arg;
+	}
+    }
+    return NULL;
+}
+
+void state_printf(state_text *this, const char *format, ...) {
+    while(!this->failed) {
+	size_t space = this->size - this->len;
+
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(this->data == NULL ? NULL : this->data + this->len, space, format, args);
+	va_end(args);
+
+	if(len < 0) {
+	    this->failed = 1;
+	    return;
+	}
+	if((size_t) len < space) {
+	    this->len += len;
+	    return;
+	}
+
+	size_t size = this->size == 0 ? 4096 : this->size * 2;
+	while(size - this->len <= (size_t) len) {
+	    size *= 2;
+	}
+	char *data = realloc(this->data, size);
+	if(data == NULL) {
+	    this->failed = 1;
+	    return;
+	}
+	this->data = data;
+	this->size = size;
+    }
+}
+
+/*
+ * Formats a channel's members as RPL_NAMREPLY lines short enough to send
+ */
+void format_names(irc_state *this, channel_state *channel, const char *server, state_text *text) {
+    size_t line_start = 0;
+    size_t names_len = 0;
+
+    size_t cursor = 0;
+    string_map_entry *entry;
+    while((entry = string_map_next(&(channel->members), &cursor)) != NULL) {
+	channel_member *member = (channel_member *) entry->value;
+	size_t need = strlen(member->prefixes) + entry->key_len + 1;
+
+	if(names_len > 0 && text->len - line_start + need > STATE_MAX_LINE) {
+	    state_printf(text, "\r\n");
+	    names_len = 0;
+	}
+	if(names_len == 0) {
+	    line_start = text->len;
+	    state_printf(text, ":%s 353 %s %c %s :", server, this->nick, channel->visibility, channel->name);
+	}
+	state_printf(text, "%s%s%.*s", names_len > 0 ? " " : "", member->prefixes, (int) entry->key_len, entry->key);
+	names_len++;
+    }
+    if(names_len > 0) {
+	state_printf(text, "\r\n");
+    }
+}
+
+shared_buffer * irc_state_snapshot(irc_state *this, const char *notice_source) {
+    if(this->nick == NULL) {
+	return NULL;
+    }
+
+    const char *server = this->server != NULL ? this->server : notice_source;
+    const char *mask = this->mask != NULL ? this->mask : this->nick;
+    state_text text = { NULL, 0, 0, 0 };
+
+    size_t cursor = 0;
+    string_map_entry *entry;
+    while((entry = string_map_next(&(this->channels), &cursor)) != NULL) {
+	channel_state *channel = (channel_state *) entry->value;
+
+	state_printf(&text, ":%s JOIN %s\r\n", mask, channel->name);
+	if(channel->topic != NULL) {
+	    state_printf(&text, ":%s 332 %s %s :%s\r\n", server, this->nick, channel->name, channel->topic);
+	}
+	if(channel->topic_setter != NULL) {
+	    state_printf(&text, ":%s 333 %s %s %s %lu\r\n", server, this->nick, channel->name,
+		    channel->topic_setter, channel->topic_set_at);
+	}
+	if(channel->modes_len > 0) {
+	    state_printf(&text, ":%s 324 %s %s +", server, this->nick, channel->name);
+	    for(size_t i = 0; i < channel->modes_len; i++) {
+		state_printf(&text, "%c", channel->modes[i].mode);
+	    }
+	    for(size_t i = 0; i < channel->modes_len; i++) {
+		if(channel->modes[i].arg != NULL) {
+		    state_printf(&text, " %s", channel->modes[i].arg);
+		}
+	    }
+	    state_printf(&text, "\r\n");
+	}
+	format_names(this, channel, server, &text);
+	state_printf(&text, ":%s 366 %s %s :End of /NAMES list.\r\n", server, this->nick, channel->name);
+    }
+    state_printf(&text, ":%s NOTICE %s :End of state\r\n", notice_source, this->nick);
+
+    shared_buffer *snapshot = text.failed ? NULL : new_shared_buffer(text.data, text.len);
+    free(text.data);
+    return snapshot;
+}
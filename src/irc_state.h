@@ -0,0 +1,112 @@
+/* irc_state.h
+ *
+ * Defines a cache of what the remote has told us about ourselves: our
+ * nick, the channels we're in, and their members, modes and topics. It's
+ * kept up to date from the lines the remote sends anyway, so a client that
+ * attaches can be handed it at once instead of asking the server again.
+ * Channels and nicks are looked up RFC1459 case-mapped.
+ */
+
+#ifndef _IRC_STATE_H
+#define _IRC_STATE_H
+
+#include "irc_message.h"
+#include "string_map.h"
+#include "shared_buffer.h"
+
+//Most member modes a server may define, e.g. ~&@%+ and a few spare
+#define STATE_MAX_PREFIXES 8
+
+//Most modes with no list kept for a channel at once
+#define STATE_MAX_MODES 32
+
+//Longest line a snapshot makes up, less the CR LF
+#define STATE_MAX_LINE 510
+
+typedef struct channel_member_struct {
+    //Member mode prefixes, highest first, e.g. "@+"
+    char prefixes[STATE_MAX_PREFIXES + 1];
+} channel_member;
+
+typedef struct channel_mode_struct {
+    char mode;
+    //The mode's param, e.g. a key or limit, or NULL if it has none
+    char *arg;
+} channel_mode;
+
+typedef struct channel_state_struct {
+    //Spelled the way the server first sent it to us
+    char *name;
+
+    //NULL while there is none
+    char *topic;
+    char *topic_setter;
+    unsigned long topic_set_at;
+
+    channel_mode modes[STATE_MAX_MODES];
+    size_t modes_len;
+
+    //'=' public, '*' private, '@' secret
+    char visibility;
+
+    //channel_member by nick
+    string_map members;
+    //Set while a NAMES listing comes in; the listing replaces the members
+    int names_pending;
+} channel_state;
+
+typedef struct irc_state_struct {
+    //Our nick, and our nick!user@host once a JOIN of ours showed it
+    char *nick;
+    char *mask;
+    //Who welcomed us, used as the source of replies in a snapshot
+    char *server;
+
+    //channel_state by name
+    string_map channels;
+
+    //Member modes and their prefixes, highest first, from ISUPPORT PREFIX
+    char prefix_modes[STATE_MAX_PREFIXES + 1];
+    char prefix_chars[STATE_MAX_PREFIXES + 1];
+
+    //Channel modes by the params they take, from ISUPPORT CHANMODES
+    char list_modes[32];
+    char param_modes[32];
+    char set_param_modes[32];
+} irc_state;
+
+void init_irc_state(irc_state *this);
+void destroy_irc_state(irc_state *this);
+
+/*
+ * Forgets every channel, and our nick
+ */
+void irc_state_clear(irc_state *this);
+
+/*
+ * Updates the state from a line the remote sent, parsed as a view.
+ * Lines that don't concern it are ignored.
+ */
+void irc_state_update(irc_state *this, irc_message *msg);
+
+/*
+ * Returns 1 if lines with a command can change the state, so a snapshot
+ * taken after one reflects it; 0 otherwise.
+ */
+int irc_state_command(int command_id);
+
+/*
+ * Returns a channel's key (mode k), or NULL if it has none
+ */
+const char * channel_key(channel_state *channel);
+
+/*
+ * Formats the state as the lines a server sends when a channel is joined:
+ * a JOIN, the topic, the modes and the NAMES listing for every channel,
+ * then a NOTICE from notice_source saying that was all.
+ *
+ * Returns the lines, or NULL if we don't know our nick yet or on error.
+ */
+shared_buffer * irc_state_snapshot(irc_state *this, const char *notice_source);
+
+#endif /* _IRC_STATE_H */
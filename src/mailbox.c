@@ -0,0 +1,107 @@
+/* mailbox.c
+ *
+ * Implementation of cross-thread mailboxes
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "mailbox.h"
+
+/*
+ * Runs everything posted so far. The queue is detached under the lock and
+ * worked through without it, so posting threads are never held up by the
+ * work itself.
+ */
+void mailbox_on_event(int fd, uint32_t events, void *args) {
+    mailbox *this = (mailbox *) args;
+
+    uint64_t count;
+    if(read(fd, &count, sizeof(count)) < 0) {
+	//Spurious wakeup, nothing to do
+    }
+
+    pthread_mutex_lock(&(this->lock));
+    mailbox_message *current = this->head;
+    this->head = NULL;
+    this->tail = NULL;
+    pthread_mutex_unlock(&(this->lock));
+
+    while(current != NULL) {
+	mailbox_message *next = current->next;
+	(*(current->fn))(current->args);
+	free(current);
+	current = next;
+    }
+}
+
+int init_mailbox(mailbox *this, event_loop *loop) {
+    pthread_mutex_init(&(this->lock), NULL);
+    this->head = NULL;
+    this->tail = NULL;
+    this->loop = loop;
+
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(fd < 0) {
+	perror("eventfd()");
+	return -1;
+    }
+
+    init_event_handler(&(this->handler), fd, &mailbox_on_event, this);
+    if(event_loop_add(loop, &(this->handler), EPOLLIN) != 0) {
+	close(fd);
+	return -1;
+    }
+    return 0;
+}
+
+void destroy_mailbox(mailbox *this) {
+    event_loop_remove(this->loop, &(this->handler));
+    close(this->handler.fd);
+
+    mailbox_message *current = this->head;
+    while(current != NULL) {
+	mailbox_message *next = current->next;
+	if(current->drop != NULL) {
+	    (*(current->drop))(current->args);
+	}
+	free(current);
+	current = next;
+    }
+    pthread_mutex_destroy(&(this->lock));
+}
+
+int mailbox_post(mailbox *this, void (*fn)(void *), void (*drop)(void *), void *args) {
+    mailbox_message *message = malloc(sizeof(mailbox_message));
+    if(message == NULL) {
+	return -1;
+    }
+    message->fn = fn;
+    message->drop = drop;
+    message->args = args;
+    message->next = NULL;
+
+    pthread_mutex_lock(&(this->lock));
+    if(this->tail == NULL) {
+	this->head = message;
+    }
+    else {
+	this->tail->next = message;
+    }
+    this->tail = message;
+    pthread_mutex_unlock(&(this->lock));
+
+    /* The message is queued and will run on the next wakeup, so the caller
+     * mustn't touch args whatever happens here. EAGAIN only means the 
+     * counter is full, i.e. a wakeup is pending anyway.
+     */
+    uint64_t one = 1;
+    if(write(this->handler.fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+	perror("write(eventfd)");
+    }
+    return 0;
+}
@@ -0,0 +1,57 @@
+/* mailbox.h
+ *
+ * Defines a way for one thread to run work on another thread's event loop.
+ * Any thread may post a function and its argument; the thread owning the 
+ * loop runs them in posting order on its next iteration.
+ */
+
+#ifndef _MAILBOX_H
+#define _MAILBOX_H
+
+#include <pthread.h>
+
+#include "event_loop.h"
+
+typedef struct mailbox_message_struct {
+    void (*fn)(void *);
+    //Releases args instead if the message never gets to run, may be NULL
+    void (*drop)(void *);
+    void *args;
+    struct mailbox_message_struct *next;
+} mailbox_message;
+
+typedef struct mailbox_struct {
+    pthread_mutex_t lock;
+    mailbox_message *head;
+    mailbox_message *tail;
+
+    //eventfd that wakes the owning loop
+    event_loop *loop;
+    event_handler handler;
+} mailbox;
+
+/*
+ * Creates the mailbox and registers it with the loop that will run the 
+ * posted work.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int init_mailbox(mailbox *this, event_loop *loop);
+
+/*
+ * Unregisters the mailbox and frees it. Anything still queued is dropped,
+ * with its drop function called on its args so nothing it holds leaks.
+ */
+void destroy_mailbox(mailbox *this);
+
+/*
+ * Queues fn(args) to run on the mailbox's loop. Safe from any thread. If
+ * the mailbox is destroyed first, drop(args) is called instead, unless 
+ * drop is NULL.
+ *
+ * Returns 0 on success, -1 on error. Once it's returned 0, args belong to
+ * the message; on -1 they're still the caller's.
+ */
+int mailbox_post(mailbox *this, void (*fn)(void *), void (*drop)(void *), void *args);
+
+#endif /* _MAILBOX_H */
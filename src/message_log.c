@@ -0,0 +1,734 @@
+/* message_log.c
+ *
+ * Implementation of the segmented message log
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "message_log.h"
+
+//Records gathered into a single writev by the writer
+#define LOG_MAX_IOV 64
+
+void * run_message_log(void *args);
+void * run_log_reads(void *args);
+int reader_seek(log_reader *this);
+
+void segment_path(char *path, size_t size, const char *directory, uint64_t first_seq, const char *extension) {
+    snprintf(path, size, "%s/%020llu.%s", directory, (unsigned long long) first_seq, extension);
+}
+
+size_t index_file_size(size_t capacity) {
+    return sizeof(log_index_header) + capacity * sizeof(log_index_entry);
+}
+
+int compare_segments(const void *a, const void *b) {
+    uint64_t left = ((const log_segment *) a)->first_seq;
+    uint64_t right = ((const log_segment *) b)->first_seq;
+    return left < right ? -1 : left > right;
+}
+
+/*
+ * Maps a segment's index read-only.
+ *
+ * Returns the mapping, or NULL if there's no usable index.
+ */
+log_index_header * map_index(const char *directory, uint64_t first_seq, size_t *map_len) {
+    char path[4096];
+    segment_path(path, sizeof(path), directory, first_seq, "idx");
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+	return NULL;
+    }
+
+    struct stat index_stat;
+    log_index_header *index = NULL;
+    if(fstat(fd, &index_stat) == 0 && (size_t) index_stat.st_size >= sizeof(log_index_header)) {
+	index = mmap(NULL, index_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(index == MAP_FAILED) {
+	    index = NULL;
+	}
+	else if(index->magic != LOG_INDEX_MAGIC || index->version != LOG_INDEX_VERSION) {
+	    munmap(index, index_stat.st_size);
+	    index = NULL;
+	}
+	*map_len = index_stat.st_size;
+    }
+    close(fd);
+    return index;
+}
+
+/*
+ * Number of index entries it's safe to look at
+ */
+uint64_t index_count(log_index_header *index, size_t map_len) {
+    uint64_t count = __atomic_load_n(&(index->count), __ATOMIC_ACQUIRE);
+    uint64_t fits = (map_len - sizeof(log_index_header)) / sizeof(log_index_entry);
+    return count < fits ? count : fits;
+}
+
+/*
+ * Finds the end of the last complete record in a segment left behind by a
+ * previous run, cutting off a torn one, and notes the segment's first
+ * timestamp and last sequence number.
+ */
+int recover_segment(message_log *this, log_segment *segment) {
+    char path[4096];
+    segment_path(path, sizeof(path), this->directory, segment->first_seq, "log");
+
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if(fd < 0) {
+	perror(path);
+	return -1;
+    }
+
+    struct stat log_stat;
+    if(fstat(fd, &log_stat) != 0) {
+	close(fd);
+	return -1;
+    }
+
+    //Start from the last indexed record, if the index survived
+    uint64_t offset = 0;
+    size_t map_len;
+    log_index_header *index = map_index(this->directory, segment->first_seq, &map_len);
+    if(index != NULL) {
+	uint64_t count = index_count(index, map_len);
+	log_index_entry *entries = (log_index_entry *) (index + 1);
+	while(count > 0 && entries[count - 1].offset >= (uint64_t) log_stat.st_size) {
+	    count--;
+	}
+	if(count > 0) {
+	    offset = entries[count - 1].offset;
+	}
+	munmap(index, map_len);
+    }
+
+    log_record_header header;
+    while(pread(fd, &header, sizeof(header), offset) == sizeof(header)
+	    && offset + sizeof(header) + header.len <= (uint64_t) log_stat.st_size) {
+	if(offset == 0) {
+	    segment->first_timestamp_us = header.timestamp_us;
+	}
+	if(header.seq > this->last_seq) {
+	    this->last_seq = header.seq;
+	}
+	offset += sizeof(header) + header.len;
+    }
+
+    if(offset < (uint64_t) log_stat.st_size) {
+	fprintf(stderr, "NOTICE: Truncating torn record at %s:%llu\n", path, (unsigned long long) offset);
+	if(ftruncate(fd, offset) != 0) {
+	    perror("ftruncate()");
+	}
+    }
+    if(segment->first_timestamp_us == 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header)) {
+	segment->first_timestamp_us = header.timestamp_us;
+    }
+    segment->committed = offset;
+
+    close(fd);
+    return 0;
+}
+
+int open_message_log(message_log *this, const char *directory) {
+    memset(this, 0, sizeof(message_log));
+    this->directory = strdup(directory);
+    this->fd = -1;
+
+    if(mkdir(directory, 0755) != 0 && errno != EEXIST) {
+	perror(directory);
+	return -1;
+    }
+
+    DIR *dir = opendir(directory);
+    if(dir == NULL) {
+	perror(directory);
+	return -1;
+    }
+
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL) {
+	char *end;
+	unsigned long long first_seq = strtoull(entry->d_name, &end, 10);
+	if(end != entry->d_name + 20 || strcmp(end, ".log") != 0) {
+	    continue;
+	}
+
+	if(this->segments_len == this->segments_size) {
+	    this->segments_size = this->segments_size == 0 ? 16 : this->segments_size * 2;
+	    this->segments = realloc(this->segments, this->segments_size * sizeof(log_segment));
+	}
+	log_segment *segment = &(this->segments[this->segments_len++]);
+	memset(segment, 0, sizeof(log_segment));
+	segment->first_seq = first_seq;
+    }
+    closedir(dir);
+
+    if(this->segments_len > 0) {
+	qsort(this->segments, this->segments_len, sizeof(log_segment), &compare_segments);
+	for(size_t i = 0; i < this->segments_len; i++) {
+	    if(recover_segment(this, &(this->segments[i])) != 0) {
+		return -1;
+	    }
+	}
+    }
+
+    pthread_mutex_init(&(this->lock), NULL);
+    pthread_cond_init(&(this->wake), NULL);
+    pthread_cond_init(&(this->read_wake), NULL);
+
+    int error = pthread_create(&(this->thread), NULL, &run_message_log, this);
+    if(error != 0) {
+	fprintf(stderr, "Error: could not start log writer: %s\n", strerror(error));
+	return -1;
+    }
+    error = pthread_create(&(this->read_thread), NULL, &run_log_reads, this);
+    if(error != 0) {
+	fprintf(stderr, "Error: could not start log reader: %s\n", strerror(error));
+	close_message_log(this);
+	return -1;
+    }
+    return 0;
+}
+
+void close_message_log(message_log *this) {
+    pthread_mutex_lock(&(this->lock));
+    this->stopping = 1;
+    pthread_cond_signal(&(this->wake));
+    pthread_mutex_unlock(&(this->lock));
+
+    pthread_join(this->thread, NULL);
+    message_log_stop_reads(this);
+
+    pthread_cond_destroy(&(this->read_wake));
+    pthread_cond_destroy(&(this->wake));
+    pthread_mutex_destroy(&(this->lock));
+    free(this->segments);
+    free(this->directory);
+}
+
+void message_log_append(message_log *this, shared_buffer *line, uint64_t timestamp_us) {
+    log_pending *pending = malloc(sizeof(log_pending));
+    if(pending == NULL) {
+	return;
+    }
+    pending->line = shared_buffer_ref(line);
+    pending->timestamp_us = timestamp_us;
+    pending->next = NULL;
+
+    pthread_mutex_lock(&(this->lock));
+    if(this->pending_len >= LOG_MAX_PENDING) {
+	//The disk can't keep up; better a gap in the log than running out of memory
+	__atomic_add_fetch(&(this->dropped), 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&(this->lock));
+	shared_buffer_unref(pending->line);
+	free(pending);
+	return;
+    }
+    this->pending_len++;
+    if(this->pending_tail == NULL) {
+	this->pending_head = pending;
+	//The writer only needs waking for the first line of a batch
+	pthread_cond_signal(&(this->wake));
+    }
+    else {
+	this->pending_tail->next = pending;
+    }
+    this->pending_tail = pending;
+    pthread_mutex_unlock(&(this->lock));
+}
+
+/* Writer thread */
+
+/*
+ * Makes the records written so far durable, then lets readers see them
+ */
+void publish_segment(message_log *this, uint64_t index_entries) {
+    if(fdatasync(this->fd) != 0) {
+	perror("fdatasync()");
+    }
+    __atomic_store_n(&(this->index->count), index_entries, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&(this->lock));
+    this->segments[this->segments_len - 1].committed = this->offset;
+    pthread_mutex_unlock(&(this->lock));
+}
+
+void seal_segment(message_log *this) {
+    if(this->fd < 0) {
+	return;
+    }
+    munmap(this->index, index_file_size(this->index_capacity));
+    close(this->fd);
+    this->fd = -1;
+    this->index = NULL;
+}
+
+int start_segment(message_log *this, uint64_t first_seq, uint64_t first_timestamp_us) {
+    char path[4096];
+
+    /* A crash between starting a segment and writing to it leaves one 
+     * named after the line we're about to write, which we take over. One
+     * with records in it would mean the sequence numbers went backwards.
+     */
+    pthread_mutex_lock(&(this->lock));
+    log_segment *last = this->segments_len > 0 ? &(this->segments[this->segments_len - 1]) : NULL;
+    int reuse = last != NULL && last->first_seq == first_seq;
+    uint64_t committed = reuse ? last->committed : 0;
+    pthread_mutex_unlock(&(this->lock));
+
+    segment_path(path, sizeof(path), this->directory, first_seq, "log");
+    if(committed > 0) {
+	fprintf(stderr, "Error: %s already has records in it\n", path);
+	return -1;
+    }
+    this->fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if(this->fd < 0) {
+	perror(path);
+	return -1;
+    }
+
+    //The index is sized for a full segment up front so it never moves
+    this->index_capacity = LOG_SEGMENT_SIZE / LOG_INDEX_INTERVAL + 1;
+    size_t index_size = index_file_size(this->index_capacity);
+
+    segment_path(path, sizeof(path), this->directory, first_seq, "idx");
+    int index_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(index_fd < 0 || ftruncate(index_fd, index_size) != 0
+	    || (this->index = mmap(NULL, index_size, PROT_READ | PROT_WRITE, MAP_SHARED, index_fd, 0)) == MAP_FAILED) {
+	perror(path);
+	if(index_fd >= 0) {
+	    close(index_fd);
+	}
+	close(this->fd);
+	this->fd = -1;
+	this->index = NULL;
+	return -1;
+    }
+    close(index_fd);
+
+    this->index->magic = LOG_INDEX_MAGIC;
+    this->index->version = LOG_INDEX_VERSION;
+    this->index->count = 0;
+    this->offset = 0;
+    this->indexed_offset = 0;
+
+    pthread_mutex_lock(&(this->lock));
+    if(!reuse && this->segments_len == this->segments_size) {
+	this->segments_size = this->segments_size == 0 ? 16 : this->segments_size * 2;
+	this->segments = realloc(this->segments, this->segments_size * sizeof(log_segment));
+    }
+    log_segment *segment = &(this->segments[reuse ? this->segments_len - 1 : this->segments_len++]);
+    segment->first_seq = first_seq;
+    segment->first_timestamp_us = first_timestamp_us;
+    segment->committed = 0;
+
+    //Retention: readers still holding an old segment open keep reading it
+    while(this->segments_len > LOG_MAX_SEGMENTS) {
+	segment_path(path, sizeof(path), this->directory, this->segments[0].first_seq, "log");
+	unlink(path);
+	segment_path(path, sizeof(path), this->directory, this->segments[0].first_seq, "idx");
+	unlink(path);
+	memmove(this->segments, this->segments + 1, --this->segments_len * sizeof(log_segment));
+    }
+    pthread_mutex_unlock(&(this->lock));
+    return 0;
+}
+
+/*
+ * Writes out a gathered set of records, picking up after short writes
+ */
+int write_records(message_log *this, struct iovec *iov, int iovcnt) {
+    while(iovcnt > 0) {
+	ssize_t written = writev(this->fd, iov, iovcnt);
+	if(written < 0) {
+	    if(errno == EINTR) {
+		continue;
+	    }
+	    perror("writev()");
+	    return -1;
+	}
+
+	while(iovcnt > 0 && (size_t) written >= iov->iov_len) {
+	    written -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if(iovcnt > 0) {
+	    iov->iov_base = (char *) iov->iov_base + written;
+	    iov->iov_len -= written;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Appends a batch of lines to the log with as few writes as possible,
+ * rolling over to a new segment when the current one is full, and syncs
+ * once at the end.
+ */
+void write_batch(message_log *this, log_pending *batch) {
+    struct iovec iov[LOG_MAX_IOV * 2];
+    log_record_header headers[LOG_MAX_IOV];
+    int records = 0;
+    uint64_t index_entries = this->index != NULL ? this->index->count : 0;
+
+    for(log_pending *pending = batch; pending != NULL; pending = pending->next) {
+	shared_buffer *line = pending->line;
+	size_t len = line->len - line->header_len;
+	uint64_t record_size = sizeof(log_record_header) + len;
+
+	if(this->fd < 0 || (this->offset > 0 && this->offset + record_size > LOG_SEGMENT_SIZE)) {
+	    if(this->fd >= 0) {
+		write_records(this, iov, records * 2);
+		records = 0;
+		publish_segment(this, index_entries);
+		seal_segment(this);
+	    }
+	    if(start_segment(this, line->seq, pending->timestamp_us) != 0) {
+		//Nowhere to put the rest of the batch
+		unsigned long lost = 0;
+		for(; pending != NULL; pending = pending->next) {
+		    lost++;
+		}
+		__atomic_add_fetch(&(this->dropped), lost, __ATOMIC_RELAXED);
+		fprintf(stderr, "Error: dropped %lu lines meant for the message log\n", lost);
+		return;
+	    }
+	    index_entries = 0;
+	}
+
+	if((this->offset == 0 || this->offset - this->indexed_offset >= LOG_INDEX_INTERVAL)
+		&& index_entries < this->index_capacity) {
+	    log_index_entry *entry = ((log_index_entry *) (this->index + 1)) + index_entries++;
+	    entry->seq = line->seq;
+	    entry->timestamp_us = pending->timestamp_us;
+	    entry->offset = this->offset;
+	    this->indexed_offset = this->offset;
+	}
+
+	log_record_header *header = &(headers[records]);
+	header->seq = line->seq;
+	header->timestamp_us = pending->timestamp_us;
+	header->len = len;
+	header->reserved = 0;
+
+	iov[records * 2].iov_base = header;
+	iov[records * 2].iov_len = sizeof(log_record_header);
+	iov[records * 2 + 1].iov_base = line->data + line->header_len;
+	iov[records * 2 + 1].iov_len = len;
+	records++;
+
+	this->offset += record_size;
+	this->records++;
+
+	if(records == LOG_MAX_IOV) {
+	    write_records(this, iov, records * 2);
+	    records = 0;
+	}
+    }
+
+    if(this->fd >= 0) {
+	write_records(this, iov, records * 2);
+	publish_segment(this, index_entries);
+    }
+    this->batches++;
+}
+
+void * run_message_log(void *args) {
+    message_log *this = (message_log *) args;
+
+    while(1) {
+	pthread_mutex_lock(&(this->lock));
+	while(this->pending_head == NULL && !this->stopping) {
+	    pthread_cond_wait(&(this->wake), &(this->lock));
+	}
+	//Everything appended while we were busy goes out as one batch
+	log_pending *batch = this->pending_head;
+	this->pending_head = this->pending_tail = NULL;
+	this->pending_len = 0;
+	int stopping = this->stopping;
+	pthread_mutex_unlock(&(this->lock));
+
+	if(batch == NULL && stopping) {
+	    break;
+	}
+
+	write_batch(this, batch);
+
+	log_pending *next;
+	for(log_pending *current = batch; current != NULL; current = next) {
+	    next = current->next;
+	    shared_buffer_unref(current->line);
+	    free(current);
+	}
+    }
+
+    seal_segment(this);
+    return NULL;
+}
+
+/* Readers */
+
+/*
+ * Looks up a segment by its first sequence number, or the one after it
+ *
+ * Returns 1 if found, 0 if not.
+ */
+int find_segment(message_log *log, uint64_t first_seq, int next, log_segment *found) {
+    int result = 0;
+
+    pthread_mutex_lock(&(log->lock));
+    for(size_t i = 0; i < log->segments_len; i++) {
+	if(next ? log->segments[i].first_seq > first_seq : log->segments[i].first_seq == first_seq) {
+	    *found = log->segments[i];
+	    result = 1;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&(log->lock));
+    return result;
+}
+
+/*
+ * Opens a segment for reading at the last indexed record before the start
+ * of our range, or at its first record.
+ */
+int reader_open_segment(log_reader *this, uint64_t first_seq, int seek) {
+    char path[4096];
+    segment_path(path, sizeof(path), this->log->directory, first_seq, "log");
+
+    if(this->fd >= 0) {
+	close(this->fd);
+    }
+    this->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(this->fd < 0) {
+	return -1;
+    }
+    this->segment_seq = first_seq;
+    this->offset = 0;
+
+    size_t map_len;
+    log_index_header *index = seek ? map_index(this->log->directory, first_seq, &map_len) : NULL;
+    if(index != NULL) {
+	log_index_entry *entries = (log_index_entry *) (index + 1);
+	uint64_t low = 0, high = index_count(index, map_len);
+
+	//Last entry with a key below the start of the range
+	while(low < high) {
+	    uint64_t middle = low + (high - low) / 2;
+	    uint64_t key = this->by_time ? entries[middle].timestamp_us : entries[middle].seq;
+	    if(key < this->from) {
+		low = middle + 1;
+	    }
+	    else {
+		high = middle;
+	    }
+	}
+	if(low > 0) {
+	    this->offset = entries[low - 1].offset;
+	}
+	munmap(index, map_len);
+    }
+    return 0;
+}
+
+int log_reader_open(log_reader *this, message_log *log, int by_time, uint64_t from, uint64_t to) {
+    this->log = log;
+    this->by_time = by_time;
+    this->from = from;
+    this->to = to;
+    this->fd = -1;
+    this->done = 0;
+    this->chunk = malloc(LOG_READ_CHUNK);
+    if(this->chunk == NULL) {
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * Opens the last segment starting at or before the range, or the oldest
+ * one, at the place its index points us to
+ */
+int reader_seek(log_reader *this) {
+    message_log *log = this->log;
+    int found = 0;
+    uint64_t first_seq = 0;
+
+    pthread_mutex_lock(&(log->lock));
+    for(size_t i = 0; i < log->segments_len; i++) {
+	uint64_t key = this->by_time ? log->segments[i].first_timestamp_us : log->segments[i].first_seq;
+	if(!found || key <= this->from) {
+	    first_seq = log->segments[i].first_seq;
+	    found = 1;
+	}
+    }
+    pthread_mutex_unlock(&(log->lock));
+
+    if(!found) {
+	this->done = 1;
+	return 0;
+    }
+    return reader_open_segment(this, first_seq, 1);
+}
+
+void log_reader_close(log_reader *this) {
+    if(this->fd >= 0) {
+	close(this->fd);
+	this->fd = -1;
+    }
+    free(this->chunk);
+    this->chunk = NULL;
+}
+
+int log_reader_next(log_reader *this, void (*emit)(log_record_header *, const char *, void *), void *args) {
+    if(this->fd < 0 && !this->done && reader_seek(this) != 0) {
+	return -1;
+    }
+    if(this->done) {
+	return 0;
+    }
+
+    log_segment segment;
+    uint64_t committed;
+    if(find_segment(this->log, this->segment_seq, 0, &segment)) {
+	committed = segment.committed;
+    }
+    else {
+	//Deleted while we read it, but our fd still holds all of it
+	struct stat log_stat;
+	committed = fstat(this->fd, &log_stat) == 0 ? (uint64_t) log_stat.st_size : 0;
+    }
+
+    if(this->offset >= committed) {
+	if(!find_segment(this->log, this->segment_seq, 1, &segment)) {
+	    //Caught up with the writer
+	    this->done = 1;
+	    return 0;
+	}
+	if(reader_open_segment(this, segment.first_seq, 0) != 0) {
+	    return -1;
+	}
+	return 0;
+    }
+
+    size_t want = committed - this->offset;
+    if(want > LOG_READ_CHUNK) {
+	want = LOG_READ_CHUNK;
+    }
+    ssize_t got = pread(this->fd, this->chunk, want, this->offset);
+    if(got <= 0) {
+	return -1;
+    }
+
+    int emitted = 0;
+    size_t position = 0;
+    while(position + sizeof(log_record_header) <= (size_t) got) {
+	log_record_header header;
+	memcpy(&header, this->chunk + position, sizeof(header));
+	if(position + sizeof(header) + header.len > (size_t) got) {
+	    break;
+	}
+
+	uint64_t key = this->by_time ? header.timestamp_us : header.seq;
+	if(key > this->to) {
+	    this->done = 1;
+	    break;
+	}
+	if(key >= this->from) {
+	    (*emit)(&header, this->chunk + position + sizeof(header), args);
+	    emitted++;
+	}
+	position += sizeof(header) + header.len;
+    }
+
+    if(position == 0 && !this->done) {
+	//A record that doesn't fit in a chunk can't be a line of ours
+	return -1;
+    }
+    this->offset += position;
+    return emitted;
+}
+
+void message_log_read(message_log *this, log_read_job *job) {
+    job->next = NULL;
+
+    pthread_mutex_lock(&(this->lock));
+    if(this->reads_stopped) {
+	pthread_mutex_unlock(&(this->lock));
+	job->result = -1;
+	if(mailbox_post(job->mailbox, job->done, job->drop, job->args) != 0) {
+	    fprintf(stderr, "Error: could not hand back a read of the message log\n");
+	}
+	return;
+    }
+    if(this->reads_tail == NULL) {
+	this->reads_head = job;
+	pthread_cond_signal(&(this->read_wake));
+    }
+    else {
+	this->reads_tail->next = job;
+    }
+    this->reads_tail = job;
+    pthread_mutex_unlock(&(this->lock));
+}
+
+/*
+ * Reader thread: runs the jobs in the order they came, and hands each back
+ * to its mailbox
+ */
+void * run_log_reads(void *args) {
+    message_log *this = (message_log *) args;
+
+    while(1) {
+	pthread_mutex_lock(&(this->lock));
+	while(this->reads_head == NULL && !this->reads_stopped) {
+	    pthread_cond_wait(&(this->read_wake), &(this->lock));
+	}
+	log_read_job *job = this->reads_head;
+	if(job != NULL) {
+	    this->reads_head = job->next;
+	    if(this->reads_head == NULL) {
+		this->reads_tail = NULL;
+	    }
+	}
+	int stopping = this->reads_stopped;
+	pthread_mutex_unlock(&(this->lock));
+
+	if(job == NULL) {
+	    break;
+	}
+
+	//Whoever's waiting on a job is told it failed rather than left hanging
+	job->result = stopping ? -1 : log_reader_next(&(job->reader), job->emit, job->args);
+	if(mailbox_post(job->mailbox, job->done, job->drop, job->args) != 0) {
+	    //Its owner still points at it, so it can't be dropped here
+	    fprintf(stderr, "Error: could not hand back a read of the message log\n");
+	}
+    }
+    return NULL;
+}
+
+void message_log_stop_reads(message_log *this) {
+    pthread_mutex_lock(&(this->lock));
+    int stopped = this->reads_stopped;
+    this->reads_stopped = 1;
+    pthread_cond_signal(&(this->read_wake));
+    pthread_mutex_unlock(&(this->lock));
+
+    if(!stopped && this->read_thread != 0) {
+	pthread_join(this->read_thread, NULL);
+    }
+}
@@ -0,0 +1,220 @@
+/* message_log.h
+ *
+ * Defines a durable, append-only log of the lines received from the
+ * remote. The log is a directory of segment files, each holding records of
+ * up to LOG_SEGMENT_SIZE bytes and named after the sequence number of its
+ * first record:
+ *
+ *   00000000000000000001.log   records: log_record_header, then the line
+ *   00000000000000000001.idx   log_index_header, then log_index_entry[]
+ *
+ * The index is sparse, one entry per LOG_INDEX_INTERVAL bytes of records,
+ * and is mmap'd by both the writer and readers. A range of the log is found
+ * by binary searching the index and scanning forward from there, so it's
+ * never read into memory whole.
+ *
+ * Lines are appended from the multiplexer's thread, but written, indexed
+ * and fsync'd in batches by a thread of the log's own. Reads for clients
+ * run on another thread of the log's, so no event loop waits on the disk.
+ */
+
+#ifndef _MESSAGE_LOG_H
+#define _MESSAGE_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "shared_buffer.h"
+#include "mailbox.h"
+
+//A segment is sealed once its records would grow past this
+#define LOG_SEGMENT_SIZE (64 * 1024 * 1024)
+
+//Bytes of records between index entries
+#define LOG_INDEX_INTERVAL 4096
+
+//Oldest segments are deleted to keep no more than this many
+#define LOG_MAX_SEGMENTS 64
+
+//How much of a segment a reader pulls in at a time
+#define LOG_READ_CHUNK (64 * 1024)
+
+//Lines that can wait for the writer before new ones are dropped
+#define LOG_MAX_PENDING 65536
+
+#define LOG_INDEX_MAGIC 0x78646c6d
+#define LOG_INDEX_VERSION 1
+
+typedef struct log_record_header_struct {
+    uint64_t seq;
+    //Receive time, microseconds since the epoch
+    uint64_t timestamp_us;
+    uint32_t len;
+    uint32_t reserved;
+} log_record_header;
+
+typedef struct log_index_header_struct {
+    uint32_t magic;
+    uint32_t version;
+    //Entries written so far, published after the records they point at
+    uint64_t count;
+} log_index_header;
+
+typedef struct log_index_entry_struct {
+    uint64_t seq;
+    uint64_t timestamp_us;
+    //Offset of the record in the segment's .log file
+    uint64_t offset;
+} log_index_entry;
+
+typedef struct log_segment_struct {
+    uint64_t first_seq;
+    uint64_t first_timestamp_us;
+    //Bytes of complete, synced records; readers stop here
+    uint64_t committed;
+} log_segment;
+
+typedef struct log_pending_struct {
+    shared_buffer *line;
+    uint64_t timestamp_us;
+    struct log_pending_struct *next;
+} log_pending;
+
+typedef struct message_log_struct {
+    char *directory;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+
+    //Lines waiting for the writer, and whether it should finish up
+    log_pending *pending_head;
+    log_pending *pending_tail;
+    size_t pending_len;
+    int stopping;
+
+    //Reads waiting for the reader thread; guarded by lock
+    pthread_t read_thread;
+    pthread_cond_t read_wake;
+    struct log_read_job_struct *reads_head;
+    struct log_read_job_struct *reads_tail;
+    int reads_stopped;
+
+    //Every segment on disk, oldest first; guarded by lock
+    log_segment *segments;
+    size_t segments_len;
+    size_t segments_size;
+
+    //Highest sequence number in the log
+    uint64_t last_seq;
+
+    //Writer state, only touched by the writer thread
+    int fd;
+    log_index_header *index;
+    size_t index_capacity;
+    uint64_t offset;
+    uint64_t indexed_offset;
+
+    unsigned long batches;
+    unsigned long records;
+    //Lines never written, for want of room in pending or of a segment
+    unsigned long dropped;
+} message_log;
+
+/*
+ * Opens, or creates, the log in a directory, and starts its writer and 
+ * reader threads. New lines go to a fresh segment, unless the last one 
+ * was left empty; a record torn by a crash is cut off the end of it.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int open_message_log(message_log *this, const char *directory);
+
+/*
+ * Writes out everything appended so far, stops the writer and frees the
+ * log.
+ */
+void close_message_log(message_log *this);
+
+/*
+ * Queues a line for the writer, leaving out its header. The line must have
+ * its seq set and be newer than everything in the log. Never blocks on
+ * disk; if LOG_MAX_PENDING lines are already waiting, the line is dropped
+ * and counted instead.
+ */
+void message_log_append(message_log *this, shared_buffer *line, uint64_t timestamp_us);
+
+/*
+ * Reads a range of the log, by sequence number or by time, a chunk at a
+ * time. Safe to use from any thread while the log is being written.
+ */
+typedef struct log_reader_struct {
+    message_log *log;
+    int by_time;
+    uint64_t from;
+    uint64_t to;
+
+    //Segment being read, and where we are in it
+    uint64_t segment_seq;
+    int fd;
+    uint64_t offset;
+    int done;
+
+    char *chunk;
+} log_reader;
+
+/*
+ * Sets a reader up for the records whose sequence number (or timestamp, if
+ * by_time) is at least from. Records past to end the range. The segment 
+ * and the place in it are only looked up by the first log_reader_next, so
+ * this never touches the disk.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int log_reader_open(log_reader *this, message_log *log, int by_time, uint64_t from, uint64_t to);
+
+void log_reader_close(log_reader *this);
+
+/*
+ * Reads up to LOG_READ_CHUNK bytes of records and calls emit for each one
+ * in the range. The line passed to emit is only valid during the call. The
+ * done flag is set once the range, or the log, is exhausted.
+ *
+ * Returns the number of records emitted, which may be 0 for a chunk with
+ * nothing in range, or -1 on error.
+ */
+int log_reader_next(log_reader *this, void (*emit)(log_record_header *, const char *, void *), void *args);
+
+/*
+ * A log_reader_next to run on the log's reader thread. Once it has run,
+ * done(args) is posted to the mailbox, with drop(args) in case the mailbox
+ * goes first; result is what log_reader_next returned.
+ */
+typedef struct log_read_job_struct {
+    log_reader reader;
+    void (*emit)(log_record_header *, const char *, void *);
+    int result;
+
+    mailbox *mailbox;
+    void (*done)(void *);
+    void (*drop)(void *);
+    void *args;
+
+    struct log_read_job_struct *next;
+} log_read_job;
+
+/*
+ * Queues a job for the reader thread. Once reads are stopped, jobs are 
+ * handed straight back with a result of -1.
+ */
+void message_log_read(message_log *this, log_read_job *job);
+
+/*
+ * Hands back every job still queued with a result of -1 and stops the 
+ * reader thread. Must be called while the jobs' mailboxes are still 
+ * around; close_message_log does it too, for a log nobody reads.
+ */
+void message_log_stop_reads(message_log *this);
+
+#endif /* _MESSAGE_LOG_H */
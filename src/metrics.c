@@ -0,0 +1,93 @@
+/* metrics.c
+ *
+ * Implements the Prometheus text formatting
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "metrics.h"
+
+void init_metrics_text(metrics_text *this) {
+    this->data = NULL;
+    this->len = 0;
+    this->size = 0;
+}
+
+void destroy_metrics_text(metrics_text *this) {
+    free(this->data);
+    init_metrics_text(this);
+}
+
+int metrics_printf(metrics_text *this, const char *format, ...) {
+    while(1) {
+	size_t space = this->size - this->len;
+
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(this->data == NULL ? NULL : this->data + this->len, space, format, args);
+	va_end(args);
+
+	if(len < 0) {
+	    return -1;
+	}
+	if((size_t) len < space) {
+	    this->len += len;
+	    return 0;
+	}
+
+	size_t size = this->size == 0 ? 16384 : this->size * 2;
+	while(size - this->len <= (size_t) len) {
+	    size *= 2;
+	}
+	char *data = realloc(this->data, size);
+	if(data == NULL) {
+	    return -1;
+	}
+	this->data = data;
+	this->size = size;
+    }
+}
+
+void metrics_escape(metrics_text *this, const char *value, size_t len) {
+    for(size_t i = 0; i < len; i++) {
+	switch(value[i]) {
+	    case '\\':
+		metrics_printf(this, "\\\\");
+		break;
+	    case '"':
+		metrics_printf(this, "\\\"");
+		break;
+	    case '\n':
+		metrics_printf(this, "\\n");
+		break;
+	    default:
+		metrics_printf(this, "%c", value[i]);
+	}
+    }
+}
+
+void metrics_family(metrics_text *this, const char *name, const char *type, const char *help) {
+    metrics_printf(this, "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s %s\n",
+	    name, help, name, type);
+}
+
+void metrics_sample(metrics_text *this, const char *name, const char *labels, unsigned long value) {
+    metrics_printf(this, METRICS_PREFIX "%s{%s} %lu\n", name, labels, value);
+}
+
+void metrics_histogram(metrics_text *this, const char *name, const char *labels, const histogram *samples) {
+    const char *separator = labels[0] == '\0' ? "" : ",";
+
+    for(int bucket = METRICS_FIRST_BUCKET; bucket <= METRICS_LAST_BUCKET; bucket++) {
+	uint64_t limit = 1ULL << bucket;
+	metrics_printf(this, METRICS_PREFIX "%s_bucket{%s%sle=\"%.9g\"} %lu\n", name, labels, separator,
+		limit / 1e9, (unsigned long) histogram_count_below(samples, limit));
+    }
+    metrics_printf(this, METRICS_PREFIX "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, separator,
+	    (unsigned long) samples->total);
+    metrics_printf(this, METRICS_PREFIX "%s_sum{%s} %.9f\n", name, labels, samples->sum / 1e9);
+    metrics_printf(this, METRICS_PREFIX "%s_count{%s} %lu\n", name, labels, (unsigned long) samples->total);
+}
@@ -0,0 +1,66 @@
+/* metrics.h
+ *
+ * Formats counters, gauges and histograms in the Prometheus text
+ * exposition format. Counters themselves are plain fields on the objects
+ * they count, only ever touched by the thread that owns the object; a
+ * scrape reads them on that thread too.
+ */
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <stddef.h>
+
+#include "histogram.h"
+
+//Metric names all start with this
+#define METRICS_PREFIX "irc_mux_"
+
+//Histograms are exported with a bucket per power of two in this range, in ns
+#define METRICS_FIRST_BUCKET 10
+#define METRICS_LAST_BUCKET 35
+
+/*
+ * A growable text buffer the exposition is formatted into
+ */
+typedef struct metrics_text_struct {
+    char *data;
+    size_t len;
+    size_t size;
+} metrics_text;
+
+void init_metrics_text(metrics_text *this);
+void destroy_metrics_text(metrics_text *this);
+
+/*
+ * Appends formatted text, growing the buffer as needed.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int metrics_printf(metrics_text *this, const char *format, ...)
+    __attribute__ ((format (printf, 2, 3)));
+
+/*
+ * Appends a label value with backslashes, quotes and newlines escaped
+ */
+void metrics_escape(metrics_text *this, const char *value, size_t len);
+
+/*
+ * Starts a metric family with its HELP and TYPE lines. type is one of
+ * "counter", "gauge" or "histogram".
+ */
+void metrics_family(metrics_text *this, const char *name, const char *type, const char *help);
+
+/*
+ * Appends one sample. labels is a comma separated list of already escaped
+ * label pairs, and may be empty.
+ */
+void metrics_sample(metrics_text *this, const char *name, const char *labels, unsigned long value);
+
+/*
+ * Appends a histogram of nanoseconds as _bucket, _sum and _count samples
+ * in seconds.
+ */
+void metrics_histogram(metrics_text *this, const char *name, const char *labels, const histogram *samples);
+
+#endif /* _METRICS_H */
@@ -0,0 +1,129 @@
+/* mux_frame.c
+ *
+ * Implements the binary client framing
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+#include "mux_frame.h"
+
+void put_u16(char *out, uint16_t value) {
+    value = htole16(value);
+    memcpy(out, &value, sizeof(value));
+}
+
+void put_u32(char *out, uint32_t value) {
+    value = htole32(value);
+    memcpy(out, &value, sizeof(value));
+}
+
+void put_u64(char *out, uint64_t value) {
+    value = htole64(value);
+    memcpy(out, &value, sizeof(value));
+}
+
+/*
+ * The line a message was parsed from, less its CR LF
+ */
+irc_slice frame_payload(irc_message *msg) {
+    irc_slice line = msg->line;
+    if(line.len > 0 && line.ptr[line.len - 1] == '\n') line.len--;
+    if(line.len > 0 && line.ptr[line.len - 1] == '\r') line.len--;
+    return line;
+}
+
+/*
+ * Writes where a field is within the line, or 0 0 if it's missing
+ */
+void put_field(char *out, irc_slice line, irc_slice field) {
+    put_u32(out, field.ptr == NULL ? 0 : (uint32_t) (field.ptr - line.ptr));
+    put_u32(out + 4, (uint32_t) field.len);
+}
+
+size_t mux_frame_len(irc_message *msg) {
+    return MUX_FRAME_HEADER_LEN + message_param_count(msg) * MUX_FRAME_PARAM_LEN + frame_payload(msg).len;
+}
+
+size_t mux_frame_encode(char *out, irc_message *msg, unsigned long seq, uint64_t time_us) {
+    irc_slice line = frame_payload(msg);
+    size_t params = message_param_count(msg);
+    size_t header_len = MUX_FRAME_HEADER_LEN + params * MUX_FRAME_PARAM_LEN;
+
+    uint8_t flags = 0;
+    if(msg->prefix_view.ptr != NULL) {
+	flags |= MUX_FRAME_PREFIX;
+    }
+    if(msg->params_trailing) {
+	flags |= MUX_FRAME_TRAILING;
+    }
+
+    put_u32(out, (uint32_t) (header_len + line.len));
+    put_u16(out + 4, (uint16_t) msg->command_id);
+    out[6] = (char) params;
+    out[7] = (char) flags;
+    put_u64(out + 8, seq);
+    put_u64(out + 16, time_us);
+    put_u32(out + 24, (uint32_t) header_len);
+    put_u32(out + 28, (uint32_t) line.len);
+    put_field(out + 32, line, msg->prefix_view);
+    put_field(out + 40, line, msg->command_view);
+    for(size_t i = 0; i < params; i++) {
+	put_field(out + MUX_FRAME_HEADER_LEN + i * MUX_FRAME_PARAM_LEN, line, message_param(msg, i));
+    }
+
+    memcpy(out + header_len, line.ptr, line.len);
+    return header_len + line.len;
+}
+
+shared_buffer * mux_frame_line(shared_buffer *line) {
+    irc_message msg;
+    if(parse_message_view(&msg, line->data + line->header_len, line->len - line->header_len) != 0) {
+	return NULL;
+    }
+
+    shared_buffer *frame = new_empty_shared_buffer(mux_frame_len(&msg));
+    if(frame == NULL) {
+	return NULL;
+    }
+    frame->tags = line->tags;
+    frame->seq = line->seq;
+    frame->time_us = line->time_us;
+    frame->len = mux_frame_encode(frame->data, &msg, line->seq, line->time_us);
+    return frame;
+}
+
+shared_buffer * mux_frame_lines(const char *data, size_t len, unsigned long seq, uint64_t time_us) {
+    //Every line gains at most a full header, and loses its CR LF
+    size_t lines = 0;
+    for(size_t i = 0; i + 1 < len; i++) {
+	if(data[i] == '\r' && data[i + 1] == '\n') {
+	    lines++;
+	}
+    }
+
+    shared_buffer *frames = new_empty_shared_buffer(len + lines * MUX_FRAME_MAX_HEADER_LEN);
+    if(frames == NULL) {
+	return NULL;
+    }
+    frames->seq = seq;
+    frames->time_us = time_us;
+
+    const char *cursor = data;
+    const char *end = data + len;
+    while(cursor < end) {
+	const char *eol = memmem(cursor, end - cursor, "\r\n", 2);
+	if(eol == NULL) {
+	    break;
+	}
+	eol += 2;
+
+	irc_message msg;
+	if(parse_message_view(&msg, cursor, eol - cursor) == 0) {
+	    frames->len += mux_frame_encode(frames->data + frames->len, &msg, seq, time_us);
+	}
+	cursor = eol;
+    }
+    return frames;
+}
@@ -0,0 +1,77 @@
+/* mux_frame.h
+ *
+ * Defines the binary framing a client can ask for with MUX FRAMING BINARY,
+ * so it doesn't have to parse every line again after we did. Each line is
+ * sent as a frame: a header saying where the line's fields are, followed
+ * by the line itself without its CR LF. All numbers are little-endian.
+ *
+ *   offset  size
+ *        0     4  frame length, this field and the line included
+ *        4     2  command id, as in irc_command.h (numerics are themselves)
+ *        6     1  number of params, n
+ *        7     1  flags, MUX_FRAME_*
+ *        8     8  sequence number, 0 for lines that aren't from the server
+ *       16     8  when the line was received, in us since the epoch
+ *       24     4  where the line starts, from the start of the frame
+ *       28     4  length of the line
+ *       32     8  prefix: offset into the line and length, 0 0 if none
+ *       40     8  command: offset and length
+ *       48   8*n  each param: offset and length
+ *
+ * The prefix excludes its ':', and so does a trailing param.
+ */
+
+#ifndef _MUX_FRAME_H
+#define _MUX_FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "irc_message.h"
+#include "shared_buffer.h"
+
+//Size of the header of a frame with no params
+#define MUX_FRAME_HEADER_LEN 48
+
+//Size a param adds to the header
+#define MUX_FRAME_PARAM_LEN 8
+
+//Largest header a frame may have
+#define MUX_FRAME_MAX_HEADER_LEN (MUX_FRAME_HEADER_LEN + IRC_MAX_PARAMS * MUX_FRAME_PARAM_LEN)
+
+//The line has a prefix
+#define MUX_FRAME_PREFIX 0x01
+//The last param was a trailing one, i.e. started with ':'
+#define MUX_FRAME_TRAILING 0x02
+
+/*
+ * Size of the frame for a line, parsed as a view
+ */
+size_t mux_frame_len(irc_message *msg);
+
+/*
+ * Writes the frame for a line, parsed as a view, to out, which must have
+ * room for mux_frame_len bytes.
+ *
+ * Returns the size of the frame.
+ */
+size_t mux_frame_encode(char *out, irc_message *msg, unsigned long seq, uint64_t time_us);
+
+/*
+ * Frames a line from the server, which keeps its tags and sequence
+ * number. The line's tag header, if any, isn't part of the frame.
+ *
+ * Returns the frame, or NULL if the line doesn't parse or on error.
+ */
+shared_buffer * mux_frame_line(shared_buffer *line);
+
+/*
+ * Frames every CR LF terminated line in data, e.g. lines we make up
+ * ourselves, giving them the sequence number and time passed in. Lines
+ * that don't parse are left out.
+ *
+ * Returns the frames, or NULL on error.
+ */
+shared_buffer * mux_frame_lines(const char *data, size_t len, unsigned long seq, uint64_t time_us);
+
+#endif /* _MUX_FRAME_H */
@@ -0,0 +1,324 @@
+/* outbound_scheduler.c
+ *
+ * Implementation of the outbound scheduler
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "outbound_scheduler.h"
+
+void outbound_on_deferred(int fd, uint32_t events, void *args);
+void outbound_on_timer(void *args);
+
+uint64_t outbound_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void init_outbound_scheduler(outbound_scheduler *this, buffered_socket *remote) {
+    memset(this, 0, sizeof(outbound_scheduler));
+    this->remote = remote;
+    init_string_map(&(this->senders), 0);
+    init_event_handler(&(this->handler), -1, &outbound_on_deferred, this);
+    init_timer(&(this->timer), &outbound_on_timer, this);
+
+    set_flood_limits(this, 10000, 2000, 0);
+    this->credit_ms = this->limits.burst_ms;
+    this->refilled_at = outbound_now_ms();
+}
+
+void set_flood_limits(outbound_scheduler *this, uint64_t burst_ms, uint64_t line_ms, uint64_t byte_us) {
+    this->limits.burst_ms = burst_ms;
+    this->limits.line_ms = line_ms;
+    this->limits.byte_us = byte_us;
+    //Always room for one of our own lines
+    this->limits.reserve_ms = line_ms + BUFSOCK_MAX_LINE * byte_us / 1000;
+    if(this->credit_ms > burst_ms) {
+	this->credit_ms = burst_ms;
+    }
+}
+
+void free_outbound_queue(outbound_queue *queue) {
+    outbound_line *next;
+    for(outbound_line *current = queue->head; current != NULL; current = next) {
+	next = current->next;
+	shared_buffer_unref(current->buffer);
+	free(current);
+    }
+    queue->head = queue->tail = NULL;
+    queue->len = 0;
+}
+
+void destroy_outbound_scheduler(outbound_scheduler *this) {
+    free_outbound_queue(&(this->urgent));
+    free_outbound_queue(&(this->priority));
+
+    outbound_queue *next;
+    for(outbound_queue *current = this->active_head; current != NULL; current = next) {
+	next = current->next_active;
+	free_outbound_queue(current);
+	free(current);
+    }
+    this->active_head = this->active_tail = NULL;
+    destroy_string_map(&(this->senders));
+
+    if(this->loop != NULL) {
+	event_loop_remove(this->loop, &(this->handler));
+	event_loop_cancel_timer(this->loop, &(this->timer));
+	this->loop = NULL;
+    }
+}
+
+int outbound_attach(outbound_scheduler *this, event_loop *loop) {
+    this->loop = loop;
+
+    //Anything queued before we had a loop
+    event_loop_defer(loop, &(this->handler));
+    return 0;
+}
+
+void outbound_queue_push(outbound_queue *queue, outbound_line *line) {
+    line->next = NULL;
+    if(queue->tail == NULL) {
+	queue->head = line;
+    }
+    else {
+	queue->tail->next = line;
+    }
+    queue->tail = line;
+    queue->len++;
+}
+
+outbound_line * outbound_queue_pop(outbound_queue *queue) {
+    outbound_line *line = queue->head;
+    queue->head = line->next;
+    if(queue->head == NULL) {
+	queue->tail = NULL;
+    }
+    queue->len--;
+    return line;
+}
+
+/*
+ * Puts a queued line on the way to the remote, now that we have room for it
+ */
+void outbound_schedule(outbound_scheduler *this) {
+    if(this->loop != NULL) {
+	event_loop_defer(this->loop, &(this->handler));
+    }
+}
+
+void outbound_set_remote(outbound_scheduler *this, buffered_socket *remote) {
+    this->remote = remote;
+    free_outbound_queue(&(this->urgent));
+    free_outbound_queue(&(this->priority));
+    if(this->loop != NULL) {
+	event_loop_cancel_timer(this->loop, &(this->timer));
+    }
+
+    //A new connection starts with a clean slate as far as flood rules go
+    this->credit_ms = this->limits.burst_ms;
+    this->refilled_at = outbound_now_ms();
+    outbound_schedule(this);
+}
+
+void outbound_hold_clients(outbound_scheduler *this, int held) {
+    this->clients_held = held;
+    if(!held) {
+	outbound_schedule(this);
+    }
+}
+
+int outbound_send(outbound_scheduler *this, unsigned long sender, shared_buffer *line) {
+    outbound_queue *queue = string_map_get(&(this->senders), (char *) &sender, sizeof(sender));
+
+    if(queue == NULL) {
+	queue = calloc(1, sizeof(outbound_queue));
+	if(queue == NULL || string_map_put(&(this->senders), (char *) &sender, sizeof(sender), queue) != 0) {
+	    free(queue);
+	    return -1;
+	}
+	queue->sender = sender;
+
+	//New senders wait for their turn behind everyone already waiting
+	if(this->active_tail == NULL) {
+	    this->active_head = queue;
+	}
+	else {
+	    this->active_tail->next_active = queue;
+	}
+	this->active_tail = queue;
+    }
+    else if(queue->len >= OUTBOUND_MAX_QUEUED) {
+	this->stats.dropped++;
+	return -1;
+    }
+
+    outbound_line *entry = malloc(sizeof(outbound_line));
+    if(entry == NULL) {
+	return -1;
+    }
+    entry->buffer = shared_buffer_ref(line);
+    outbound_queue_push(queue, entry);
+
+    outbound_schedule(this);
+    return 0;
+}
+
+/*
+ * Formats one of our own lines onto one of our queues
+ */
+int outbound_vqueue(outbound_scheduler *this, outbound_queue *queue, const char *format, va_list args) {
+    char buf[BUFSOCK_MAX_LINE + 1];
+
+    //Nothing of ours is worth queueing this much of, it'd only go out too late
+    if(queue->len >= OUTBOUND_MAX_OWN) {
+	this->stats.dropped++;
+	return -1;
+    }
+
+    int len = vsnprintf(buf, sizeof(buf), format, args);
+    if(len < 0) {
+	return -1;
+    }
+    else if(len > BUFSOCK_MAX_LINE) {
+	len = BUFSOCK_MAX_LINE;
+	memcpy(buf + len - 2, "\r\n", 2);
+    }
+
+    outbound_line *entry = malloc(sizeof(outbound_line));
+    if(entry == NULL || (entry->buffer = new_shared_buffer(buf, len)) == NULL) {
+	free(entry);
+	return -1;
+    }
+    outbound_queue_push(queue, entry);
+
+    outbound_schedule(this);
+    return 0;
+}
+
+int outbound_printf(outbound_scheduler *this, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int error = outbound_vqueue(this, &(this->priority), format, args);
+    va_end(args);
+    return error;
+}
+
+int outbound_printf_urgent(outbound_scheduler *this, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int error = outbound_vqueue(this, &(this->urgent), format, args);
+    va_end(args);
+    return error;
+}
+
+uint64_t outbound_cost(outbound_scheduler *this, shared_buffer *line) {
+    return this->limits.line_ms + line->len * this->limits.byte_us / 1000;
+}
+
+/*
+ * Hands a line to the remote and pays for it
+ */
+void outbound_transmit(outbound_scheduler *this, outbound_line *line, uint64_t cost) {
+    //Only urgent lines go out without the credit for them
+    this->credit_ms = this->credit_ms > cost ? this->credit_ms - cost : 0;
+    this->stats.sent++;
+    bufsock_write_shared(this->remote, line->buffer);
+    shared_buffer_unref(line->buffer);
+    free(line);
+}
+
+/*
+ * Arms the timer to fire once there's wait_ms more credit
+ */
+void outbound_arm(outbound_scheduler *this, uint64_t wait_ms) {
+    event_loop_add_timer(this->loop, &(this->timer), wait_ms);
+}
+
+void outbound_run(outbound_scheduler *this) {
+    if(this->remote == NULL) {
+	return;
+    }
+
+    uint64_t now = outbound_now_ms();
+    this->credit_ms += now - this->refilled_at;
+    if(this->credit_ms > this->limits.burst_ms) {
+	this->credit_ms = this->limits.burst_ms;
+    }
+    this->refilled_at = now;
+
+    //Urgent lines can't wait, whatever's in the bucket
+    while(this->urgent.head != NULL) {
+	uint64_t cost = outbound_cost(this, this->urgent.head->buffer);
+	outbound_transmit(this, outbound_queue_pop(&(this->urgent)), cost);
+    }
+
+    //Our own lines next, they may spend the reserve
+    while(this->priority.head != NULL) {
+	uint64_t cost = outbound_cost(this, this->priority.head->buffer);
+	if(this->credit_ms < cost) {
+	    outbound_arm(this, cost - this->credit_ms);
+	    return;
+	}
+	outbound_transmit(this, outbound_queue_pop(&(this->priority)), cost);
+    }
+
+    //Then a line per sender per turn
+    while(this->active_head != NULL && !this->clients_held) {
+	outbound_queue *queue = this->active_head;
+	uint64_t cost = outbound_cost(this, queue->head->buffer) + this->limits.reserve_ms;
+	if(this->credit_ms < cost) {
+	    this->stats.stalls++;
+	    outbound_arm(this, cost - this->credit_ms);
+	    return;
+	}
+	outbound_transmit(this, outbound_queue_pop(queue), cost - this->limits.reserve_ms);
+
+	this->active_head = queue->next_active;
+	if(this->active_head == NULL) {
+	    this->active_tail = NULL;
+	}
+	queue->next_active = NULL;
+
+	if(queue->len > 0) {
+	    if(this->active_tail == NULL) {
+		this->active_head = queue;
+	    }
+	    else {
+		this->active_tail->next_active = queue;
+	    }
+	    this->active_tail = queue;
+	}
+	else {
+	    string_map_remove(&(this->senders), (char *) &(queue->sender), sizeof(queue->sender));
+	    free(queue);
+	}
+    }
+}
+
+/*
+ * Runs when lines were queued this iteration
+ */
+void outbound_on_deferred(int fd, uint32_t events, void *args) {
+    outbound_scheduler *this = (outbound_scheduler *) args;
+
+    //Nothing else can go out before the timer fires anyway
+    if(timer_is_armed(&(this->timer)) && this->urgent.head == NULL && this->priority.head == NULL) {
+	return;
+    }
+    outbound_run(this);
+}
+
+/*
+ * Runs once there's credit for the line that had to wait
+ */
+void outbound_on_timer(void *args) {
+    outbound_run((outbound_scheduler *) args);
+}
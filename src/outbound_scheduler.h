@@ -0,0 +1,164 @@
+/* outbound_scheduler.h
+ *
+ * Defines the scheduler that paces lines sent to the remote. IRC servers
+ * disconnect clients that send faster than their flood rules allow, so 
+ * every line goes through a token bucket: each line costs some credit, and
+ * credit comes back at one millisecond per millisecond up to a burst limit.
+ * With the RFC1459 defaults (2 seconds a line, 10 seconds ahead at most)
+ * that's a burst of 5 lines, then one every 2 seconds.
+ *
+ * Lines of our own (registration, rejoins) go out before any client line,
+ * and client lines never eat into the credit kept in reserve for them. 
+ * Client lines are queued per sender and the senders are served round 
+ * robin, so one chatty bot can't starve the rest.
+ *
+ * PONGs and our keepalive PINGs are urgent: the server drops us if they're
+ * late, and they're rare and short, so they go ahead of everything and 
+ * don't wait for credit. They still pay what they can, so whatever comes
+ * next waits a little longer instead.
+ */
+
+#ifndef _OUTBOUND_SCHEDULER_H
+#define _OUTBOUND_SCHEDULER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "event_loop.h"
+#include "buffered_socket.h"
+#include "shared_buffer.h"
+#include "string_map.h"
+
+//Most lines a single sender may have waiting
+#define OUTBOUND_MAX_QUEUED 1024
+
+//Most of our own lines that may be waiting, urgent ones and the rest each
+#define OUTBOUND_MAX_OWN 64
+
+typedef struct flood_limits_struct {
+    //Most credit that can build up, i.e. how far ahead we may send
+    uint64_t burst_ms;
+    //Credit a line costs, plus a little more for every byte of it
+    uint64_t line_ms;
+    uint64_t byte_us;
+    //Credit client lines must leave untouched
+    uint64_t reserve_ms;
+} flood_limits;
+
+typedef struct outbound_line_struct {
+    shared_buffer *buffer;
+    struct outbound_line_struct *next;
+} outbound_line;
+
+typedef struct outbound_queue_struct {
+    unsigned long sender;
+    outbound_line *head;
+    outbound_line *tail;
+    size_t len;
+
+    //Next sender in line for a turn
+    struct outbound_queue_struct *next_active;
+} outbound_queue;
+
+typedef struct outbound_stats_struct {
+    unsigned long sent;
+    //Times client lines had to wait for credit
+    unsigned long stalls;
+    //Lines refused because their sender's queue, or ours, was full
+    unsigned long dropped;
+} outbound_stats;
+
+typedef struct outbound_scheduler_struct {
+    //NULL while we're not connected, when nothing goes out
+    buffered_socket *remote;
+    event_loop *loop;
+    //Set while client lines must wait, e.g. until we've registered
+    int clients_held;
+
+    flood_limits limits;
+    uint64_t credit_ms;
+    uint64_t refilled_at;
+
+    //PONGs and keepalive PINGs, sent right away
+    outbound_queue urgent;
+    //Our other lines, sent before any client's
+    outbound_queue priority;
+
+    //Senders with lines waiting, keyed by sender id, served round robin
+    string_map senders;
+    outbound_queue *active_head;
+    outbound_queue *active_tail;
+
+    //Deferred after lines are queued, so a loop iteration's worth goes in one go
+    event_handler handler;
+    //Fires once there's credit for the next line
+    timer timer;
+
+    outbound_stats stats;
+} outbound_scheduler;
+
+/*
+ * Sets up a scheduler for the given remote, or for none yet if it's NULL,
+ * with the RFC1459 limits and a full bucket.
+ */
+void init_outbound_scheduler(outbound_scheduler *this, buffered_socket *remote);
+
+/*
+ * Frees every queued line, and detaches the scheduler if it was attached.
+ */
+void destroy_outbound_scheduler(outbound_scheduler *this);
+
+/*
+ * Runs the scheduler on a loop, and schedules anything queued before.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int outbound_attach(outbound_scheduler *this, event_loop *loop);
+
+void set_flood_limits(outbound_scheduler *this, uint64_t burst_ms, uint64_t line_ms, uint64_t byte_us);
+
+/*
+ * Points the scheduler at a new connection to the remote, with a full 
+ * bucket, or at NULL when the connection is lost. Our own lines still
+ * queued were meant for the old connection and are dropped; client lines
+ * stay queued for the next.
+ */
+void outbound_set_remote(outbound_scheduler *this, buffered_socket *remote);
+
+/*
+ * Holds client lines back, or lets them go again. Our own lines go out 
+ * regardless.
+ */
+void outbound_hold_clients(outbound_scheduler *this, int held);
+
+/*
+ * Queues a client line, which must end with CR LF.
+ *
+ * Returns 0 on success, -1 if the sender has too much queued already or on
+ * error.
+ */
+int outbound_send(outbound_scheduler *this, unsigned long sender, shared_buffer *line);
+
+/*
+ * Formats one of our own lines, of at most BUFSOCK_MAX_LINE bytes, and 
+ * queues it ahead of every client line.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int outbound_printf(outbound_scheduler *this, const char *format, ...)
+    __attribute__ ((format (printf, 2, 3)));
+
+/*
+ * Like outbound_printf, but for PONGs and keepalive PINGs, which go ahead
+ * of every other line and never wait for credit.
+ */
+int outbound_printf_urgent(outbound_scheduler *this, const char *format, ...)
+    __attribute__ ((format (printf, 2, 3)));
+
+/*
+ * Sends as much as the flood limits allow right now, and arms the timer
+ * for the rest. Called by the scheduler's own handler.
+ */
+void outbound_run(outbound_scheduler *this);
+
+#endif /* _OUTBOUND_SCHEDULER_H */
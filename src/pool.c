@@ -0,0 +1,71 @@
+/* pool.c
+ *
+ * Implementation of the slab pool
+ */
+
+#include <stdlib.h>
+
+#include "pool.h"
+
+void init_pool(pool *this, size_t object_size) {
+    //Room for the free list link, and alignment for whatever goes in
+    if(object_size < sizeof(void *)) {
+	object_size = sizeof(void *);
+    }
+    this->object_size = (object_size + POOL_ALIGN - 1) & ~(size_t) (POOL_ALIGN - 1);
+    this->slabs = NULL;
+    this->free_list = NULL;
+    this->slabs_len = 0;
+    this->in_use = 0;
+}
+
+void destroy_pool(pool *this) {
+    pool_slab *next;
+    for(pool_slab *current = this->slabs; current != NULL; current = next) {
+	next = current->next;
+	free(current);
+    }
+    init_pool(this, this->object_size);
+}
+
+/*
+ * Adds a slab and threads its objects onto the free list
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int pool_grow(pool *this) {
+    pool_slab *slab = malloc(sizeof(pool_slab) + this->object_size * POOL_SLAB_OBJECTS);
+    if(slab == NULL) {
+	return -1;
+    }
+    slab->next = this->slabs;
+    this->slabs = slab;
+    this->slabs_len++;
+
+    for(size_t i = POOL_SLAB_OBJECTS; i > 0; i--) {
+	void **object = (void **) (slab->objects + (i - 1) * this->object_size);
+	*object = this->free_list;
+	this->free_list = object;
+    }
+    return 0;
+}
+
+void * pool_alloc(pool *this) {
+    if(this->free_list == NULL && pool_grow(this) != 0) {
+	return NULL;
+    }
+
+    void **object = (void **) this->free_list;
+    this->free_list = *object;
+    this->in_use++;
+    return object;
+}
+
+void pool_free(pool *this, void *object) {
+    if(object == NULL) {
+	return;
+    }
+    *(void **) object = this->free_list;
+    this->free_list = object;
+    this->in_use--;
+}
@@ -0,0 +1,51 @@
+/* pool.h
+ *
+ * Defines a slab pool of fixed size objects. Objects are carved out of
+ * slabs of POOL_SLAB_OBJECTS at a time and recycled through a free list,
+ * so after warming up a pool serves its objects without calling malloc.
+ *
+ * A pool is not thread safe: objects must be allocated and freed by the
+ * thread that owns it.
+ */
+
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <stddef.h>
+
+#define POOL_SLAB_OBJECTS 64
+#define POOL_ALIGN 16
+
+typedef struct pool_slab_struct {
+    struct pool_slab_struct *next;
+    char objects[] __attribute__ ((aligned (POOL_ALIGN)));
+} pool_slab;
+
+typedef struct pool_struct {
+    size_t object_size;
+    pool_slab *slabs;
+    //Freed objects, linked through their first bytes
+    void *free_list;
+
+    size_t slabs_len;
+    size_t in_use;
+} pool;
+
+void init_pool(pool *this, size_t object_size);
+
+/*
+ * Frees every slab. Objects still in use become invalid.
+ */
+void destroy_pool(pool *this);
+
+/*
+ * Returns an uninitialised object, or NULL on error.
+ */
+void * pool_alloc(pool *this);
+
+/*
+ * Returns an object to the pool it came from
+ */
+void pool_free(pool *this, void *object);
+
+#endif /* _POOL_H */
@@ -0,0 +1,148 @@
+/* scan.c
+ *
+ * Implementation of the byte scanning kernels
+ *
+ * The vector versions compare a whole register of input against the byte
+ * we're after and turn the result into a bitmask, so finding the match is
+ * a single count-trailing-zeros. CR LF is found by comparing the input
+ * against '\r' and the same input shifted by one byte against '\n'.
+ */
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+#include "scan.h"
+
+/*
+ * Scalar fallback, also used for the tails the vector loops leave behind
+ */
+const char * scan_byte_scalar(const char *buf, size_t len, char c) {
+    return memchr(buf, c, len);
+}
+
+const char * scan_crlf_scalar(const char *buf, size_t len) {
+    const char *end = buf + len;
+
+    while(buf < end) {
+	const char *cr = memchr(buf, '\r', end - buf);
+	if(cr == NULL || cr + 1 >= end) {
+	    return NULL;
+	}
+	if(cr[1] == '\n') {
+	    return cr;
+	}
+	buf = cr + 1;
+    }
+    return NULL;
+}
+
+#ifdef SCAN_X86
+
+__attribute__ ((target ("sse2")))
+const char * scan_byte_sse2(const char *buf, size_t len, char c) {
+    const __m128i needle = _mm_set1_epi8(c);
+    size_t i = 0;
+
+    for(; i + 16 <= len; i += 16) {
+	__m128i chunk = _mm_loadu_si128((const __m128i *)(buf + i));
+	unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+	if(mask != 0) {
+	    return buf + i + __builtin_ctz(mask);
+	}
+    }
+    return scan_byte_scalar(buf + i, len - i, c);
+}
+
+__attribute__ ((target ("sse2")))
+const char * scan_crlf_sse2(const char *buf, size_t len) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t i = 0;
+
+    //The shifted load reads one byte ahead, so stop a byte early
+    for(; i + 17 <= len; i += 16) {
+	__m128i first = _mm_loadu_si128((const __m128i *)(buf + i));
+	__m128i second = _mm_loadu_si128((const __m128i *)(buf + i + 1));
+	__m128i hits = _mm_and_si128(_mm_cmpeq_epi8(first, cr), _mm_cmpeq_epi8(second, lf));
+	unsigned int mask = _mm_movemask_epi8(hits);
+	if(mask != 0) {
+	    return buf + i + __builtin_ctz(mask);
+	}
+    }
+    return scan_crlf_scalar(buf + i, len - i);
+}
+
+__attribute__ ((target ("avx2")))
+const char * scan_byte_avx2(const char *buf, size_t len, char c) {
+    const __m256i needle = _mm256_set1_epi8(c);
+    size_t i = 0;
+
+    for(; i + 32 <= len; i += 32) {
+	__m256i chunk = _mm256_loadu_si256((const __m256i *)(buf + i));
+	unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+	if(mask != 0) {
+	    return buf + i + __builtin_ctz(mask);
+	}
+    }
+    return scan_byte_sse2(buf + i, len - i, c);
+}
+
+__attribute__ ((target ("avx2")))
+const char * scan_crlf_avx2(const char *buf, size_t len) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+
+    for(; i + 33 <= len; i += 32) {
+	__m256i first = _mm256_loadu_si256((const __m256i *)(buf + i));
+	__m256i second = _mm256_loadu_si256((const __m256i *)(buf + i + 1));
+	__m256i hits = _mm256_and_si256(_mm256_cmpeq_epi8(first, cr), _mm256_cmpeq_epi8(second, lf));
+	unsigned int mask = _mm256_movemask_epi8(hits);
+	if(mask != 0) {
+	    return buf + i + __builtin_ctz(mask);
+	}
+    }
+    return scan_crlf_sse2(buf + i, len - i);
+}
+
+#endif /* SCAN_X86 */
+
+/* Dispatch table, filled in before main() runs and read-only afterwards,
+ * so it's safe to share between threads.
+ */
+const char * (*scan_byte_impl)(const char *, size_t, char) = &scan_byte_scalar;
+const char * (*scan_crlf_impl)(const char *, size_t) = &scan_crlf_scalar;
+const char *scan_impl_name = "scalar";
+
+__attribute__ ((constructor))
+void scan_init(void) {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+	scan_byte_impl = &scan_byte_avx2;
+	scan_crlf_impl = &scan_crlf_avx2;
+	scan_impl_name = "avx2";
+    }
+    else if(__builtin_cpu_supports("sse2")) {
+	scan_byte_impl = &scan_byte_sse2;
+	scan_crlf_impl = &scan_crlf_sse2;
+	scan_impl_name = "sse2";
+    }
+#endif /* SCAN_X86 */
+}
+
+const char * scan_byte(const char *buf, size_t len, char c) {
+    return (*scan_byte_impl)(buf, len, c);
+}
+
+const char * scan_crlf(const char *buf, size_t len) {
+    return (*scan_crlf_impl)(buf, len);
+}
+
+const char * scan_implementation(void) {
+    return scan_impl_name;
+}
@@ -0,0 +1,30 @@
+/* scan.h
+ *
+ * Byte scanning kernels used for line framing and message parsing. The
+ * best implementation for the CPU we're running on (AVX2, SSE2 or plain C)
+ * is picked once at startup.
+ */
+
+#ifndef _SCAN_H
+#define _SCAN_H
+
+#include <stddef.h>
+
+/*
+ * Returns a pointer to the first occurrence of c in [buf, buf + len), or
+ * NULL if there isn't one.
+ */
+const char * scan_byte(const char *buf, size_t len, char c);
+
+/*
+ * Returns a pointer to the '\r' of the first "\r\n" in [buf, buf + len), or
+ * NULL if there isn't one.
+ */
+const char * scan_crlf(const char *buf, size_t len);
+
+/*
+ * Name of the implementation in use: "avx2", "sse2" or "scalar"
+ */
+const char * scan_implementation(void);
+
+#endif /* _SCAN_H */
@@ -1,14 +1,183 @@
 /*
  * Gimpy lil test harness for the multiplexer
+ *
+ * Usage: bot [-t threads] [-p] [-w workers] [-l log directory] [-a] [-i seconds] [-c CA file] [config]
+ *
+ * Without a config file a single multiplexer for irc.cat.pdx.edu is run.
+ * Otherwise every non-blank, non-comment line of the config describes one
+ * multiplexer:
+ *
+ *   <server> <port> <socket path> <nick> <username> <realname...>
+ *
+ * and the multiplexers are spread over the given number of threads, pinned
+ * to cores with -p. With -w, each multiplexer fans out to its clients from
+ * that many worker threads of its own. With -l, each multiplexer logs what
+ * it receives to a directory named after its socket under the given one.
+ * With -a, each multiplexer serves its metrics on <socket path>.admin. With
+ * -i, clients that stay quiet for that many seconds are PINGed, and
+ * dropped if they don't answer within as many again. A port written as
+ * +6697 connects with TLS, and the server's certificate is checked against
+ * the system's CAs, or only against those in the file given with -c.
  */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/stat.h>
+
 #include "irc_multiplexer.h"
+#include "irc_host.h"
+
+/*
+ * Builds a multiplexer out of one config line.
+ *
+ * Returns NULL if the line is malformed.
+ */
+irc_multiplexer * multiplexer_from_config(char *line, size_t workers, char *log_directory, int admin, uint64_t idle_ms, char *ca_file) {
+    char *saveptr;
+    char *server = strtok_r(line, " \t", &saveptr);
+    char *port = strtok_r(NULL, " \t", &saveptr);
+    char *socket_path = strtok_r(NULL, " \t", &saveptr);
+    char *nick = strtok_r(NULL, " \t", &saveptr);
+    char *username = strtok_r(NULL, " \t", &saveptr);
+    char *realname = strtok_r(NULL, "", &saveptr);
+
+    if(realname == NULL) {
+	return NULL;
+    }
+    while(*realname == ' ' || *realname == '\t') realname++;
+
+    irc_multiplexer *mux = malloc(sizeof(irc_multiplexer));
+    init_multiplexer(mux);
+    set_fanout_workers(mux, workers);
+    set_client_idle_timeout(mux, idle_ms);
+    set_irc_server(mux, strdup(server), atoi(port));
+    if(port[0] == '+') {
+	set_irc_tls(mux, ca_file);
+    }
+    set_local_socket(mux, strdup(socket_path));
+    if(admin) {
+	char *admin_path = malloc(strlen(socket_path) + sizeof(".admin"));
+	sprintf(admin_path, "%s.admin", socket_path);
+	set_admin_socket(mux, admin_path);
+    }
+
+    if(log_directory != NULL) {
+	char *socket_name = strdup(socket_path);
+	char *path = malloc(strlen(log_directory) + strlen(socket_path) + 2);
+	sprintf(path, "%s/%s", log_directory, basename(socket_name));
+	free(socket_name);
+	set_message_log(mux, path);
+    }
+
+    mux->identity.nick = strdup(nick);
+    mux->identity.username = strdup(username);
+    mux->identity.realname = strdup(realname);
+    mux->identity.hostname = strdup(username);
+    mux->identity.servername = "*";
+    return mux;
+}
+
+int run_config(char *path, size_t threads, int pin_threads, size_t workers, char *log_directory, int admin, uint64_t idle_ms, char *ca_file) {
+    FILE *config = fopen(path, "r");
+    if(config == NULL) {
+	perror(path);
+	return 1;
+    }
+
+    irc_host host;
+    if(init_host(&host, threads, pin_threads) != 0) {
+	return 1;
+    }
+
+    char line[1024];
+    int line_number = 0;
+    while(fgets(line, sizeof(line), config) != NULL) {
+	line_number++;
+	line[strcspn(line, "\r\n")] = '\0';
+
+	char *start = line;
+	while(*start == ' ' || *start == '\t') start++;
+	if(*start == '\0' || *start == '#') {
+	    continue;
+	}
+
+	irc_multiplexer *mux = multiplexer_from_config(start, workers, log_directory, admin, idle_ms, ca_file);
+	if(mux == NULL) {
+	    fprintf(stderr, "%s:%d: expected <server> <port or +port for TLS> <socket path> <nick> <username> <realname>\n",
+		    path, line_number);
+	    return 1;
+	}
+	host_add_multiplexer(&host, mux);
+    }
+    fclose(config);
+
+    start_host(&host);
+    return 0;
+}
 
 int main(int argc, char **argv) {
 
+    size_t threads = 1;
+    int pin_threads = 0;
+    size_t workers = 0;
+    char *log_directory = NULL;
+    int admin = 0;
+    uint64_t idle_ms = 0;
+    char *ca_file = NULL;
+
+    int opt;
+    while((opt = getopt(argc, argv, "t:pw:l:ai:c:")) != -1) {
+	switch(opt) {
+	    case 't':
+		threads = strtoul(optarg, NULL, 10);
+		break;
+	    case 'p':
+		pin_threads = 1;
+		break;
+	    case 'w':
+		workers = strtoul(optarg, NULL, 10);
+		break;
+	    case 'l':
+		log_directory = optarg;
+		break;
+	    case 'a':
+		admin = 1;
+		break;
+	    case 'i':
+		idle_ms = strtoul(optarg, NULL, 10) * 1000;
+		break;
+	    case 'c':
+		ca_file = optarg;
+		break;
+	    default:
+		fprintf(stderr, "Usage: %s [-t threads] [-p] [-w workers] [-l log directory] [-a] [-i seconds] [-c CA file] [config]\n", argv[0]);
+		return 1;
+	}
+    }
+
+    if(optind < argc) {
+	if(log_directory != NULL && mkdir(log_directory, 0755) != 0 && errno != EEXIST) {
+	    perror(log_directory);
+	    return 1;
+	}
+	return run_config(argv[optind], threads, pin_threads, workers, log_directory, admin, idle_ms, ca_file);
+    }
+
     irc_multiplexer catirc;
     init_multiplexer(&catirc);
+    set_fanout_workers(&catirc, workers);
+    set_client_idle_timeout(&catirc, idle_ms);
     set_irc_server(&catirc, "irc.cat.pdx.edu", 6667);
     set_local_socket(&catirc, "/tmp/ircbot.sock");
+    if(admin) {
+	set_admin_socket(&catirc, "/tmp/ircbot.sock.admin");
+    }
+    if(log_directory != NULL) {
+	set_message_log(&catirc, log_directory);
+    }
 
     catirc.identity.nick = "finchbot";
     catirc.identity.username = "finch";
@@ -16,7 +185,7 @@ int main(int argc, char **argv) {
     catirc.identity.hostname = "finch@localhost";
     catirc.identity.servername = "*";
 
+    //Only returns on shutdown; a lost remote is reconnected to in the meantime
     start_server(&catirc);
-    return 0;
+    return 1;
 }
-
@@ -0,0 +1,56 @@
+/* shared_buffer.c
+ *
+ * Implementation of reference counted buffers
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared_buffer.h"
+
+shared_buffer * new_shared_buffer(const char *data, size_t len) {
+    return new_shared_buffer_with_header(NULL, 0, data, len);
+}
+
+shared_buffer * new_empty_shared_buffer(size_t size) {
+    shared_buffer *this = malloc(sizeof(shared_buffer) + size);
+    if(this == NULL) {
+	return NULL;
+    }
+
+    this->refcount = 1;
+    this->tags = 0;
+    this->seq = 0;
+    this->time_us = 0;
+    this->framed = NULL;
+    this->header_len = 0;
+    this->len = 0;
+    return this;
+}
+
+shared_buffer * new_shared_buffer_with_header(const char *header, size_t header_len, const char *data, size_t len) {
+    shared_buffer *this = new_empty_shared_buffer(header_len + len);
+    if(this == NULL) {
+	return NULL;
+    }
+
+    this->header_len = header_len;
+    this->len = header_len + len;
+    memcpy(this->data, header, header_len);
+    memcpy(this->data + header_len, data, len);
+    return this;
+}
+
+shared_buffer * shared_buffer_ref(shared_buffer *this) {
+    __atomic_add_fetch(&(this->refcount), 1, __ATOMIC_RELAXED);
+    return this;
+}
+
+void shared_buffer_unref(shared_buffer *this) {
+    if(__atomic_sub_fetch(&(this->refcount), 1, __ATOMIC_ACQ_REL) == 0) {
+	if(this->framed != NULL) {
+	    shared_buffer_unref(this->framed);
+	}
+	free(this);
+    }
+}
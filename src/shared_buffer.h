@@ -0,0 +1,66 @@
+/* shared_buffer.h
+ *
+ * Defines an immutable, reference counted byte buffer. A line received 
+ * from the remote is stored once and every client's outbound queue holds a
+ * reference to it, so fan-out costs a reference per client rather than a
+ * copy per client.
+ */
+
+#ifndef _SHARED_BUFFER_H
+#define _SHARED_BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct shared_buffer_struct {
+    //Updated atomically, buffers may be released from any thread
+    int refcount;
+    //Free for the owner to classify the contents, zero by default
+    unsigned int tags;
+    //Sequence number of a line from the remote, and when it came in (us since the epoch), zero otherwise
+    unsigned long seq;
+    uint64_t time_us;
+    /* The same line in the binary client framing, made along with it if
+     * any client wanted that at the time; released with it
+     */
+    struct shared_buffer_struct *framed;
+    //Bytes at the front only some readers want, e.g. a message tag
+    size_t header_len;
+    size_t len;
+    char data[];
+} shared_buffer;
+
+/*
+ * Copies data into a new buffer holding a single reference.
+ *
+ * Returns NULL if memory couldn't be allocated.
+ */
+shared_buffer * new_shared_buffer(const char *data, size_t len);
+
+/*
+ * Builds a buffer out of a header followed by data. Readers that don't 
+ * want the header start at header_len.
+ *
+ * Returns NULL if memory couldn't be allocated.
+ */
+shared_buffer * new_shared_buffer_with_header(const char *header, size_t header_len, const char *data, size_t len);
+
+/*
+ * Allocates a buffer with room for size bytes, holding a single reference
+ * and none of them yet. The caller fills it in before sharing it.
+ *
+ * Returns NULL if memory couldn't be allocated.
+ */
+shared_buffer * new_empty_shared_buffer(size_t size);
+
+/*
+ * Takes another reference and returns the buffer, for convenience.
+ */
+shared_buffer * shared_buffer_ref(shared_buffer *this);
+
+/*
+ * Drops a reference, freeing the buffer when it was the last one.
+ */
+void shared_buffer_unref(shared_buffer *this);
+
+#endif /* _SHARED_BUFFER_H */
@@ -0,0 +1,183 @@
+/* string_map.c
+ *
+ * Implementation of the string hash map
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "string_map.h"
+
+#define STRING_MAP_INITIAL_SIZE 16
+
+//Marks a slot whose entry was removed, so lookups keep probing past it
+static char string_map_tombstone;
+#define STRING_MAP_TOMBSTONE (&string_map_tombstone)
+
+uint32_t string_map_hash(const char *key, size_t len, int casemapped) {
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < len; i++) {
+	char c = casemapped ? irc_tolower(key[i]) : key[i];
+	hash ^= (unsigned char) c;
+	hash *= 16777619u;
+    }
+    return hash;
+}
+
+int string_map_key_equals(string_map *this, string_map_entry *entry, const char *key, size_t len) {
+    if(entry->key_len != len) {
+	return 0;
+    }
+    if(!this->casemapped) {
+	return memcmp(entry->key, key, len) == 0;
+    }
+    for(size_t i = 0; i < len; i++) {
+	if(irc_tolower(entry->key[i]) != irc_tolower(key[i])) {
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+void init_string_map(string_map *this, int casemapped) {
+    this->entries = NULL;
+    this->size = 0;
+    this->len = 0;
+    this->used = 0;
+    this->casemapped = casemapped;
+}
+
+void destroy_string_map(string_map *this) {
+    for(size_t i = 0; i < this->size; i++) {
+	char *key = this->entries[i].key;
+	if(key != NULL && key != STRING_MAP_TOMBSTONE) {
+	    free(key);
+	}
+    }
+    free(this->entries);
+    init_string_map(this, this->casemapped);
+}
+
+/*
+ * Finds the slot holding key, or NULL if it isn't in the map
+ */
+string_map_entry * string_map_find(string_map *this, const char *key, size_t len) {
+    if(this->size == 0) {
+	return NULL;
+    }
+
+    uint32_t hash = string_map_hash(key, len, this->casemapped);
+    size_t mask = this->size - 1;
+    for(size_t i = hash & mask; ; i = (i + 1) & mask) {
+	string_map_entry *entry = &(this->entries[i]);
+	if(entry->key == NULL) {
+	    return NULL;
+	}
+	if(entry->key != STRING_MAP_TOMBSTONE && entry->hash == hash
+		&& string_map_key_equals(this, entry, key, len)) {
+	    return entry;
+	}
+    }
+}
+
+/*
+ * Moves every live entry into a table of new_size slots, dropping 
+ * tombstones along the way.
+ */
+int string_map_resize(string_map *this, size_t new_size) {
+    string_map_entry *entries = calloc(new_size, sizeof(string_map_entry));
+    if(entries == NULL) {
+	return -1;
+    }
+
+    for(size_t i = 0; i < this->size; i++) {
+	string_map_entry *entry = &(this->entries[i]);
+	if(entry->key == NULL || entry->key == STRING_MAP_TOMBSTONE) {
+	    continue;
+	}
+
+	size_t j = entry->hash & (new_size - 1);
+	while(entries[j].key != NULL) {
+	    j = (j + 1) & (new_size - 1);
+	}
+	entries[j] = *entry;
+    }
+
+    free(this->entries);
+    this->entries = entries;
+    this->size = new_size;
+    this->used = this->len;
+    return 0;
+}
+
+void * string_map_get(string_map *this, const char *key, size_t len) {
+    string_map_entry *entry = string_map_find(this, key, len);
+    return entry == NULL ? NULL : entry->value;
+}
+
+int string_map_put(string_map *this, const char *key, size_t len, void *value) {
+    string_map_entry *entry = string_map_find(this, key, len);
+    if(entry != NULL) {
+	entry->value = value;
+	return 0;
+    }
+
+    //Keep the load factor, tombstones included, under 3/4
+    if((this->used + 1) * 4 > this->size * 3) {
+	size_t new_size = this->size == 0 ? STRING_MAP_INITIAL_SIZE : this->size;
+	while((this->len + 1) * 2 > new_size) {
+	    new_size *= 2;
+	}
+	if(string_map_resize(this, new_size) != 0) {
+	    return -1;
+	}
+    }
+
+    char *copy = malloc(len + 1);
+    if(copy == NULL) {
+	return -1;
+    }
+    memcpy(copy, key, len);
+    copy[len] = '\0';
+
+    uint32_t hash = string_map_hash(key, len, this->casemapped);
+    size_t mask = this->size - 1;
+    size_t i = hash & mask;
+    while(this->entries[i].key != NULL && this->entries[i].key != STRING_MAP_TOMBSTONE) {
+	i = (i + 1) & mask;
+    }
+
+    if(this->entries[i].key == NULL) {
+	this->used++;
+    }
+    this->entries[i].key = copy;
+    this->entries[i].key_len = len;
+    this->entries[i].hash = hash;
+    this->entries[i].value = value;
+    this->len++;
+    return 0;
+}
+
+void * string_map_remove(string_map *this, const char *key, size_t len) {
+    string_map_entry *entry = string_map_find(this, key, len);
+    if(entry == NULL) {
+	return NULL;
+    }
+
+    void *value = entry->value;
+    free(entry->key);
+    entry->key = STRING_MAP_TOMBSTONE;
+    entry->value = NULL;
+    this->len--;
+    return value;
+}
+
+string_map_entry * string_map_next(string_map *this, size_t *cursor) {
+    while(*cursor < this->size) {
+	string_map_entry *entry = &(this->entries[(*cursor)++]);
+	if(entry->key != NULL && entry->key != STRING_MAP_TOMBSTONE) {
+	    return entry;
+	}
+    }
+    return NULL;
+}
@@ -0,0 +1,79 @@
+/* string_map.h
+ *
+ * Defines a hash map from strings to pointers, using open addressing. Keys
+ * are copied. A map can be case-mapped, in which case keys are compared 
+ * the way RFC1459 compares nicks and channel names: A-Z match a-z, and
+ * []\~ match {}|^.
+ */
+
+#ifndef _STRING_MAP_H
+#define _STRING_MAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct string_map_entry_struct {
+    //NULL for an empty slot, STRING_MAP_TOMBSTONE for a removed one
+    char *key;
+    size_t key_len;
+    uint32_t hash;
+    void *value;
+} string_map_entry;
+
+typedef struct string_map_struct {
+    string_map_entry *entries;
+    size_t size;
+    size_t len;
+    //Live entries plus tombstones, to decide when to rehash
+    size_t used;
+    int casemapped;
+} string_map;
+
+/*
+ * Lowercases a byte the RFC1459 way, where {}|~ are the lowercase of []\^
+ */
+static inline char irc_tolower(char c) {
+    if((c >= 'A' && c <= 'Z') || c == '[' || c == ']' || c == '\\' || c == '^') {
+	return c + 32;
+    }
+    return c;
+}
+
+/*
+ * Hashes a key, case-mapped or not (FNV-1a).
+ */
+uint32_t string_map_hash(const char *key, size_t len, int casemapped);
+
+void init_string_map(string_map *this, int casemapped);
+
+/*
+ * Frees the map and its keys, but not the values.
+ */
+void destroy_string_map(string_map *this);
+
+/*
+ * Returns the value stored under key, or NULL if there is none.
+ */
+void * string_map_get(string_map *this, const char *key, size_t len);
+
+/*
+ * Stores value under key, replacing any previous value.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int string_map_put(string_map *this, const char *key, size_t len, void *value);
+
+/*
+ * Removes key from the map.
+ *
+ * Returns the value that was stored, or NULL if there was none.
+ */
+void * string_map_remove(string_map *this, const char *key, size_t len);
+
+/*
+ * Iterates over the map. Start with *cursor at 0; returns NULL when done.
+ * The map must not be modified while iterating.
+ */
+string_map_entry * string_map_next(string_map *this, size_t *cursor);
+
+#endif /* _STRING_MAP_H */
@@ -0,0 +1,579 @@
+/* subscription.c
+ *
+ * Implementation of subscription filters and routing
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "subscription.h"
+
+/*
+ * Compares two strings the RFC1459 way
+ */
+int irc_equals(const char *a, size_t a_len, const char *b, size_t b_len) {
+    if(a_len != b_len) {
+	return 0;
+    }
+    for(size_t i = 0; i < a_len; i++) {
+	if(irc_tolower(a[i]) != irc_tolower(b[i])) {
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+int irc_mask_match(const char *mask, size_t mask_len, const char *str, size_t len) {
+    size_t m = 0, s = 0;
+    //Where to pick up again if the last '*' has to swallow another byte
+    size_t star = mask_len, star_s = 0;
+
+    while(s < len) {
+	if(m < mask_len && mask[m] == '*') {
+	    star = m++;
+	    star_s = s;
+	}
+	else if(m < mask_len && (mask[m] == '?' || irc_tolower(mask[m]) == irc_tolower(str[s]))) {
+	    m++;
+	    s++;
+	}
+	else if(star != mask_len) {
+	    m = star + 1;
+	    s = ++star_s;
+	}
+	else {
+	    return 0;
+	}
+    }
+
+    while(m < mask_len && mask[m] == '*') m++;
+    return m == mask_len;
+}
+
+int is_mask(const char *value, size_t len) {
+    for(size_t i = 0; i < len; i++) {
+	if(value[i] == '*' || value[i] == '?' || value[i] == '!' || value[i] == '@') {
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+int is_channel(irc_slice name) {
+    return name.len > 1 && (name.ptr[0] == '#' || name.ptr[0] == '&' || name.ptr[0] == '!');
+}
+
+/* Subscriber sets */
+
+int subscriber_set_push(subscriber_set *this, subscriber *sub) {
+    if(this->len == this->size) {
+	size_t size = this->size == 0 ? 8 : this->size * 2;
+	subscriber **items = realloc(this->items, size * sizeof(subscriber *));
+	if(items == NULL) {
+	    return -1;
+	}
+	this->items = items;
+	this->size = size;
+    }
+    this->items[this->len++] = sub;
+    return 0;
+}
+
+/*
+ * Removes sub by moving the last item into its place
+ *
+ * Returns the item that moved, or NULL if none did.
+ */
+subscriber * subscriber_set_remove_at(subscriber_set *this, size_t index) {
+    this->len--;
+    if(index == this->len) {
+	return NULL;
+    }
+    this->items[index] = this->items[this->len];
+    return this->items[index];
+}
+
+void subscriber_set_remove(subscriber_set *this, subscriber *sub) {
+    for(size_t i = 0; i < this->len; i++) {
+	if(this->items[i] == sub) {
+	    subscriber_set_remove_at(this, i);
+	    return;
+	}
+    }
+}
+
+/*
+ * Adds sub to the set stored under key, creating the set if needed
+ */
+int index_insert(string_map *map, const char *key, size_t len, subscriber *sub) {
+    subscriber_set *set = string_map_get(map, key, len);
+    if(set == NULL) {
+	set = calloc(1, sizeof(subscriber_set));
+	if(set == NULL || string_map_put(map, key, len, set) != 0) {
+	    free(set);
+	    return -1;
+	}
+    }
+    return subscriber_set_push(set, sub);
+}
+
+/*
+ * Takes sub out of the set stored under key, dropping the set once empty
+ */
+void index_erase(string_map *map, const char *key, size_t len, subscriber *sub) {
+    subscriber_set *set = string_map_get(map, key, len);
+    if(set == NULL) {
+	return;
+    }
+    subscriber_set_remove(set, sub);
+    if(set->len == 0) {
+	string_map_remove(map, key, len);
+	free(set->items);
+	free(set);
+    }
+}
+
+/*
+ * Same as index_insert, for commands with an id
+ */
+int command_insert(subscription_index *this, int command, subscriber *sub) {
+    subscriber_set *set = this->command_sets[command];
+    if(set == NULL) {
+	set = calloc(1, sizeof(subscriber_set));
+	if(set == NULL) {
+	    return -1;
+	}
+	this->command_sets[command] = set;
+	this->command_sets_len++;
+    }
+    return subscriber_set_push(set, sub);
+}
+
+void command_erase(subscription_index *this, int command, subscriber *sub) {
+    subscriber_set *set = this->command_sets[command];
+    if(set == NULL) {
+	return;
+    }
+    subscriber_set_remove(set, sub);
+    if(set->len == 0) {
+	this->command_sets[command] = NULL;
+	this->command_sets_len--;
+	free(set->items);
+	free(set);
+    }
+}
+
+int unfiltered_insert(subscription_index *this, subscriber *sub) {
+    sub->unfiltered_slot = this->unfiltered.len;
+    return subscriber_set_push(&(this->unfiltered), sub);
+}
+
+void unfiltered_erase(subscription_index *this, subscriber *sub) {
+    subscriber *moved = subscriber_set_remove_at(&(this->unfiltered), sub->unfiltered_slot);
+    if(moved != NULL) {
+	moved->unfiltered_slot = sub->unfiltered_slot;
+    }
+}
+
+/* Index */
+
+void init_subscription_index(subscription_index *this) {
+    memset(this, 0, sizeof(subscription_index));
+    init_string_map(&(this->commands), 1);
+    init_string_map(&(this->channels), 1);
+    init_string_map(&(this->nicks), 1);
+}
+
+void destroy_subscription_index(subscription_index *this) {
+    string_map *maps[] = { &(this->commands), &(this->channels), &(this->nicks) };
+    for(size_t i = 0; i < sizeof(maps) / sizeof(maps[0]); i++) {
+	size_t cursor = 0;
+	string_map_entry *entry;
+	while((entry = string_map_next(maps[i], &cursor)) != NULL) {
+	    subscriber_set *set = (subscriber_set *) entry->value;
+	    free(set->items);
+	    free(set);
+	}
+	destroy_string_map(maps[i]);
+    }
+    for(size_t i = 0; i < CMD_COUNT; i++) {
+	if(this->command_sets[i] != NULL) {
+	    free(this->command_sets[i]->items);
+	    free(this->command_sets[i]);
+	}
+    }
+
+    free(this->masks);
+    free(this->unfiltered.items);
+    free(this->matches.items);
+    init_subscription_index(this);
+}
+
+int subscription_add(subscription_index *this, subscriber *sub, void *owner) {
+    sub->owner = owner;
+    sub->filters = NULL;
+    sub->stamp = this->stamp;
+    return unfiltered_insert(this, sub);
+}
+
+void subscription_remove(subscription_index *this, subscriber *sub) {
+    //Leaves the subscriber in the unfiltered set, where it's cheap to find
+    unsubscribe_all(this, sub);
+    unfiltered_erase(this, sub);
+}
+
+filter_type parse_filter_type(irc_slice name, irc_slice value) {
+    if(value.len == 0) {
+	return FILTER_TYPE_COUNT;
+    }
+
+    if(irc_equals(name.ptr, name.len, "COMMAND", 7)) {
+	return FILTER_COMMAND;
+    }
+    if(irc_equals(name.ptr, name.len, "NUMERIC", 7)) {
+	if(value.len != 3) {
+	    return FILTER_TYPE_COUNT;
+	}
+	for(size_t i = 0; i < value.len; i++) {
+	    if(value.ptr[i] < '0' || value.ptr[i] > '9') {
+		return FILTER_TYPE_COUNT;
+	    }
+	}
+	return FILTER_COMMAND;
+    }
+    if(irc_equals(name.ptr, name.len, "CHANNEL", 7)) {
+	return is_channel(value) ? FILTER_CHANNEL : FILTER_TYPE_COUNT;
+    }
+    if(irc_equals(name.ptr, name.len, "PREFIX", 6)) {
+	return FILTER_PREFIX;
+    }
+    return FILTER_TYPE_COUNT;
+}
+
+/*
+ * Links a filter into the index structure its type routes through
+ */
+int index_filter(subscription_index *this, subscriber *sub, subscription_filter *filter) {
+    switch(filter->type) {
+	case FILTER_COMMAND:
+	    if(filter->command != CMD_UNKNOWN) {
+		return command_insert(this, filter->command, sub);
+	    }
+	    return index_insert(&(this->commands), filter->value, filter->value_len, sub);
+	case FILTER_CHANNEL:
+	    return index_insert(&(this->channels), filter->value, filter->value_len, sub);
+	case FILTER_PREFIX:
+	default:
+	    if(!is_mask(filter->value, filter->value_len)) {
+		return index_insert(&(this->nicks), filter->value, filter->value_len, sub);
+	    }
+	    if(this->masks_len == this->masks_size) {
+		size_t size = this->masks_size == 0 ? 8 : this->masks_size * 2;
+		subscription_mask *masks = realloc(this->masks, size * sizeof(subscription_mask));
+		if(masks == NULL) {
+		    return -1;
+		}
+		this->masks = masks;
+		this->masks_size = size;
+	    }
+	    this->masks[this->masks_len].filter = filter;
+	    this->masks[this->masks_len].subscriber = sub;
+	    this->masks_len++;
+	    return 0;
+    }
+}
+
+void unindex_filter(subscription_index *this, subscriber *sub, subscription_filter *filter) {
+    switch(filter->type) {
+	case FILTER_COMMAND:
+	    if(filter->command != CMD_UNKNOWN) {
+		command_erase(this, filter->command, sub);
+		break;
+	    }
+	    index_erase(&(this->commands), filter->value, filter->value_len, sub);
+	    break;
+	case FILTER_CHANNEL:
+	    index_erase(&(this->channels), filter->value, filter->value_len, sub);
+	    break;
+	case FILTER_PREFIX:
+	default:
+	    if(!is_mask(filter->value, filter->value_len)) {
+		index_erase(&(this->nicks), filter->value, filter->value_len, sub);
+		break;
+	    }
+	    for(size_t i = 0; i < this->masks_len; i++) {
+		if(this->masks[i].filter == filter) {
+		    this->masks[i] = this->masks[--this->masks_len];
+		    break;
+		}
+	    }
+	    break;
+    }
+}
+
+int subscribe(subscription_index *this, subscriber *sub, filter_type type, const char *value, size_t len) {
+    for(subscription_filter *current = sub->filters; current != NULL; current = current->next) {
+	if(current->type == type && irc_equals(current->value, current->value_len, value, len)) {
+	    return 1;
+	}
+    }
+
+    subscription_filter *filter = malloc(sizeof(subscription_filter));
+    if(filter == NULL || (filter->value = malloc(len + 1)) == NULL) {
+	free(filter);
+	return -1;
+    }
+    memcpy(filter->value, value, len);
+    filter->value[len] = '\0';
+    filter->value_len = len;
+    filter->type = type;
+    filter->command = type == FILTER_COMMAND ? lookup_command(value, len) : CMD_UNKNOWN;
+
+    if(index_filter(this, sub, filter) != 0) {
+	free(filter->value);
+	free(filter);
+	return -1;
+    }
+
+    //First filter, so stop getting everything
+    if(sub->filters == NULL) {
+	unfiltered_erase(this, sub);
+    }
+    filter->next = sub->filters;
+    sub->filters = filter;
+    return 0;
+}
+
+int unsubscribe(subscription_index *this, subscriber *sub, filter_type type, const char *value, size_t len) {
+    for(subscription_filter **current = &(sub->filters); *current != NULL; current = &((*current)->next)) {
+	subscription_filter *filter = *current;
+	if(filter->type != type || !irc_equals(filter->value, filter->value_len, value, len)) {
+	    continue;
+	}
+
+	*current = filter->next;
+	unindex_filter(this, sub, filter);
+	free(filter->value);
+	free(filter);
+
+	if(sub->filters == NULL) {
+	    unfiltered_insert(this, sub);
+	}
+	return 0;
+    }
+    return 1;
+}
+
+void unsubscribe_all(subscription_index *this, subscriber *sub) {
+    if(sub->filters == NULL) {
+	return;
+    }
+
+    subscription_filter *next;
+    for(subscription_filter *current = sub->filters; current != NULL; current = next) {
+	next = current->next;
+	unindex_filter(this, sub, current);
+	free(current->value);
+	free(current);
+    }
+    sub->filters = NULL;
+    unfiltered_insert(this, sub);
+}
+
+/*
+ * Adds everyone in a set to the matches
+ */
+void route_set(subscription_index *this, subscriber_set *set) {
+    if(set == NULL) {
+	return;
+    }
+    for(size_t i = 0; i < set->len; i++) {
+	subscriber *sub = set->items[i];
+	if(sub->stamp != this->stamp) {
+	    sub->stamp = this->stamp;
+	    subscriber_set_push(&(this->matches), sub);
+	}
+    }
+}
+
+/*
+ * Adds everyone in the set stored under key to the matches
+ */
+void route_key(subscription_index *this, string_map *map, const char *key, size_t len) {
+    route_set(this, string_map_get(map, key, len));
+}
+
+size_t message_channels(irc_message *msg, irc_slice *channels, size_t max) {
+    size_t found = 0;
+    size_t count = message_param_count(msg);
+    if(count > 1 && msg->params_trailing) {
+	count--;
+    }
+
+    for(size_t i = 0; i < count; i++) {
+	irc_slice param = message_param(msg, i);
+	const char *end = param.ptr + param.len;
+
+	//Targets may be comma separated lists, as in "PART #a,#b"
+	while(param.ptr < end && found < max) {
+	    const char *comma = memchr(param.ptr, ',', end - param.ptr);
+	    irc_slice target = { param.ptr, (comma == NULL ? end : comma) - param.ptr };
+	    if(is_channel(target)) {
+		channels[found++] = target;
+	    }
+	    param.ptr = target.ptr + target.len + 1;
+	}
+    }
+    return found;
+}
+
+/*
+ * Routes on every channel the line is about
+ */
+void route_channels(subscription_index *this, irc_message *msg) {
+    irc_slice channels[IRC_MAX_PARAMS];
+    size_t count = message_channels(msg, channels, IRC_MAX_PARAMS);
+
+    for(size_t i = 0; i < count; i++) {
+	route_key(this, &(this->channels), channels[i].ptr, channels[i].len);
+    }
+}
+
+/*
+ * Length of the nick at the start of a prefix
+ */
+size_t prefix_nick_len(irc_slice prefix) {
+    size_t nick_len = 0;
+    while(nick_len < prefix.len && prefix.ptr[nick_len] != '!' && prefix.ptr[nick_len] != '@') {
+	nick_len++;
+    }
+    return nick_len;
+}
+
+int subscription_matches(subscriber *sub, irc_message *msg) {
+    if(sub->filters == NULL) {
+	return 1;
+    }
+
+    irc_slice channels[IRC_MAX_PARAMS];
+    size_t channels_len = 0;
+    int channels_found = 0;
+    irc_slice prefix = msg->prefix_view;
+
+    for(subscription_filter *filter = sub->filters; filter != NULL; filter = filter->next) {
+	switch(filter->type) {
+	    case FILTER_COMMAND:
+		if(filter->command != CMD_UNKNOWN) {
+		    if(filter->command == msg->command_id) {
+			return 1;
+		    }
+		}
+		else if(irc_equals(filter->value, filter->value_len, msg->command_view.ptr, msg->command_view.len)) {
+		    return 1;
+		}
+		break;
+
+	    case FILTER_CHANNEL:
+		if(!channels_found) {
+		    channels_len = message_channels(msg, channels, IRC_MAX_PARAMS);
+		    channels_found = 1;
+		}
+		for(size_t i = 0; i < channels_len; i++) {
+		    if(irc_equals(filter->value, filter->value_len, channels[i].ptr, channels[i].len)) {
+			return 1;
+		    }
+		}
+		break;
+
+	    case FILTER_PREFIX:
+	    default:
+		if(prefix.ptr == NULL) {
+		    break;
+		}
+		if(is_mask(filter->value, filter->value_len)) {
+		    if(irc_mask_match(filter->value, filter->value_len, prefix.ptr, prefix.len)) {
+			return 1;
+		    }
+		}
+		else if(irc_equals(filter->value, filter->value_len, prefix.ptr, prefix_nick_len(prefix))) {
+		    return 1;
+		}
+		break;
+	}
+    }
+    return 0;
+}
+
+subscription_filter * copy_filters(subscription_filter *filters) {
+    subscription_filter *copy = NULL;
+    subscription_filter **tail = &copy;
+
+    for(subscription_filter *current = filters; current != NULL; current = current->next) {
+	subscription_filter *filter = malloc(sizeof(subscription_filter));
+	if(filter == NULL || (filter->value = strdup(current->value)) == NULL) {
+	    free(filter);
+	    free_filters(copy);
+	    return NULL;
+	}
+	filter->type = current->type;
+	filter->value_len = current->value_len;
+	filter->command = current->command;
+	filter->next = NULL;
+	*tail = filter;
+	tail = &(filter->next);
+    }
+    return copy;
+}
+
+void free_filters(subscription_filter *filters) {
+    subscription_filter *next;
+    for(subscription_filter *current = filters; current != NULL; current = next) {
+	next = current->next;
+	free(current->value);
+	free(current);
+    }
+}
+
+subscriber_set * subscription_route(subscription_index *this, irc_message *msg) {
+    this->stamp++;
+    this->matches.len = 0;
+
+    //Unfiltered subscribers can't be matched twice, so skip the stamping
+    for(size_t i = 0; i < this->unfiltered.len; i++) {
+	subscriber_set_push(&(this->matches), this->unfiltered.items[i]);
+    }
+    if(msg == NULL) {
+	return &(this->matches);
+    }
+
+    if(msg->command_id != CMD_UNKNOWN) {
+	if(this->command_sets_len > 0) {
+	    route_set(this, this->command_sets[msg->command_id]);
+	}
+    }
+    else if(this->commands.len > 0) {
+	route_key(this, &(this->commands), msg->command_view.ptr, msg->command_view.len);
+    }
+
+    if(this->channels.len > 0) {
+	route_channels(this, msg);
+    }
+
+    irc_slice prefix = msg->prefix_view;
+    if(prefix.ptr != NULL && this->nicks.len > 0) {
+	route_key(this, &(this->nicks), prefix.ptr, prefix_nick_len(prefix));
+    }
+
+    if(prefix.ptr != NULL) {
+	for(size_t i = 0; i < this->masks_len; i++) {
+	    subscription_mask *mask = &(this->masks[i]);
+	    if(mask->subscriber->stamp != this->stamp 
+		    && irc_mask_match(mask->filter->value, mask->filter->value_len, prefix.ptr, prefix.len)) {
+		mask->subscriber->stamp = this->stamp;
+		subscriber_set_push(&(this->matches), mask->subscriber);
+	    }
+	}
+    }
+
+    return &(this->matches);
+}
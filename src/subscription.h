@@ -0,0 +1,175 @@
+/* subscription.h
+ *
+ * Defines subscription filters, and the indexes used to route a line from
+ * the remote to just the clients that asked for it.
+ *
+ * A subscriber with no filters gets every line. Once it has any, it only
+ * gets lines matching at least one of them:
+ *
+ *   COMMAND  the command or numeric, e.g. PRIVMSG or 353
+ *   CHANNEL  a channel named in the params, e.g. the target of a PRIVMSG
+ *   PREFIX   the nick in the prefix, or a mask like *!*@host matched
+ *            against the whole prefix
+ *
+ * Commands are looked up by id in a table, channels and nicks in hash
+ * maps, so routing a line costs about as much as the number of subscribers
+ * it goes to. Only prefix masks with wildcards are checked one by one.
+ */
+
+#ifndef _SUBSCRIPTION_H
+#define _SUBSCRIPTION_H
+
+#include <stddef.h>
+
+#include "irc_message.h"
+#include "string_map.h"
+
+typedef enum filter_type_enum {
+    FILTER_COMMAND,
+    FILTER_CHANNEL,
+    FILTER_PREFIX,
+    FILTER_TYPE_COUNT
+} filter_type;
+
+typedef struct subscription_filter_struct {
+    filter_type type;
+    char *value;
+    size_t value_len;
+    //COMMAND filters only: the value resolved by lookup_command
+    int command;
+    struct subscription_filter_struct *next;
+} subscription_filter;
+
+/*
+ * Routing state embedded in whatever is being routed to
+ */
+typedef struct subscriber_struct {
+    void *owner;
+    subscription_filter *filters;
+
+    //Where we sit in the index's unfiltered set, while we have no filters
+    size_t unfiltered_slot;
+
+    //Last line we were matched to, so overlapping filters deliver once
+    unsigned long stamp;
+} subscriber;
+
+typedef struct subscriber_set_struct {
+    subscriber **items;
+    size_t len;
+    size_t size;
+} subscriber_set;
+
+typedef struct subscription_mask_struct {
+    subscription_filter *filter;
+    subscriber *subscriber;
+} subscription_mask;
+
+typedef struct subscription_index_struct {
+    //Subscribers with no filters, which get everything
+    subscriber_set unfiltered;
+
+    //Subscribers to each command we have an id for, NULL if none
+    subscriber_set *command_sets[CMD_COUNT];
+    size_t command_sets_len;
+
+    //Keyed by unknown command, channel and nick; values are subscriber_sets
+    string_map commands;
+    string_map channels;
+    string_map nicks;
+
+    //Prefix filters with wildcards in them
+    subscription_mask *masks;
+    size_t masks_len;
+    size_t masks_size;
+
+    //Subscribers matched by the last route, reused from line to line
+    subscriber_set matches;
+    unsigned long stamp;
+} subscription_index;
+
+void init_subscription_index(subscription_index *this);
+
+/*
+ * Frees the index. Every subscriber must have been removed already.
+ */
+void destroy_subscription_index(subscription_index *this);
+
+/*
+ * Adds a subscriber with no filters to the index.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int subscription_add(subscription_index *this, subscriber *sub, void *owner);
+
+/*
+ * Drops a subscriber and all its filters from the index
+ */
+void subscription_remove(subscription_index *this, subscriber *sub);
+
+/*
+ * Parses a filter type name (COMMAND, NUMERIC, CHANNEL or PREFIX, in any
+ * case). NUMERIC is a COMMAND that must be three digits.
+ *
+ * Returns the type, or FILTER_TYPE_COUNT if the name or value is invalid.
+ */
+filter_type parse_filter_type(irc_slice name, irc_slice value);
+
+/*
+ * Adds a filter to a subscriber.
+ *
+ * Returns 0 on success, 1 if the subscriber already had it, -1 on error.
+ */
+int subscribe(subscription_index *this, subscriber *sub, filter_type type, const char *value, size_t len);
+
+/*
+ * Removes a filter from a subscriber. A subscriber left with no filters
+ * goes back to getting everything.
+ *
+ * Returns 0 on success, 1 if the subscriber didn't have it.
+ */
+int unsubscribe(subscription_index *this, subscriber *sub, filter_type type, const char *value, size_t len);
+
+/*
+ * Removes all of a subscriber's filters
+ */
+void unsubscribe_all(subscription_index *this, subscriber *sub);
+
+/*
+ * Finds every subscriber a line should go to, each exactly once. With a
+ * NULL msg only the unfiltered subscribers match. The returned set belongs
+ * to the index and is overwritten by the next call.
+ */
+subscriber_set * subscription_route(subscription_index *this, irc_message *msg);
+
+/*
+ * Returns 1 if a line matches any of a subscriber's filters, or if it has
+ * none; 0 otherwise. Works on subscribers that aren't in an index too.
+ */
+int subscription_matches(subscriber *sub, irc_message *msg);
+
+/*
+ * Copies a subscriber's filters, e.g. to match against on another thread.
+ *
+ * Returns the copy, or NULL if there are no filters or on error.
+ */
+subscription_filter * copy_filters(subscription_filter *filters);
+
+void free_filters(subscription_filter *filters);
+
+/*
+ * Finds the channels a line is about: every channel named in its params,
+ * except in the trailing param unless it's the only one (as in 
+ * "JOIN :#channel"). Comma separated lists are split up.
+ *
+ * Returns the number of channels found, at most max.
+ */
+size_t message_channels(irc_message *msg, irc_slice *channels, size_t max);
+
+/*
+ * Returns 1 if str matches a mask of literals, '*' and '?', compared the
+ * RFC1459 way; 0 otherwise.
+ */
+int irc_mask_match(const char *mask, size_t mask_len, const char *str, size_t len);
+
+#endif /* _SUBSCRIPTION_H */
@@ -0,0 +1,170 @@
+/* timer_wheel.c
+ *
+ * Implements the hierarchical timer wheel
+ */
+
+#include <string.h>
+
+#include "timer_wheel.h"
+
+#define LEVEL_SHIFT(level) (TIMER_WHEEL_BITS * (level))
+
+void init_timer_wheel(timer_wheel *this, uint64_t now) {
+    memset(this, 0, sizeof(timer_wheel));
+    this->now = now;
+}
+
+void init_timer(timer *this, timer_callback callback, void *args) {
+    this->expires = 0;
+    this->callback = callback;
+    this->args = args;
+    this->next = NULL;
+    this->pprev = NULL;
+    this->level = 0;
+    this->slot = 0;
+}
+
+/*
+ * Files a timer in the slot that is processed last before it expires: the
+ * lowest level whose span covers the time left.
+ */
+void link_timer(timer_wheel *this, timer *t) {
+    uint64_t expires = t->expires < this->now ? this->now : t->expires;
+    if(expires - this->now >= TIMER_WHEEL_SPAN) {
+	expires = this->now + TIMER_WHEEL_SPAN - 1;
+    }
+
+    unsigned int level = 0;
+    while(level < TIMER_WHEEL_LEVELS - 1 && expires - this->now >= (1ULL << LEVEL_SHIFT(level + 1))) {
+	level++;
+    }
+    unsigned int slot = (expires >> LEVEL_SHIFT(level)) & (TIMER_WHEEL_SLOTS - 1);
+
+    timer **head = &(this->slots[level][slot]);
+    t->next = *head;
+    if(*head != NULL) {
+	(*head)->pprev = &(t->next);
+    }
+    *head = t;
+    t->pprev = head;
+    t->level = level;
+    t->slot = slot;
+    this->occupied[level] |= 1ULL << slot;
+}
+
+void unlink_timer(timer_wheel *this, timer *t) {
+    *(t->pprev) = t->next;
+    if(t->next != NULL) {
+	t->next->pprev = t->pprev;
+    }
+    t->next = NULL;
+    t->pprev = NULL;
+
+    if(this->slots[t->level][t->slot] == NULL) {
+	this->occupied[t->level] &= ~(1ULL << t->slot);
+    }
+}
+
+void timer_arm(timer_wheel *this, timer *t, uint64_t expires) {
+    if(timer_is_armed(t)) {
+	unlink_timer(this, t);
+    }
+    else {
+	this->armed++;
+    }
+    t->expires = expires;
+    link_timer(this, t);
+}
+
+void timer_cancel(timer_wheel *this, timer *t) {
+    if(timer_is_armed(t)) {
+	unlink_timer(this, t);
+	this->armed--;
+    }
+}
+
+/*
+ * Takes every timer out of a slot, leaving them on a list of their own
+ * that unlink_timer still works on.
+ */
+void detach_slot(timer_wheel *this, unsigned int level, unsigned int slot, timer **list) {
+    *list = this->slots[level][slot];
+    if(*list != NULL) {
+	(*list)->pprev = list;
+    }
+    this->slots[level][slot] = NULL;
+    this->occupied[level] &= ~(1ULL << slot);
+}
+
+/*
+ * Processes tick this->now: timers on higher levels whose slot comes up
+ * are moved down, then the timers due on this tick are fired.
+ */
+void run_tick(timer_wheel *this) {
+    uint64_t tick = this->now;
+
+    for(unsigned int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+	if((tick & ((1ULL << LEVEL_SHIFT(level)) - 1)) != 0) {
+	    continue;
+	}
+
+	timer *refile;
+	detach_slot(this, level, (tick >> LEVEL_SHIFT(level)) & (TIMER_WHEEL_SLOTS - 1), &refile);
+	while(refile != NULL) {
+	    timer *t = refile;
+	    unlink_timer(this, t);
+	    link_timer(this, t);
+	}
+    }
+
+    timer *due;
+    detach_slot(this, 0, tick & (TIMER_WHEEL_SLOTS - 1), &due);
+
+    //Timers armed from the callbacks are for the next tick at the earliest
+    this->now = tick + 1;
+    while(due != NULL) {
+	timer *t = due;
+	unlink_timer(this, t);
+	this->armed--;
+	(*(t->callback))(t->args);
+    }
+}
+
+void timer_wheel_advance(timer_wheel *this, uint64_t now) {
+    while(this->now <= now) {
+	//Skip the ticks where nothing happens
+	uint64_t next = timer_wheel_next(this);
+	if(next > now) {
+	    this->now = now + 1;
+	    return;
+	}
+	this->now = next;
+	run_tick(this);
+    }
+}
+
+uint64_t timer_wheel_next(timer_wheel *this) {
+    uint64_t next = UINT64_MAX;
+
+    for(unsigned int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+	uint64_t occupied = this->occupied[level];
+	if(occupied == 0) {
+	    continue;
+	}
+
+	//A slot is processed when the tick reaches its start, so one that started already waits a turn
+	unsigned int shift = LEVEL_SHIFT(level);
+	uint64_t base = this->now >> shift;
+	if((this->now & ((1ULL << shift) - 1)) != 0) {
+	    base++;
+	}
+
+	unsigned int start = base & (TIMER_WHEEL_SLOTS - 1);
+	uint64_t rotated = start == 0 ? occupied : (occupied >> start) | (occupied << (TIMER_WHEEL_SLOTS - start));
+	uint64_t tick = (base + __builtin_ctzll(rotated)) << shift;
+	if(tick < next) {
+	    next = tick;
+	}
+    }
+    return next;
+}
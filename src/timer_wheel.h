@@ -0,0 +1,82 @@
+/* timer_wheel.h
+ *
+ * Defines a hierarchical timer wheel with millisecond ticks. Timers are
+ * embedded in their owners and kept on intrusive lists, so arming and
+ * cancelling are O(1) and never allocate. Each level has TIMER_WHEEL_SLOTS
+ * slots, each covering TIMER_WHEEL_SLOTS times as many ticks as a slot on
+ * the level below; timers far out wait on a high level and are moved down
+ * as their time approaches.
+ */
+
+#ifndef _TIMER_WHEEL_H
+#define _TIMER_WHEEL_H
+
+#include <stdint.h>
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+//Timers further out than this (about 4.6 hours) are parked and re-filed
+#define TIMER_WHEEL_SPAN (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+typedef void (*timer_callback)(void *args);
+
+typedef struct timer_struct {
+    //Absolute expiry, in ms on the event loop's clock
+    uint64_t expires;
+
+    timer_callback callback;
+    void *args;
+
+    //Links in a slot's list; pprev is NULL while the timer isn't armed
+    struct timer_struct *next;
+    struct timer_struct **pprev;
+    //The slot it's in
+    unsigned char level;
+    unsigned char slot;
+} timer;
+
+typedef struct timer_wheel_struct {
+    //Next tick to be processed
+    uint64_t now;
+
+    timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    //Bit i of occupied[level] is set when slots[level][i] has timers
+    uint64_t occupied[TIMER_WHEEL_LEVELS];
+    unsigned long armed;
+} timer_wheel;
+
+void init_timer_wheel(timer_wheel *this, uint64_t now);
+
+void init_timer(timer *this, timer_callback callback, void *args);
+
+/*
+ * Arms a timer to fire at an absolute tick, moving it if it was armed
+ * already. A time that has passed fires on the next advance.
+ */
+void timer_arm(timer_wheel *this, timer *t, uint64_t expires);
+
+/*
+ * Disarms a timer. Harmless if it isn't armed.
+ */
+void timer_cancel(timer_wheel *this, timer *t);
+
+static inline int timer_is_armed(timer *t) {
+    return t->pprev != NULL;
+}
+
+/*
+ * Fires every timer due at or before now, in order of expiry tick.
+ * Callbacks may arm and cancel timers, including their own.
+ */
+void timer_wheel_advance(timer_wheel *this, uint64_t now);
+
+/*
+ * Returns the tick by which the wheel next needs advancing, or
+ * UINT64_MAX if nothing is armed. This may be earlier than the next
+ * expiry, when timers need moving down a level first.
+ */
+uint64_t timer_wheel_next(timer_wheel *this);
+
+#endif /* _TIMER_WHEEL_H */
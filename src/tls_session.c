@@ -0,0 +1,319 @@
+/* tls_session.c
+ *
+ * Implements TLS sessions with OpenSSL, handing the record layer to the
+ * kernel where it's supported
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <arpa/inet.h>
+
+#ifdef HAVE_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#endif /* HAVE_TLS */
+
+#include "tls_session.h"
+
+#ifdef HAVE_TLS
+
+void on_handshake_event(int fd, uint32_t events, void *args);
+void on_handshake_deadline(void *args);
+
+/*
+ * Prints and clears OpenSSL's error queue
+ */
+void print_tls_errors(const char *what) {
+    unsigned long error;
+    char text[256];
+    while((error = ERR_get_error()) != 0) {
+	ERR_error_string_n(error, text, sizeof(text));
+	fprintf(stderr, "Error: %s: %s\n", what, text);
+    }
+}
+
+int init_tls_context(tls_context *this, const char *ca_file) {
+    this->ctx = SSL_CTX_new(TLS_client_method());
+    if(this->ctx == NULL) {
+	print_tls_errors("SSL_CTX_new");
+	return -1;
+    }
+
+    SSL_CTX_set_min_proto_version(this->ctx, TLS1_2_VERSION);
+    /* The kernel takes over the crypto after the handshake if it can. Servers
+     * often hang up without a close_notify, and a line cut short that way has
+     * no CR LF to pass for a whole one, so that's just an EOF.
+     */
+    SSL_CTX_set_options(this->ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_mode(this->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_verify(this->ctx, SSL_VERIFY_PEER, NULL);
+
+    int loaded = ca_file != NULL
+	? SSL_CTX_load_verify_locations(this->ctx, ca_file, NULL)
+	: SSL_CTX_set_default_verify_paths(this->ctx);
+    if(loaded != 1) {
+	print_tls_errors(ca_file != NULL ? ca_file : "loading the system CAs");
+	SSL_CTX_free(this->ctx);
+	this->ctx = NULL;
+	return -1;
+    }
+
+    /* OpenSSL writes the handshake and alerts with write(), which can't be
+     * told MSG_NOSIGNAL, so a server hanging up mid-handshake would SIGPIPE
+     * us. EPIPE does just as well.
+     */
+    signal(SIGPIPE, SIG_IGN);
+    return 0;
+}
+
+void destroy_tls_context(tls_context *this) {
+    if(this->ctx != NULL) {
+	SSL_CTX_free(this->ctx);
+	this->ctx = NULL;
+    }
+}
+
+tls_session * new_tls_session(tls_context *context, int fd, const char *host) {
+    tls_session *this = calloc(1, sizeof(tls_session));
+    if(this == NULL) {
+	return NULL;
+    }
+    this->fd = fd;
+    init_event_handler(&(this->handler), -1, &on_handshake_event, this);
+    init_timer(&(this->deadline), &on_handshake_deadline, this);
+
+    this->ssl = SSL_new(context->ctx);
+    if(this->ssl == NULL || SSL_set_fd(this->ssl, fd) != 1) {
+	print_tls_errors("SSL_new");
+	destroy_tls_session(this);
+	return NULL;
+    }
+
+    //Servers named by address are checked against their IP SANs, and get no SNI
+    X509_VERIFY_PARAM *param = SSL_get0_param(this->ssl);
+    unsigned char address[sizeof(struct in6_addr)];
+    int by_address = inet_pton(AF_INET, host, address) == 1 || inet_pton(AF_INET6, host, address) == 1;
+    int checked = by_address
+	? X509_VERIFY_PARAM_set1_ip_asc(param, host)
+	: X509_VERIFY_PARAM_set1_host(param, host, 0) && SSL_set_tlsext_host_name(this->ssl, host);
+    if(checked != 1) {
+	print_tls_errors(host);
+	destroy_tls_session(this);
+	return NULL;
+    }
+
+    SSL_set_connect_state(this->ssl);
+    return this;
+}
+
+void destroy_tls_session(tls_session *this) {
+    if(this->loop != NULL) {
+	if(this->handler.fd >= 0) {
+	    event_loop_remove(this->loop, &(this->handler));
+	}
+	event_loop_cancel_timer(this->loop, &(this->deadline));
+    }
+
+    if(this->ssl != NULL) {
+	//Best effort: one try at a close_notify, without waiting for the server's
+	if(this->established) {
+	    SSL_shutdown(this->ssl);
+	}
+	SSL_free(this->ssl);
+    }
+    ERR_clear_error();
+    free(this->write_buffer);
+    free(this);
+}
+
+/*
+ * Moves the handshake along as far as it'll go without blocking. Once it's
+ * done, sees whether the kernel took over the records and calls back.
+ */
+void tls_continue_handshake(tls_session *this) {
+    ERR_clear_error();
+    int result = SSL_do_handshake(this->ssl);
+
+    if(result != 1) {
+	int error = SSL_get_error(this->ssl, result);
+	if(error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+	    return;
+	}
+
+	long verified = SSL_get_verify_result(this->ssl);
+	if(verified != X509_V_OK) {
+	    fprintf(stderr, "Error: TLS certificate rejected: %s\n", X509_verify_cert_error_string(verified));
+	}
+	else if(error == SSL_ERROR_SYSCALL && errno != 0) {
+	    perror("TLS handshake");
+	}
+	else {
+	    fprintf(stderr, "Error: TLS handshake failed\n");
+	}
+	print_tls_errors("TLS handshake");
+    }
+    else {
+	this->established = 1;
+	this->ktls_send = BIO_get_ktls_send(SSL_get_wbio(this->ssl));
+	this->ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(this->ssl));
+
+	fprintf(stderr, "TLS established with %s using %s, kernel TLS for sending: %s, receiving: %s\n",
+		SSL_get_version(this->ssl), SSL_get_cipher_name(this->ssl),
+		this->ktls_send ? "yes" : "no", this->ktls_recv ? "yes" : "no");
+    }
+
+    //The socket is going back to whoever started us
+    event_loop_remove(this->loop, &(this->handler));
+    this->handler.fd = -1;
+    event_loop_cancel_timer(this->loop, &(this->deadline));
+    (*(this->callback))(this, this->established, this->args);
+}
+
+int tls_handshake(tls_session *this, event_loop *loop, tls_callback callback, void *args) {
+    this->loop = loop;
+    this->callback = callback;
+    this->args = args;
+
+    //Edge-triggered, and a fresh registration reports what's ready already, which gets us started
+    init_event_handler(&(this->handler), this->fd, &on_handshake_event, this);
+    if(event_loop_add(loop, &(this->handler), EPOLLIN | EPOLLOUT | EPOLLRDHUP) != 0) {
+	this->handler.fd = -1;
+	return -1;
+    }
+    event_loop_add_timer(loop, &(this->deadline), TLS_HANDSHAKE_TIMEOUT);
+    return 0;
+}
+
+void on_handshake_event(int fd, uint32_t events, void *args) {
+    tls_continue_handshake((tls_session *) args);
+}
+
+/*
+ * Timer: the server never finished the handshake
+ */
+void on_handshake_deadline(void *args) {
+    tls_session *this = (tls_session *) args;
+
+    fprintf(stderr, "Error: timed out in the TLS handshake\n");
+    event_loop_remove(this->loop, &(this->handler));
+    this->handler.fd = -1;
+    (*(this->callback))(this, 0, this->args);
+}
+
+/*
+ * Turns the outcome of an SSL_read or SSL_write into what recv or sendmsg
+ * would have returned
+ */
+ssize_t tls_result(tls_session *this, int result) {
+    if(result > 0) {
+	return result;
+    }
+
+    switch(SSL_get_error(this->ssl, result)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+	    errno = EAGAIN;
+	    return -1;
+	case SSL_ERROR_ZERO_RETURN:
+	    //close_notify
+	    return 0;
+	case SSL_ERROR_SYSCALL:
+	    //An EOF without a close_notify is still an EOF to us
+	    if(errno == 0) {
+		return 0;
+	    }
+	    return -1;
+	default:
+	    print_tls_errors("TLS");
+	    errno = EPROTO;
+	    return -1;
+    }
+}
+
+ssize_t tls_recv(tls_session *this, void *buffer, size_t len) {
+    if(this->ktls_recv) {
+	ssize_t received = recv(this->fd, buffer, len, MSG_DONTWAIT);
+	//EIO means the next record isn't data, e.g. a session ticket, and OpenSSL has to deal with it
+	if(received >= 0 || errno != EIO) {
+	    return received;
+	}
+    }
+
+    ERR_clear_error();
+    errno = 0;
+    return tls_result(this, SSL_read(this->ssl, buffer, len > INT32_MAX ? INT32_MAX : (int) len));
+}
+
+ssize_t tls_sendmsg(tls_session *this, const struct msghdr *msg) {
+    if(this->ktls_send) {
+	return sendmsg(this->fd, msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+
+    if(this->write_buffer == NULL) {
+	this->write_buffer = malloc(TLS_WRITE_SIZE);
+	if(this->write_buffer == NULL) {
+	    errno = ENOMEM;
+	    return -1;
+	}
+    }
+
+    /* Gather up to a record's worth, so a burst of short lines costs one
+     * record rather than one each. A write that has to be repeated takes
+     * exactly the bytes it had last time, which are still at the front.
+     */
+    size_t limit = this->write_retry > 0 ? this->write_retry : TLS_WRITE_SIZE;
+    size_t len = 0;
+    for(size_t i = 0; i < msg->msg_iovlen && len < limit; i++) {
+	size_t take = msg->msg_iov[i].iov_len;
+	if(take > limit - len) {
+	    take = limit - len;
+	}
+	memcpy(this->write_buffer + len, msg->msg_iov[i].iov_base, take);
+	len += take;
+    }
+
+    ERR_clear_error();
+    errno = 0;
+    ssize_t sent = tls_result(this, SSL_write(this->ssl, this->write_buffer, (int) len));
+    this->write_retry = sent < 0 && errno == EAGAIN ? len : 0;
+    return sent;
+}
+
+#else
+
+int init_tls_context(tls_context *this, const char *ca_file) {
+    fprintf(stderr, "Error: built without TLS support\n");
+    this->ctx = NULL;
+    return -1;
+}
+
+void destroy_tls_context(tls_context *this) {
+}
+
+tls_session * new_tls_session(tls_context *context, int fd, const char *host) {
+    return NULL;
+}
+
+int tls_handshake(tls_session *this, event_loop *loop, tls_callback callback, void *args) {
+    return -1;
+}
+
+void destroy_tls_session(tls_session *this) {
+}
+
+ssize_t tls_recv(tls_session *this, void *buffer, size_t len) {
+    errno = EPROTONOSUPPORT;
+    return -1;
+}
+
+ssize_t tls_sendmsg(tls_session *this, const struct msghdr *msg) {
+    errno = EPROTONOSUPPORT;
+    return -1;
+}
+
+#endif /* HAVE_TLS */
@@ -0,0 +1,102 @@
+/* tls_session.h
+ *
+ * Defines a TLS session over a connected, non-blocking socket, for the
+ * remote. The handshake is done with OpenSSL on the event loop. After that,
+ * if the kernel can do the record crypto (kTLS), the session gets out of
+ * the way: buffered_socket keeps using plain recv and sendmsg on the fd
+ * with no extra copy. If it can't, records go through OpenSSL instead.
+ *
+ * Built without OpenSSL (no HAVE_TLS), every session fails to start.
+ */
+
+#ifndef _TLS_SESSION_H
+#define _TLS_SESSION_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "event_loop.h"
+
+//How long the handshake may take
+#define TLS_HANDSHAKE_TIMEOUT (30 * 1000)
+
+//Most plaintext OpenSSL gets at once when the kernel isn't doing the crypto, one full record
+#define TLS_WRITE_SIZE 16384
+
+/*
+ * Certificates and settings shared by every session we start
+ */
+typedef struct tls_context_struct {
+    struct ssl_ctx_st *ctx;
+} tls_context;
+
+typedef struct tls_session_struct tls_session;
+
+/*
+ * Called once the handshake is over; ok is 0 if it failed
+ */
+typedef void (*tls_callback)(tls_session *session, int ok, void *args);
+
+struct tls_session_struct {
+    int fd;
+    struct ssl_st *ssl;
+
+    //Watches the fd while the handshake runs
+    event_loop *loop;
+    event_handler handler;
+    timer deadline;
+    tls_callback callback;
+    void *args;
+    int established;
+
+    //Whether the kernel encrypts what we send and decrypts what we read
+    int ktls_send;
+    int ktls_recv;
+
+    /* Plaintext handed to SSL_write, which needs the same bytes again when
+     * it couldn't finish; 0 if it did
+     */
+    size_t write_retry;
+    char *write_buffer;
+};
+
+/*
+ * Sets up certificate checking against the system's CAs, or only against
+ * those in ca_file if it isn't NULL.
+ *
+ * Returns 0 on success, -1 on error or if we were built without TLS.
+ */
+int init_tls_context(tls_context *this, const char *ca_file);
+void destroy_tls_context(tls_context *this);
+
+/*
+ * Starts a TLS session on fd, checking that the server's certificate is
+ * for host. The fd stays the caller's.
+ *
+ * Returns the session, or NULL on error.
+ */
+tls_session * new_tls_session(tls_context *context, int fd, const char *host);
+
+/*
+ * Shakes hands with the server on loop, and calls back when that's done
+ * or has failed. The callback is always called later from the loop.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int tls_handshake(tls_session *this, event_loop *loop, tls_callback callback, void *args);
+
+/*
+ * Sends a close_notify if it can do so without blocking, and frees the
+ * session. Doesn't close the fd.
+ */
+void destroy_tls_session(tls_session *this);
+
+/*
+ * Like recv() and sendmsg() on the session's fd, non-blocking and without
+ * SIGPIPE: they return the plaintext bytes read or accepted, 0 on EOF, or
+ * -1 with errno set, EAGAIN included.
+ */
+ssize_t tls_recv(tls_session *this, void *buffer, size_t len);
+ssize_t tls_sendmsg(tls_session *this, const struct msghdr *msg);
+
+#endif /* _TLS_SESSION_H */
@@ -17,7 +17,7 @@ char * strn_append(char **old_str, char *append_str, size_t n) {
     if(*old_str == NULL) {
 	*old_str = malloc(n + 1);
 	memset(*old_str, 0, n + 1);
-	strcpy(*old_str, append_str);
+	strncpy(*old_str, append_str, n);
     }
     else {
 	int new_str_len = strlen(*old_str) + n;
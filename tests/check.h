@@ -0,0 +1,45 @@
+/* check.h
+ *
+ * The little the tests need: CHECK reports a condition that doesn't hold
+ * and carries on, and the test's main returns check_failed() so ctest sees
+ * whether any did. Random inputs come from a fixed seed, so a failure can
+ * be run again.
+ */
+
+#ifndef _CHECK_H
+#define _CHECK_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+static unsigned long check_failures = 0;
+
+#define CHECK(condition, ...) do { \
+    if(!(condition)) { \
+	check_failures++; \
+	fprintf(stderr, "%s:%d: %s: ", __FILE__, __LINE__, #condition); \
+	fprintf(stderr, __VA_ARGS__); \
+	fputc('\n', stderr); \
+    } \
+} while(0)
+
+static inline int check_failed(const char *name) {
+    if(check_failures > 0) {
+	fprintf(stderr, "%s: %lu checks failed\n", name, check_failures);
+	return 1;
+    }
+    fprintf(stdout, "%s: ok\n", name);
+    return 0;
+}
+
+/*
+ * xorshift64*, good enough to shuffle test inputs
+ */
+static inline uint64_t check_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+#endif /* _CHECK_H */
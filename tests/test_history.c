@@ -0,0 +1,261 @@
+/* test_history.c
+ *
+ * Records lines into rings small enough to wrap many times over, and asks
+ * for random ranges, whole and filtered by channel, checking each answer
+ * against a plain list of every line ever recorded: exactly the lines
+ * still held, in order, none twice, and missing_upto owning up to the
+ * ones that aren't.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "history.h"
+
+#define GLOBAL_SIZE 64
+#define CHANNEL_SIZE 16
+#define LINES 3000
+
+//Channels a line can name; the ones we're in get rings of their own
+const char *names[] = { "#a", "#b", "#c", "#other" };
+#define NAMES_LEN (sizeof(names) / sizeof(names[0]))
+int joined_names[NAMES_LEN] = { 1, 1, 1, 0 };
+
+typedef struct recorded_struct {
+    unsigned long seq;
+    //Which of names the line is about
+    int about[NAMES_LEN];
+    //How many lines each channel's ring had taken with this one, 0 if it wasn't put in one
+    unsigned long channel_pushes[NAMES_LEN];
+} recorded;
+
+history hist;
+string_map joined;
+recorded lines[LINES + 1];
+unsigned long recorded_len = 0;
+//Lines pushed into each channel's ring so far, as the ring counts them
+unsigned long channel_pushed[NAMES_LEN];
+uint64_t seed = 0xda942042e4dd58b5ULL;
+
+/*
+ * Makes up a line about some of the channels, sometimes naming one twice
+ * in another case, the way "PART #a,#A" does
+ */
+void record_line(unsigned long seq) {
+    recorded *line = &(lines[seq]);
+    memset(line, 0, sizeof(recorded));
+    line->seq = seq;
+
+    char text[256];
+    size_t len;
+    switch(check_random(&seed) % 5) {
+    case 0:
+	//About nothing we'd call a channel
+	len = snprintf(text, sizeof(text), ":n!u@h PRIVMSG me :%lu\r\n", seq);
+	break;
+    case 1: {
+	//Two or more at once
+	size_t first = check_random(&seed) % NAMES_LEN, second = check_random(&seed) % NAMES_LEN;
+	len = snprintf(text, sizeof(text), ":n!u@h PART %s,%s :%lu\r\n", names[first], names[second], seq);
+	line->about[first] = line->about[second] = 1;
+	break;
+    }
+    case 2: {
+	size_t which = check_random(&seed) % NAMES_LEN;
+	len = snprintf(text, sizeof(text), ":n!u@h PRIVMSG %s,%c%c :%lu\r\n", names[which], names[which][0],
+		names[which][1] - 32, seq);
+	line->about[which] = 1;
+	break;
+    }
+    default: {
+	size_t which = check_random(&seed) % NAMES_LEN;
+	len = snprintf(text, sizeof(text), ":n!u@h PRIVMSG %s :%lu #c\r\n", names[which], seq);
+	line->about[which] = 1;
+	break;
+    }
+    }
+
+    shared_buffer *buffer = new_shared_buffer(text, len);
+    buffer->seq = seq;
+    irc_message msg;
+    CHECK(parse_message_view(&msg, buffer->data, buffer->len) == 0, "couldn't parse %s", text);
+    history_record(&hist, buffer, &msg, &joined);
+    shared_buffer_unref(buffer);
+
+    for(size_t i = 0; i < NAMES_LEN; i++) {
+	if(line->about[i] && joined_names[i]) {
+	    line->channel_pushes[i] = ++channel_pushed[i];
+	}
+    }
+    recorded_len = seq;
+}
+
+/*
+ * What the global ring still holds, and what a channel's ring does
+ */
+int held_globally(unsigned long seq) {
+    return seq + GLOBAL_SIZE > recorded_len;
+}
+
+int held_by_channel(unsigned long seq, size_t channel) {
+    return lines[seq].channel_pushes[channel] + CHANNEL_SIZE > channel_pushed[channel];
+}
+
+/*
+ * The reference for one query. Channel filters only (or none at all), as
+ * the rings are what's under test; which channels are ours decides which
+ * rings are searched.
+ */
+void check_range(int *wanted, unsigned long after, unsigned long upto) {
+    subscription_filter filters[NAMES_LEN];
+    subscription_filter *head = NULL;
+    int channels_only = 1, any = 0;
+    for(size_t i = 0; i < NAMES_LEN; i++) {
+	if(wanted == NULL || !wanted[i]) {
+	    continue;
+	}
+	filters[i].type = FILTER_CHANNEL;
+	filters[i].value = (char *) names[i];
+	filters[i].value_len = strlen(names[i]);
+	filters[i].command = CMD_UNKNOWN;
+	filters[i].next = head;
+	head = &(filters[i]);
+	channels_only &= joined_names[i];
+	any = 1;
+    }
+    channels_only &= any;
+
+    //Expected lines, and the newest one in range that can't be had
+    unsigned long expected[LINES];
+    size_t expected_len = 0;
+    unsigned long expected_missing = 0;
+    for(unsigned long seq = after + 1; seq <= upto && seq <= recorded_len; seq++) {
+	int matches = !any;
+	int held = 0;
+	for(size_t i = 0; i < NAMES_LEN; i++) {
+	    if(any && wanted[i] && lines[seq].about[i]) {
+		matches = 1;
+		held |= channels_only && held_by_channel(seq, i);
+	    }
+	}
+	if(!channels_only) {
+	    held = held_globally(seq);
+	}
+
+	if(matches && held) {
+	    expected[expected_len++] = seq;
+	}
+	//Lost lines are owned up to whether they'd have matched or not
+	if(!channels_only && !held_globally(seq)) {
+	    expected_missing = seq;
+	}
+    }
+    if(channels_only) {
+	//The newest line any of the rings dropped, short of the range's end
+	for(size_t i = 0; i < NAMES_LEN; i++) {
+	    if(!wanted[i] || channel_pushed[i] <= CHANNEL_SIZE) {
+		continue;
+	    }
+	    unsigned long oldest = 0;
+	    for(unsigned long seq = 1; seq <= recorded_len && oldest == 0; seq++) {
+		if(lines[seq].channel_pushes[i] == channel_pushed[i] - CHANNEL_SIZE + 1) {
+		    oldest = seq;
+		}
+	    }
+	    if(oldest > after + 1 && after < upto) {
+		unsigned long missing = oldest - 1 < upto ? oldest - 1 : upto;
+		if(missing > expected_missing) {
+		    expected_missing = missing;
+		}
+	    }
+	}
+    }
+
+    shared_buffer **got;
+    unsigned long missing_upto;
+    size_t got_len = history_collect(&hist, head, after, upto, &got, &missing_upto);
+    CHECK(got_len != (size_t) -1, "collect (%lu, %lu] failed", after, upto);
+    if(got_len == (size_t) -1) {
+	return;
+    }
+
+    CHECK(got_len == expected_len, "(%lu, %lu] %s: %zu lines, expected %zu", after, upto,
+	    channels_only ? "by channel" : "global", got_len, expected_len);
+    for(size_t i = 0; i < got_len && i < expected_len; i++) {
+	CHECK(got[i]->seq == expected[i], "(%lu, %lu] line %zu is %lu, expected %lu", after, upto, i,
+		got[i]->seq, expected[i]);
+    }
+    CHECK(missing_upto == expected_missing, "(%lu, %lu] %s: missing up to %lu, expected %lu", after, upto,
+	    channels_only ? "by channel" : "global", missing_upto, expected_missing);
+
+    for(size_t i = 0; i < got_len; i++) {
+	shared_buffer_unref(got[i]);
+    }
+    free(got);
+}
+
+/*
+ * A range ending at the newest line or short of it, starting anywhere
+ * from before anything was recorded to past the end
+ */
+void check_random_range() {
+    unsigned long upto = check_random(&seed) % 2 ? recorded_len : check_random(&seed) % (recorded_len + 2);
+    unsigned long after = check_random(&seed) % (upto + 2);
+    if(check_random(&seed) % 4 == 0 && upto > GLOBAL_SIZE) {
+	//Right around where the global ring ends
+	after = recorded_len - GLOBAL_SIZE - 2 + check_random(&seed) % 4;
+    }
+
+    int wanted[NAMES_LEN];
+    switch(check_random(&seed) % 3) {
+    case 0:
+	check_range(NULL, after, upto);
+	break;
+    default:
+	for(size_t i = 0; i < NAMES_LEN; i++) {
+	    wanted[i] = check_random(&seed) % 2;
+	}
+	check_range(wanted, after, upto);
+	break;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    CHECK(init_history(&hist, GLOBAL_SIZE, CHANNEL_SIZE) == 0, "init_history");
+    init_string_map(&joined, 1);
+    for(size_t i = 0; i < NAMES_LEN; i++) {
+	if(joined_names[i]) {
+	    string_map_put(&joined, names[i], strlen(names[i]), (void *) names[i]);
+	}
+    }
+
+    //Nothing yet
+    check_range(NULL, 0, 0);
+    int all[NAMES_LEN] = { 1, 1, 1, 0 };
+    check_range(all, 0, 10);
+
+    for(unsigned long seq = 1; seq <= LINES; seq++) {
+	record_line(seq);
+	check_random_range();
+
+	//Leave #c halfway through, after which it's only in the global ring
+	if(seq == LINES / 2) {
+	    history_forget(&hist, "#C", 2);
+	    string_map_remove(&joined, "#c", 2);
+	    joined_names[2] = 0;
+	}
+    }
+
+    //Every range that ends at the newest line, from before the start
+    for(unsigned long after = 0; after <= LINES; after++) {
+	check_range(NULL, after, LINES);
+	check_range(all, after, LINES);
+	int ours[NAMES_LEN] = { 1, 1, 0, 0 };
+	check_range(ours, after, LINES);
+    }
+
+    destroy_string_map(&joined);
+    destroy_history(&hist);
+    return check_failed("history");
+}
@@ -0,0 +1,134 @@
+/* test_irc_message.c
+ *
+ * Parses lines at the edges of the grammar: no prefix, an empty trailing
+ * param, the 15 param limit, odd spacing and missing terminators. The
+ * copying parser is checked to agree wherever the grammar has only one
+ * reading.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "irc_message.h"
+
+typedef struct parse_case_struct {
+    const char *line;
+    //-1 if the line should be refused
+    int result;
+    //NULL for no prefix
+    const char *prefix;
+    const char *command;
+    int command_id;
+    size_t params_len;
+    const char *params[IRC_MAX_PARAMS];
+    int trailing;
+    //Whether parse_message gives the same params
+    int copying;
+} parse_case;
+
+parse_case cases[] = {
+    { "PING\r\n", 0, NULL, "PING", CMD_PING, 0, { NULL }, 0, 1 },
+    { "PING :irc.example\r\n", 0, NULL, "PING", CMD_PING, 1, { "irc.example" }, 1, 1 },
+    { "  PING x\r\n", 0, NULL, "PING", CMD_PING, 1, { "x" }, 0, 1 },
+    { "privmsg #a hi", 0, NULL, "privmsg", CMD_PRIVMSG, 2, { "#a", "hi" }, 0, 1 },
+    { ":nick!u@host PRIVMSG #a :hello there\r\n", 0, "nick!u@host", "PRIVMSG", CMD_PRIVMSG, 2,
+	{ "#a", "hello there" }, 1, 1 },
+    { ":irc.example 353 me = #a :@op +voice nick\r\n", 0, "irc.example", "353", 353, 4,
+	{ "me", "=", "#a", "@op +voice nick" }, 1, 1 },
+
+    //An empty trailing param is still a param
+    { "PRIVMSG #a :\r\n", 0, NULL, "PRIVMSG", CMD_PRIVMSG, 2, { "#a", "" }, 1, 1 },
+    { ":nick PRIVMSG #a :", 0, "nick", "PRIVMSG", CMD_PRIVMSG, 2, { "#a", "" }, 1, 1 },
+    { "PING :\r\n", 0, NULL, "PING", CMD_PING, 1, { "" }, 1, 1 },
+    //Colons only mean anything at the start of a param
+    { "PRIVMSG #a :: a :b:\r\n", 0, NULL, "PRIVMSG", CMD_PRIVMSG, 2, { "#a", ": a :b:" }, 1, 1 },
+    { "MODE #a:b +k key:x\r\n", 0, NULL, "MODE", CMD_MODE, 3, { "#a:b", "+k", "key:x" }, 0, 1 },
+
+    //Spacing, and terminators that are missing or a bare LF
+    { "PRIVMSG   #a    b\r\n", 0, NULL, "PRIVMSG", CMD_PRIVMSG, 2, { "#a", "b" }, 0, 1 },
+    { "NOTICE a \r\n", 0, NULL, "NOTICE", CMD_NOTICE, 1, { "a" }, 0, 1 },
+    { "NOTICE a b\n", 0, NULL, "NOTICE", CMD_NOTICE, 2, { "a", "b" }, 0, 0 },
+    { "FOO bar\r\n", 0, NULL, "FOO", CMD_UNKNOWN, 1, { "bar" }, 0, 1 },
+
+    //The 15th param runs to the end of the line, with or without a colon
+    { "CMD 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15\r\n", 0, NULL, "CMD", CMD_UNKNOWN, 15,
+	{ "1", "2", "3", "4", "5", "6", "7", "8", "9", "10", "11", "12", "13", "14", "15" }, 0, 1 },
+    { "CMD 1 2 3 4 5 6 7 8 9 10 11 12 13 14 :15 and more\r\n", 0, NULL, "CMD", CMD_UNKNOWN, 15,
+	{ "1", "2", "3", "4", "5", "6", "7", "8", "9", "10", "11", "12", "13", "14", "15 and more" }, 1, 1 },
+    { "CMD 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 and more\r\n", 0, NULL, "CMD", CMD_UNKNOWN, 15,
+	{ "1", "2", "3", "4", "5", "6", "7", "8", "9", "10", "11", "12", "13", "14", "15 and more" }, 0, 0 },
+    { ":p CMD 1 2 3 4 5 6 7 8 9 10 11 12 13 14 :\r\n", 0, "p", "CMD", CMD_UNKNOWN, 15,
+	{ "1", "2", "3", "4", "5", "6", "7", "8", "9", "10", "11", "12", "13", "14", "" }, 1, 1 },
+
+    //Nothing to call a command
+    { "", -1 },
+    { "\r\n", -1 },
+    { "   \r\n", -1 },
+    { ":nick\r\n", -1 },
+    { ":nick \r\n", -1 },
+};
+
+int slice_is(irc_slice slice, const char *str) {
+    return slice.ptr != NULL && slice_equals(slice, str);
+}
+
+void check_copying(parse_case *c) {
+    irc_message *msg = parse_message((char *) c->line);
+    if(msg == NULL) {
+	CHECK(0, "%s: parse_message failed", c->line);
+	return;
+    }
+
+    CHECK(c->prefix == NULL ? msg->prefix == NULL : msg->prefix != NULL && strcmp(msg->prefix + 1, c->prefix) == 0,
+	    "%s: copied prefix %s", c->line, msg->prefix);
+    CHECK(strcmp(msg->command, c->command) == 0, "%s: copied command %s", c->line, msg->command);
+    CHECK(msg->command_id == c->command_id, "%s: copied command id %d", c->line, msg->command_id);
+    CHECK(msg->params_len == c->params_len, "%s: %zu params copied", c->line, msg->params_len);
+    for(size_t i = 0; i < msg->params_len && i < c->params_len; i++) {
+	CHECK(strcmp(msg->params_array[i], c->params[i]) == 0, "%s: copied param %zu is %s", c->line, i,
+		msg->params_array[i]);
+    }
+    destroy_message(msg);
+}
+
+int main(int argc, char *argv[]) {
+    for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+	parse_case *c = &(cases[i]);
+
+	//A copy just big enough, so reading past the end shows up under a sanitizer
+	size_t len = strlen(c->line);
+	char *line = malloc(len > 0 ? len : 1);
+	memcpy(line, c->line, len);
+
+	irc_message msg;
+	int result = parse_message_view(&msg, line, len);
+	CHECK(result == c->result, "%s: returned %d", c->line, result);
+	if(result != 0 || c->result != 0) {
+	    free(line);
+	    continue;
+	}
+
+	CHECK(c->prefix == NULL ? msg.prefix_view.ptr == NULL : slice_is(msg.prefix_view, c->prefix),
+		"%s: prefix %.*s", c->line, (int) msg.prefix_view.len, msg.prefix_view.ptr);
+	CHECK(slice_is(msg.command_view, c->command), "%s: command %.*s", c->line,
+		(int) msg.command_view.len, msg.command_view.ptr);
+	CHECK(msg.command_id == c->command_id, "%s: command id %d", c->line, msg.command_id);
+
+	size_t count = message_param_count(&msg);
+	CHECK(count == c->params_len, "%s: %zu params", c->line, count);
+	for(size_t p = 0; p < count && p < c->params_len; p++) {
+	    irc_slice param = message_param(&msg, p);
+	    CHECK(slice_is(param, c->params[p]), "%s: param %zu is %.*s", c->line, p, (int) param.len, param.ptr);
+	}
+	CHECK(message_param(&msg, count).ptr == NULL, "%s: a param past the last", c->line);
+	CHECK(msg.params_trailing == c->trailing, "%s: trailing %d", c->line, msg.params_trailing);
+
+	if(c->copying) {
+	    check_copying(c);
+	}
+	free(line);
+    }
+
+    return check_failed("irc_message");
+}
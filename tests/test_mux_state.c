@@ -0,0 +1,195 @@
+/* test_mux_state.c
+ *
+ * Runs the bot with fan-out workers against the fake ircd's PRIVMSG flood,
+ * and has a client ask for MUX STATE over and over while the lines stream
+ * in. The snapshot only stands in for the lines that change the state, so
+ * every PRIVMSG must still arrive, in order, however the answers land.
+ *
+ * Usage: test_mux_state <bot>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "check.h"
+#include "fake_ircd.h"
+
+//How long to keep asking, and how fast the lines come
+#define RUN_MS 2000
+#define PRIVMSG_RATE 20000
+
+int connect_client(const char *socket_path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+
+    for(int tries = 0; tries < 500; tries++) {
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0) {
+	    return -1;
+	}
+	if(connect(fd, (struct sockaddr *) &address, sizeof(address)) == 0) {
+	    return fd;
+	}
+	close(fd);
+	struct timespec pause = { 0, 10 * 1000 * 1000 };
+	nanosleep(&pause, NULL);
+    }
+    return -1;
+}
+
+void send_line(int fd, const char *line) {
+    CHECK(write(fd, line, strlen(line)) == (ssize_t) strlen(line), "couldn't send %s", line);
+}
+
+pid_t start_bot(const char *bot, const char *directory, in_port_t port, const char *socket_path) {
+    char config_path[256];
+    snprintf(config_path, sizeof(config_path), "%s/state.conf", directory);
+    FILE *config = fopen(config_path, "w");
+    if(config == NULL) {
+	return -1;
+    }
+    fprintf(config, "127.0.0.1 %u %s loadgen loadgen State Test\n", (unsigned int) port, socket_path);
+    fclose(config);
+
+    pid_t pid = fork();
+    if(pid == 0) {
+	if(freopen("/dev/null", "w", stdout) == NULL || freopen("/dev/null", "w", stderr) == NULL) {
+	    _exit(127);
+	}
+	execl(bot, bot, "-w", "2", config_path, (char *) NULL);
+	_exit(127);
+    }
+    return pid;
+}
+
+int main(int argc, char *argv[]) {
+    if(argc != 2) {
+	fprintf(stderr, "Usage: %s <bot>\n", argv[0]);
+	return 2;
+    }
+
+    char directory[] = "/tmp/test_mux_state.XXXXXX";
+    if(mkdtemp(directory) == NULL) {
+	perror("mkdtemp()");
+	return 1;
+    }
+    char socket_path[128];
+    snprintf(socket_path, sizeof(socket_path), "%s/mux.sock", directory);
+
+    traffic_mix mix;
+    memset(&mix, 0, sizeof(mix));
+    mix.privmsg_rate = PRIVMSG_RATE;
+    mix.privmsg_size = 16;
+
+    fake_ircd ircd;
+    pid_t bot = -1;
+    int fd = -1;
+    if(init_fake_ircd(&ircd, &mix, FAKE_TLS_OFF, NULL) != 0) {
+	CHECK(0, "couldn't start the fake ircd");
+	goto cleanup;
+    }
+    bot = start_bot(argv[1], directory, ircd.port, socket_path);
+    if(bot < 0 || fake_ircd_accept(&ircd, 5000) != 0) {
+	CHECK(0, "the bot never registered");
+	goto cleanup;
+    }
+
+    fd = connect_client(socket_path);
+    if(fd < 0) {
+	CHECK(0, "couldn't attach to %s", socket_path);
+	goto cleanup;
+    }
+    send_line(fd, "MUX LIVE\r\nMUX STATE\r\n");
+    if(fake_ircd_start(&ircd) != 0) {
+	CHECK(0, "couldn't start the flood");
+	goto cleanup;
+    }
+
+    char buf[65536];
+    size_t len = 0;
+    unsigned long last = 0, privmsgs = 0, gaps = 0, states = 0;
+    uint64_t deadline = now_ns() + RUN_MS * 1000000ULL;
+    int stopped = 0;
+
+    //Once the flood stops, read until the bot goes quiet
+    while(1) {
+	if(!stopped && now_ns() > deadline) {
+	    fake_ircd_stop(&ircd);
+	    stopped = 1;
+	}
+
+	struct pollfd ready = { fd, POLLIN, 0 };
+	if(poll(&ready, 1, stopped ? 500 : 100) != 1) {
+	    if(stopped) {
+		break;
+	    }
+	    continue;
+	}
+	ssize_t received = read(fd, buf + len, sizeof(buf) - len);
+	if(received <= 0) {
+	    CHECK(0, "the bot hung up");
+	    break;
+	}
+	len += received;
+
+	char *line = buf;
+	char *end;
+	while((end = memchr(line, '\n', buf + len - line)) != NULL) {
+	    *end = '\0';
+	    char *text = strstr(line, " PRIVMSG " FAKE_IRCD_CHANNEL " :");
+	    if(text != NULL) {
+		unsigned long number = strtoul(text + strlen(" PRIVMSG " FAKE_IRCD_CHANNEL " :"), NULL, 10);
+		if(last != 0 && number != last + 1 && gaps++ < 10) {
+		    CHECK(0, "PRIVMSG %lu followed %lu", number, last);
+		}
+		last = number;
+		privmsgs++;
+	    }
+	    else if(strstr(line, ":End of state") != NULL || strstr(line, ":Not registered yet") != NULL) {
+		//Ask again straight away, so a request is nearly always in flight
+		states++;
+		if(!stopped) {
+		    send_line(fd, "MUX STATE\r\n");
+		}
+	    }
+	    else if(strstr(line, "messages dropped") != NULL) {
+		CHECK(0, "the client fell behind: %s", line);
+	    }
+	    line = end + 1;
+	}
+	len = buf + len - line;
+	memmove(buf, line, len);
+    }
+
+    CHECK(gaps == 0, "%lu gaps in %lu PRIVMSGs", gaps, privmsgs);
+    CHECK(privmsgs > 0 && last == ircd.privmsgs_sent, "got up to PRIVMSG %lu of %lu", last,
+	    (unsigned long) ircd.privmsgs_sent);
+    CHECK(states > 1, "only %lu states answered", states);
+    fprintf(stdout, "%lu PRIVMSGs through %lu states\n", privmsgs, states);
+
+cleanup:
+    if(fd >= 0) {
+	close(fd);
+    }
+    if(bot > 0) {
+	kill(bot, SIGTERM);
+	waitpid(bot, NULL, 0);
+    }
+    destroy_fake_ircd(&ircd);
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s/state.conf", directory);
+    unlink(path);
+    unlink(socket_path);
+    rmdir(directory);
+    return check_failed("mux_state");
+}
@@ -0,0 +1,159 @@
+/* test_scan.c
+ *
+ * Checks every scanning kernel the CPU can run against a plain loop, at
+ * every alignment within a cache line and every length up to a few vectors
+ * past the widest, so each vector loop and each tail it leaves is covered.
+ */
+
+#include <string.h>
+
+#include "check.h"
+#include "scan.h"
+
+#define ALIGNMENTS 64
+#define MAX_LEN 100
+
+typedef const char * (*byte_scanner)(const char *, size_t, char);
+typedef const char * (*crlf_scanner)(const char *, size_t);
+
+//The kernels themselves, which scan.h doesn't export
+const char * scan_byte_scalar(const char *buf, size_t len, char c);
+const char * scan_crlf_scalar(const char *buf, size_t len);
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86 1
+const char * scan_byte_sse2(const char *buf, size_t len, char c);
+const char * scan_crlf_sse2(const char *buf, size_t len);
+const char * scan_byte_avx2(const char *buf, size_t len, char c);
+const char * scan_crlf_avx2(const char *buf, size_t len);
+#endif
+
+typedef struct scanner_struct {
+    const char *name;
+    byte_scanner byte;
+    crlf_scanner crlf;
+} scanner;
+
+scanner scanners[4];
+size_t scanners_len = 0;
+
+//Room either side, filled with things to find, so reading outside [buf, buf + len) shows
+char space[ALIGNMENTS + MAX_LEN + 64] __attribute__ ((aligned (64)));
+
+const char * reference_byte(const char *buf, size_t len, char c) {
+    for(size_t i = 0; i < len; i++) {
+	if(buf[i] == c) {
+	    return buf + i;
+	}
+    }
+    return NULL;
+}
+
+const char * reference_crlf(const char *buf, size_t len) {
+    for(size_t i = 0; i + 1 < len; i++) {
+	if(buf[i] == '\r' && buf[i + 1] == '\n') {
+	    return buf + i;
+	}
+    }
+    return NULL;
+}
+
+void check_all(const char *buf, size_t len, const char *what) {
+    const char *expected_byte = reference_byte(buf, len, ':');
+    const char *expected_crlf = reference_crlf(buf, len);
+
+    for(size_t i = 0; i < scanners_len; i++) {
+	const char *found = (*scanners[i].byte)(buf, len, ':');
+	CHECK(found == expected_byte, "%s byte, %s, offset %zu length %zu: found %ld, expected %ld",
+		scanners[i].name, what, (size_t) (buf - space) % ALIGNMENTS, len,
+		found == NULL ? -1L : (long) (found - buf), expected_byte == NULL ? -1L : (long) (expected_byte - buf));
+
+	found = (*scanners[i].crlf)(buf, len);
+	CHECK(found == expected_crlf, "%s crlf, %s, offset %zu length %zu: found %ld, expected %ld",
+		scanners[i].name, what, (size_t) (buf - space) % ALIGNMENTS, len,
+		found == NULL ? -1L : (long) (found - buf), expected_crlf == NULL ? -1L : (long) (expected_crlf - buf));
+    }
+}
+
+/*
+ * Fills the whole space with matches, then buf with filler, so anything
+ * found outside buf is a bug
+ */
+char * prepare(size_t offset, size_t len) {
+    for(size_t i = 0; i < sizeof(space); i++) {
+	space[i] = "\r\n:"[i % 3];
+    }
+    char *buf = space + offset;
+    memset(buf, 'a', len);
+    return buf;
+}
+
+int main(int argc, char *argv[]) {
+    scanners[scanners_len++] = (scanner) { "scalar", &scan_byte_scalar, &scan_crlf_scalar };
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2")) {
+	scanners[scanners_len++] = (scanner) { "sse2", &scan_byte_sse2, &scan_crlf_sse2 };
+    }
+    if(__builtin_cpu_supports("avx2")) {
+	scanners[scanners_len++] = (scanner) { "avx2", &scan_byte_avx2, &scan_crlf_avx2 };
+    }
+#endif
+    scanners[scanners_len++] = (scanner) { "dispatch", &scan_byte, &scan_crlf };
+
+    for(size_t offset = 0; offset < ALIGNMENTS; offset++) {
+	for(size_t len = 0; len <= MAX_LEN; len++) {
+	    char *buf = prepare(offset, len);
+	    check_all(buf, len, "nothing");
+
+	    //One match at each position; at the last one, a CR without its LF
+	    for(size_t at = 0; at < len; at++) {
+		buf[at] = '\r';
+		if(at + 1 < len) {
+		    buf[at + 1] = '\n';
+		}
+		check_all(buf, len, "one");
+
+		//A CR before the CR LF, which a shifted compare mustn't take for it
+		if(at > 0) {
+		    buf[at - 1] = '\r';
+		    check_all(buf, len, "CR CR LF");
+		    buf[at - 1] = 'a';
+		}
+
+		//A LF before a CR
+		buf[at] = '\n';
+		if(at + 1 < len) {
+		    buf[at + 1] = '\r';
+		}
+		check_all(buf, len, "LF CR");
+
+		buf[at] = ':';
+		if(at + 1 < len) {
+		    buf[at + 1] = 'a';
+		}
+		check_all(buf, len, "byte");
+		buf[at] = 'a';
+	    }
+	}
+    }
+
+    //Random runs of the bytes that matter, denser and sparser
+    uint64_t seed = 0x2545f4914f6cdd1dULL;
+    for(int round = 0; round < 200; round++) {
+	unsigned int sparseness = 1 + round % 6;
+	for(size_t offset = 0; offset < ALIGNMENTS; offset++) {
+	    size_t len = check_random(&seed) % (MAX_LEN + 1);
+	    char *buf = prepare(offset, len);
+	    for(size_t i = 0; i < len; i++) {
+		uint64_t pick = check_random(&seed);
+		if(pick % (1 << sparseness) == 0) {
+		    buf[i] = "\r\n:"[(pick >> 16) % 3];
+		}
+	    }
+	    check_all(buf, len, "random");
+	}
+    }
+
+    fprintf(stdout, "scan implementation %s\n", scan_implementation());
+    return check_failed("scan");
+}
@@ -0,0 +1,275 @@
+/* test_subscription.c
+ *
+ * Subscribes and unsubscribes random filters for a crowd of subscribers and
+ * routes random lines, checking the index picks out exactly the subscribers
+ * a straightforward look through every filter of every subscriber would.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "subscription.h"
+
+#define SUBSCRIBERS 64
+#define MAX_FILTERS 4
+#define ROUNDS 20000
+
+typedef struct reference_filter_struct {
+    filter_type type;
+    const char *value;
+} reference_filter;
+
+typedef struct reference_struct {
+    reference_filter filters[MAX_FILTERS];
+    size_t filters_len;
+} reference;
+
+const char *commands[] = { "PRIVMSG", "privmsg", "NOTICE", "JOIN", "PART", "KICK", "353", "001", "FOO", "foo" };
+const char *channels[] = { "#a", "#A", "#b", "&c", "!chan", "#[x]", "#{X}", "#^", "#~" };
+const char *prefixes[] = { "alice", "ALICE", "bob", "b^b", "B~B", "[x]", "*!*@host.example", "*!~u@*",
+    "b?b*", "al*", "*", "*@*.EXAMPLE", "bob!*" };
+
+//What lines are made of
+const char *nicks[] = { "alice", "Alice", "bob", "b~b", "{x}", "carol", "irc.example" };
+const char *hosts[] = { "host.example", "HOST.example", "other.example", "127.0.0.1" };
+const char *targets[] = { "#a", "#A", "#b", "&c", "&C", "!chan", "#{x}", "#[X]", "#~", "#^", "#", "bob",
+    "#a,#b", "#b,&c,nick", "*", ":#a" };
+
+subscription_index index_;
+subscriber subscribers[SUBSCRIBERS];
+reference references[SUBSCRIBERS];
+uint64_t seed = 0x853c49e6748fea9bULL;
+
+#define PICK(array) (array[check_random(&seed) % (sizeof(array) / sizeof(array[0]))])
+
+/* The reference, written out the long way */
+
+char rfc_lower(char c) {
+    if(c >= 'A' && c <= 'Z') return c - 'A' + 'a';
+    if(c == '[') return '{';
+    if(c == ']') return '}';
+    if(c == '\\') return '|';
+    if(c == '^') return '~';
+    return c;
+}
+
+int rfc_equals(const char *a, const char *b, size_t b_len) {
+    if(strlen(a) != b_len) {
+	return 0;
+    }
+    for(size_t i = 0; i < b_len; i++) {
+	if(rfc_lower(a[i]) != rfc_lower(b[i])) {
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+int glob(const char *mask, const char *str, const char *end) {
+    if(*mask == '\0') {
+	return str == end;
+    }
+    if(*mask == '*') {
+	for(const char *s = str; s <= end; s++) {
+	    if(glob(mask + 1, s, end)) {
+		return 1;
+	    }
+	}
+	return 0;
+    }
+    if(str == end) {
+	return 0;
+    }
+    return (*mask == '?' || rfc_lower(*mask) == rfc_lower(*str)) && glob(mask + 1, str + 1, end);
+}
+
+int reference_matches(reference *ref, irc_message *msg) {
+    if(ref->filters_len == 0) {
+	return 1;
+    }
+
+    irc_slice prefix = msg->prefix_view;
+    size_t nick_len = 0;
+    while(prefix.ptr != NULL && nick_len < prefix.len && prefix.ptr[nick_len] != '!' && prefix.ptr[nick_len] != '@') {
+	nick_len++;
+    }
+
+    for(size_t i = 0; i < ref->filters_len; i++) {
+	reference_filter *filter = &(ref->filters[i]);
+	switch(filter->type) {
+	case FILTER_COMMAND:
+	    if(rfc_equals(filter->value, msg->command_view.ptr, msg->command_view.len)) {
+		return 1;
+	    }
+	    break;
+
+	case FILTER_CHANNEL: {
+	    //Every param but a trailing one, unless that's the only one
+	    size_t count = message_param_count(msg);
+	    if(count > 1 && msg->params_trailing) {
+		count--;
+	    }
+	    for(size_t p = 0; p < count; p++) {
+		irc_slice param = message_param(msg, p);
+		size_t start = 0;
+		for(size_t at = 0; at <= param.len; at++) {
+		    if(at < param.len && param.ptr[at] != ',') {
+			continue;
+		    }
+		    const char *target = param.ptr + start;
+		    size_t len = at - start;
+		    if(len > 1 && strchr("#&!", target[0]) != NULL && rfc_equals(filter->value, target, len)) {
+			return 1;
+		    }
+		    start = at + 1;
+		}
+	    }
+	    break;
+	}
+
+	default:
+	    if(prefix.ptr == NULL) {
+		break;
+	    }
+	    if(strpbrk(filter->value, "*?!@") != NULL) {
+		if(glob(filter->value, prefix.ptr, prefix.ptr + prefix.len)) {
+		    return 1;
+		}
+	    }
+	    else if(rfc_equals(filter->value, prefix.ptr, nick_len)) {
+		return 1;
+	    }
+	    break;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Adds or drops a filter on both sides, checking they agree on whether it
+ * was there
+ */
+void change_filters(size_t i) {
+    subscriber *sub = &(subscribers[i]);
+    reference *ref = &(references[i]);
+
+    unsigned int action = check_random(&seed) % 16;
+    if(action == 0) {
+	unsubscribe_all(&index_, sub);
+	ref->filters_len = 0;
+	return;
+    }
+
+    reference_filter filter;
+    filter.type = check_random(&seed) % FILTER_TYPE_COUNT;
+    filter.value = filter.type == FILTER_COMMAND ? PICK(commands) : filter.type == FILTER_CHANNEL ? PICK(channels) : PICK(prefixes);
+    size_t len = strlen(filter.value);
+
+    size_t found = ref->filters_len;
+    for(size_t f = 0; f < ref->filters_len; f++) {
+	if(ref->filters[f].type == filter.type && rfc_equals(ref->filters[f].value, filter.value, len)) {
+	    found = f;
+	}
+    }
+
+    if(action < 8) {
+	if(found == ref->filters_len && ref->filters_len == MAX_FILTERS) {
+	    return;
+	}
+	int result = subscribe(&index_, sub, filter.type, filter.value, len);
+	CHECK(result == (found < ref->filters_len), "subscribe %s returned %d", filter.value, result);
+	if(found == ref->filters_len) {
+	    ref->filters[ref->filters_len++] = filter;
+	}
+    }
+    else {
+	int result = unsubscribe(&index_, sub, filter.type, filter.value, len);
+	CHECK(result == (found == ref->filters_len), "unsubscribe %s returned %d", filter.value, result);
+	if(found < ref->filters_len) {
+	    ref->filters[found] = ref->filters[--ref->filters_len];
+	}
+    }
+}
+
+size_t random_line(char *line, size_t size) {
+    size_t len = 0;
+    if(check_random(&seed) % 4 != 0) {
+	len += snprintf(line + len, size - len, ":%s", PICK(nicks));
+	if(check_random(&seed) % 3 != 0) {
+	    len += snprintf(line + len, size - len, "!%su@%s", check_random(&seed) % 2 ? "~" : "", PICK(hosts));
+	}
+	line[len++] = ' ';
+    }
+    len += snprintf(line + len, size - len, "%s", PICK(commands));
+
+    size_t params = check_random(&seed) % 5;
+    for(size_t i = 0; i < params; i++) {
+	//A trailing param has to be the last
+	const char *target = PICK(targets);
+	if(target[0] == ':' && i + 1 < params) {
+	    target++;
+	}
+	len += snprintf(line + len, size - len, " %s", target);
+    }
+    len += snprintf(line + len, size - len, "\r\n");
+    return len;
+}
+
+int main(int argc, char *argv[]) {
+    init_subscription_index(&index_);
+    for(size_t i = 0; i < SUBSCRIBERS; i++) {
+	CHECK(subscription_add(&index_, &(subscribers[i]), &(references[i])) == 0, "adding %zu", i);
+	references[i].filters_len = 0;
+    }
+
+    unsigned long routed = 0;
+    for(int round = 0; round < ROUNDS; round++) {
+	for(int changes = check_random(&seed) % 4; changes > 0; changes--) {
+	    change_filters(check_random(&seed) % SUBSCRIBERS);
+	}
+
+	char line[512];
+	size_t len = random_line(line, sizeof(line));
+	irc_message msg;
+	if(parse_message_view(&msg, line, len) != 0) {
+	    CHECK(0, "couldn't parse %.*s", (int) len, line);
+	    continue;
+	}
+
+	int routed_to[SUBSCRIBERS] = { 0 };
+	subscriber_set *set = subscription_route(&index_, &msg);
+	for(size_t i = 0; i < set->len; i++) {
+	    size_t which = (reference *) set->items[i]->owner - references;
+	    CHECK(routed_to[which] == 0, "%zu routed %.*s twice", which, (int) len - 2, line);
+	    routed_to[which] = 1;
+	}
+	routed += set->len;
+
+	for(size_t i = 0; i < SUBSCRIBERS; i++) {
+	    int expected = reference_matches(&(references[i]), &msg);
+	    CHECK(routed_to[i] == expected, "%zu routed %d, expected %d: %.*s", i, routed_to[i], expected,
+		    (int) len - 2, line);
+	    CHECK(subscription_matches(&(subscribers[i]), &msg) == expected, "%zu matches %.*s", i,
+		    (int) len - 2, line);
+	}
+    }
+
+    //With no line, only those without filters
+    subscriber_set *set = subscription_route(&index_, NULL);
+    size_t unfiltered = 0;
+    for(size_t i = 0; i < SUBSCRIBERS; i++) {
+	unfiltered += references[i].filters_len == 0;
+    }
+    CHECK(set->len == unfiltered, "%zu routed a NULL line, %zu unfiltered", set->len, unfiltered);
+
+    for(size_t i = 0; i < SUBSCRIBERS; i++) {
+	subscription_remove(&index_, &(subscribers[i]));
+    }
+    set = subscription_route(&index_, NULL);
+    CHECK(set->len == 0, "%zu still routed after removal", set->len);
+    destroy_subscription_index(&index_);
+
+    fprintf(stdout, "%lu routed over %d lines\n", routed, ROUNDS);
+    return check_failed("subscription");
+}
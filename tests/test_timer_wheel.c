@@ -0,0 +1,189 @@
+/* test_timer_wheel.c
+ *
+ * Arms timers across every level of the wheel and past its span, moves
+ * and cancels some, and checks each one left fires exactly once, on its
+ * own tick, in order of expiry. Callbacks cancel other timers (including
+ * ones due on the same tick) and re-arm themselves.
+ */
+
+#include <stdlib.h>
+
+#include "check.h"
+#include "timer_wheel.h"
+
+#define PROBES 4000
+
+typedef struct probe_struct {
+    timer t;
+    uint64_t expires;
+    //Times left to re-arm itself when it fires
+    int rearms;
+    //Another probe to cancel when it fires, or -1
+    int victim;
+    int cancelled;
+    int done;
+} probe;
+
+timer_wheel wheel;
+probe probes[PROBES];
+uint64_t seed = 0x9e3779b97f4a7c15ULL;
+uint64_t last_fired = 0;
+unsigned long fired = 0;
+
+/*
+ * Some ticks on the same level as the ones it's a span of, some further
+ * out than the wheel goes
+ */
+uint64_t random_delay() {
+    unsigned int bits = TIMER_WHEEL_BITS * (1 + check_random(&seed) % (TIMER_WHEEL_LEVELS + 1));
+    return check_random(&seed) % (1ULL << bits);
+}
+
+void cancel_probe(probe *p) {
+    if(timer_is_armed(&(p->t))) {
+	timer_cancel(&wheel, &(p->t));
+	p->cancelled = 1;
+    }
+}
+
+void on_probe(void *args) {
+    probe *p = args;
+    //While a tick's timers fire, the wheel is already on the next one
+    uint64_t tick = wheel.now - 1;
+
+    CHECK(!p->done && !p->cancelled, "probe %ld fired again", (long) (p - probes));
+    CHECK(p->expires == tick, "probe %ld due at %llu fired at %llu", (long) (p - probes),
+	    (unsigned long long) p->expires, (unsigned long long) tick);
+    CHECK(tick >= last_fired, "tick %llu fired after %llu", (unsigned long long) tick,
+	    (unsigned long long) last_fired);
+    last_fired = tick;
+    fired++;
+
+    if(p->victim >= 0) {
+	cancel_probe(&(probes[p->victim]));
+	p->victim = -1;
+    }
+
+    if(p->rearms > 0) {
+	p->rearms--;
+	p->expires = tick + 1 + random_delay();
+	timer_arm(&wheel, &(p->t), p->expires);
+    }
+    else {
+	p->done = 1;
+    }
+}
+
+/*
+ * The earliest expiry of the probes still armed, which the wheel mustn't
+ * ask to be advanced past
+ */
+uint64_t earliest_probe() {
+    uint64_t earliest = UINT64_MAX;
+    for(size_t i = 0; i < PROBES; i++) {
+	if(timer_is_armed(&(probes[i].t)) && probes[i].expires < earliest) {
+	    earliest = probes[i].expires;
+	}
+    }
+    return earliest;
+}
+
+int main(int argc, char *argv[]) {
+    //Not on a slot boundary of any level, so every level wraps around at some point
+    uint64_t start = (1ULL << 40) + 12345;
+    init_timer_wheel(&wheel, start);
+    CHECK(timer_wheel_next(&wheel) == UINT64_MAX, "empty wheel has a next tick");
+
+    for(size_t i = 0; i < PROBES; i++) {
+	probe *p = &(probes[i]);
+	init_timer(&(p->t), &on_probe, p);
+	p->expires = start + random_delay();
+	p->rearms = check_random(&seed) % 8 == 0 ? 1 + check_random(&seed) % 3 : 0;
+	p->victim = check_random(&seed) % 8 == 0 ? (int) (check_random(&seed) % PROBES) : -1;
+	p->cancelled = 0;
+	p->done = 0;
+	timer_arm(&wheel, &(p->t), p->expires);
+    }
+    CHECK(wheel.armed == PROBES, "%lu armed", wheel.armed);
+
+    //Move some, cancel some, and arm a few of those again
+    for(size_t i = 0; i < PROBES; i++) {
+	probe *p = &(probes[i]);
+	switch(check_random(&seed) % 6) {
+	case 0:
+	    p->expires = start + random_delay();
+	    timer_arm(&wheel, &(p->t), p->expires);
+	    break;
+	case 1:
+	    cancel_probe(p);
+	    timer_cancel(&wheel, &(p->t));
+	    break;
+	case 2:
+	    timer_cancel(&wheel, &(p->t));
+	    p->expires = start + random_delay();
+	    timer_arm(&wheel, &(p->t), p->expires);
+	    break;
+	}
+    }
+
+    unsigned long armed = 0;
+    for(size_t i = 0; i < PROBES; i++) {
+	armed += timer_is_armed(&(probes[i].t));
+    }
+    CHECK(wheel.armed == armed, "wheel has %lu armed, probes %lu", wheel.armed, armed);
+
+    //Advance to exactly the next tick asked for, a little past it, or just a tick or two
+    unsigned long steps = 0;
+    while(wheel.armed > 0 && steps++ < 10000000) {
+	uint64_t next = timer_wheel_next(&wheel);
+	uint64_t earliest = earliest_probe();
+	CHECK(next >= wheel.now && next <= earliest, "next %llu, now %llu, earliest %llu",
+		(unsigned long long) next, (unsigned long long) wheel.now, (unsigned long long) earliest);
+	if(next == UINT64_MAX) {
+	    break;
+	}
+
+	uint64_t target;
+	switch(check_random(&seed) % 4) {
+	case 0:
+	    target = next;
+	    break;
+	case 1:
+	    target = next + check_random(&seed) % TIMER_WHEEL_SLOTS;
+	    break;
+	case 2:
+	    target = next + check_random(&seed) % 5000;
+	    break;
+	default:
+	    target = wheel.now + check_random(&seed) % 3;
+	    break;
+	}
+	timer_wheel_advance(&wheel, target);
+	CHECK(earliest_probe() > target, "a timer due by %llu is still armed", (unsigned long long) target);
+    }
+
+    unsigned long cancelled = 0;
+    for(size_t i = 0; i < PROBES; i++) {
+	CHECK(probes[i].done != probes[i].cancelled, "probe %zu done %d cancelled %d", i,
+		probes[i].done, probes[i].cancelled);
+	cancelled += probes[i].cancelled;
+    }
+    CHECK(wheel.armed == 0, "%lu still armed", wheel.armed);
+    CHECK(timer_wheel_next(&wheel) == UINT64_MAX, "empty wheel has a next tick");
+    CHECK(cancelled > 0 && cancelled < PROBES, "%lu of %d cancelled", cancelled, PROBES);
+
+    //A time that has passed fires on the next advance
+    probe late;
+    init_timer(&(late.t), &on_probe, &late);
+    late.expires = wheel.now;
+    late.rearms = 0;
+    late.victim = -1;
+    late.cancelled = 0;
+    late.done = 0;
+    timer_arm(&wheel, &(late.t), wheel.now - 1000);
+    timer_wheel_advance(&wheel, wheel.now);
+    CHECK(late.done, "timer armed in the past didn't fire");
+
+    fprintf(stdout, "%lu fired, %lu cancelled\n", fired, cancelled);
+    return check_failed("timer_wheel");
+}